@@ -0,0 +1,135 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+// ============================================
+// FRAME AUTHENTICATION
+// ============================================
+// Every message ends with a 32-bit tag: SipHash-2-4 of all the bytes before
+// it under a 128-bit key shared by the whole fleet, truncated to its low 32
+// bits. Base messages also carry authEpoch, which together with the
+// sequence forms a counter that only goes up, so a vehicle can refuse a
+// recorded frame played back later.
+//
+// Checking a tag costs far more than the session and index checks, so
+// receivers only check messages they would otherwise act on.
+// ============================================
+
+#define AUTH_KEY_BYTES 16
+#define AUTH_TAG_BYTES 4
+
+struct AuthKey {
+    uint64_t k0, k1;
+};
+
+static inline uint64_t authRead64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+static inline void initAuthKey(AuthKey *key, const uint8_t bytes[AUTH_KEY_BYTES]) {
+    key->k0 = authRead64(bytes);
+    key->k1 = authRead64(bytes + 8);
+}
+
+#define AUTH_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define AUTH_SIPROUND                                                                                 \
+    do {                                                                                              \
+        v0 += v1; v1 = AUTH_ROTL(v1, 13); v1 ^= v0; v0 = AUTH_ROTL(v0, 32);                           \
+        v2 += v3; v3 = AUTH_ROTL(v3, 16); v3 ^= v2;                                                   \
+        v0 += v3; v3 = AUTH_ROTL(v3, 21); v3 ^= v0;                                                   \
+        v2 += v1; v1 = AUTH_ROTL(v1, 17); v1 ^= v2; v2 = AUTH_ROTL(v2, 32);                           \
+    } while (0)
+
+// Reference SipHash-2-4, 64-bit result
+static inline uint64_t sipHash24(const AuthKey *key, const uint8_t *data, size_t len) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key->k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key->k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key->k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ key->k1;
+    const uint8_t *end = data + (len & ~(size_t)7);
+    for (; data != end; data += 8) {
+        uint64_t m = authRead64(data);
+        v3 ^= m;
+        AUTH_SIPROUND;
+        AUTH_SIPROUND;
+        v0 ^= m;
+    }
+    uint64_t b = (uint64_t)len << 56;
+    for (int i = (int)(len & 7) - 1; i >= 0; i--) {
+        b |= (uint64_t)data[i] << (8 * i);
+    }
+    v3 ^= b;
+    AUTH_SIPROUND;
+    AUTH_SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    AUTH_SIPROUND;
+    AUTH_SIPROUND;
+    AUTH_SIPROUND;
+    AUTH_SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Writes the tag into the last AUTH_TAG_BYTES of the message
+static inline void signMessage(const AuthKey *key, uint8_t *message, size_t len) {
+    uint32_t tag = (uint32_t)sipHash24(key, message, len - AUTH_TAG_BYTES);
+    memcpy(message + len - AUTH_TAG_BYTES, &tag, sizeof(tag));
+}
+
+static inline bool verifyMessage(const AuthKey *key, const uint8_t *message, size_t len) {
+    if (len < AUTH_TAG_BYTES) {
+        return false;
+    }
+    uint32_t tag = (uint32_t)sipHash24(key, message, len - AUTH_TAG_BYTES);
+    uint32_t received;
+    memcpy(&received, message + len - AUTH_TAG_BYTES, sizeof(received));
+    return tag == received;
+}
+
+// Replay protection for one sender: every counter is taken once, and only
+// within REPLAY_WINDOW of the newest so a late repeat still gets through
+#define REPLAY_WINDOW 32
+
+struct ReplayWindow {
+    uint32_t last;
+    uint32_t seen; // Bit n set when last - n has been taken
+    bool valid;    // False until the first authentic message
+};
+
+static inline uint32_t authCounter(uint16_t epoch, uint16_t sequence) {
+    return (uint32_t)epoch << 16 | sequence;
+}
+
+static inline bool acceptCounter(ReplayWindow *w, uint32_t counter) {
+    if (!w->valid || counter > w->last) {
+        uint32_t ahead = w->valid ? counter - w->last : REPLAY_WINDOW;
+        w->seen = ahead < REPLAY_WINDOW ? w->seen << ahead | 1 : 1;
+        w->last = counter;
+        w->valid = true;
+        return true;
+    }
+    uint32_t behind = w->last - counter;
+    if (behind >= REPLAY_WINDOW || (w->seen & (uint32_t)1 << behind)) {
+        return false;
+    }
+    w->seen |= (uint32_t)1 << behind;
+    return true;
+}
+
+// Parses 32 hex digits, false if there are not exactly that many
+static inline bool parseAuthKey(const char *hex, uint8_t bytes[AUTH_KEY_BYTES]) {
+    for (int i = 0; i < AUTH_KEY_BYTES * 2; i++) {
+        char c = hex[i];
+        int nibble = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                                    : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (nibble < 0) {
+            return false;
+        }
+        bytes[i / 2] = (uint8_t)(i % 2 ? bytes[i / 2] << 4 | nibble : nibble);
+    }
+    return hex[AUTH_KEY_BYTES * 2] == '\0';
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <Arduino.h>
+#include <Preferences.h>
+#include "auth.h"
+
+// ============================================
+// AUTH KEY STORE AND COST
+// ============================================
+// The fleet key lives in NVS namespace "auth". Building with
+// -DAUTH_KEY=\"<32 hex digits>\" writes it there on the next boot, after
+// which any build keeps using it. Without a key every tag is left at zero
+// and nothing is checked, so older units keep working until provisioned.
+//
+// Signing and checking are timed with the CPU cycle counter and printed
+// with the other statistics.
+// ============================================
+
+static AuthKey authKey;
+static bool authEnabled = false;
+
+// Call once from setup()
+static void loadAuthKey() {
+    Preferences authStore;
+    authStore.begin("auth", false);
+    uint8_t bytes[AUTH_KEY_BYTES];
+    bool stored = authStore.getBytes("key", bytes, sizeof(bytes)) == sizeof(bytes);
+#ifdef AUTH_KEY
+    uint8_t provisioned[AUTH_KEY_BYTES];
+    if (!parseAuthKey(AUTH_KEY, provisioned)) {
+        Serial.println("AUTH_KEY must be 32 hex digits, ignored");
+    } else if (!stored || memcmp(bytes, provisioned, sizeof(bytes)) != 0) {
+        authStore.putBytes("key", provisioned, sizeof(provisioned));
+        memcpy(bytes, provisioned, sizeof(bytes));
+        stored = true;
+        Serial.println("Auth key provisioned");
+    }
+#endif
+    authStore.end();
+    if (stored) {
+        initAuthKey(&authKey, bytes);
+        authEnabled = true;
+    } else {
+        Serial.println("No auth key, frames are not authenticated");
+    }
+}
+
+struct AuthCost {
+    uint32_t count;
+    uint64_t cycles;
+    uint32_t maxCycles;
+};
+
+static inline void noteAuthCost(AuthCost *cost, uint32_t cycles) {
+    cost->count++;
+    cost->cycles += cycles;
+    if (cycles > cost->maxCycles) {
+        cost->maxCycles = cycles;
+    }
+}
+
+// Prints and clears one line, nothing when there was no work
+static void reportAuthCost(const char *what, AuthCost *cost) {
+    if (cost->count == 0) {
+        return;
+    }
+    uint32_t average = (uint32_t)(cost->cycles / cost->count);
+    uint32_t mhz = ESP.getCpuFreqMHz();
+    Serial.printf("Auth %s: %u, avg %u cycles (%u us), max %u cycles\n", what, cost->count, average,
+                  average / mhz, cost->maxCycles);
+    memset(cost, 0, sizeof(*cost));
+}
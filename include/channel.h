@@ -0,0 +1,236 @@
+#pragma once
+#include <stdint.h>
+
+// ============================================
+// CHANNEL SELECTION AND MIGRATION
+// ============================================
+// Plain logic with the current time passed in, so the same code runs on the
+// ESP32 and against a simulated radio on a PC. Firmwares only apply the
+// channel these functions return.
+// ============================================
+
+#ifndef WIFI_CHANNEL_MIN
+#define WIFI_CHANNEL_MIN 1
+#endif
+#ifndef WIFI_CHANNEL_MAX
+#define WIFI_CHANNEL_MAX 11
+#endif
+// Base beacon period while nothing is changing
+#ifndef CHANNEL_ANNOUNCE_PERIOD_MS
+#define CHANNEL_ANNOUNCE_PERIOD_MS 200
+#endif
+// Beacon period while a move is scheduled, so every vehicle hears it
+#ifndef CHANNEL_MOVE_ANNOUNCE_PERIOD_MS
+#define CHANNEL_MOVE_ANNOUNCE_PERIOD_MS 40
+#endif
+// Warning time between the first move announcement and the switch
+#ifndef CHANNEL_MOVE_DELAY_MS
+#define CHANNEL_MOVE_DELAY_MS 400
+#endif
+// Loss (percent) reported by a driven vehicle that counts as bad
+#ifndef CHANNEL_LOSS_THRESHOLD
+#define CHANNEL_LOSS_THRESHOLD 30
+#endif
+// How long loss has to stay above the threshold before the fleet moves
+#ifndef CHANNEL_LOSS_HOLD_MS
+#define CHANNEL_LOSS_HOLD_MS 5000
+#endif
+// Congestion added to a channel the fleet had to leave, so it is not picked again soon
+#ifndef CHANNEL_LOSS_PENALTY
+#define CHANNEL_LOSS_PENALTY 200
+#endif
+// Minimum time between two moves
+#ifndef CHANNEL_MOVE_COOLDOWN_MS
+#define CHANNEL_MOVE_COOLDOWN_MS 30000
+#endif
+// A vehicle that hears nothing from the base for this long starts searching
+#ifndef CHANNEL_SEARCH_TIMEOUT_MS
+#define CHANNEL_SEARCH_TIMEOUT_MS 1000
+#endif
+// Time spent listening on each channel while searching
+#ifndef CHANNEL_DWELL_MS
+#define CHANNEL_DWELL_MS (CHANNEL_ANNOUNCE_PERIOD_MS * 5 / 2)
+#endif
+// Active scan time per channel when the base picks its channel at boot
+// (the Arduino default is 300 ms, over 3 s for the whole band)
+#ifndef CHANNEL_SCAN_MS_PER_CHANNEL
+#define CHANNEL_SCAN_MS_PER_CHANNEL 80
+#endif
+
+#define WIFI_CHANNEL_COUNT (WIFI_CHANNEL_MAX - WIFI_CHANNEL_MIN + 1)
+
+// --------------------------------------------
+// Scoring (base, at startup)
+// --------------------------------------------
+
+// Congestion per channel, indexed by channel number
+struct ChannelScores {
+    int32_t congestion[WIFI_CHANNEL_MAX + 1];
+};
+
+static inline void clearChannelScores(ChannelScores *scores) {
+    for (int c = 0; c <= WIFI_CHANNEL_MAX; c++) {
+        scores->congestion[c] = 0;
+    }
+}
+
+// Adds one network found by a scan. A 2.4 GHz channel is 22 MHz wide, so a
+// network also loads the four channels on either side, less the further away.
+static inline void addNetworkToScores(ChannelScores *scores, int channel, int32_t rssi) {
+    int32_t strength = rssi + 100; // -100 dBm and below barely matters
+    if (strength < 1) {
+        strength = 1;
+    }
+    for (int c = channel - 4; c <= channel + 4; c++) {
+        if (c < WIFI_CHANNEL_MIN || c > WIFI_CHANNEL_MAX) {
+            continue;
+        }
+        int distance = c > channel ? c - channel : channel - c;
+        scores->congestion[c] += strength * (5 - distance) / 5;
+    }
+}
+
+// Lowest congestion wins, ties go to the non-overlapping channels 1, 6 and 11
+static inline uint8_t pickCleanestChannel(const ChannelScores *scores, uint8_t excludeChannel = 0) {
+    uint8_t best = 0;
+    for (int c = WIFI_CHANNEL_MIN; c <= WIFI_CHANNEL_MAX; c++) {
+        if (c == excludeChannel) {
+            continue;
+        }
+        if (best == 0 || scores->congestion[c] < scores->congestion[best]) {
+            best = c;
+        } else if (scores->congestion[c] == scores->congestion[best] && (c == 1 || c == 6 || c == 11) &&
+                   !(best == 1 || best == 6 || best == 11)) {
+            best = c;
+        }
+    }
+    return best;
+}
+
+// --------------------------------------------
+// Migration (base)
+// --------------------------------------------
+
+struct ChannelMigrator {
+    uint8_t channel;          // Channel the base is on
+    uint8_t nextChannel;      // Target of a scheduled move, equal to channel otherwise
+    unsigned long switchAt;   // When the scheduled move happens
+    unsigned long lossSince;  // Start of the current high-loss stretch, 0 when loss is fine
+    unsigned long lastMove;   // Time of the last completed move
+    bool moved;               // A move has happened, lastMove is valid
+};
+
+static inline void initChannelMigrator(ChannelMigrator *m, uint8_t channel) {
+    m->channel = channel;
+    m->nextChannel = channel;
+    m->switchAt = 0;
+    m->lossSince = 0;
+    m->lastMove = 0;
+    m->moved = false;
+}
+
+static inline bool channelMovePending(const ChannelMigrator *m) {
+    return m->nextChannel != m->channel;
+}
+
+static inline void scheduleChannelMove(ChannelMigrator *m, uint8_t nextChannel, unsigned long now) {
+    if (nextChannel == m->channel || channelMovePending(m)) {
+        return;
+    }
+    m->nextChannel = nextChannel;
+    m->switchAt = now + CHANNEL_MOVE_DELAY_MS;
+}
+
+// Feeds one loss sample from a driven vehicle. Returns true when loss has
+// stayed above the threshold long enough that the fleet should move.
+static inline bool reportChannelLoss(ChannelMigrator *m, uint8_t lossPercent, unsigned long now) {
+    if (lossPercent < CHANNEL_LOSS_THRESHOLD) {
+        m->lossSince = 0;
+        return false;
+    }
+    if (m->lossSince == 0) {
+        m->lossSince = now ? now : 1;
+    }
+    if (channelMovePending(m) || (m->moved && now - m->lastMove < CHANNEL_MOVE_COOLDOWN_MS)) {
+        return false;
+    }
+    return now - m->lossSince >= CHANNEL_LOSS_HOLD_MS;
+}
+
+// Returns the channel the base radio should be on now
+static inline uint8_t updateChannelMigrator(ChannelMigrator *m, unsigned long now) {
+    if (channelMovePending(m) && (long)(now - m->switchAt) >= 0) {
+        m->channel = m->nextChannel;
+        m->lossSince = 0;
+        m->lastMove = now;
+        m->moved = true;
+    }
+    return m->channel;
+}
+
+static inline uint16_t channelMoveIn(const ChannelMigrator *m, unsigned long now) {
+    if (!channelMovePending(m) || (long)(now - m->switchAt) >= 0) {
+        return 0;
+    }
+    return (uint16_t)(m->switchAt - now);
+}
+
+// --------------------------------------------
+// Following (vehicles)
+// --------------------------------------------
+
+struct ChannelFollower {
+    uint8_t channel;             // Channel the radio should be on
+    uint8_t pendingChannel;      // Announced move, 0 when none
+    unsigned long switchAt;
+    unsigned long lastBaseFrame; // Last time anything from the base was heard
+    unsigned long dwellStart;    // When the current search channel was entered
+    bool searching;
+};
+
+static inline void initChannelFollower(ChannelFollower *f, uint8_t channel, unsigned long now) {
+    f->channel = channel;
+    f->pendingChannel = 0;
+    f->switchAt = 0;
+    f->lastBaseFrame = now;
+    f->dwellStart = now;
+    f->searching = true; // Nothing heard yet
+}
+
+static inline void followerHeardBase(ChannelFollower *f, unsigned long now) {
+    f->lastBaseFrame = now;
+    f->searching = false;
+}
+
+static inline void followerHeardAnnounce(ChannelFollower *f, uint8_t channel, uint8_t nextChannel,
+                                         uint16_t switchInMs, unsigned long now) {
+    followerHeardBase(f, now);
+    // Heard on a channel that differs from what we think we are on (scan overlap)
+    if (channel >= WIFI_CHANNEL_MIN && channel <= WIFI_CHANNEL_MAX) {
+        f->channel = channel;
+    }
+    if (nextChannel != channel && nextChannel >= WIFI_CHANNEL_MIN && nextChannel <= WIFI_CHANNEL_MAX) {
+        f->pendingChannel = nextChannel;
+        f->switchAt = now + switchInMs;
+    }
+}
+
+// Returns the channel the vehicle radio should be on now
+static inline uint8_t updateChannelFollower(ChannelFollower *f, unsigned long now) {
+    if (f->pendingChannel && (long)(now - f->switchAt) >= 0) {
+        f->channel = f->pendingChannel;
+        f->pendingChannel = 0;
+        // Give the base the usual grace period on the new channel
+        f->lastBaseFrame = now;
+    }
+    if (!f->searching && now - f->lastBaseFrame > CHANNEL_SEARCH_TIMEOUT_MS) {
+        f->searching = true;
+        f->dwellStart = now;
+    }
+    if (f->searching && now - f->dwellStart >= CHANNEL_DWELL_MS) {
+        f->channel = f->channel >= WIFI_CHANNEL_MAX ? WIFI_CHANNEL_MIN : f->channel + 1;
+        f->pendingChannel = 0;
+        f->dwellStart = now;
+    }
+    return f->channel;
+}
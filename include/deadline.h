@@ -0,0 +1,148 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "protocol.h"
+
+// ============================================
+// DEADLINE MONITOR
+// ============================================
+// Times every iteration of a control loop against a budget. The loop marks
+// the stage it is entering with enterDeadlineStage() and calls
+// endDeadlineIteration() before it waits again; the first mark after that
+// starts the next iteration, so the wait itself never counts. An iteration
+// that takes longer than the budget is an overrun, charged to the stage that
+// was running when the budget ran out.
+//
+// A stage that never returns is a stall. Another task notices it with
+// checkDeadlineStall() and makes the outputs safe, and the task watchdog in
+// tasks.h resets the chip if the loop stays stuck. Plain logic: the loop
+// owns the monitor, the stall check and the reports only read it.
+// ============================================
+
+#ifndef DEADLINE_BUDGET_US
+#define DEADLINE_BUDGET_US 5000
+#endif
+#ifndef DEADLINE_STALL_MS
+#define DEADLINE_STALL_MS 250
+#endif
+
+enum DeadlineStage {
+    DEADLINE_IDLE,     // Between iterations
+    DEADLINE_GOVERNOR, // Vehicles: range governor
+    DEADLINE_APPLY,    // Vehicles: a frame or a new drive limit to the outputs
+    DEADLINE_CONFIRM,  // Vehicles: release acknowledgement and frame log
+    DEADLINE_TIMEOUT,  // Vehicles: connection timeout
+    DEADLINE_RELAY,    // Semi: state to the trailer. Trailer: relay and direct paths
+    DEADLINE_POWER,    // Vehicles: power management
+    DEADLINE_SERIAL,   // Trailer: the semi's serial line
+    DEADLINE_MACRO,    // Vehicles: motion macro. Base radio task: macro starts and keepalives
+    DEADLINE_STOPS,    // Base radio task from here on
+    DEADLINE_HANDOFFS,
+    DEADLINE_FRAMES,
+    DEADLINE_REPEATS,
+    DEADLINE_CHANNEL,
+    DEADLINE_STAGE_COUNT
+};
+
+static const char *const deadlineStageNames[DEADLINE_STAGE_COUNT] = {
+    "idle", "governor", "apply", "confirm", "timeout", "relay", "power",
+    "serial", "macro", "stops", "handoffs", "frames", "repeats", "channel"};
+
+struct DeadlineMonitor {
+    uint32_t budgetUs;
+    volatile uint8_t stage;       // DEADLINE_IDLE between iterations
+    volatile uint32_t iterations; // Started since boot
+    uint32_t startUs;
+    bool over;                    // The current iteration ran out of budget
+    uint8_t overStage;
+    // Totals since boot
+    volatile uint32_t overruns;
+    uint32_t stageOverruns[DEADLINE_STAGE_COUNT];
+    uint8_t lastOverrunStage;
+    unsigned long lastOverrunMs;  // When the latest overrun ended
+    uint32_t worstUs;             // Longest overrunning iteration
+    uint8_t worstStage;
+};
+
+static inline void initDeadline(DeadlineMonitor *m, uint32_t budgetUs) {
+    memset(m, 0, sizeof(*m));
+    m->budgetUs = budgetUs;
+}
+
+static inline void checkDeadlineBudget(DeadlineMonitor *m, uint32_t nowUs) {
+    if (!m->over && m->stage != DEADLINE_IDLE && nowUs - m->startUs > m->budgetUs) {
+        m->over = true;
+        m->overStage = m->stage;
+    }
+}
+
+static inline void enterDeadlineStage(DeadlineMonitor *m, uint8_t stage, uint32_t nowUs) {
+    if (m->stage == DEADLINE_IDLE) {
+        m->startUs = nowUs;
+        m->over = false;
+        m->iterations++;
+    } else {
+        checkDeadlineBudget(m, nowUs);
+    }
+    m->stage = stage;
+}
+
+// True when the iteration overran
+static inline bool endDeadlineIteration(DeadlineMonitor *m, uint32_t nowUs, unsigned long nowMs) {
+    if (m->stage == DEADLINE_IDLE) {
+        return false;
+    }
+    checkDeadlineBudget(m, nowUs);
+    m->stage = DEADLINE_IDLE;
+    if (!m->over) {
+        return false;
+    }
+    uint32_t us = nowUs - m->startUs;
+    m->stageOverruns[m->overStage]++;
+    m->lastOverrunStage = m->overStage;
+    m->lastOverrunMs = nowMs;
+    if (us > m->worstUs) {
+        m->worstUs = us;
+        m->worstStage = m->overStage;
+    }
+    m->overruns++;
+    return true;
+}
+
+// Kept by the task that watches a loop
+struct DeadlineStallWatch {
+    uint32_t iterations;
+    unsigned long since; // The watcher's clock when it first saw this iteration
+    bool stalled;
+    uint32_t stalls;
+};
+
+// Call periodically from another task. True once when the loop has been in
+// the same iteration for DEADLINE_STALL_MS. Uses only the watcher's clock,
+// so it never compares a half updated start time.
+static inline bool checkDeadlineStall(DeadlineStallWatch *w, const DeadlineMonitor *m, unsigned long now) {
+    uint32_t iterations = m->iterations;
+    if (m->stage == DEADLINE_IDLE || iterations != w->iterations) {
+        w->iterations = iterations;
+        w->since = now;
+        w->stalled = false;
+        return false;
+    }
+    if (w->stalled || now - w->since < DEADLINE_STALL_MS) {
+        return false;
+    }
+    w->stalled = true;
+    w->stalls++;
+    return true;
+}
+
+// Overruns since the previous report, for the base's vehicle list
+static inline void fillDeadlineReport(const DeadlineMonitor *m, uint32_t *reportedOverruns, LinkReport *report) {
+    uint32_t overruns = m->overruns;
+    uint32_t fresh = overruns - *reportedOverruns;
+    *reportedOverruns = overruns;
+    report->overruns = fresh > 0xFFFF ? 0xFFFF : fresh;
+    report->overrunStage = m->lastOverrunStage;
+    uint32_t worstMs = (m->worstUs + 999) / 1000;
+    report->worstOverrunMs = worstMs > 0xFF ? 0xFF : worstMs;
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+// ============================================
+// BUTTON PRESS EVENTS
+// ============================================
+// The base turns button levels into press counts: every input below has a
+// 4-bit counter that goes up once per press, and every frame carries all of
+// them. A vehicle compares the counters with the frame it handled before, so
+// a press whose frames were lost still arrives with the next frame, a held
+// button counts once, and no debounce timers are needed. Up to 15 presses of
+// one input can be missed before the count wraps.
+//
+// The epoch changes whenever a controller starts driving a receiver (it
+// connects or switches vehicle) and the counters restart from 0 with it, so
+// a vehicle that sees a new epoch takes the counts as the presses made since.
+// One controller per vehicle: two controllers take turns with their epochs.
+// ============================================
+
+enum EdgeInput {
+    EDGE_A,          // buttons bit 0, Cross on PS4
+    EDGE_B,          // buttons bit 1, Circle on PS4
+    EDGE_X,          // buttons bit 2, Square on PS4
+    EDGE_Y,          // buttons bit 3, Triangle on PS4
+    EDGE_DPAD_UP,    // dpad bit 0
+    EDGE_DPAD_DOWN,  // dpad bit 1
+    EDGE_DPAD_RIGHT, // dpad bit 2
+    EDGE_DPAD_LEFT,  // dpad bit 3
+    EDGE_THUMB_L,
+    EDGE_THUMB_R,
+    EDGE_R1,
+    EDGE_L1,
+    EDGE_R2,
+    EDGE_L2,
+    EDGE_INPUT_COUNT
+};
+
+// Two counters per byte
+#define PRESS_COUNT_BYTES ((EDGE_INPUT_COUNT + 1) / 2)
+
+static inline uint8_t pressCount(const uint8_t counts[PRESS_COUNT_BYTES], int input) {
+    return (counts[input / 2] >> (input % 2 * 4)) & 0x0F;
+}
+
+static inline void setPressCount(uint8_t counts[PRESS_COUNT_BYTES], int input, uint8_t count) {
+    int shift = input % 2 * 4;
+    counts[input / 2] = (counts[input / 2] & ~(0x0F << shift)) | (count & 0x0F) << shift;
+}
+
+// Bit i set while EdgeInput i is held
+static inline uint16_t edgeLevels(uint16_t buttons, uint8_t dpad, bool thumbL, bool thumbR, bool r1, bool l1,
+                                  bool r2, bool l2) {
+    return (buttons & 0x0F) | (uint16_t)(dpad & 0x0F) << EDGE_DPAD_UP | (uint16_t)thumbL << EDGE_THUMB_L |
+           (uint16_t)thumbR << EDGE_THUMB_R | (uint16_t)r1 << EDGE_R1 | (uint16_t)l1 << EDGE_L1 |
+           (uint16_t)r2 << EDGE_R2 | (uint16_t)l2 << EDGE_L2;
+}
+
+// Base side, one per controller
+struct PressCounter {
+    uint16_t levels; // Inputs held in the previous sample
+    uint8_t epoch;
+    uint8_t counts[PRESS_COUNT_BYTES];
+};
+
+// New drive session. Inputs already held do not count until released and
+// pressed again.
+static inline void startPressEpoch(PressCounter *c, uint8_t epoch, uint16_t levels) {
+    c->levels = levels;
+    c->epoch = epoch;
+    memset(c->counts, 0, sizeof(c->counts));
+}
+
+// Counts every input that went from released to held since the previous sample
+static inline void countPresses(PressCounter *c, uint16_t levels) {
+    uint16_t pressed = levels & ~c->levels;
+    c->levels = levels;
+    for (int i = 0; pressed; i++, pressed >>= 1) {
+        if (pressed & 1) {
+            setPressCount(c->counts, i, pressCount(c->counts, i) + 1);
+        }
+    }
+}
+
+// Vehicle side
+struct PressTracker {
+    bool valid; // False until the first frame after boot
+    uint8_t epoch;
+    uint8_t counts[PRESS_COUNT_BYTES];
+};
+
+// Fills presses with how often each input was pressed since the previous
+// frame. The first frame after boot only sets the reference, so nothing
+// pressed before the vehicle was up is replayed.
+static inline void takePresses(PressTracker *t, uint8_t epoch, const uint8_t counts[PRESS_COUNT_BYTES],
+                               uint8_t presses[EDGE_INPUT_COUNT]) {
+    bool newEpoch = epoch != t->epoch;
+    for (int i = 0; i < EDGE_INPUT_COUNT; i++) {
+        uint8_t count = pressCount(counts, i);
+        if (!t->valid) {
+            presses[i] = 0;
+        } else if (newEpoch) {
+            presses[i] = count;
+        } else {
+            presses[i] = (count - pressCount(t->counts, i)) & 0x0F;
+        }
+    }
+    t->valid = true;
+    t->epoch = epoch;
+    memcpy(t->counts, counts, sizeof(t->counts));
+}
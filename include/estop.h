@@ -0,0 +1,155 @@
+#pragma once
+#include <string.h>
+#include "protocol.h"
+
+// ============================================
+// EMERGENCY STOP
+// ============================================
+// A stop goes around the frame pipeline. The base sends a StopMessage
+// STOP_COPIES times, STOP_COPY_INTERVAL_MS apart, ahead of everything else
+// its radio task has to send. Vehicles act on it in their receive callback:
+// every output is written safe there and then, without waiting for the
+// control task, and a StopAck reports how long that took.
+//
+//   button      L1, R1, L2 and R2 together on any controller stop the whole
+//               fleet
+//   serial      "stop" on the base's serial monitor, the whole fleet
+//   disconnect  a controller dropping out stops the vehicle it drove
+//
+// Vehicles do not latch a stop, the next control frame drives them again.
+// So after a fleet stop the base holds every controller's frames back until
+// the combination is pressed again, held for STOP_RESUME_HOLD_MS and let go,
+// or "resume" is typed. Plain logic: the base owns the slots and the radio.
+// ============================================
+
+#ifndef STOP_COPIES
+#define STOP_COPIES 5
+#endif
+#ifndef STOP_COPY_INTERVAL_MS
+#define STOP_COPY_INTERVAL_MS 5
+#endif
+#ifndef STOP_RESUME_HOLD_MS
+#define STOP_RESUME_HOLD_MS 2000
+#endif
+// Stops in flight at once, one per controller is plenty
+#define STOP_SLOTS 4
+
+enum StopReason { STOP_BUTTON, STOP_SERIAL, STOP_DISCONNECT, STOP_REASON_COUNT };
+
+static const char *const stopReasonNames[STOP_REASON_COUNT] = {"button", "serial", "disconnect"};
+
+// What a trigger hands the radio task
+struct StopRequest {
+    uint32_t vehicleIndex; // RECEIVER_NONE for every vehicle
+    uint8_t reason;
+    uint32_t triggeredUs;  // Microsecond clock at the trigger
+};
+
+struct StopBroadcast {
+    bool used;
+    bool active;
+    uint8_t copiesSent;
+    unsigned long lastSent;
+    StopRequest request;
+    uint16_t stopId;
+    uint32_t firstCopyUs;  // Trigger to the first copy leaving the radio, 0 before
+};
+
+// Kept after the last copy so late acknowledgements still find their stop
+static inline StopBroadcast *startStop(StopBroadcast slots[STOP_SLOTS], const StopRequest *request, uint16_t stopId) {
+    // A free slot, the one started longest ago first
+    StopBroadcast *slot = NULL;
+    for (int i = 0; i < STOP_SLOTS; i++) {
+        StopBroadcast *candidate = &slots[i];
+        if (!slot || (slot->active && !candidate->active) ||
+            (slot->active == candidate->active && (int16_t)(candidate->stopId - slot->stopId) < 0)) {
+            slot = candidate;
+        }
+    }
+    memset(slot, 0, sizeof(*slot));
+    slot->used = true;
+    slot->active = true;
+    slot->request = *request;
+    slot->stopId = stopId;
+    return slot;
+}
+
+// The next copy to send, NULL when none is due
+static inline StopBroadcast *dueStop(StopBroadcast slots[STOP_SLOTS], unsigned long now) {
+    for (int i = 0; i < STOP_SLOTS; i++) {
+        StopBroadcast *slot = &slots[i];
+        if (slot->active && (slot->copiesSent == 0 || now - slot->lastSent >= STOP_COPY_INTERVAL_MS)) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static inline void buildStopMessage(const StopBroadcast *slot, StopMessage *message) {
+    memset(message, 0, sizeof(*message));
+    message->receiverIndex = RECEIVER_STOP;
+    message->vehicleIndex = slot->request.vehicleIndex;
+    message->stopId = slot->stopId;
+    message->reason = slot->request.reason;
+}
+
+static inline void noteStopSent(StopBroadcast *slot, unsigned long now, uint32_t nowUs) {
+    if (slot->copiesSent == 0) {
+        uint32_t us = nowUs - slot->request.triggeredUs;
+        slot->firstCopyUs = us ? us : 1;
+    }
+    slot->copiesSent++;
+    slot->lastSent = now;
+    if (slot->copiesSent >= STOP_COPIES) {
+        slot->active = false;
+    }
+}
+
+static inline bool stopPending(const StopBroadcast slots[STOP_SLOTS]) {
+    for (int i = 0; i < STOP_SLOTS; i++) {
+        if (slots[i].active) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline StopBroadcast *findStop(StopBroadcast slots[STOP_SLOTS], uint16_t stopId) {
+    for (int i = 0; i < STOP_SLOTS; i++) {
+        if (slots[i].used && slots[i].stopId == stopId) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+// The stop button combination of one controller
+struct StopCombo {
+    bool held;
+    bool canResume;      // Pressed while the fleet was already stopped
+    unsigned long since;
+};
+
+enum StopComboAction { STOP_COMBO_NONE, STOP_COMBO_STOP, STOP_COMBO_RESUME };
+
+static inline bool stopComboHeld(bool l1, bool r1, bool l2, bool r2) {
+    return l1 && r1 && l2 && r2;
+}
+
+// Stops on the press. Resumes on letting go of a later press held long
+// enough, so the press that stopped the fleet never resumes it. Controllers
+// only report changes, so the release is the first sample after the hold.
+static inline StopComboAction updateStopCombo(StopCombo *combo, bool held, bool fleetStopped, unsigned long now) {
+    if (!held) {
+        bool resume = combo->held && combo->canResume && fleetStopped && now - combo->since >= STOP_RESUME_HOLD_MS;
+        combo->held = false;
+        return resume ? STOP_COMBO_RESUME : STOP_COMBO_NONE;
+    }
+    if (!combo->held) {
+        combo->held = true;
+        combo->since = now;
+        combo->canResume = fleetStopped;
+        return fleetStopped ? STOP_COMBO_NONE : STOP_COMBO_STOP;
+    }
+    return STOP_COMBO_NONE;
+}
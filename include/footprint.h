@@ -0,0 +1,98 @@
+#pragma once
+#include <Arduino.h>
+
+// ============================================
+// MEMORY FOOTPRINT
+// ============================================
+// Runtime side of the footprint report, the build side is
+// scripts/footprint.py. reportTaskStacks() in tasks.h prints the heap next
+// to the stacks:
+//
+//   free       heap free right now
+//   lowest     least heap free since boot
+//   largest    largest block one allocation can get; far below free means
+//              the heap is fragmented
+//
+// Built with -DHEAP_GUARD=1 every malloc, calloc and realloc goes through
+// a counter (footprint.py adds the --wrap linker flags), and tasks passed
+// to guardHeap() count what they allocate once setup() is done. The control
+// path should show zero. -DHEAP_GUARD=2 aborts on the first such
+// allocation instead, the backtrace shows where it came from.
+// ============================================
+
+#define GUARDED_TASKS 3
+
+struct GuardedTask {
+    TaskHandle_t handle;
+    volatile uint32_t allocations;
+    volatile uint32_t lastSize;
+};
+static GuardedTask guardedTasks[GUARDED_TASKS];
+static volatile int guardedTaskCount = 0;
+
+// Call at the end of setup() with the tasks that must not allocate from then on
+static void guardHeap(TaskHandle_t handle) {
+    if (handle && guardedTaskCount < GUARDED_TASKS) {
+        guardedTasks[guardedTaskCount].handle = handle;
+        guardedTasks[guardedTaskCount].allocations = 0;
+        guardedTaskCount++;
+    }
+}
+
+#ifdef HEAP_GUARD
+#include <esp_rom_sys.h>
+
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t count, size_t size);
+extern "C" void *__real_realloc(void *pointer, size_t size);
+
+static IRAM_ATTR void noteAllocation(size_t size) {
+    if (guardedTaskCount == 0) {
+        return;
+    }
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < guardedTaskCount; i++) {
+        if (guardedTasks[i].handle == task) {
+            guardedTasks[i].allocations++;
+            guardedTasks[i].lastSize = size;
+#if HEAP_GUARD > 1
+            // Serial could allocate itself
+            esp_rom_printf("Heap guard: %s allocated %u bytes\n", pcTaskGetName(task), (unsigned)size);
+            abort();
+#endif
+        }
+    }
+}
+
+// Every firmware is a single translation unit, so these are defined once.
+// In IRAM like the heap itself, it is called with the flash cache off too.
+extern "C" IRAM_ATTR void *__wrap_malloc(size_t size) {
+    noteAllocation(size);
+    return __real_malloc(size);
+}
+extern "C" IRAM_ATTR void *__wrap_calloc(size_t count, size_t size) {
+    noteAllocation(count * size);
+    return __real_calloc(count, size);
+}
+extern "C" IRAM_ATTR void *__wrap_realloc(void *pointer, size_t size) {
+    noteAllocation(size);
+    return __real_realloc(pointer, size);
+}
+#endif
+
+static void reportHeap() {
+    uint32_t free = ESP.getFreeHeap();
+    uint32_t largest = ESP.getMaxAllocHeap();
+    Serial.printf("Heap: free %u, lowest %u, largest block %u (%u%% fragmented)", free, ESP.getMinFreeHeap(),
+                  largest, free ? (unsigned)(100 - (uint64_t)largest * 100 / free) : 0);
+#ifdef HEAP_GUARD
+    for (int i = 0; i < guardedTaskCount; i++) {
+        Serial.printf(", %s allocated %u times", pcTaskGetName(guardedTasks[i].handle),
+                      guardedTasks[i].allocations);
+        if (guardedTasks[i].allocations) {
+            Serial.printf(" (last %u bytes)", guardedTasks[i].lastSize);
+        }
+    }
+#endif
+    Serial.println();
+}
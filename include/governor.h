@@ -0,0 +1,182 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+// ============================================
+// RANGE GOVERNOR
+// ============================================
+// Scales a vehicle's drive down as its link to the base fades, so it rolls
+// to a halt well before the connection timeout instead of running its last
+// command until then. Three signs of a fading link, each mapped linearly
+// from full speed at its `full` threshold to a stop at its `stop` one:
+//
+//   loss     share of base messages missed, from counts that decay by 1/16
+//            every control tick; every base message counts, not only our
+//            own frames
+//   gap      time between base messages, smoothed, or the silence since
+//            the last one when that is longer. Announces keep it short
+//            while the driver's controller has nothing new to send.
+//   rssi     signal of the base, when the radio gives it
+//
+// The weakest of the three sets the target and the limit moves towards it
+// at most GOVERNOR_FULL per rampDownMs going down and per rampUpMs going up,
+// so speed never jumps. The limit starts at zero and comes up once the base
+// is heard. Plain logic owned by the control task; the firmwares use it
+// through vehiclelink.h, the simulator directly.
+// ============================================
+
+#ifndef GOVERNOR_FULL_LOSS_PERCENT
+#define GOVERNOR_FULL_LOSS_PERCENT 15
+#endif
+#ifndef GOVERNOR_STOP_LOSS_PERCENT
+#define GOVERNOR_STOP_LOSS_PERCENT 70
+#endif
+#ifndef GOVERNOR_FULL_GAP_MS
+#define GOVERNOR_FULL_GAP_MS 300
+#endif
+#ifndef GOVERNOR_STOP_GAP_MS
+#define GOVERNOR_STOP_GAP_MS 1200
+#endif
+#ifndef GOVERNOR_FULL_RSSI
+#define GOVERNOR_FULL_RSSI -75
+#endif
+#ifndef GOVERNOR_STOP_RSSI
+#define GOVERNOR_STOP_RSSI -92
+#endif
+#ifndef GOVERNOR_RAMP_DOWN_MS
+#define GOVERNOR_RAMP_DOWN_MS 300
+#endif
+#ifndef GOVERNOR_RAMP_UP_MS
+#define GOVERNOR_RAMP_UP_MS 1000
+#endif
+
+#define GOVERNOR_FULL 256
+#define GOVERNOR_RSSI_UNKNOWN 0
+
+struct GovernorConfig {
+    uint8_t fullLossPercent;
+    uint8_t stopLossPercent;
+    uint16_t fullGapMs;
+    uint16_t stopGapMs;
+    int8_t fullRssi;
+    int8_t stopRssi;
+    uint16_t rampDownMs;
+    uint16_t rampUpMs;
+};
+
+static inline GovernorConfig defaultGovernorConfig() {
+    GovernorConfig config;
+    config.fullLossPercent = GOVERNOR_FULL_LOSS_PERCENT;
+    config.stopLossPercent = GOVERNOR_STOP_LOSS_PERCENT;
+    config.fullGapMs = GOVERNOR_FULL_GAP_MS;
+    config.stopGapMs = GOVERNOR_STOP_GAP_MS;
+    config.fullRssi = GOVERNOR_FULL_RSSI;
+    config.stopRssi = GOVERNOR_STOP_RSSI;
+    config.rampDownMs = GOVERNOR_RAMP_DOWN_MS;
+    config.rampUpMs = GOVERNOR_RAMP_UP_MS;
+    return config;
+}
+
+struct RangeGovernor {
+    int32_t limit;           // 0..GOVERNOR_FULL, applied by governed()
+    int32_t target;
+    uint32_t receivedAverage; // Decaying message counts << 8
+    uint32_t missedAverage;
+    uint8_t lossPercent;
+    uint32_t gapAverage;     // ms << 3
+    uint16_t lastReceived;   // SequenceStats totals at the previous update
+    uint16_t lastMissed;
+    bool heardBase;
+    unsigned long spanStart; // Since the last update that saw a base message
+    unsigned long lastUpdate;
+    // Statistics, readers clear them
+    int32_t lowestLimit;
+    uint32_t limitedMs;      // Time the link held the target below full
+};
+
+static inline void initGovernor(RangeGovernor *g, unsigned long now) {
+    memset(g, 0, sizeof(*g));
+    g->spanStart = now;
+    g->lastUpdate = now;
+    g->lowestLimit = GOVERNOR_FULL;
+}
+
+// GOVERNOR_FULL at or better than full, 0 at or worse than stop
+static inline int32_t governorScale(int32_t value, int32_t full, int32_t stop) {
+    if (full < stop) {
+        if (value <= full) return GOVERNOR_FULL;
+        if (value >= stop) return 0;
+        return (stop - value) * GOVERNOR_FULL / (stop - full);
+    }
+    if (value >= full) return GOVERNOR_FULL;
+    if (value <= stop) return 0;
+    return (value - stop) * GOVERNOR_FULL / (full - stop);
+}
+
+// Call on every control tick with the running base message totals and the
+// time the base was last heard. Returns true when the limit moved.
+static inline bool updateGovernor(RangeGovernor *g, const GovernorConfig *config, uint16_t received, uint16_t missed,
+                                  unsigned long lastHeard, int8_t rssi, unsigned long now) {
+    uint16_t newReceived = received - g->lastReceived;
+    uint16_t newMissed = missed - g->lastMissed;
+    g->lastReceived = received;
+    // A late repeat can take missed back down, see countSequence()
+    if ((int16_t)newMissed < 0) {
+        newMissed = 0;
+    } else {
+        g->lastMissed = missed;
+    }
+    // Weighted by message count, a tick with one message in it says little
+    g->receivedAverage += ((uint32_t)newReceived << 8) - (g->receivedAverage >> 4);
+    g->missedAverage += ((uint32_t)newMissed << 8) - (g->missedAverage >> 4);
+    uint32_t heard = g->receivedAverage + g->missedAverage;
+    g->lossPercent = heard ? (uint8_t)((uint64_t)g->missedAverage * 100 / heard) : 0;
+    if (newReceived) {
+        uint32_t gap = (now - g->spanStart) / newReceived;
+        g->gapAverage = g->heardBase ? g->gapAverage + gap - (g->gapAverage >> 3) : gap << 3;
+        g->spanStart = now;
+        g->heardBase = true;
+    }
+
+    int32_t target = 0;
+    if (g->heardBase) {
+        target = governorScale(g->lossPercent, config->fullLossPercent, config->stopLossPercent);
+        int32_t silence = now - lastHeard;
+        int32_t gap = g->gapAverage >> 3;
+        int32_t gapScore = governorScale(silence > gap ? silence : gap, config->fullGapMs, config->stopGapMs);
+        if (gapScore < target) {
+            target = gapScore;
+        }
+        if (rssi != GOVERNOR_RSSI_UNKNOWN) {
+            int32_t rssiScore = governorScale(rssi, config->fullRssi, config->stopRssi);
+            if (rssiScore < target) {
+                target = rssiScore;
+            }
+        }
+    }
+    g->target = target;
+
+    uint32_t elapsed = now - g->lastUpdate;
+    g->lastUpdate = now;
+    if (g->heardBase && target < GOVERNOR_FULL) {
+        g->limitedMs += elapsed;
+    }
+    int32_t before = g->limit;
+    if (target < g->limit) {
+        int32_t step = config->rampDownMs ? elapsed * GOVERNOR_FULL / config->rampDownMs : GOVERNOR_FULL;
+        g->limit = g->limit - step > target ? g->limit - step : target;
+    } else if (target > g->limit) {
+        int32_t step = config->rampUpMs ? elapsed * GOVERNOR_FULL / config->rampUpMs : GOVERNOR_FULL;
+        g->limit = g->limit + step < target ? g->limit + step : target;
+    }
+    // The ramp up after boot is not the link's doing
+    if (g->limit < before && g->limit < g->lowestLimit) {
+        g->lowestLimit = g->limit;
+    }
+    return g->limit != before;
+}
+
+// A drive command scaled to the current limit
+static inline int32_t governed(const RangeGovernor *g, int32_t value) {
+    return value * g->limit / GOVERNOR_FULL;
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include <string.h>
+#include "protocol.h"
+
+// ============================================
+// VEHICLE HANDOFF
+// ============================================
+// When a controller switches to another vehicle, the vehicle it leaves gets
+// a release frame: a control frame with every stick, trigger and button at
+// rest and FRAME_RELEASE set. It keeps the press epoch and counters of the
+// last frame so nothing is toggled, and the vehicle applies it like any
+// other frame, so it is at neutral one frame after the switch instead of
+// running its last command until the connection timeout.
+//
+// The vehicle answers with a ReleaseAck once the frame is applied. The base
+// sends the release before the first frame for the new vehicle and repeats
+// it every HANDOFF_RETRY_MS until acknowledged, at most HANDOFF_MAX_ATTEMPTS
+// times. Plain logic: the base owns the slots and the radio.
+// ============================================
+
+#ifndef HANDOFF_RETRY_MS
+#define HANDOFF_RETRY_MS 20
+#endif
+#ifndef HANDOFF_MAX_ATTEMPTS
+#define HANDOFF_MAX_ATTEMPTS 10
+#endif
+// Vehicles left at the same time, one per controller is plenty
+#define HANDOFF_SLOTS 4
+
+struct Handoff {
+    bool active;
+    uint8_t attempts;
+    unsigned long started;
+    unsigned long lastSent;
+    struct_message release;
+};
+
+struct HandoffStats {
+    uint32_t started;
+    uint32_t acked;
+    uint32_t failed;      // Gave up after HANDOFF_MAX_ATTEMPTS
+    uint32_t attempts;    // Release frames sent
+    uint32_t maxAckMs;    // Switch to acknowledgement, longest seen
+};
+
+// Everything at rest, press state kept from the last frame for that vehicle
+static inline void buildReleaseFrame(const struct_message *last, struct_message *release) {
+    memset(release, 0, sizeof(*release));
+    release->receiverIndex = last->receiverIndex;
+    release->pressEpoch = last->pressEpoch;
+    memcpy(release->pressCounts, last->pressCounts, sizeof(release->pressCounts));
+    release->flags = FRAME_RELEASE;
+}
+
+// A newer release for the same vehicle replaces the pending one
+static inline bool startHandoff(Handoff slots[HANDOFF_SLOTS], HandoffStats *stats, const struct_message *last,
+                                unsigned long now) {
+    Handoff *slot = NULL;
+    for (int i = 0; i < HANDOFF_SLOTS; i++) {
+        if (slots[i].active && slots[i].release.receiverIndex == last->receiverIndex) {
+            slot = &slots[i];
+            break;
+        }
+        if (!slots[i].active && !slot) {
+            slot = &slots[i];
+        }
+    }
+    if (!slot) {
+        return false;
+    }
+    buildReleaseFrame(last, &slot->release);
+    slot->active = true;
+    slot->attempts = 0;
+    slot->started = now;
+    stats->started++;
+    return true;
+}
+
+// The next release frame to send, NULL when none is due
+static inline Handoff *dueHandoff(Handoff slots[HANDOFF_SLOTS], HandoffStats *stats, unsigned long now) {
+    for (int i = 0; i < HANDOFF_SLOTS; i++) {
+        Handoff *slot = &slots[i];
+        if (!slot->active || (slot->attempts > 0 && now - slot->lastSent < HANDOFF_RETRY_MS)) {
+            continue;
+        }
+        if (slot->attempts >= HANDOFF_MAX_ATTEMPTS) {
+            slot->active = false;
+            stats->failed++;
+            continue;
+        }
+        return slot;
+    }
+    return NULL;
+}
+
+static inline void noteHandoffSent(Handoff *slot, HandoffStats *stats, unsigned long now) {
+    slot->attempts++;
+    slot->lastSent = now;
+    stats->attempts++;
+}
+
+static inline bool handoffPending(const Handoff slots[HANDOFF_SLOTS]) {
+    for (int i = 0; i < HANDOFF_SLOTS; i++) {
+        if (slots[i].active) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// A controller is driving the vehicle again, its release is void
+static inline void cancelHandoff(Handoff slots[HANDOFF_SLOTS], uint32_t vehicleIndex) {
+    for (int i = 0; i < HANDOFF_SLOTS; i++) {
+        if (slots[i].release.receiverIndex == vehicleIndex) {
+            slots[i].active = false;
+        }
+    }
+}
+
+static inline void ackHandoff(Handoff slots[HANDOFF_SLOTS], HandoffStats *stats, uint32_t vehicleIndex,
+                              unsigned long now) {
+    for (int i = 0; i < HANDOFF_SLOTS; i++) {
+        Handoff *slot = &slots[i];
+        if (slot->active && slot->release.receiverIndex == vehicleIndex) {
+            slot->active = false;
+            stats->acked++;
+            if (now - slot->started > stats->maxAckMs) {
+                stats->maxAckMs = now - slot->started;
+            }
+        }
+    }
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <stdint.h>
+
+// ============================================
+// LIGHT PATTERN ENGINE
+// ============================================
+// Plain logic with the current time passed in. The vehicle picks a pattern
+// and calls updateLights() on every housekeeping tick; the returned bits are
+// the lights that should be on right now. Nothing here blocks, and the
+// caller only has to touch pins (or the trailer link) when the bits change.
+// ============================================
+
+// Half period of turn signals and hazards
+#ifndef LIGHT_BLINK_MS
+#define LIGHT_BLINK_MS 300
+#endif
+
+// Output bits, one per light channel
+#define LIGHT_LT1 0x01
+#define LIGHT_LT2 0x02
+#define LIGHT_LT3 0x04
+
+enum LightPattern {
+    LIGHTS_OFF,
+    LIGHTS_STEADY, // LT1 and LT2 on
+    LIGHTS_TURN,   // LT1 and LT2 on, the side being steered to blinks
+    LIGHTS_HAZARD  // LT1 and LT2 blink together
+};
+
+struct LightEngine {
+    LightPattern pattern;
+    int8_t turn;              // -1 blinks LT1, 1 blinks LT2, 0 neither
+    bool aux;                 // LT3, independent of the pattern
+    bool blinkOn;             // Current half of the blink cycle
+    unsigned long blinkStart;
+};
+
+static inline void initLightEngine(LightEngine *e) {
+    e->pattern = LIGHTS_OFF;
+    e->turn = 0;
+    e->aux = false;
+    e->blinkOn = true;
+    e->blinkStart = 0;
+}
+
+// Starts a pattern at the beginning of its cycle, so a new blink is seen at once
+static inline void setLightPattern(LightEngine *e, LightPattern pattern, unsigned long now) {
+    if (pattern == e->pattern) {
+        return;
+    }
+    e->pattern = pattern;
+    e->blinkOn = true;
+    e->blinkStart = now;
+}
+
+static inline void setTurnDirection(LightEngine *e, int8_t turn, unsigned long now) {
+    if (turn == e->turn) {
+        return;
+    }
+    e->turn = turn;
+    e->blinkOn = true;
+    e->blinkStart = now;
+}
+
+// Returns the LIGHT_ bits that should be on now
+static inline uint8_t updateLights(LightEngine *e, unsigned long now) {
+    if (now - e->blinkStart >= LIGHT_BLINK_MS) {
+        e->blinkOn = !e->blinkOn;
+        e->blinkStart = now;
+    }
+    uint8_t lights = 0;
+    switch (e->pattern) {
+        case LIGHTS_OFF:
+            break;
+        case LIGHTS_STEADY:
+            lights = LIGHT_LT1 | LIGHT_LT2;
+            break;
+        case LIGHTS_TURN:
+            lights = LIGHT_LT1 | LIGHT_LT2;
+            if (!e->blinkOn) {
+                lights &= e->turn < 0 ? ~LIGHT_LT1 : e->turn > 0 ? ~LIGHT_LT2 : 0xFF;
+            }
+            break;
+        case LIGHTS_HAZARD:
+            lights = e->blinkOn ? LIGHT_LT1 | LIGHT_LT2 : 0;
+            break;
+    }
+    if (e->aux) {
+        lights |= LIGHT_LT3;
+    }
+    return lights;
+}
@@ -0,0 +1,310 @@
+#pragma once
+#include <stddef.h>
+#include <string.h>
+#include "protocol.h"
+#include "channel.h"
+
+// ============================================
+// VEHICLE LINK STATE
+// ============================================
+// What a vehicle knows about its connection to the base. Plain functions of
+// the current time, used by the firmwares through vehiclelink.h and by the
+// network simulator directly.
+//
+// A vehicle belongs to one base session. Until it has been paired it
+// listens to every base, and the first base that drives it becomes its
+// session. A paired vehicle that hears nothing of its base for the first
+// SESSION_REPAIR_QUIET_MS after power up listens to every base until
+// SESSION_PAIRING_WINDOW_MS, so switching a vehicle to another base means
+// powering it up with its old base off. Hearing its own base closes the
+// window at once. Every other message of another session is dropped and
+// counted.
+//
+// With an authKey set, every base message must carry a valid tag, and those
+// of the paired base a counter above the last one (auth.h), before it is
+// counted or acted on. Frames for other vehicles are checked too: they share
+// the sequence, and a forged one could otherwise take the sequence of a real
+// frame and skew the loss figures. Without a key nothing is checked.
+// ============================================
+
+#ifndef SESSION_REPAIR_QUIET_MS
+#define SESSION_REPAIR_QUIET_MS 3000
+#endif
+#ifndef SESSION_PAIRING_WINDOW_MS
+#define SESSION_PAIRING_WINDOW_MS 10000
+#endif
+// Foreign sessions counted by id, the rest go into one shared counter
+#define FOREIGN_SESSION_SLOTS 4
+
+struct ForeignSession {
+    uint16_t session;
+    uint32_t rejected;
+};
+
+struct VehicleLink {
+    ChannelFollower follower;
+    SequenceStats baseStats;
+    uint16_t reportedReceived; // baseStats totals at the previous report
+    uint16_t reportedMissed;
+    uint16_t reportedRecovered;
+    uint16_t ownFrames;        // Frames for this vehicle, first copies only
+    uint16_t reportedOwnFrames;
+    uint16_t reportSequence;
+    uint16_t session;          // Paired base, SESSION_NONE until the first one drives us
+    bool pairing;              // Any session is accepted while set
+    unsigned long pairingStart;
+    uint16_t messageSession;   // Session of the message accepted last
+    ForeignSession foreign[FOREIGN_SESSION_SLOTS];
+    uint32_t foreignOther;     // Rejected once every slot is taken
+    const AuthKey *authKey;    // NULL accepts messages without checking tags
+    ReplayWindow replay;       // Counter of the paired base
+    uint32_t authFailures;     // Bad tags
+    uint32_t tagChecks;        // Tags computed, for timing them
+    uint32_t replays;          // Good tags with an old counter
+    // Newest emergency stop, see estop.h. Copies after the first are ignored.
+    bool stopValid;
+    bool stopPending;          // Heard, not yet taken by takeStop()
+    uint16_t stopId;
+    uint16_t stopSequence;     // Sequence of the copy heard first
+    uint32_t stopIndex;        // Vehicle it is for, RECEIVER_NONE for all
+    uint32_t stops;
+    // Newest macro start, see macro.h. Copies after the first are ignored.
+    bool macroValid;
+    bool macroPending;         // Heard, not yet taken by takeMacro()
+    uint16_t macroRunId;
+    uint8_t macro;
+    uint32_t macroIndex;       // Vehicle it is for
+};
+
+// startChannel is where the base was last heard, the search starts there.
+// session is the base paired before, SESSION_NONE if there is none.
+static inline void initVehicleLink(VehicleLink *link, uint8_t startChannel, uint16_t session, unsigned long now) {
+    memset(link, 0, sizeof(*link));
+    if (startChannel < WIFI_CHANNEL_MIN || startChannel > WIFI_CHANNEL_MAX) {
+        startChannel = WIFI_CHANNEL_MIN;
+    }
+    initChannelFollower(&link->follower, startChannel, now);
+    link->session = session;
+    link->pairing = true;
+    link->pairingStart = now;
+}
+
+static inline void countForeignSession(VehicleLink *link, uint16_t session) {
+    for (int i = 0; i < FOREIGN_SESSION_SLOTS; i++) {
+        ForeignSession *slot = &link->foreign[i];
+        if (slot->rejected == 0) {
+            slot->session = session;
+        }
+        if (slot->session == session) {
+            slot->rejected++;
+            return;
+        }
+    }
+    link->foreignOther++;
+}
+
+// First check on every incoming message: false for another base's traffic
+static inline bool acceptSession(VehicleLink *link, const uint8_t *data, int len, unsigned long now) {
+    uint16_t session = messageSession(data, len);
+    if (session == SESSION_NONE) {
+        return false;
+    }
+    if (session != link->session) {
+        unsigned long age = now - link->pairingStart;
+        if (link->session == SESSION_NONE ||
+            (link->pairing && age >= SESSION_REPAIR_QUIET_MS && age < SESSION_PAIRING_WINDOW_MS)) {
+            link->messageSession = session;
+            return true;
+        }
+        countForeignSession(link, session);
+        return false;
+    }
+    // Our own base is around, nobody else gets to pair with us
+    link->pairing = false;
+    link->messageSession = session;
+    return true;
+}
+
+// Tag and counter check for a base message that passed acceptSession()
+static inline bool authenticBaseMessage(VehicleLink *link, const uint8_t *data, int len, uint16_t epoch,
+                                        uint16_t sequence) {
+    if (!link->authKey) {
+        return true;
+    }
+    link->tagChecks++;
+    if (!verifyMessage(link->authKey, data, len)) {
+        link->authFailures++;
+        return false;
+    }
+    // While pairing another base may be heard, its counter is not ours to track
+    if (link->messageSession == link->session && !acceptCounter(&link->replay, authCounter(epoch, sequence))) {
+        link->replays++;
+        return false;
+    }
+    return true;
+}
+
+// Call for a message the vehicle acts on, pairs with its session
+static inline void confirmSession(VehicleLink *link) {
+    if (link->messageSession != link->session) {
+        link->replay.valid = false;
+    }
+    link->session = link->messageSession;
+    link->pairing = false;
+}
+
+// Handles network messages from the base. Returns true only for a control
+// frame the vehicle should look at.
+static inline bool receiveBaseMessage(VehicleLink *link, const uint8_t *data, int len, unsigned long now) {
+    if (!acceptSession(link, data, len, now)) {
+        return false;
+    }
+    uint32_t receiverIndex;
+    uint16_t sequence;
+    memcpy(&receiverIndex, data, sizeof(receiverIndex));
+    memcpy(&sequence, data + sizeof(receiverIndex), sizeof(sequence));
+
+    if (receiverIndex < RECEIVER_RESERVED) {
+        if (len < (int)sizeof(struct_message)) {
+            return false;
+        }
+        // Repeats are dropped here, before the tag check and the control task
+        if (sequenceSeen(&link->baseStats, sequence)) {
+            link->baseStats.duplicates++;
+            return false;
+        }
+        uint16_t epoch;
+        memcpy(&epoch, data + offsetof(struct_message, authEpoch), sizeof(epoch));
+        if (!authenticBaseMessage(link, data, sizeof(struct_message), epoch, sequence)) {
+            return false;
+        }
+        uint8_t flags = data[offsetof(struct_message, flags)];
+        countSequence(&link->baseStats, sequence, flags & FRAME_REPEAT);
+        followerHeardBase(&link->follower, now);
+        return true;
+    }
+    if (receiverIndex == RECEIVER_CHANNEL_ANNOUNCE && len >= (int)sizeof(ChannelAnnounce)) {
+        ChannelAnnounce announce;
+        memcpy(&announce, data, sizeof(announce));
+        // A forged announce could move the whole fleet off its channel
+        if (!authenticBaseMessage(link, data, sizeof(announce), announce.authEpoch, sequence)) {
+            return false;
+        }
+        countSequence(&link->baseStats, sequence);
+        followerHeardAnnounce(&link->follower, announce.channel, announce.nextChannel, announce.switchInMs, now);
+    }
+    if (receiverIndex == RECEIVER_STOP && len >= (int)sizeof(StopMessage)) {
+        StopMessage stop;
+        memcpy(&stop, data, sizeof(stop));
+        if (!authenticBaseMessage(link, data, sizeof(stop), stop.authEpoch, sequence)) {
+            return false;
+        }
+        countSequence(&link->baseStats, sequence);
+        followerHeardBase(&link->follower, now);
+        if (!link->stopValid || stop.stopId != link->stopId) {
+            link->stopValid = true;
+            link->stopPending = true;
+            link->stopId = stop.stopId;
+            link->stopSequence = sequence;
+            link->stopIndex = stop.vehicleIndex;
+        }
+    }
+    if (receiverIndex == RECEIVER_MACRO && len >= (int)sizeof(MacroMessage)) {
+        MacroMessage start;
+        memcpy(&start, data, sizeof(start));
+        if (!authenticBaseMessage(link, data, sizeof(start), start.authEpoch, sequence)) {
+            return false;
+        }
+        countSequence(&link->baseStats, sequence);
+        followerHeardBase(&link->follower, now);
+        if (!link->macroValid || start.runId != link->macroRunId) {
+            link->macroValid = true;
+            link->macroPending = true;
+            link->macroRunId = start.runId;
+            link->macro = start.macro;
+            link->macroIndex = start.vehicleIndex;
+        }
+    }
+    return false;
+}
+
+// Fills in a report covering everything since the previous one
+static inline void buildLinkReport(VehicleLink *link, uint32_t vehicleIndex, VehicleType type, LinkReport *report) {
+    memset(report, 0, sizeof(*report));
+    report->receiverIndex = RECEIVER_LINK_REPORT;
+    report->sequence = link->reportSequence++;
+    report->sessionId = link->session;
+    report->vehicleIndex = vehicleIndex;
+    report->vehicleType = type;
+    uint16_t received = link->baseStats.received;
+    uint16_t missed = link->baseStats.missed;
+    uint16_t recovered = link->baseStats.recovered;
+    report->framesReceived = received - link->reportedReceived;
+    link->reportedReceived = received;
+    // A gap of the previous period filled by a late repeat takes missed back
+    // down, that is left for the next report
+    if ((int16_t)(missed - link->reportedMissed) > 0) {
+        report->framesMissed = missed - link->reportedMissed;
+        link->reportedMissed = missed;
+    }
+    report->framesRecovered = recovered - link->reportedRecovered;
+    link->reportedRecovered = recovered;
+    report->ownFrames = link->ownFrames - link->reportedOwnFrames;
+    link->reportedOwnFrames = link->ownFrames;
+}
+
+// Call for every frame addressed to this vehicle
+static inline void countOwnFrame(VehicleLink *link, const struct_message *frame) {
+    if (!(frame->flags & FRAME_REPEAT)) {
+        link->ownFrames++;
+    }
+}
+
+// Call after receiveBaseMessage() returned false. True once for a stop
+// addressed to the whole fleet or to either index.
+static inline bool takeStop(VehicleLink *link, uint32_t vehicleIndex, uint32_t otherIndex = RECEIVER_NONE) {
+    if (!link->stopPending) {
+        return false;
+    }
+    link->stopPending = false;
+    uint32_t index = link->stopIndex;
+    if (index != RECEIVER_NONE && index != vehicleIndex && (otherIndex == RECEIVER_NONE || index != otherIndex)) {
+        return false;
+    }
+    link->stops++;
+    return true;
+}
+
+// Call after receiveBaseMessage() returned false. True once for a macro
+// start addressed to this vehicle, with the macro to run.
+static inline bool takeMacro(VehicleLink *link, uint32_t vehicleIndex, uint8_t *macro) {
+    if (!link->macroPending) {
+        return false;
+    }
+    link->macroPending = false;
+    if (link->macroIndex != vehicleIndex) {
+        return false;
+    }
+    *macro = link->macro;
+    return true;
+}
+
+static inline void buildStopAck(const VehicleLink *link, uint32_t vehicleIndex, uint32_t safeUs, StopAck *ack) {
+    memset(ack, 0, sizeof(*ack));
+    ack->receiverIndex = RECEIVER_STOP_ACK;
+    ack->sequence = link->stopSequence;
+    ack->sessionId = link->session;
+    ack->vehicleIndex = vehicleIndex;
+    ack->stopId = link->stopId;
+    ack->safeUs = safeUs > 0xFFFF ? 0xFFFF : (uint16_t)safeUs;
+}
+
+// Answer to a release frame the vehicle has applied, see handoff.h
+static inline void buildReleaseAck(const VehicleLink *link, const struct_message *frame, uint32_t vehicleIndex,
+                                   ReleaseAck *ack) {
+    memset(ack, 0, sizeof(*ack));
+    ack->receiverIndex = RECEIVER_RELEASE_ACK;
+    ack->sequence = frame->sequence;
+    ack->sessionId = link->session;
+    ack->vehicleIndex = vehicleIndex;
+}
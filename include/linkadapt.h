@@ -0,0 +1,192 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "protocol.h"
+
+// ============================================
+// LINK ADAPTATION
+// ============================================
+// The base picks a profile for every vehicle from how well it hears its own
+// frames:
+//
+// LINK_PROFILE_FAST    a fast PHY rate, so frames spend less time on air:
+//                      lowest latency for a vehicle close by
+// LINK_PROFILE_NORMAL  the ESP-NOW default rate, as before
+// LINK_PROFILE_ROBUST  the slowest rate (Long Range when built with
+//                      LINK_LONG_RANGE), at most one frame every
+//                      LINK_ROBUST_FRAME_MS and each one sent twice, so a
+//                      vehicle at the edge of range keeps being driven
+//                      instead of hitting its failsafe
+//
+// Every link report says how many frames for the vehicle arrived first
+// time; the base compares that with what it sent. LINK_DEGRADE_REPORTS bad
+// reports in a row step a vehicle one profile down, LINK_RECOVER_REPORTS
+// good ones step it back up. A vehicle that has to step down again needs
+// twice as many good reports next time, up to LINK_RECOVER_REPORTS_MAX, so a
+// link on the edge between two profiles does not flap. RSSI counts too when
+// the radio gives it. Broadcast frames are never acknowledged, so delivery
+// is only known from the reports.
+//
+// The radio task owns the slots and the sent counters, the receive
+// callback only writes the profile and its own counters; every field is a
+// single word.
+// ============================================
+
+#ifndef LINK_DEGRADE_LOSS_PERCENT
+#define LINK_DEGRADE_LOSS_PERCENT 10
+#endif
+#ifndef LINK_RECOVER_LOSS_PERCENT
+#define LINK_RECOVER_LOSS_PERCENT 2
+#endif
+#ifndef LINK_DEGRADE_RSSI
+#define LINK_DEGRADE_RSSI -82
+#endif
+#ifndef LINK_RECOVER_RSSI
+#define LINK_RECOVER_RSSI -70
+#endif
+#ifndef LINK_DEGRADE_REPORTS
+#define LINK_DEGRADE_REPORTS 2
+#endif
+#ifndef LINK_RECOVER_REPORTS
+#define LINK_RECOVER_REPORTS 5
+#endif
+#ifndef LINK_RECOVER_REPORTS_MAX
+#define LINK_RECOVER_REPORTS_MAX 60
+#endif
+// Fewer frames than this in a report period say nothing about the link
+#ifndef LINK_ADAPT_MIN_FRAMES
+#define LINK_ADAPT_MIN_FRAMES 20
+#endif
+#ifndef LINK_ROBUST_FRAME_MS
+#define LINK_ROBUST_FRAME_MS 20
+#endif
+// A vehicle that stops reporting no longer holds the announces at its profile
+#ifndef LINK_ADAPT_STALE_MS
+#define LINK_ADAPT_STALE_MS 3500
+#endif
+#define LINK_ADAPT_SLOTS 16
+#define LINK_RSSI_UNKNOWN 0
+
+enum LinkProfile { LINK_PROFILE_FAST, LINK_PROFILE_NORMAL, LINK_PROFILE_ROBUST, LINK_PROFILE_COUNT };
+
+struct LinkProfileSettings {
+    const char *name;
+    uint16_t minFrameMs; // Between two frames for the vehicle, 0 sends every update
+    bool repeat;         // Every frame twice, see redundancy.h
+};
+
+static const LinkProfileSettings linkProfiles[LINK_PROFILE_COUNT] = {
+    {"fast", 0, false},
+    {"normal", 0, false},
+    {"robust", LINK_ROBUST_FRAME_MS, true},
+};
+
+struct LinkAdapt {
+    uint32_t index;          // RECEIVER_NONE while the slot is free
+    volatile uint8_t profile;
+    uint16_t framesSent;     // Running total, radio task
+    unsigned long lastFrame; // millis() of the last frame sent, radio task
+    uint16_t sentAtReport;   // framesSent at the previous report, receive callback
+    uint8_t badReports;
+    uint8_t goodReports;
+    uint8_t recoverReports;  // Good reports needed to step up
+    uint8_t lastLossPercent;
+    unsigned long lastReport;
+    uint32_t changes;
+};
+
+struct LinkAdaptTable {
+    LinkAdapt entries[LINK_ADAPT_SLOTS];
+};
+
+static inline void initLinkAdaptTable(LinkAdaptTable *table) {
+    memset(table, 0, sizeof(*table));
+}
+
+// Radio task only: claims a slot for a vehicle the first time it is sent to
+static inline LinkAdapt *claimLinkAdapt(LinkAdaptTable *table, uint32_t index) {
+    for (int i = 0; i < LINK_ADAPT_SLOTS; i++) {
+        LinkAdapt *entry = &table->entries[i];
+        if (entry->index == index) {
+            return entry;
+        }
+        if (entry->index == RECEIVER_NONE) {
+            entry->profile = LINK_PROFILE_NORMAL;
+            entry->recoverReports = LINK_RECOVER_REPORTS;
+            entry->index = index;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static inline LinkAdapt *findLinkAdapt(LinkAdaptTable *table, uint32_t index) {
+    for (int i = 0; i < LINK_ADAPT_SLOTS; i++) {
+        if (table->entries[i].index == index) {
+            return &table->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static inline uint8_t linkProfileOf(LinkAdaptTable *table, uint32_t index) {
+    LinkAdapt *entry = findLinkAdapt(table, index);
+    return entry ? entry->profile : LINK_PROFILE_NORMAL;
+}
+
+// Radio task: false while the vehicle's profile holds its next frame back
+static inline bool linkFrameDue(const LinkAdapt *entry, unsigned long now) {
+    return !entry || now - entry->lastFrame >= linkProfiles[entry->profile].minFrameMs;
+}
+
+static inline void noteLinkFrameSent(LinkAdapt *entry, unsigned long now) {
+    if (entry) {
+        entry->framesSent++;
+        entry->lastFrame = now;
+    }
+}
+
+// Receive callback, for a report of this base. Returns true when the
+// profile changed.
+static inline bool adaptLink(LinkAdapt *entry, uint16_t ownFrames, int8_t rssi, unsigned long now) {
+    uint16_t sent = entry->framesSent - entry->sentAtReport;
+    entry->sentAtReport = entry->framesSent;
+    entry->lastReport = now;
+    if (sent < LINK_ADAPT_MIN_FRAMES) {
+        return false;
+    }
+    // Frames in flight at report time can make ownFrames a little larger
+    uint8_t loss = ownFrames >= sent ? 0 : (uint8_t)((uint32_t)(sent - ownFrames) * 100 / sent);
+    entry->lastLossPercent = loss;
+    bool rssiKnown = rssi != LINK_RSSI_UNKNOWN;
+    bool bad = loss >= LINK_DEGRADE_LOSS_PERCENT || (rssiKnown && rssi < LINK_DEGRADE_RSSI);
+    bool good = loss <= LINK_RECOVER_LOSS_PERCENT && (!rssiKnown || rssi > LINK_RECOVER_RSSI);
+    entry->badReports = bad ? entry->badReports + 1 : 0;
+    entry->goodReports = good ? entry->goodReports + 1 : 0;
+    if (entry->badReports >= LINK_DEGRADE_REPORTS && entry->profile < LINK_PROFILE_ROBUST) {
+        entry->profile++;
+        entry->recoverReports = entry->recoverReports * 2 > LINK_RECOVER_REPORTS_MAX ? LINK_RECOVER_REPORTS_MAX
+                                                                                   : entry->recoverReports * 2;
+    } else if (entry->goodReports >= entry->recoverReports && entry->profile > LINK_PROFILE_FAST) {
+        entry->profile--;
+    } else {
+        return false;
+    }
+    entry->badReports = 0;
+    entry->goodReports = 0;
+    entry->changes++;
+    return true;
+}
+
+// Announces go out at the most robust profile of any vehicle still reporting
+static inline uint8_t announceProfile(const LinkAdaptTable *table, unsigned long now) {
+    uint8_t profile = LINK_PROFILE_NORMAL;
+    for (int i = 0; i < LINK_ADAPT_SLOTS; i++) {
+        const LinkAdapt *entry = &table->entries[i];
+        if (entry->index != RECEIVER_NONE && now - entry->lastReport < LINK_ADAPT_STALE_MS &&
+            entry->profile > profile) {
+            profile = entry->profile;
+        }
+    }
+    return profile;
+}
@@ -0,0 +1,495 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "protocol.h"
+
+// ============================================
+// MOTION MACROS
+// ============================================
+// A macro is a short byte code sequence kept in a vehicle's firmware, played
+// against the vehicle's own clock instead of being driven frame by frame
+// over the radio. The base starts one with a single MacroMessage, sent
+// MACRO_COPIES times like a stop. Steps:
+//
+//   SET      channel to a percentage and leave it there
+//   DRIVE    channel to a percentage for a time, then off; the next step
+//            starts straight away, so several axes can move at once
+//   WAIT     for a time
+//   SERVO    servo to an angle at a rate in degrees per second, 0 jumps
+//   SETTLE   until every DRIVE has run out and every servo has arrived
+//   END      every channel off, servos stay where they are
+//
+// What a channel or servo moves is up to the firmware, see its macro table.
+// Each step is timed from the one before it, not from when the control task
+// got to it, so a late wake never adds up over a sequence.
+//
+// Any input on the controller ends a macro: the vehicle applies that frame
+// as usual. So do a release frame, an emergency stop and the connection
+// timeout. While its macro runs the base holds back the driver's frames
+// that carry no input and sends the last one every MACRO_KEEPALIVE_MS
+// instead, so the vehicle stays connected. Plain logic: the vehicle's
+// control task owns the player, the base's radio task the broadcasts.
+// ============================================
+
+#ifndef MACRO_COPIES
+#define MACRO_COPIES 3
+#endif
+#ifndef MACRO_COPY_INTERVAL_MS
+#define MACRO_COPY_INTERVAL_MS 5
+#endif
+// Below GOVERNOR_FULL_GAP_MS, so the range governor does not see a fading link
+#ifndef MACRO_KEEPALIVE_MS
+#define MACRO_KEEPALIVE_MS 200
+#endif
+// Stick or trigger throw, after the base's deadband, that counts as input
+#ifndef MACRO_ABORT_AXIS
+#define MACRO_ABORT_AXIS 40
+#endif
+// Servo positions are worked out this often while one moves
+#ifndef MACRO_SERVO_TICK_MS
+#define MACRO_SERVO_TICK_MS 10
+#endif
+#define MACRO_CHANNELS 8
+#define MACRO_SERVOS 2
+#define MACRO_SERVO_CENTRE 90
+// One macro per D-pad direction
+#define MACRO_KEYS 4
+// Macro starts in flight at once
+#define MACRO_SLOTS 4
+
+enum MacroOp {
+    MACRO_OP_END,    // op
+    MACRO_OP_SET,    // op, channel, percent
+    MACRO_OP_DRIVE,  // op, channel, percent, ms low, ms high
+    MACRO_OP_WAIT,   // op, ms low, ms high
+    MACRO_OP_SERVO,  // op, servo, angle, degrees per second
+    MACRO_OP_SETTLE, // op
+    MACRO_OP_COUNT
+};
+
+static const uint8_t macroOpLengths[MACRO_OP_COUNT] = {1, 3, 5, 3, 4, 1};
+
+// Steps for a macro table, percentages -100 to 100, times up to 65535 ms
+#define MACRO_SET(channel, percent) MACRO_OP_SET, (uint8_t)(channel), (uint8_t)(int8_t)(percent)
+#define MACRO_DRIVE(channel, percent, ms)                                                                      \
+    MACRO_OP_DRIVE, (uint8_t)(channel), (uint8_t)(int8_t)(percent), (uint8_t)((ms) & 0xFF), (uint8_t)((ms) >> 8)
+#define MACRO_WAIT(ms) MACRO_OP_WAIT, (uint8_t)((ms) & 0xFF), (uint8_t)((ms) >> 8)
+#define MACRO_SERVO(servo, angle, degreesPerSecond) \
+    MACRO_OP_SERVO, (uint8_t)(servo), (uint8_t)(angle), (uint8_t)(degreesPerSecond)
+#define MACRO_SETTLE MACRO_OP_SETTLE
+#define MACRO_END MACRO_OP_END
+
+struct MacroDef {
+    const char *name;
+    const uint8_t *code;
+    uint16_t length;
+};
+
+#define MACRO_DEF(name, code) {name, code, sizeof(code)}
+
+enum MacroEnd { MACRO_DONE, MACRO_ABORT_INPUT, MACRO_ABORT_RELEASE, MACRO_ABORT_STOP, MACRO_ABORT_TIMEOUT,
+                MACRO_REPLACED, MACRO_END_COUNT };
+
+static const char *const macroEndNames[MACRO_END_COUNT] = {"done", "input", "release", "stop", "timeout",
+                                                             "replaced"};
+
+// Every step known, channels and servos in range, ends with END
+static inline bool validMacro(const MacroDef *macro) {
+    uint16_t pc = 0;
+    while (pc < macro->length) {
+        const uint8_t *step = macro->code + pc;
+        if (step[0] >= MACRO_OP_COUNT || pc + macroOpLengths[step[0]] > macro->length) {
+            return false;
+        }
+        if (step[0] == MACRO_OP_END) {
+            return true;
+        }
+        if ((step[0] == MACRO_OP_SET || step[0] == MACRO_OP_DRIVE) && step[1] >= MACRO_CHANNELS) {
+            return false;
+        }
+        if (step[0] == MACRO_OP_SERVO && step[1] >= MACRO_SERVOS) {
+            return false;
+        }
+        pc += macroOpLengths[step[0]];
+    }
+    return false;
+}
+
+struct MacroPlayer {
+    const MacroDef *macro;     // NULL when no macro runs
+    uint16_t pc;
+    uint32_t clockUs;          // When the step at pc was due
+    bool blocked;              // The step at pc is a WAIT or SETTLE still running
+    uint32_t waitUntilUs;
+    int8_t drive[MACRO_CHANNELS];
+    uint32_t driveUntilUs[MACRO_CHANNELS];
+    uint8_t timedDrives;       // Bit per channel running a DRIVE
+    int16_t servoAngle[MACRO_SERVOS];
+    int16_t servoFrom[MACRO_SERVOS];
+    int16_t servoTarget[MACRO_SERVOS];
+    uint8_t servoRate[MACRO_SERVOS];
+    uint32_t servoStartUs[MACRO_SERVOS];
+    uint8_t servosUsed;        // Bit per servo this macro has moved
+    uint8_t servosMoving;
+    uint32_t lastFinishUs;     // Latest DRIVE or servo finish, where a SETTLE continues from
+    // Timing of the current run
+    uint32_t startedUs;
+    uint16_t events;           // WAITs, DRIVEs and servo moves that ran out
+    uint32_t lateSumUs;        // How long after they were due they were handled
+    uint32_t lateMaxUs;
+};
+
+static inline bool macroTimeReached(uint32_t nowUs, uint32_t dueUs) {
+    return (int32_t)(nowUs - dueUs) >= 0;
+}
+
+static inline void noteMacroEvent(MacroPlayer *p, uint32_t nowUs, uint32_t dueUs) {
+    uint32_t late = nowUs - dueUs;
+    p->events++;
+    p->lateSumUs += late;
+    if (late > p->lateMaxUs) {
+        p->lateMaxUs = late;
+    }
+}
+
+static inline void noteMacroFinish(MacroPlayer *p, uint32_t finishUs) {
+    if ((int32_t)(finishUs - p->lastFinishUs) > 0) {
+        p->lastFinishUs = finishUs;
+    }
+}
+
+// servoAngles are where the servos are now, NULL for MACRO_SERVO_CENTRE
+static inline void startMacro(MacroPlayer *p, const MacroDef *macro, uint32_t nowUs, const int16_t *servoAngles) {
+    memset(p, 0, sizeof(*p));
+    p->macro = macro;
+    p->clockUs = nowUs;
+    p->lastFinishUs = nowUs;
+    p->startedUs = nowUs;
+    for (int s = 0; s < MACRO_SERVOS; s++) {
+        p->servoAngle[s] = servoAngles ? servoAngles[s] : MACRO_SERVO_CENTRE;
+    }
+}
+
+// Every channel off, servos stay where they are
+static inline void stopMacro(MacroPlayer *p) {
+    memset(p->drive, 0, sizeof(p->drive));
+    p->timedDrives = 0;
+    p->servosMoving = 0;
+    p->macro = NULL;
+}
+
+static inline uint16_t macroWord(const uint8_t *bytes) {
+    return bytes[0] | bytes[1] << 8;
+}
+
+static inline uint32_t servoTravelUs(const MacroPlayer *p, int s) {
+    int16_t distance = p->servoTarget[s] - p->servoFrom[s];
+    return (uint32_t)(distance < 0 ? -distance : distance) * 1000000UL / p->servoRate[s];
+}
+
+// Runs everything that is due by nowUs. True when a drive or a servo angle
+// changed, the firmware then writes its outputs from the player. A macro
+// that reached END is no longer running afterwards.
+static inline bool runMacro(MacroPlayer *p, uint32_t nowUs) {
+    bool changed = false;
+    bool progress = true;
+    while (p->macro && progress) {
+        progress = false;
+        for (int c = 0; c < MACRO_CHANNELS; c++) {
+            if ((p->timedDrives & (1 << c)) && macroTimeReached(nowUs, p->driveUntilUs[c])) {
+                p->timedDrives &= ~(1 << c);
+                p->drive[c] = 0;
+                noteMacroEvent(p, nowUs, p->driveUntilUs[c]);
+                changed = true;
+            }
+        }
+        for (int s = 0; s < MACRO_SERVOS; s++) {
+            if (!(p->servosMoving & (1 << s))) {
+                continue;
+            }
+            uint32_t travelUs = servoTravelUs(p, s);
+            uint32_t elapsedUs = nowUs - p->servoStartUs[s];
+            int16_t angle = p->servoTarget[s];
+            if (elapsedUs < travelUs) {
+                int16_t moved = (int16_t)((uint64_t)elapsedUs * p->servoRate[s] / 1000000UL);
+                angle = p->servoFrom[s] + (p->servoTarget[s] > p->servoFrom[s] ? moved : -moved);
+            } else {
+                p->servosMoving &= ~(1 << s);
+                noteMacroEvent(p, nowUs, p->servoStartUs[s] + travelUs);
+            }
+            if (angle != p->servoAngle[s]) {
+                p->servoAngle[s] = angle;
+                changed = true;
+            }
+        }
+        if (p->blocked) {
+            uint8_t op = p->macro->code[p->pc];
+            uint32_t dueUs = p->waitUntilUs;
+            if (op == MACRO_OP_SETTLE) {
+                if (p->timedDrives || p->servosMoving) {
+                    break;
+                }
+                dueUs = (int32_t)(p->lastFinishUs - p->clockUs) > 0 ? p->lastFinishUs : p->clockUs;
+            } else if (!macroTimeReached(nowUs, dueUs)) {
+                break;
+            } else {
+                noteMacroEvent(p, nowUs, dueUs);
+            }
+            p->blocked = false;
+            p->clockUs = dueUs;
+            p->pc += macroOpLengths[op];
+        }
+        // Steps up to the next one that blocks
+        while (p->macro && !p->blocked) {
+            const uint8_t *step = p->macro->code + p->pc;
+            if (p->pc >= p->macro->length || step[0] >= MACRO_OP_COUNT || step[0] == MACRO_OP_END) {
+                stopMacro(p);
+                changed = true;
+                break;
+            }
+            progress = true;
+            uint8_t c = step[1];
+            switch (step[0]) {
+            case MACRO_OP_SET:
+                p->drive[c] = (int8_t)step[2];
+                p->timedDrives &= ~(1 << c);
+                changed = true;
+                break;
+            case MACRO_OP_DRIVE:
+                p->drive[c] = (int8_t)step[2];
+                p->driveUntilUs[c] = p->clockUs + macroWord(step + 3) * 1000UL;
+                p->timedDrives |= 1 << c;
+                noteMacroFinish(p, p->driveUntilUs[c]);
+                changed = true;
+                break;
+            case MACRO_OP_WAIT:
+                p->waitUntilUs = p->clockUs + macroWord(step + 1) * 1000UL;
+                p->blocked = true;
+                break;
+            case MACRO_OP_SERVO:
+                p->servosUsed |= 1 << c;
+                p->servoFrom[c] = p->servoAngle[c];
+                p->servoTarget[c] = step[2];
+                p->servoRate[c] = step[3];
+                p->servoStartUs[c] = p->clockUs;
+                if (step[3] == 0 || p->servoAngle[c] == step[2]) {
+                    p->servosMoving &= ~(1 << c);
+                    p->servoAngle[c] = step[2];
+                    changed = true;
+                } else {
+                    p->servosMoving |= 1 << c;
+                    noteMacroFinish(p, p->clockUs + servoTravelUs(p, c));
+                }
+                break;
+            case MACRO_OP_SETTLE:
+                p->blocked = true;
+                break;
+            }
+            if (!p->blocked) {
+                p->pc += macroOpLengths[step[0]];
+            }
+        }
+    }
+    return changed;
+}
+
+// Microseconds until runMacro() has something to do, maxUs when nothing is due sooner
+static inline uint32_t macroDueInUs(const MacroPlayer *p, uint32_t nowUs, uint32_t maxUs) {
+    if (!p->macro) {
+        return maxUs;
+    }
+    uint32_t due = maxUs;
+    if (p->servosMoving && due > MACRO_SERVO_TICK_MS * 1000UL) {
+        due = MACRO_SERVO_TICK_MS * 1000UL;
+    }
+    for (int c = 0; c < MACRO_CHANNELS; c++) {
+        if (p->timedDrives & (1 << c)) {
+            int32_t left = (int32_t)(p->driveUntilUs[c] - nowUs);
+            due = left <= 0 ? 0 : ((uint32_t)left < due ? (uint32_t)left : due);
+        }
+    }
+    if (p->blocked && p->macro->code[p->pc] == MACRO_OP_WAIT) {
+        int32_t left = (int32_t)(p->waitUntilUs - nowUs);
+        due = left <= 0 ? 0 : ((uint32_t)left < due ? (uint32_t)left : due);
+    }
+    return due;
+}
+
+static inline uint32_t macroLateAverageUs(const MacroPlayer *p) {
+    return p->events ? p->lateSumUs / p->events : 0;
+}
+
+static inline bool axisInput(int32_t value) {
+    return value > MACRO_ABORT_AXIS || value < -MACRO_ABORT_AXIS;
+}
+
+// Anything the driver does on the controller, the misc buttons aside
+static inline bool macroInput(const struct_message *frame) {
+    return axisInput(frame->axisX) || axisInput(frame->axisY) || axisInput(frame->axisRX) ||
+           axisInput(frame->axisRY) || frame->brake > MACRO_ABORT_AXIS || frame->throttle > MACRO_ABORT_AXIS ||
+           frame->buttons || frame->dpad || frame->thumbR || frame->thumbL || frame->r1 || frame->l1 || frame->r2 ||
+           frame->l2;
+}
+
+// Base side from here on
+
+// What a trigger hands the radio task
+struct MacroRequest {
+    uint32_t vehicleIndex;
+    uint8_t macro;
+    int8_t controller;     // Whose frames go quiet, -1 for none
+};
+
+struct MacroBroadcast {
+    bool active;
+    uint8_t copiesSent;
+    unsigned long lastSent;
+    MacroRequest request;
+    uint16_t runId;
+};
+
+// A new start for a vehicle replaces one still going out to it
+static inline void startMacroBroadcast(MacroBroadcast slots[MACRO_SLOTS], const MacroRequest *request,
+                                       uint16_t runId) {
+    MacroBroadcast *slot = &slots[0];
+    for (int i = 0; i < MACRO_SLOTS; i++) {
+        if (slots[i].active && slots[i].request.vehicleIndex == request->vehicleIndex) {
+            slot = &slots[i];
+            break;
+        }
+        if (slot->active && !slots[i].active) {
+            slot = &slots[i];
+        }
+    }
+    memset(slot, 0, sizeof(*slot));
+    slot->active = true;
+    slot->request = *request;
+    slot->runId = runId;
+}
+
+static inline MacroBroadcast *dueMacroBroadcast(MacroBroadcast slots[MACRO_SLOTS], unsigned long now) {
+    for (int i = 0; i < MACRO_SLOTS; i++) {
+        MacroBroadcast *slot = &slots[i];
+        if (slot->active && (slot->copiesSent == 0 || now - slot->lastSent >= MACRO_COPY_INTERVAL_MS)) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static inline void buildMacroMessage(const MacroBroadcast *slot, MacroMessage *message) {
+    memset(message, 0, sizeof(*message));
+    message->receiverIndex = RECEIVER_MACRO;
+    message->vehicleIndex = slot->request.vehicleIndex;
+    message->runId = slot->runId;
+    message->macro = slot->request.macro;
+}
+
+static inline void noteMacroBroadcastSent(MacroBroadcast *slot, unsigned long now) {
+    slot->copiesSent++;
+    slot->lastSent = now;
+    if (slot->copiesSent >= MACRO_COPIES) {
+        slot->active = false;
+    }
+}
+
+// A stop must not be followed by a macro start, RECEIVER_NONE cancels all
+static inline void cancelMacroBroadcasts(MacroBroadcast slots[MACRO_SLOTS], uint32_t vehicleIndex) {
+    for (int i = 0; i < MACRO_SLOTS; i++) {
+        if (vehicleIndex == RECEIVER_NONE || slots[i].request.vehicleIndex == vehicleIndex) {
+            slots[i].active = false;
+        }
+    }
+}
+
+// One controller's frames while the vehicle it drives runs a macro
+struct MacroQuiet {
+    bool active;
+    uint32_t vehicleIndex;
+    unsigned long lastSent; // Last frame of this controller on air
+};
+
+static inline void startMacroQuiet(MacroQuiet *quiet, uint32_t vehicleIndex, unsigned long now) {
+    quiet->active = true;
+    quiet->vehicleIndex = vehicleIndex;
+    quiet->lastSent = now;
+}
+
+// True when the frame can stay at the base. The first one with input, for
+// another vehicle or releasing this one ends the quiet.
+static inline bool macroQuietHolds(MacroQuiet *quiet, const struct_message *frame) {
+    if (!quiet->active) {
+        return false;
+    }
+    if (frame->receiverIndex != quiet->vehicleIndex || (frame->flags & FRAME_RELEASE) || macroInput(frame)) {
+        quiet->active = false;
+        return false;
+    }
+    return true;
+}
+
+static inline bool macroKeepaliveDue(const MacroQuiet *quiet, unsigned long now) {
+    return quiet->active && now - quiet->lastSent >= MACRO_KEEPALIVE_MS;
+}
+
+// How long the radio task may wait before a copy or keepalive is due
+static inline unsigned long nextMacroSendIn(const MacroBroadcast slots[MACRO_SLOTS], const MacroQuiet *quiet,
+                                            int controllers, unsigned long now, unsigned long wait) {
+    for (int i = 0; i < MACRO_SLOTS; i++) {
+        if (slots[i].active && wait > MACRO_COPY_INTERVAL_MS) {
+            wait = MACRO_COPY_INTERVAL_MS;
+        }
+    }
+    for (int i = 0; i < controllers; i++) {
+        if (quiet[i].active) {
+            unsigned long since = now - quiet[i].lastSent;
+            unsigned long left = since >= MACRO_KEEPALIVE_MS ? 0 : MACRO_KEEPALIVE_MS - since;
+            if (left < wait) {
+                wait = left;
+            }
+        }
+    }
+    return wait;
+}
+
+// Held on one controller: D-pad up, down, right and left start macros 0 to 3
+struct MacroTrigger {
+    uint8_t dpad; // Previous sample
+};
+
+// The macro to start, -1 for none. Only a direction pressed while the
+// button is held counts, so letting go of the button never starts one.
+static inline int macroTriggered(MacroTrigger *trigger, bool held, uint8_t dpad) {
+    uint8_t pressed = dpad & ~trigger->dpad;
+    trigger->dpad = dpad;
+    if (!held) {
+        return -1;
+    }
+    for (int key = 0; key < MACRO_KEYS; key++) {
+        if (pressed & (1 << key)) {
+            return key;
+        }
+    }
+    return -1;
+}
+
+// Input stage: call for every frame before its presses are counted. While
+// the button is held the D-pad only picks macros and is cleared in the
+// frame. The macro to start on the vehicle the frame is for, -1 for none.
+static inline int takeMacroTrigger(MacroTrigger *trigger, bool held, struct_message *frame) {
+    int macro = macroTriggered(trigger, held, frame->dpad);
+    if (held) {
+        frame->dpad = 0;
+    }
+    if (frame->receiverIndex == 0 || frame->receiverIndex == RECEIVER_NONE) {
+        return -1;
+    }
+    return macro;
+}
+
+struct MacroStats {
+    uint32_t started;
+    uint32_t copies;      // MacroMessages sent
+    uint32_t heldFrames;  // Frames without input kept at the base during a macro
+    uint32_t keepalives;  // Frames sent instead of them
+};
@@ -0,0 +1,94 @@
+#pragma once
+#include <stdint.h>
+
+// ============================================
+// DRIVE MIXER
+// ============================================
+// Turns a throttle and a steering stick into left and right motor commands
+// in one pass, integer only. Sticks run -512..512, positive steering turns
+// right; commands run -255..255 for moveMotor().
+//
+// DRIVE_ACKERMANN  a steering servo does the turning; past the deadband the
+//                  inner side slows down by up to `assist` (256 = stops) at
+//                  full lock to help the front wheels round
+// DRIVE_SKID       tracked or skid-steer: steering is added to one side and
+//                  taken from the other, scaled down together when one side
+//                  would pass full speed
+// DRIVE_PIVOT_LEFT/RIGHT  turn on the spot, the inner side runs backwards at
+//                  the throttle speed
+//
+// Throttle inside MIXER_THROTTLE_DEADBAND (in motor units, after halving)
+// stops both sides, the band the fork's drive always had.
+// ============================================
+
+#define MIXER_INPUT_RANGE 512
+#define MIXER_OUTPUT_RANGE 255
+// Steering inside this band leaves both sides at the throttle speed
+#ifndef MIXER_STEER_DEADBAND
+#define MIXER_STEER_DEADBAND 90
+#endif
+
+#ifndef MIXER_THROTTLE_DEADBAND
+#define MIXER_THROTTLE_DEADBAND 15
+#endif
+
+enum DriveMode { DRIVE_ACKERMANN, DRIVE_SKID, DRIVE_PIVOT_LEFT, DRIVE_PIVOT_RIGHT };
+
+struct DriveCommand {
+    int16_t left;
+    int16_t right;
+};
+
+static inline int32_t clampDrive(int32_t value) {
+    return value > MIXER_OUTPUT_RANGE ? MIXER_OUTPUT_RANGE : value < -MIXER_OUTPUT_RANGE ? -MIXER_OUTPUT_RANGE : value;
+}
+
+static inline DriveCommand mixDrive(DriveMode mode, int32_t throttle, int32_t steering, int32_t assist) {
+    // Full stick is 512, half of it is full motor speed
+    int32_t speed = throttle / 2;
+    if (speed <= MIXER_THROTTLE_DEADBAND && speed >= -MIXER_THROTTLE_DEADBAND) {
+        speed = 0;
+    }
+    int32_t left = speed;
+    int32_t right = speed;
+    switch (mode) {
+        case DRIVE_ACKERMANN: {
+            int32_t lock = steering < 0 ? -steering : steering;
+            if (lock > MIXER_STEER_DEADBAND) {
+                int32_t slowdown =
+                    assist * (lock - MIXER_STEER_DEADBAND) / (MIXER_INPUT_RANGE - MIXER_STEER_DEADBAND);
+                int32_t inner = speed * (256 - slowdown) / 256;
+                if (steering > 0) {
+                    right = inner;
+                } else {
+                    left = inner;
+                }
+            }
+            break;
+        }
+        case DRIVE_SKID: {
+            left = speed + steering / 2;
+            right = speed - steering / 2;
+            int32_t peak = left < 0 ? -left : left;
+            int32_t otherPeak = right < 0 ? -right : right;
+            if (otherPeak > peak) {
+                peak = otherPeak;
+            }
+            if (peak > MIXER_OUTPUT_RANGE) {
+                left = left * MIXER_OUTPUT_RANGE / peak;
+                right = right * MIXER_OUTPUT_RANGE / peak;
+            }
+            break;
+        }
+        case DRIVE_PIVOT_LEFT:
+            left = -speed;
+            break;
+        case DRIVE_PIVOT_RIGHT:
+            right = -speed;
+            break;
+    }
+    DriveCommand command;
+    command.left = (int16_t)clampDrive(left);
+    command.right = (int16_t)clampDrive(right);
+    return command;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <Arduino.h>
+#include <Preferences.h>
+
+// ============================================
+// PERSISTED VEHICLE STATE
+// ============================================
+// Servo positions and toggles that survive a power cycle, so a vehicle boots
+// where it was left instead of driving everything to fixed positions. Each
+// firmware keeps one small struct; the housekeeping task hands over the
+// current values every tick and they are written once they have stopped
+// changing, which keeps flash wear down while a trim is being held.
+// ============================================
+
+#ifndef PERSIST_SETTLE_MS
+#define PERSIST_SETTLE_MS 2000
+#endif
+#define PERSIST_NAMESPACE "vehicle"
+#define PERSIST_KEY "state"
+#define PERSIST_MAX_SIZE 32
+
+static Preferences persistStore;
+static uint8_t persistedCopy[PERSIST_MAX_SIZE]; // What flash holds
+static uint8_t pendingCopy[PERSIST_MAX_SIZE];   // Newer state waiting to settle
+static unsigned long pendingSince = 0;
+static bool pendingValid = false;
+
+// Fills state with the saved copy. Returns false and leaves state as it is
+// on first boot or when the struct changed size since it was saved.
+static bool loadPersistedState(void *state, size_t size) {
+    if (size > PERSIST_MAX_SIZE) {
+        return false;
+    }
+    persistStore.begin(PERSIST_NAMESPACE, false);
+    bool loaded = persistStore.getBytesLength(PERSIST_KEY) == size &&
+                  persistStore.getBytes(PERSIST_KEY, persistedCopy, size) == size;
+    if (loaded) {
+        memcpy(state, persistedCopy, size);
+    } else {
+        memcpy(persistedCopy, state, size);
+    }
+    return loaded;
+}
+
+// Call every housekeeping tick with the current state
+static void persistStateWhenSettled(const void *state, size_t size) {
+    if (size > PERSIST_MAX_SIZE) {
+        return;
+    }
+    if (memcmp(state, pendingValid ? pendingCopy : persistedCopy, size) != 0) {
+        memcpy(pendingCopy, state, size);
+        pendingSince = millis();
+        pendingValid = true;
+        return;
+    }
+    if (pendingValid && millis() - pendingSince >= PERSIST_SETTLE_MS) {
+        persistStore.putBytes(PERSIST_KEY, pendingCopy, size);
+        memcpy(persistedCopy, pendingCopy, size);
+        pendingValid = false;
+    }
+}
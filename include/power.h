@@ -0,0 +1,162 @@
+#pragma once
+#include <Arduino.h>
+#include <WiFi.h>
+#include <esp_sleep.h>
+#include "vehiclelink.h"
+
+// ============================================
+// VEHICLE POWER POLICY
+// ============================================
+// driven: frames for this vehicle within POWER_IDLE_AFTER_MS. Full CPU
+//         clock, radio never sleeps.
+// idle:   the base is heard but drives someone else. CPU at 80 MHz (the
+//         lowest clock the radio runs at) and modem sleep requested.
+// asleep: nothing from the base for POWER_SLEEP_AFTER_MS, e.g. it is
+//         switched off. Light sleep for POWER_SLEEP_MS, then a listen window
+//         of POWER_LISTEN_MS, long enough to hear a channel beacon.
+//
+// The control task calls wakeForFrame() for every frame addressed to the
+// vehicle, which goes straight back to driven, and servicePower() on every
+// iteration, in its DEADLINE_POWER stage. Light sleep stops the servo pulses, so servos go limp while
+// asleep; motors are already stopped by then by the connection timeout.
+// ============================================
+
+#ifndef POWER_IDLE_AFTER_MS
+#define POWER_IDLE_AFTER_MS 30000
+#endif
+// 0 keeps the vehicle idle forever instead of sleeping
+#ifndef POWER_SLEEP_AFTER_MS
+#define POWER_SLEEP_AFTER_MS 60000
+#endif
+#ifndef POWER_SLEEP_MS
+#define POWER_SLEEP_MS 500
+#endif
+#ifndef POWER_LISTEN_MS
+#define POWER_LISTEN_MS (CHANNEL_ANNOUNCE_PERIOD_MS + 100)
+#endif
+#define POWER_DRIVEN_CPU_MHZ 240
+#define POWER_IDLE_CPU_MHZ 80
+// Typical module current in each state, only used for the estimate in the
+// report. Measure your own board and override them.
+#ifndef POWER_DRIVEN_MA
+#define POWER_DRIVEN_MA 115
+#endif
+#ifndef POWER_IDLE_MA
+#define POWER_IDLE_MA 80
+#endif
+#ifndef POWER_LIGHT_SLEEP_MA
+#define POWER_LIGHT_SLEEP_MA 1
+#endif
+#ifndef POWER_REPORT_PERIOD_MS
+#define POWER_REPORT_PERIOD_MS 10000
+#endif
+
+enum PowerState { POWER_DRIVEN, POWER_IDLE, POWER_ASLEEP, POWER_STATE_COUNT };
+static const char *const powerStateNames[POWER_STATE_COUNT] = {"driven", "idle", "asleep"};
+
+// Running totals kept by the control task, reportPowerStats() takes differences
+struct PowerStats {
+    uint32_t stateMs[POWER_STATE_COUNT];
+    uint32_t sleptMs;          // Part of asleep spent in light sleep
+    uint32_t maxIdleWakeUs;    // Idle to driven, reset by every report
+    uint32_t maxSleepWakeMs;   // Listen window opened to driven, reset by every report
+};
+
+static volatile PowerState powerState = POWER_DRIVEN;
+static PowerStats powerStats;
+static unsigned long lastDrivenTime = 0;
+static unsigned long lastPowerServiceTime = 0;
+static unsigned long listenWindowStart = 0;
+
+static void enterPowerState(PowerState state) {
+    if (state == POWER_DRIVEN) {
+        setCpuFrequencyMhz(POWER_DRIVEN_CPU_MHZ);
+        WiFi.setSleep(false);
+    } else if (powerState == POWER_DRIVEN) {
+        WiFi.setSleep(true);
+        setCpuFrequencyMhz(POWER_IDLE_CPU_MHZ);
+    }
+    listenWindowStart = millis();
+    powerState = state;
+}
+
+// Call from the control task for every frame addressed to this vehicle
+static void wakeForFrame() {
+    lastDrivenTime = millis();
+    if (powerState == POWER_DRIVEN) {
+        return;
+    }
+    unsigned long start = micros();
+    PowerState previous = powerState;
+    unsigned long listened = millis() - listenWindowStart;
+    enterPowerState(POWER_DRIVEN);
+    uint32_t us = micros() - start;
+    if (previous == POWER_IDLE && us > powerStats.maxIdleWakeUs) {
+        powerStats.maxIdleWakeUs = us;
+    }
+    if (previous == POWER_ASLEEP && listened > powerStats.maxSleepWakeMs) {
+        powerStats.maxSleepWakeMs = listened;
+    }
+}
+
+// Call from the control task on every iteration, frame or not
+static void servicePower() {
+    unsigned long now = millis();
+    powerStats.stateMs[powerState] += now - lastPowerServiceTime;
+    lastPowerServiceTime = now;
+
+    bool baseHeard = now - vehicleLink.follower.lastBaseFrame < POWER_SLEEP_AFTER_MS || POWER_SLEEP_AFTER_MS == 0;
+    PowerState target = now - lastDrivenTime < POWER_IDLE_AFTER_MS ? POWER_DRIVEN
+                        : baseHeard                                 ? POWER_IDLE
+                                                                    : POWER_ASLEEP;
+    // Driven is only entered through wakeForFrame(), so target is driven only while we already are
+    if (target != powerState) {
+        enterPowerState(target);
+    }
+    if (powerState != POWER_ASLEEP || now - listenWindowStart < POWER_LISTEN_MS) {
+        return;
+    }
+    // Nothing heard in this listen window, sleep until the next one. The
+    // sleep is no work of the control loop: its iteration ends here and a
+    // new one starts on waking, so the deadline monitor never counts it.
+    endControlIteration();
+    esp_sleep_enable_timer_wakeup((uint64_t)POWER_SLEEP_MS * 1000);
+    if (esp_light_sleep_start() == ESP_OK) {
+        powerStats.sleptMs += millis() - now;
+    }
+    listenWindowStart = millis();
+    controlStage(DEADLINE_POWER);
+}
+
+// Call from the housekeeping task: state changes and a summary every POWER_REPORT_PERIOD_MS
+static void reportPowerStats() {
+    static PowerState reportedState = POWER_DRIVEN;
+    static unsigned long lastReportTime = 0;
+    static PowerStats last;
+    PowerState state = powerState;
+    if (state != reportedState) {
+        reportedState = state;
+        Serial.printf("Power: %s\n", powerStateNames[state]);
+    }
+    if (millis() - lastReportTime < POWER_REPORT_PERIOD_MS) {
+        return;
+    }
+    lastReportTime = millis();
+    PowerStats now = powerStats;
+    uint32_t ms[POWER_STATE_COUNT];
+    uint32_t totalMs = 0;
+    for (int i = 0; i < POWER_STATE_COUNT; i++) {
+        ms[i] = now.stateMs[i] - last.stateMs[i];
+        totalMs += ms[i];
+    }
+    uint32_t sleptMs = now.sleptMs - last.sleptMs;
+    uint64_t charge = (uint64_t)ms[POWER_DRIVEN] * POWER_DRIVEN_MA + (uint64_t)ms[POWER_IDLE] * POWER_IDLE_MA +
+                      (uint64_t)(ms[POWER_ASLEEP] - sleptMs) * POWER_IDLE_MA + (uint64_t)sleptMs * POWER_LIGHT_SLEEP_MA;
+    Serial.printf("Power: driven %u ms, idle %u ms, asleep %u ms (%u ms in light sleep), est. %u mA | "
+                  "wake from idle %u us max, from sleep %u ms max + up to %d ms asleep\n",
+                  ms[POWER_DRIVEN], ms[POWER_IDLE], ms[POWER_ASLEEP], sleptMs,
+                  totalMs ? (uint32_t)(charge / totalMs) : 0, now.maxIdleWakeUs, now.maxSleepWakeMs, POWER_SLEEP_MS);
+    last = now;
+    powerStats.maxIdleWakeUs = 0;
+    powerStats.maxSleepWakeMs = 0;
+}
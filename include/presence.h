@@ -0,0 +1,117 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "protocol.h"
+#include "deadline.h"
+
+// ============================================
+// VEHICLE PRESENCE
+// ============================================
+// The base learns which vehicles are powered from their link reports, sent
+// once a second by every vehicle that hears it. A vehicle is live until
+// PRESENCE_TIMEOUT_MS passes without a report. The forward and back buttons
+// step through live vehicles only, in index order, and wrap around.
+//
+// Slots are claimed once per index and never given back; written by the
+// radio receive callback and read by the input and loop tasks, every field
+// is a single word so a reader never sees a torn value.
+// ============================================
+
+#ifndef PRESENCE_TIMEOUT_MS
+#define PRESENCE_TIMEOUT_MS 3500
+#endif
+#define PRESENCE_SLOTS 16
+#define PRESENCE_RSSI_UNKNOWN 0
+
+static const char *const vehicleTypeNames[VEHICLE_TYPE_COUNT] = {"unknown", "excavator", "forklift",
+                                                                 "dump truck", "semi", "trailer"};
+
+struct PresenceEntry {
+    uint32_t index;      // RECEIVER_NONE while the slot is free
+    uint8_t type;        // VehicleType
+    uint8_t lossPercent; // From the latest report
+    uint8_t rawLossPercent; // The same before repeats filled gaps, see redundancy.h
+    int8_t rssi;         // Of the latest report, PRESENCE_RSSI_UNKNOWN if the radio does not tell
+    bool paired;         // False while the vehicle has no session yet
+    uint32_t overruns;   // Control loop overruns reported since the base booted
+    uint8_t overrunStage; // DeadlineStage of the latest one
+    uint8_t worstOverrunMs;
+    unsigned long lastSeen;
+};
+
+struct PresenceTable {
+    PresenceEntry entries[PRESENCE_SLOTS];
+};
+
+static inline void initPresenceTable(PresenceTable *table) {
+    memset(table, 0, sizeof(*table));
+}
+
+static inline bool isPresent(const PresenceEntry *entry, unsigned long now) {
+    return entry->index != RECEIVER_NONE && now - entry->lastSeen < PRESENCE_TIMEOUT_MS;
+}
+
+// Trailers follow their tractor and are never driven directly
+static inline bool isSelectable(const PresenceEntry *entry, unsigned long now) {
+    return isPresent(entry, now) && entry->type != VEHICLE_TRAILER;
+}
+
+static inline void notePresence(PresenceTable *table, const LinkReport *report, int8_t rssi, unsigned long now) {
+    if (report->vehicleIndex == RECEIVER_NONE || report->vehicleIndex >= RECEIVER_RESERVED) {
+        return;
+    }
+    PresenceEntry *entry = NULL;
+    for (int i = 0; i < PRESENCE_SLOTS && !entry; i++) {
+        if (table->entries[i].index == report->vehicleIndex || table->entries[i].index == RECEIVER_NONE) {
+            entry = &table->entries[i];
+        }
+    }
+    if (!entry) {
+        return;
+    }
+    entry->type = report->vehicleType < VEHICLE_TYPE_COUNT ? report->vehicleType : VEHICLE_UNKNOWN;
+    entry->lossPercent = sequenceLossPercent(report->framesReceived, report->framesMissed);
+    entry->rawLossPercent = rawLossPercent(report->framesReceived, report->framesMissed, report->framesRecovered);
+    entry->rssi = rssi;
+    entry->paired = report->sessionId != SESSION_NONE;
+    entry->overruns += report->overruns;
+    entry->overrunStage = report->overrunStage < DEADLINE_STAGE_COUNT ? report->overrunStage : DEADLINE_IDLE;
+    entry->worstOverrunMs = report->worstOverrunMs;
+    entry->lastSeen = now;
+    entry->index = report->vehicleIndex;
+}
+
+static inline const PresenceEntry *findPresence(const PresenceTable *table, uint32_t index) {
+    for (int i = 0; i < PRESENCE_SLOTS; i++) {
+        if (table->entries[i].index == index) {
+            return &table->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// The live vehicle after current (direction 1) or before it (-1), wrapping
+// around. Returns current when no vehicle is live.
+static inline uint32_t stepPresentVehicle(const PresenceTable *table, uint32_t current, int direction,
+                                          unsigned long now) {
+    uint32_t best = RECEIVER_NONE;  // Nearest in the step direction
+    uint32_t wrap = RECEIVER_NONE;  // Lowest going forward, highest going back
+    for (int i = 0; i < PRESENCE_SLOTS; i++) {
+        const PresenceEntry *entry = &table->entries[i];
+        if (!isSelectable(entry, now)) {
+            continue;
+        }
+        uint32_t index = entry->index;
+        bool ahead = direction > 0 ? index > current : index < current;
+        if (ahead && (best == RECEIVER_NONE || (direction > 0 ? index < best : index > best))) {
+            best = index;
+        }
+        if (wrap == RECEIVER_NONE || (direction > 0 ? index < wrap : index > wrap)) {
+            wrap = index;
+        }
+    }
+    if (best != RECEIVER_NONE) {
+        return best;
+    }
+    return wrap != RECEIVER_NONE ? wrap : current;
+}
@@ -0,0 +1,230 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "edges.h"
+#include "auth.h"
+
+// ============================================
+// ESP-NOW MESSAGES
+// ============================================
+// Every message starts with receiverIndex, sequence and sessionId. Indexes
+// below RECEIVER_RESERVED address a vehicle with a control frame, the ones
+// above tag network messages that share the same broadcast channel.
+// sessionId names the base a message belongs to, so several bases can share
+// a venue; it sits at the same offset in every message so a receiver can
+// drop foreign traffic before looking at anything else. Every message ends
+// with authTag, see auth.h.
+// ============================================
+
+#define RECEIVER_NONE 0
+#define RECEIVER_RESERVED 0xFFFFFF00
+#define RECEIVER_CHANNEL_ANNOUNCE 0xFFFFFF01 // base -> all, ChannelAnnounce
+#define RECEIVER_LINK_REPORT 0xFFFFFF02      // vehicle -> base, LinkReport
+#define RECEIVER_TRAILER_STATE 0xFFFFFF03    // semi -> its trailer, TrailerStateMessage
+#define RECEIVER_RELEASE_ACK 0xFFFFFF04      // vehicle -> base, ReleaseAck
+#define RECEIVER_STOP 0xFFFFFF05             // base -> all, StopMessage
+#define RECEIVER_STOP_ACK 0xFFFFFF06         // vehicle -> base, StopAck
+#define RECEIVER_MACRO 0xFFFFFF07            // base -> all, MacroMessage
+
+// Never used by a base, a vehicle with this session is not paired yet
+#define SESSION_NONE 0
+#define MESSAGE_HEADER_BYTES 8 // receiverIndex, sequence, sessionId
+#define SESSION_ID_OFFSET 6
+
+// Control frame sent by the base to the selected vehicle
+typedef struct struct_message {
+    uint32_t receiverIndex;
+    uint16_t sequence;      // Incremented for every message the base sends
+    uint16_t sessionId;     // Base that sent it
+    uint16_t buttons;
+    uint8_t dpad;
+    int32_t axisX, axisY;
+    int32_t axisRX, axisRY;
+    uint32_t brake, throttle;
+    uint16_t miscButtons;
+    bool thumbR, thumbL, r1, l1, r2, l2;
+    uint8_t pressEpoch;                     // Press counting session, see edges.h
+    uint8_t pressCounts[PRESS_COUNT_BYTES]; // 4-bit press counter per EdgeInput
+    uint8_t flags;                          // FRAME_* bits
+    uint16_t authEpoch;                     // Counter above the sequence, see auth.h
+    uint32_t authTag;
+} struct_message;
+
+// The controller has moved on to another vehicle, see handoff.h
+#define FRAME_RELEASE 0x01
+// Second copy of a frame already sent, same sequence, see redundancy.h
+#define FRAME_REPEAT 0x02
+
+// Beacon telling the fleet which channel the base is on and where it is going
+typedef struct ChannelAnnounce {
+    uint32_t receiverIndex; // RECEIVER_CHANNEL_ANNOUNCE
+    uint16_t sequence;
+    uint16_t sessionId;
+    uint8_t channel;        // Channel the base is transmitting on now
+    uint8_t nextChannel;    // Equal to channel unless a move is scheduled
+    uint16_t switchInMs;    // Time left until the base moves to nextChannel
+    uint16_t authEpoch;
+    uint32_t authTag;
+} ChannelAnnounce;
+
+// What a vehicle is, carried in its link reports
+enum VehicleType {
+    VEHICLE_UNKNOWN,
+    VEHICLE_EXCAVATOR,
+    VEHICLE_FORKLIFT,
+    VEHICLE_DUMP_TRUCK,
+    VEHICLE_SEMI,
+    VEHICLE_TRAILER,
+    VEHICLE_TYPE_COUNT
+};
+
+// Sent by every vehicle so the base can see how well it is being heard and
+// which vehicles are powered
+typedef struct LinkReport {
+    uint32_t receiverIndex; // RECEIVER_LINK_REPORT
+    uint16_t sequence;      // Vehicle's own report counter
+    uint16_t sessionId;     // Base the vehicle is paired with
+    uint32_t vehicleIndex;
+    uint16_t framesReceived; // Base messages heard since the previous report
+    uint16_t framesMissed;   // Gaps in the base sequence since the previous report
+    uint16_t framesRecovered; // Received only as a repeat, the first copy was lost
+    uint16_t ownFrames;      // Frames for this vehicle that arrived first time, see linkadapt.h
+    uint8_t vehicleType;     // VehicleType
+    uint8_t overrunStage;    // Control loop stage of the latest overrun, see deadline.h
+    uint16_t overruns;       // Control loop overruns since the previous report
+    uint8_t worstOverrunMs;  // Longest overrunning iteration since boot
+    uint32_t authTag;
+} LinkReport;
+
+// A vehicle has applied a release frame
+typedef struct ReleaseAck {
+    uint32_t receiverIndex; // RECEIVER_RELEASE_ACK
+    uint16_t sequence;      // Base sequence of the release frame
+    uint16_t sessionId;
+    uint32_t vehicleIndex;
+    uint32_t authTag;
+} ReleaseAck;
+
+// Emergency stop, see estop.h. Every copy of one stop has the same stopId
+// and a sequence of its own.
+typedef struct StopMessage {
+    uint32_t receiverIndex; // RECEIVER_STOP
+    uint16_t sequence;
+    uint16_t sessionId;
+    uint32_t vehicleIndex;  // RECEIVER_NONE stops every vehicle
+    uint16_t stopId;
+    uint8_t reason;         // StopReason
+    uint16_t authEpoch;
+    uint32_t authTag;
+} StopMessage;
+
+// A vehicle has made its outputs safe
+typedef struct StopAck {
+    uint32_t receiverIndex; // RECEIVER_STOP_ACK
+    uint16_t sequence;      // Base sequence of the copy that stopped it
+    uint16_t sessionId;
+    uint32_t vehicleIndex;
+    uint16_t stopId;
+    uint16_t safeUs;        // Receive callback entry to outputs written
+    uint32_t authTag;
+} StopAck;
+
+// Starts a motion macro stored on the vehicle, see macro.h. Every copy of
+// one start has the same runId and a sequence of its own.
+typedef struct MacroMessage {
+    uint32_t receiverIndex; // RECEIVER_MACRO
+    uint16_t sequence;
+    uint16_t sessionId;
+    uint32_t vehicleIndex;
+    uint16_t runId;
+    uint8_t macro;          // Index into the vehicle's macro table
+    uint16_t authEpoch;
+    uint32_t authTag;
+} MacroMessage;
+
+// Everything a semi wants its trailer to do, relayed over the air so the
+// trailer does not need the serial cable
+typedef struct TrailerStateMessage {
+    uint32_t receiverIndex; // RECEIVER_TRAILER_STATE
+    uint16_t sequence;      // Semi's own counter
+    uint16_t sessionId;     // Base the semi is paired with
+    uint32_t tractorIndex;  // Receiver index of the semi, a trailer only follows its own
+    uint16_t state;         // packTrailerState() from trailerstate.h
+    uint16_t authEpoch;     // Semi's boot count, above the sequence like the base's
+    uint32_t authTag;
+} TrailerStateMessage;
+
+// Session of any message, SESSION_NONE when it is too short to carry one
+static inline uint16_t messageSession(const uint8_t *data, int len) {
+    uint16_t session = SESSION_NONE;
+    if (len >= MESSAGE_HEADER_BYTES) {
+        memcpy(&session, data + SESSION_ID_OFFSET, sizeof(session));
+    }
+    return session;
+}
+
+// Loss counting on the base sequence, shared by everything that listens to the base
+struct SequenceStats {
+    uint16_t lastSequence;
+    bool valid;
+    uint32_t seen;       // Bit n set when lastSequence - n has been counted
+    uint16_t received;   // Running totals, readers take differences
+    uint16_t missed;     // Never heard, not even as a repeat
+    uint16_t recovered;  // Heard only as a repeat
+    uint16_t duplicates; // Repeats of a sequence already counted
+};
+
+// Gaps larger than this are treated as a base restart rather than loss
+#define SEQUENCE_RESYNC_GAP 1000
+// How far back a late sequence still fills its gap
+#define SEQUENCE_WINDOW 32
+
+// Counts each sequence once. Returns false for one already counted, so the
+// second copy of a repeated frame goes no further.
+static inline bool countSequence(SequenceStats *stats, uint16_t sequence, bool repeat = false) {
+    uint16_t ahead = (uint16_t)(sequence - stats->lastSequence);
+    uint16_t behind = (uint16_t)(stats->lastSequence - sequence);
+    if (stats->valid && behind < SEQUENCE_WINDOW) {
+        uint32_t bit = (uint32_t)1 << behind;
+        if (stats->seen & bit) {
+            stats->duplicates++;
+            return false;
+        }
+        // Counted as missed when the gap opened
+        stats->seen |= bit;
+        stats->missed--;
+    } else {
+        if (stats->valid && ahead < SEQUENCE_RESYNC_GAP) {
+            stats->missed += ahead - 1;
+            stats->seen = ahead < SEQUENCE_WINDOW ? stats->seen << ahead | 1 : 1;
+        } else {
+            // Nothing before a restart was counted missed, so nothing can fill it
+            stats->seen = 0xFFFFFFFF;
+        }
+        stats->lastSequence = sequence;
+        stats->valid = true;
+    }
+    stats->received++;
+    if (repeat) {
+        stats->recovered++;
+    }
+    return true;
+}
+
+// True for a sequence countSequence() has counted already. Counts nothing,
+// so a message that later fails its tag check leaves no trace.
+static inline bool sequenceSeen(const SequenceStats *stats, uint16_t sequence) {
+    uint16_t behind = (uint16_t)(stats->lastSequence - sequence);
+    return stats->valid && behind < SEQUENCE_WINDOW && (stats->seen & (uint32_t)1 << behind);
+}
+
+// Loss in percent over the counted window, 0 when nothing was expected
+static inline uint8_t sequenceLossPercent(uint16_t received, uint16_t missed) {
+    uint32_t expected = (uint32_t)received + missed;
+    return expected ? (uint8_t)((uint32_t)missed * 100 / expected) : 0;
+}
+
+// Loss on air, counting frames that only got through as a repeat
+static inline uint8_t rawLossPercent(uint16_t received, uint16_t missed, uint16_t recovered) {
+    return sequenceLossPercent(received - recovered, missed + recovered);
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <string.h>
+#include "protocol.h"
+
+// ============================================
+// FRAME REDUNDANCY
+// ============================================
+// Broadcast frames get no retries from the radio, so a lost frame leaves a
+// vehicle on its previous command until the next controller update. With
+// redundancy on, the base sends a frame a second time FRAME_REPEAT_DELAY_MS
+// later, far enough apart that one burst of interference rarely takes both
+// copies. The copy keeps the sequence number and carries FRAME_REPEAT;
+// vehicles count a sequence once (countSequence() in protocol.h) and drop
+// the second copy before it reaches the control task.
+//
+// REDUNDANCY_CHANGES  repeat frames whose command differs from the one sent
+//                     before for that controller; losing an unchanged
+//                     frame costs nothing, the vehicle already has it
+// REDUNDANCY_ALL      repeat every frame, twice the airtime
+//
+// A newer frame for the same controller replaces a repeat not yet sent.
+// Vehicles report what reached them only as a repeat, so the base can show
+// the loss on air next to the loss left after repeats.
+// ============================================
+
+enum RedundancyMode { REDUNDANCY_OFF, REDUNDANCY_CHANGES, REDUNDANCY_ALL, REDUNDANCY_MODE_COUNT };
+
+#ifndef FRAME_REDUNDANCY
+#define FRAME_REDUNDANCY REDUNDANCY_OFF
+#endif
+#ifndef FRAME_REPEAT_DELAY_MS
+#define FRAME_REPEAT_DELAY_MS 4
+#endif
+
+static const char *const redundancyModeNames[REDUNDANCY_MODE_COUNT] = {"off", "changes", "all"};
+
+struct FrameRepeat {
+    bool pending;
+    unsigned long due;
+    struct_message frame;
+};
+
+// Same command, ignoring what is stamped on every message
+static inline bool sameCommand(const struct_message *a, const struct_message *b) {
+    struct_message x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    x.sequence = y.sequence = 0;
+    x.sessionId = y.sessionId = 0;
+    x.authEpoch = y.authEpoch = 0;
+    x.authTag = y.authTag = 0;
+    x.flags = y.flags = 0;
+    return memcmp(&x, &y, sizeof(x)) == 0;
+}
+
+// Call once a frame has been sent. previous is the frame sent before it for
+// the same controller, NULL if there was none.
+static inline void scheduleRepeat(FrameRepeat *repeat, int mode, const struct_message *frame,
+                                  const struct_message *previous, unsigned long now) {
+    repeat->pending = false;
+    if (mode == REDUNDANCY_OFF || (mode == REDUNDANCY_CHANGES && previous && sameCommand(frame, previous))) {
+        return;
+    }
+    memcpy(&repeat->frame, frame, sizeof(repeat->frame));
+    repeat->frame.flags |= FRAME_REPEAT;
+    repeat->due = now + FRAME_REPEAT_DELAY_MS;
+    repeat->pending = true;
+}
+
+static inline bool repeatDue(const FrameRepeat *repeat, unsigned long now) {
+    return repeat->pending && (long)(now - repeat->due) >= 0;
+}
+
+// The vehicle is being released, an older command must not follow the release
+static inline void cancelRepeats(FrameRepeat *repeats, int count, uint32_t vehicleIndex) {
+    for (int i = 0; i < count; i++) {
+        if (repeats[i].frame.receiverIndex == vehicleIndex) {
+            repeats[i].pending = false;
+        }
+    }
+}
+
+// Milliseconds until the next repeat is due, at most limit
+static inline unsigned long nextRepeatIn(const FrameRepeat *repeats, int count, unsigned long now,
+                                         unsigned long limit) {
+    for (int i = 0; i < count; i++) {
+        if (repeats[i].pending) {
+            long left = (long)(repeats[i].due - now);
+            if (left < 0) {
+                left = 0;
+            }
+            if ((unsigned long)left < limit) {
+                limit = left;
+            }
+        }
+    }
+    return limit;
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <stdint.h>
+
+// ============================================
+// SOFTWARE PWM FOR PORT EXPANDER OUTPUTS
+// ============================================
+// The MCP23017 has no PWM of its own. A hardware timer splits every PWM
+// period into SOFTPWM_STEPS slots; on each slot the outputs of all 16
+// channels are computed and written to both ports in one transfer. A channel
+// with duty d is on for the first d slots of the period. Slots where no
+// output changes are not written, so steady outputs cost no bus time.
+//
+// Plain logic: the firmware owns the timer and the I2C write. The tick rate
+// is SOFTPWM_FREQUENCY_HZ * SOFTPWM_STEPS, and each write of both ports takes
+// roughly 100 us at 400 kHz, so 100 Hz x 16 steps keeps the bus below 20%.
+// The firmware measures the real write time at boot and warns when the
+// configured rate would use more than SOFTPWM_BUS_BUDGET_PERCENT of the bus.
+// ============================================
+
+#ifndef SOFTPWM_FREQUENCY_HZ
+#define SOFTPWM_FREQUENCY_HZ 100
+#endif
+// Duty resolution, duty runs from 0 (off) to SOFTPWM_STEPS (always on)
+#ifndef SOFTPWM_STEPS
+#define SOFTPWM_STEPS 16
+#endif
+#ifndef SOFTPWM_BUS_BUDGET_PERCENT
+#define SOFTPWM_BUS_BUDGET_PERCENT 50
+#endif
+#ifndef SOFTPWM_I2C_HZ
+#define SOFTPWM_I2C_HZ 400000
+#endif
+#define SOFTPWM_TICK_HZ (SOFTPWM_FREQUENCY_HZ * SOFTPWM_STEPS)
+#define SOFTPWM_CHANNELS 16
+
+// The PWM task is woken by the timer and only does the port write, so it
+// runs above the control task
+#ifndef SOFTPWM_TASK_CORE
+#define SOFTPWM_TASK_CORE 1
+#endif
+#ifndef SOFTPWM_TASK_PRIORITY
+#define SOFTPWM_TASK_PRIORITY 6
+#endif
+#ifndef SOFTPWM_TASK_STACK
+#define SOFTPWM_TASK_STACK 2048
+#endif
+
+struct SoftPwm {
+    volatile uint8_t duty[SOFTPWM_CHANNELS]; // Set by the control task
+    uint8_t slot;                             // Owned by the tick
+};
+
+static inline void initSoftPwm(SoftPwm *p) {
+    for (int i = 0; i < SOFTPWM_CHANNELS; i++) {
+        p->duty[i] = 0;
+    }
+    p->slot = 0;
+}
+
+// Output bits for the current slot, then moves on to the next one
+static inline uint16_t nextSoftPwmLevels(SoftPwm *p) {
+    uint16_t levels = 0;
+    for (int i = 0; i < SOFTPWM_CHANNELS; i++) {
+        if (p->duty[i] > p->slot) {
+            levels |= 1 << i;
+        }
+    }
+    p->slot = p->slot + 1 < SOFTPWM_STEPS ? p->slot + 1 : 0;
+    return levels;
+}
+
+// Drives an H-bridge pair: positive duty on channel0, negative on channel1.
+// The idle side is cleared first so both are never on in the same slot.
+static inline void setSoftPwmMotor(SoftPwm *p, int channel0, int channel1, int duty) {
+    if (duty > SOFTPWM_STEPS) duty = SOFTPWM_STEPS;
+    if (duty < -SOFTPWM_STEPS) duty = -SOFTPWM_STEPS;
+    if (duty >= 0) {
+        p->duty[channel1] = 0;
+        p->duty[channel0] = duty;
+    } else {
+        p->duty[channel0] = 0;
+        p->duty[channel1] = -duty;
+    }
+}
+
+// Maps a stick value to a signed duty. Nothing moves inside the deadzone,
+// past it the duty grows linearly to SOFTPWM_STEPS at full throw.
+static inline int stickToDuty(int32_t value, int32_t deadzone, int32_t range) {
+    int32_t magnitude = value < 0 ? -value : value;
+    if (magnitude <= deadzone) {
+        return 0;
+    }
+    int32_t duty = 1 + (magnitude - deadzone) * (SOFTPWM_STEPS - 1) / (range - deadzone);
+    if (duty > SOFTPWM_STEPS) {
+        duty = SOFTPWM_STEPS;
+    }
+    return value < 0 ? -duty : duty;
+}
+
+// Buttons have no throw, they run their output at full duty
+static inline int buttonDuty(bool forward, bool reverse) {
+    return forward ? SOFTPWM_STEPS : reverse ? -SOFTPWM_STEPS : 0;
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include <stdint.h>
+
+// ============================================
+// STICK CALIBRATION AND FILTERING
+// ============================================
+// Plain logic used by the base station. A resting stick reads a few counts
+// off centre and wanders by a few more, so every frame differed from the
+// last one. The centre offset is measured once per controller, and each
+// axis then goes through a deadband and an adaptive hysteresis so a quiet
+// stick produces exactly the same value frame after frame.
+// ============================================
+
+// Deadband around centre, in raw stick counts (sticks read -512..511)
+#ifndef STICK_DEADBAND
+#define STICK_DEADBAND 24
+#endif
+// Deadband at the released end of the triggers (0..1023)
+#ifndef TRIGGER_DEADBAND
+#define TRIGGER_DEADBAND 16
+#endif
+// Smallest and largest change that gets through once the output is settled
+#ifndef STICK_HYSTERESIS_MIN
+#define STICK_HYSTERESIS_MIN 3
+#endif
+#ifndef STICK_HYSTERESIS_MAX
+#define STICK_HYSTERESIS_MAX 24
+#endif
+// Frames averaged for a centre calibration
+#ifndef CALIBRATION_SAMPLES
+#define CALIBRATION_SAMPLES 50
+#endif
+// A calibration is thrown away if the stick moved more than this while sampling
+#ifndef CALIBRATION_MAX_SPREAD
+#define CALIBRATION_MAX_SPREAD 40
+#endif
+// ...or if the measured centre is further off than this (stick was held)
+#ifndef CALIBRATION_MAX_OFFSET
+#define CALIBRATION_MAX_OFFSET 120
+#endif
+
+#define STICK_RANGE 512
+#define CALIBRATED_AXES 4 // axisX, axisY, axisRX, axisRY
+
+// --------------------------------------------
+// Centre calibration
+// --------------------------------------------
+
+struct StickCalibration {
+    int32_t offset[CALIBRATED_AXES];
+};
+
+struct CalibrationSampler {
+    int32_t sum[CALIBRATED_AXES];
+    int32_t low[CALIBRATED_AXES];
+    int32_t high[CALIBRATED_AXES];
+    uint16_t count;
+};
+
+static inline void startCalibration(CalibrationSampler *s) {
+    for (int a = 0; a < CALIBRATED_AXES; a++) {
+        s->sum[a] = 0;
+        s->low[a] = INT32_MAX;
+        s->high[a] = INT32_MIN;
+    }
+    s->count = 0;
+}
+
+// Adds one frame of raw stick readings. Returns true once a good calibration
+// has been written to result; a bad run starts over on its own.
+static inline bool addCalibrationSample(CalibrationSampler *s, const int32_t raw[CALIBRATED_AXES],
+                                        StickCalibration *result) {
+    for (int a = 0; a < CALIBRATED_AXES; a++) {
+        s->sum[a] += raw[a];
+        if (raw[a] < s->low[a]) s->low[a] = raw[a];
+        if (raw[a] > s->high[a]) s->high[a] = raw[a];
+    }
+    if (++s->count < CALIBRATION_SAMPLES) {
+        return false;
+    }
+    bool good = true;
+    for (int a = 0; a < CALIBRATED_AXES; a++) {
+        int32_t offset = s->sum[a] / CALIBRATION_SAMPLES;
+        if (s->high[a] - s->low[a] > CALIBRATION_MAX_SPREAD || offset > CALIBRATION_MAX_OFFSET ||
+            offset < -CALIBRATION_MAX_OFFSET) {
+            good = false;
+        }
+        result->offset[a] = offset;
+    }
+    startCalibration(s);
+    return good;
+}
+
+// --------------------------------------------
+// Deadband and hysteresis
+// --------------------------------------------
+
+struct AxisFilter {
+    int32_t output;    // Last value let through
+    int32_t lastRaw;
+    int32_t noise16;   // Average frame-to-frame wobble while still, times 16
+    bool valid;
+};
+
+static inline void resetAxisFilter(AxisFilter *f) {
+    f->output = 0;
+    f->lastRaw = 0;
+    f->noise16 = STICK_HYSTERESIS_MIN * 16;
+    f->valid = false;
+}
+
+// Removes the deadband and stretches the rest so full deflection still
+// reaches full range
+static inline int32_t applyDeadband(int32_t value, int32_t deadband, int32_t range) {
+    if (value > deadband) {
+        return (value - deadband) * range / (range - deadband);
+    }
+    if (value < -deadband) {
+        return (value + deadband) * range / (range - deadband);
+    }
+    return 0;
+}
+
+// Filters one reading. The hysteresis follows the wobble measured while the
+// stick is still, so a noisy controller gets a wider band than a clean one.
+static inline int32_t filterAxis(AxisFilter *f, int32_t raw, int32_t deadband, int32_t range) {
+    int32_t step = raw > f->lastRaw ? raw - f->lastRaw : f->lastRaw - raw;
+    f->lastRaw = raw;
+    if (f->valid && step <= STICK_HYSTERESIS_MAX) {
+        f->noise16 += step - f->noise16 / 16;
+    }
+
+    int32_t value = applyDeadband(raw, deadband, range);
+    // Peak-to-peak wobble is about three times the average step
+    int32_t hysteresis = f->noise16 * 4 / 16;
+    if (hysteresis < STICK_HYSTERESIS_MIN) hysteresis = STICK_HYSTERESIS_MIN;
+    if (hysteresis > STICK_HYSTERESIS_MAX) hysteresis = STICK_HYSTERESIS_MAX;
+
+    int32_t change = value > f->output ? value - f->output : f->output - value;
+    // Centre and the ends always get through so the stick can settle exactly there
+    if (!f->valid || change >= hysteresis || value == 0 || raw >= range - 1 || raw <= -range) {
+        f->output = value;
+    }
+    f->valid = true;
+    return f->output;
+}
@@ -0,0 +1,168 @@
+#pragma once
+#include <Arduino.h>
+#include <esp_task_wdt.h>
+#include <esp_idf_version.h>
+#include "footprint.h"
+#include "deadline.h"
+
+// ============================================
+// TASK LAYOUT
+// ============================================
+// The WiFi/ESP-NOW stack runs on core 0. Time critical work gets its own
+// high priority task pinned to core 1 so it never competes with the radio,
+// and everything that may block (lights, logging, telemetry, serial links)
+// runs in a low priority housekeeping task. Control loops time their
+// iterations (include/deadline.h) and feed the task watchdog.
+//
+// Every value below can be overridden from platformio.ini, for example:
+//   build_flags = -DCONTROL_TASK_PRIORITY=10 -DHOUSEKEEPING_TASK_STACK=6144
+// ============================================
+
+#ifndef CONTROL_TASK_CORE
+#define CONTROL_TASK_CORE 1
+#endif
+#ifndef CONTROL_TASK_PRIORITY
+#define CONTROL_TASK_PRIORITY 5
+#endif
+#ifndef CONTROL_TASK_STACK
+#define CONTROL_TASK_STACK 4096
+#endif
+#ifndef HOUSEKEEPING_TASK_CORE
+#define HOUSEKEEPING_TASK_CORE 0
+#endif
+#ifndef HOUSEKEEPING_TASK_PRIORITY
+#define HOUSEKEEPING_TASK_PRIORITY 1
+#endif
+#ifndef HOUSEKEEPING_TASK_STACK
+#define HOUSEKEEPING_TASK_STACK 4096
+#endif
+
+// How long the control task waits for a new frame before running its
+// connection checks anyway
+#ifndef CONTROL_IDLE_PERIOD_MS
+#define CONTROL_IDLE_PERIOD_MS 20
+#endif
+// Housekeeping tick, also the resolution of light sequences
+#ifndef HOUSEKEEPING_PERIOD_MS
+#define HOUSEKEEPING_PERIOD_MS 10
+#endif
+// How often stack high-water marks and the heap are printed, 0 disables the report
+#ifndef STACK_REPORT_PERIOD_MS
+#define STACK_REPORT_PERIOD_MS 10000
+#endif
+// A control loop that stops feeding the task watchdog this long resets the
+// chip, setup() then brings every output up stopped. 0 leaves the watchdog
+// as the core set it up.
+#ifndef WATCHDOG_TIMEOUT_S
+#define WATCHDOG_TIMEOUT_S 3
+#endif
+
+#define MAX_REPORTED_TASKS 6
+
+struct TaskEntry {
+    const char *name;
+    TaskHandle_t handle;
+    uint32_t stackSize;
+};
+static TaskEntry reportedTasks[MAX_REPORTED_TASKS];
+static int reportedTaskCount = 0;
+
+// Adds a task to the stack report, e.g. the Arduino loop task from setup()
+static void watchTask(const char *name, TaskHandle_t handle, uint32_t stackSize) {
+    if (handle && reportedTaskCount < MAX_REPORTED_TASKS) {
+        reportedTasks[reportedTaskCount].name = name;
+        reportedTasks[reportedTaskCount].handle = handle;
+        reportedTasks[reportedTaskCount].stackSize = stackSize;
+        reportedTaskCount++;
+    }
+}
+
+// Creates a task pinned to a core and registers it for stack reporting
+static TaskHandle_t startPinnedTask(TaskFunction_t function, const char *name, uint32_t stackSize,
+                                    UBaseType_t priority, BaseType_t core) {
+    TaskHandle_t handle = nullptr;
+    if (xTaskCreatePinnedToCore(function, name, stackSize, nullptr, priority, &handle, core) != pdPASS) {
+        Serial.printf("Failed to start task %s\n", name);
+        return nullptr;
+    }
+    watchTask(name, handle, stackSize);
+    return handle;
+}
+
+// Prints the minimum free stack (in bytes) each registered task has seen,
+// of the stack it was given, then the heap
+static void reportTaskStacks() {
+    Serial.print("Stack free:");
+    for (int i = 0; i < reportedTaskCount; i++) {
+        Serial.printf(" %s=%u/%u", reportedTasks[i].name,
+                      (unsigned)uxTaskGetStackHighWaterMark(reportedTasks[i].handle), reportedTasks[i].stackSize);
+    }
+    Serial.println();
+    reportHeap();
+}
+
+// Call from a periodic task; prints the stack report every STACK_REPORT_PERIOD_MS
+static void reportTaskStacksPeriodically() {
+#if STACK_REPORT_PERIOD_MS > 0
+    static unsigned long lastReportTime = 0;
+    if (millis() - lastReportTime >= STACK_REPORT_PERIOD_MS) {
+        lastReportTime = millis();
+        reportTaskStacks();
+    }
+#endif
+}
+
+// Call at the start of setup(), before the tasks that subscribe start
+static void startTaskWatchdog() {
+#if WATCHDOG_TIMEOUT_S > 0
+#if ESP_IDF_VERSION_MAJOR >= 5
+    esp_task_wdt_config_t config = {};
+    config.timeout_ms = WATCHDOG_TIMEOUT_S * 1000;
+#ifdef CONFIG_ESP_TASK_WDT_CHECK_IDLE_TASK_CPU0
+    config.idle_core_mask |= 1 << 0;
+#endif
+#ifdef CONFIG_ESP_TASK_WDT_CHECK_IDLE_TASK_CPU1
+    config.idle_core_mask |= 1 << 1;
+#endif
+    config.trigger_panic = true;
+    if (esp_task_wdt_reconfigure(&config) == ESP_ERR_INVALID_STATE) {
+        esp_task_wdt_init(&config);
+    }
+#else
+    // Already running from boot, this sets the timeout and makes it reset
+    esp_task_wdt_init(WATCHDOG_TIMEOUT_S, true);
+#endif
+#endif
+}
+
+// Call first thing in a loop task; from then on it must call feedWatchdog()
+// at least every WATCHDOG_TIMEOUT_S
+static void subscribeWatchdog() {
+#if WATCHDOG_TIMEOUT_S > 0
+    esp_task_wdt_add(NULL);
+#endif
+}
+
+static inline void feedWatchdog() {
+#if WATCHDOG_TIMEOUT_S > 0
+    esp_task_wdt_reset();
+#endif
+}
+
+// Prints a loop's overruns when there are new ones since the previous call
+static void reportDeadline(const char *name, const DeadlineMonitor *m, uint32_t *printedOverruns) {
+    uint32_t overruns = m->overruns;
+    if (overruns == *printedOverruns) {
+        return;
+    }
+    *printedOverruns = overruns;
+    Serial.printf("%s overruns of %u us: %u, last %lu ms ago in %s, worst %u us in %s, by stage:", name,
+                  m->budgetUs, overruns, millis() - m->lastOverrunMs, deadlineStageNames[m->lastOverrunStage],
+                  m->worstUs, deadlineStageNames[m->worstStage]);
+    for (int i = 0; i < DEADLINE_STAGE_COUNT; i++) {
+        if (m->stageOverruns[i]) {
+            Serial.printf(" %s=%u", deadlineStageNames[i], m->stageOverruns[i]);
+        }
+    }
+    Serial.println();
+}
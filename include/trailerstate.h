@@ -0,0 +1,148 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "lights.h"
+
+// ============================================
+// SEMI TO TRAILER STATE SYNC
+// ============================================
+// The semi keeps the state it wants the trailer in and the trailer applies
+// whatever it is told, so repeating a line never changes anything. Changes
+// go out as the original one-number codes below, and a snapshot of the whole
+// state ("S<hex>,<age ms>") follows at a low rate so a lost line is
+// repaired by the next snapshot instead of leaving the trailer out of sync.
+// Over ESP-NOW the packed state travels in a TrailerStateMessage instead.
+//
+//  1 Legs up         2 Legs down       3 Ramp up        4 Ramp down
+//  5 Aux 1 forward   6 Aux 1 reverse   7 Aux 1 stop
+//  8 Aux 2 forward   9 Aux 2 reverse  10 Aux 2 stop
+// 11 LT1 off        12 LT1 on         13 LT2 off       14 LT2 on
+// 15 LT3 off        16 LT3 on
+// ============================================
+
+// How often the semi sends a full snapshot; also the worst-case repair time
+#ifndef TRAILER_SNAPSHOT_PERIOD_MS
+#define TRAILER_SNAPSHOT_PERIOD_MS 1000
+#endif
+// The trailer stops its aux motors when it hears nothing for this long
+#ifndef TRAILER_LINK_TIMEOUT_MS
+#define TRAILER_LINK_TIMEOUT_MS (TRAILER_SNAPSHOT_PERIOD_MS * 3)
+#endif
+
+#define TRAILER_MAX_CODES 7 // One per field
+
+struct TrailerState {
+    bool legsUp;
+    bool rampUp;
+    int8_t aux1;    // 1 forward, -1 reverse, 0 stop
+    int8_t aux2;
+    uint8_t lights; // LIGHT_ bits from lights.h
+};
+
+// Boot state of the trailer: legs down to hold it up, ramp closed, all off
+static inline void initTrailerState(TrailerState *s) {
+    s->legsUp = false;
+    s->rampUp = true;
+    s->aux1 = 0;
+    s->aux2 = 0;
+    s->lights = 0;
+}
+
+static inline bool trailerStatesEqual(const TrailerState *a, const TrailerState *b) {
+    return a->legsUp == b->legsUp && a->rampUp == b->rampUp && a->aux1 == b->aux1 && a->aux2 == b->aux2 &&
+           a->lights == b->lights;
+}
+
+// Aux motors follow the triggers: R1/R2 run aux 1, L1/L2 run aux 2. Used by
+// the semi and by a trailer reading base frames directly.
+static inline void setTrailerAuxFromTriggers(TrailerState *s, bool r1, bool r2, bool l1, bool l2) {
+    s->aux1 = r1 ? 1 : r2 ? -1 : 0;
+    s->aux2 = l1 ? 1 : l2 ? -1 : 0;
+}
+
+// Codes that turn state `from` into state `to`, returns how many were written
+static inline int trailerCodesForChange(const TrailerState *from, const TrailerState *to,
+                                        uint8_t codes[TRAILER_MAX_CODES]) {
+    int count = 0;
+    if (from->legsUp != to->legsUp) codes[count++] = to->legsUp ? 1 : 2;
+    if (from->rampUp != to->rampUp) codes[count++] = to->rampUp ? 3 : 4;
+    if (from->aux1 != to->aux1) codes[count++] = to->aux1 > 0 ? 5 : to->aux1 < 0 ? 6 : 7;
+    if (from->aux2 != to->aux2) codes[count++] = to->aux2 > 0 ? 8 : to->aux2 < 0 ? 9 : 10;
+    uint8_t changed = from->lights ^ to->lights;
+    if (changed & LIGHT_LT1) codes[count++] = (to->lights & LIGHT_LT1) ? 12 : 11;
+    if (changed & LIGHT_LT2) codes[count++] = (to->lights & LIGHT_LT2) ? 14 : 13;
+    if (changed & LIGHT_LT3) codes[count++] = (to->lights & LIGHT_LT3) ? 16 : 15;
+    return count;
+}
+
+// Sets the one field a code refers to. Returns false for unknown codes.
+static inline bool applyTrailerCode(TrailerState *s, int code) {
+    switch (code) {
+        case 1: s->legsUp = true; break;
+        case 2: s->legsUp = false; break;
+        case 3: s->rampUp = true; break;
+        case 4: s->rampUp = false; break;
+        case 5: s->aux1 = 1; break;
+        case 6: s->aux1 = -1; break;
+        case 7: s->aux1 = 0; break;
+        case 8: s->aux2 = 1; break;
+        case 9: s->aux2 = -1; break;
+        case 10: s->aux2 = 0; break;
+        case 11: s->lights &= ~LIGHT_LT1; break;
+        case 12: s->lights |= LIGHT_LT1; break;
+        case 13: s->lights &= ~LIGHT_LT2; break;
+        case 14: s->lights |= LIGHT_LT2; break;
+        case 15: s->lights &= ~LIGHT_LT3; break;
+        case 16: s->lights |= LIGHT_LT3; break;
+        default: return false;
+    }
+    return true;
+}
+
+// Packs the whole state into 9 bits: legs, ramp, aux1 (2), aux2 (2), lights (3)
+static inline uint16_t packTrailerState(const TrailerState *s) {
+    uint16_t aux1 = s->aux1 > 0 ? 1 : s->aux1 < 0 ? 2 : 0;
+    uint16_t aux2 = s->aux2 > 0 ? 1 : s->aux2 < 0 ? 2 : 0;
+    return (s->legsUp ? 1 : 0) | (s->rampUp ? 2 : 0) | aux1 << 2 | aux2 << 4 | (uint16_t)(s->lights & 7) << 6;
+}
+
+// Bits of the packed state that hold the aux motors
+#define TRAILER_PACKED_AUX_MASK 0x3C
+
+static inline void unpackTrailerState(uint16_t packed, TrailerState *s) {
+    s->legsUp = packed & 1;
+    s->rampUp = packed & 2;
+    uint8_t aux1 = (packed >> 2) & 3;
+    uint8_t aux2 = (packed >> 4) & 3;
+    s->aux1 = aux1 == 1 ? 1 : aux1 == 2 ? -1 : 0;
+    s->aux2 = aux2 == 1 ? 1 : aux2 == 2 ? -1 : 0;
+    s->lights = (packed >> 6) & 7;
+}
+
+// Snapshot line without the newline. ageMs is the time since the state last
+// changed, which lets the trailer tell how late a repair came.
+static inline int formatTrailerSnapshot(const TrailerState *s, uint32_t ageMs, char *buffer, size_t size) {
+    return snprintf(buffer, size, "S%03X,%lu", packTrailerState(s), (unsigned long)(ageMs > 65535 ? 65535 : ageMs));
+}
+
+// Applies one received line, either a code or a snapshot. Returns false for
+// anything it does not understand. *ageMs is set for snapshots, -1 otherwise.
+static inline bool parseTrailerLine(const char *line, TrailerState *s, long *ageMs) {
+    *ageMs = -1;
+    if (line[0] == 'S') {
+        char *end;
+        unsigned long packed = strtoul(line + 1, &end, 16);
+        if (end == line + 1 || packed > 0x1FF) {
+            return false;
+        }
+        unpackTrailerState((uint16_t)packed, s);
+        if (*end == ',') {
+            *ageMs = strtol(end + 1, nullptr, 10);
+        }
+        return true;
+    }
+    char *end;
+    long code = strtol(line, &end, 10);
+    return end != line && applyTrailerCode(s, (int)code);
+}
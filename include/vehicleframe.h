@@ -0,0 +1,116 @@
+#pragma once
+#include <stdint.h>
+#include "governor.h"
+
+// ============================================
+// PER-FRAME VEHICLE LOGIC
+// ============================================
+// What the vehicles' processGamepad() functions work out from a frame, kept
+// apart from the pin, servo and expander writes so src/bench times the code
+// the firmwares run. Plain logic like mixer.h and softpwm.h.
+// ============================================
+
+// Tuning of each vehicle, here so the benchmark uses the same figures
+
+// Inner side slowdown at full lock (256 = stops). The dump truck's servo does
+// all the turning, the fork's inner side is left at about half speed.
+#define DUMP_STEER_ASSIST 0
+#define FORK_STEER_ASSIST 120
+// Full stick turns the steering servo 512 / divisor degrees
+#define DUMP_STEERING_DIVISOR 11
+#define FORK_STEERING_DIVISOR 9
+#define SEMI_STEERING_DIVISOR 9
+// Motor commands inside the deadband leave the motor off. The fork's
+// outputs had almost none, its mast has a band of its own.
+#define MOTOR_DEADBAND 15
+#define FORK_MOTOR_DEADBAND 1
+#define MAST_DEADBAND 100
+// Stick throw (of 512) before the excavator's hydraulics start to move
+#define HYDRAULIC_DEADZONE 60
+// The pivot only moves near the edges, so working the boom does not swing the cab
+#define PIVOT_DEADZONE 300
+#define HYDRAULIC_STICK_RANGE 512
+// Steering trim stays within +-TRIM_LIMIT degrees. A held trim button steps
+// it once, then again every TRIM_STEP_MS.
+#define TRIM_LIMIT 20
+#ifndef TRIM_STEP_MS
+#define TRIM_STEP_MS 50
+#endif
+// Servos moved by a held button stay inside this range
+#define SERVO_STEP_MIN 10
+#define SERVO_STEP_MAX 170
+
+// Motor command as moveMotor() writes it: -255..255, 0 inside the deadband
+static inline int motorCommand(int velocity, int deadband) {
+    return velocity > deadband || velocity < -deadband ? velocity : 0;
+}
+
+// Steering servo angle before trim, 90 is straight ahead
+static inline int steeringAngle(int axisRX, int divisor) {
+    return 90 - axisRX / divisor;
+}
+
+// Fork mast: half the stick, and nothing until it is well past the centre
+static inline int mastCommand(int axisRY) {
+    int mast = axisRY / 2;
+    return mast > MAST_DEADBAND || mast < -MAST_DEADBAND ? mast : 0;
+}
+
+// Semi: half the stick scaled to the link limit, halved again in reduced speed mode
+static inline int semiThrottle(int axisY, const RangeGovernor *governor, bool reduced) {
+    int throttle = governed(governor, axisY / 2);
+    return reduced ? throttle / 2 : throttle;
+}
+
+static inline int clampTrim(int trim) {
+    return trim > TRIM_LIMIT ? TRIM_LIMIT : trim < -TRIM_LIMIT ? -TRIM_LIMIT : trim;
+}
+
+struct TrimStepper {
+    unsigned long lastStepTime;
+    bool held;
+};
+
+// Trim after this frame's buttons: movement is 1, -1 or 0 when none (or
+// both) are held. Clamped to TRIM_LIMIT, whatever it was before.
+// Time-stamped instead of waiting, so the control task never sleeps on a
+// held button.
+static inline int stepTrim(TrimStepper *t, int trim, int movement, int step, unsigned long now) {
+    if (movement == 0) {
+        t->held = false;
+        return clampTrim(trim);
+    }
+    if (t->held && now - t->lastStepTime < TRIM_STEP_MS) {
+        return clampTrim(trim);
+    }
+    t->held = true;
+    t->lastStepTime = now;
+    return clampTrim(trim + movement * step);
+}
+
+// One step of a servo towards movement (1 or -1, 0 holds). A servo outside
+// the range only moves back into it.
+static inline int stepServo(int value, int movement, int step) {
+    if (movement > 0 && value >= SERVO_STEP_MIN && value < SERVO_STEP_MAX) {
+        return value + step;
+    }
+    if (movement < 0 && value <= SERVO_STEP_MAX && value > SERVO_STEP_MIN) {
+        return value - step;
+    }
+    return value;
+}
+
+// A servo stepped while its button is held, one step every `every` frames.
+// frames counts the held frames since the last step and keeps counting
+// across a release, so tapping the button does not step it faster.
+static inline int stepHeldServo(int *frames, int value, int movement, int step, int every) {
+    if (movement == 0) {
+        return value;
+    }
+    if (*frames == every) {
+        value = stepServo(value, movement, step);
+        *frames = 0;
+    }
+    (*frames)++;
+    return value;
+}
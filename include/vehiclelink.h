@@ -0,0 +1,493 @@
+#pragma once
+#include <Arduino.h>
+#include <esp_now.h>
+#include <esp_wifi.h>
+#include <Preferences.h>
+#include "link.h"
+#include "authkey.h"
+#include "governor.h"
+#include "tasks.h"
+#include "macro.h"
+
+// ============================================
+// VEHICLE SIDE OF THE NETWORK
+// ============================================
+// Follows the base across channels, counts lost base messages and reports
+// them back. OnDataRecv calls handleBaseMessage() first, which also checks
+// the tag, takeEmergencyStop() when that returns false and
+// noteFrameAccepted() for frames it acts on,
+// the control task calls serviceRangeGovernor() on every wake, scales the
+// drive with governThrottle() and calls confirmRelease() for every frame it
+// applies, and the housekeeping task calls serviceVehicleLink() every tick.
+// The control task also marks its stages with controlStage() and calls
+// endControlIteration() before it waits again, the housekeeping task makes
+// the outputs safe when controlStalled() says so.
+// Motion macros: OnDataRecv calls takeMacroStart() after the stop check,
+// the control task waits controlWaitTicks() for a frame, skips frames
+// macroOwnsFrame() claims and writes its outputs from macroPlayer whenever
+// serviceMacro() says so.
+// The channel the base was last heard on and the session the vehicle is
+// paired with are kept in NVS, so the next boot starts listening there and
+// stays with the same base.
+// ============================================
+
+// How often a vehicle reports its reception statistics to the base
+#ifndef LINK_REPORT_PERIOD_MS
+#define LINK_REPORT_PERIOD_MS 1000
+#endif
+// How often traffic dropped from other bases is printed, only when there is some
+#ifndef SESSION_REPORT_PERIOD_MS
+#define SESSION_REPORT_PERIOD_MS 10000
+#endif
+
+static VehicleLink vehicleLink;
+static uint8_t radioChannel = 0;
+static const uint8_t linkBroadcastAddress[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+static Preferences linkStore;
+static uint8_t savedChannel = 0;
+static uint16_t savedSession = SESSION_NONE;
+static volatile unsigned long firstFrameTime = 0; // millis() of the first accepted frame, 0 before
+static AuthCost verifyCost;
+// Drive limit from the link quality, see include/governor.h. Thresholds are
+// build flags, so each vehicle's environment can set its own.
+static RangeGovernor rangeGovernor;
+static const GovernorConfig governorConfig = defaultGovernorConfig();
+static volatile int8_t baseRssi = GOVERNOR_RSSI_UNKNOWN;
+// Set by an emergency stop, cleared by the next control frame, see include/estop.h
+static volatile bool emergencyStopped = false;
+static volatile uint16_t lastStopSafeUs = 0;
+static volatile uint16_t slowestStopSafeUs = 0;
+// Control loop timing, see include/deadline.h
+static DeadlineMonitor controlDeadline = {DEADLINE_BUDGET_US};
+static DeadlineStallWatch controlStallWatch;
+static uint32_t reportedOverruns = 0; // In link reports
+static uint32_t printedOverruns = 0;  // On the serial monitor
+// Motion macros, see include/macro.h. The table is the firmware's, the
+// player belongs to the control task.
+static const MacroDef *macroTable = NULL;
+static uint8_t macroCount = 0;
+static MacroPlayer macroPlayer;
+static volatile int16_t requestedMacro = -1;     // Set by the receive callback
+static volatile uint32_t requestedMacroUs = 0;
+static volatile bool macroStopRequested = false; // Set by an emergency stop
+// Totals and the latest finished run, printed by the housekeeping task
+struct MacroLog {
+    uint32_t runs;
+    uint32_t ends[MACRO_END_COUNT];
+    uint32_t refused;       // Unknown macro, or nobody driving the vehicle
+    uint32_t frames;        // Frames from the base during the current run
+    const char *lastName;
+    uint8_t lastEnd;
+    uint32_t lastStartUs;   // Start message heard to first step
+    uint32_t lastRunMs;
+    uint16_t lastEvents;
+    uint32_t lastLateAvgUs;
+    uint32_t lastLateMaxUs;
+    uint32_t lastFrames;
+};
+static MacroLog macroLog;
+static uint32_t printedMacroRuns = 0; // Runs and refusals at the previous report
+
+static void setRadioChannel(uint8_t channel) {
+    if (channel != radioChannel && esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE) == ESP_OK) {
+        radioChannel = channel;
+    }
+}
+
+// Signs when there is a key, every message to the base goes through here
+static esp_err_t sendSigned(uint8_t *message, size_t len) {
+    if (authEnabled) {
+        signMessage(&authKey, message, len);
+    }
+    return esp_now_send(linkBroadcastAddress, message, len);
+}
+
+#ifdef GOVERNOR_RSSI
+// ESP-NOW on IDF 4 gives no signal strength, so the base's frames are also
+// taken from the promiscuous stream: an action frame whose vendor element
+// carries a message of our base. Off by default, the radio then hands every
+// management frame on the channel to this callback.
+#define ESPNOW_BODY_OFFSET 39 // 802.11 header, category, OUI, random, vendor element header
+static void sniffBaseRssi(void *buffer, wifi_promiscuous_pkt_type_t type) {
+    const wifi_promiscuous_pkt_t *packet = (const wifi_promiscuous_pkt_t *)buffer;
+    int len = packet->rx_ctrl.sig_len;
+    if (type != WIFI_PKT_MGMT || len <= ESPNOW_BODY_OFFSET || packet->payload[24] != 127) {
+        return;
+    }
+    const uint8_t *body = packet->payload + ESPNOW_BODY_OFFSET;
+    if (vehicleLink.session != SESSION_NONE &&
+        messageSession(body, len - ESPNOW_BODY_OFFSET) == vehicleLink.session) {
+        baseRssi = packet->rx_ctrl.rssi;
+    }
+}
+#endif
+
+// Call once after esp_now_init()
+static void startVehicleLink() {
+    loadAuthKey();
+    linkStore.begin("link", false);
+    savedChannel = linkStore.getUChar("channel", 0);
+    savedSession = linkStore.getUShort("session", SESSION_NONE);
+    esp_now_peer_info_t peerInfo;
+    memset(&peerInfo, 0, sizeof(peerInfo));
+    memcpy(peerInfo.peer_addr, linkBroadcastAddress, 6);
+    peerInfo.channel = 0; // Follow whatever channel the radio is on
+    peerInfo.encrypt = false;
+    if (esp_now_add_peer(&peerInfo) != ESP_OK) {
+        Serial.println("Failed to add broadcast peer");
+    }
+#ifdef LINK_LONG_RANGE
+    // Hears the base's Long Range frames as well as the normal ones
+    esp_wifi_set_protocol(WIFI_IF_STA, WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N | WIFI_PROTOCOL_LR);
+#endif
+    initVehicleLink(&vehicleLink, savedChannel, savedSession, millis());
+    vehicleLink.authKey = authEnabled ? &authKey : NULL;
+    setRadioChannel(vehicleLink.follower.channel);
+    initGovernor(&rangeGovernor, millis());
+#ifdef GOVERNOR_RSSI
+    wifi_promiscuous_filter_t filter = {WIFI_PROMIS_FILTER_MASK_MGMT};
+    esp_wifi_set_promiscuous_filter(&filter);
+    esp_wifi_set_promiscuous_rx_cb(sniffBaseRssi);
+    esp_wifi_set_promiscuous(true);
+#endif
+    Serial.printf("Radio up on channel %d at %lu ms, paired with base %04x\n", radioChannel, millis(), savedSession);
+}
+
+// Call from OnDataRecv for every frame the vehicle acts on, with the frame
+// when it is addressed to this vehicle
+static void noteFrameAccepted(const struct_message *frame = NULL) {
+    confirmSession(&vehicleLink);
+    if (frame) {
+        countOwnFrame(&vehicleLink, frame);
+        emergencyStopped = false;
+    }
+    if (firstFrameTime == 0) {
+        firstFrameTime = millis();
+    }
+}
+
+// Call from the control task after applying a frame, acknowledges a release
+static void confirmRelease(const struct_message *frame, uint32_t vehicleIndex) {
+    if (!(frame->flags & FRAME_RELEASE)) {
+        return;
+    }
+    ReleaseAck ack;
+    buildReleaseAck(&vehicleLink, frame, vehicleIndex, &ack);
+    sendSigned((uint8_t *)&ack, sizeof(ack));
+}
+
+// Call from the control task on every wake, before applying a frame.
+// Returns true when the drive limit moved, an idle vehicle then applies its
+// last frame again.
+static bool serviceRangeGovernor() {
+    return updateGovernor(&rangeGovernor, &governorConfig, vehicleLink.baseStats.received,
+                          vehicleLink.baseStats.missed, vehicleLink.follower.lastBaseFrame, baseRssi, millis());
+}
+
+static int governThrottle(int value) {
+    return governed(&rangeGovernor, value);
+}
+
+static void reportGovernor() {
+    if (rangeGovernor.limitedMs == 0) {
+        return;
+    }
+    Serial.printf("Range governor: limited for %u ms, down to %d%%, now %d%%, loss %u%%, gap %u ms",
+                  rangeGovernor.limitedMs, rangeGovernor.lowestLimit * 100 / GOVERNOR_FULL,
+                  rangeGovernor.limit * 100 / GOVERNOR_FULL, rangeGovernor.lossPercent,
+                  rangeGovernor.gapAverage >> 3);
+    if (baseRssi != GOVERNOR_RSSI_UNKNOWN) {
+        Serial.printf(", %d dBm", baseRssi);
+    }
+    Serial.println();
+    rangeGovernor.limitedMs = 0;
+    rangeGovernor.lowestLimit = GOVERNOR_FULL;
+}
+
+// The first stage after endControlIteration() starts the next iteration
+static void controlStage(DeadlineStage stage) {
+    enterDeadlineStage(&controlDeadline, stage, micros());
+}
+
+static void endControlIteration() {
+    endDeadlineIteration(&controlDeadline, micros(), millis());
+    feedWatchdog();
+}
+
+// Call from the housekeeping task every tick. True once when the control
+// task has been stuck in one iteration for DEADLINE_STALL_MS: stop every
+// output, the task watchdog resets the vehicle if it stays stuck.
+static bool controlStalled() {
+    if (!checkDeadlineStall(&controlStallWatch, &controlDeadline, millis())) {
+        return false;
+    }
+    Serial.printf("Control stalled in %s for %d ms, outputs stopped (%u stalls)\n",
+                  deadlineStageNames[controlDeadline.stage], DEADLINE_STALL_MS, controlStallWatch.stalls);
+    return true;
+}
+
+// Handles network messages from the base. Returns true only for a control
+// frame the vehicle should look at.
+static bool handleBaseMessage(const uint8_t *data, int len) {
+    uint32_t checks = vehicleLink.tagChecks;
+    uint32_t start = ESP.getCycleCount();
+    bool frame = receiveBaseMessage(&vehicleLink, data, len, millis());
+    if (vehicleLink.tagChecks != checks) {
+        noteAuthCost(&verifyCost, ESP.getCycleCount() - start);
+    }
+    return frame;
+}
+
+// Call from OnDataRecv when handleBaseMessage() returns false. True once
+// for an emergency stop of this vehicle (or of otherIndex): make every
+// output safe straight away, then call confirmStop() with micros() taken
+// on entry to OnDataRecv.
+static bool takeEmergencyStop(uint32_t vehicleIndex, uint32_t otherIndex = RECEIVER_NONE) {
+    if (!takeStop(&vehicleLink, vehicleIndex, otherIndex)) {
+        return false;
+    }
+    emergencyStopped = true;
+    requestedMacro = -1;
+    macroStopRequested = true;
+    return true;
+}
+
+// Acknowledges from the receive callback, the outputs are already safe
+static void confirmStop(uint32_t vehicleIndex, uint32_t heardUs) {
+    StopAck ack;
+    buildStopAck(&vehicleLink, vehicleIndex, micros() - heardUs, &ack);
+    lastStopSafeUs = ack.safeUs;
+    if (ack.safeUs > slowestStopSafeUs) {
+        slowestStopSafeUs = ack.safeUs;
+    }
+    sendSigned((uint8_t *)&ack, sizeof(ack));
+}
+
+static void reportStops() {
+    if (vehicleLink.stops) {
+        Serial.printf("Emergency stops: %u, outputs safe %u us after the frame, slowest %u us\n", vehicleLink.stops,
+                      lastStopSafeUs, slowestStopSafeUs);
+    }
+}
+
+// Call from setup() with the firmware's macro table, D-pad up, down, right
+// and left on the base start entries 0 to 3
+static void useMacros(const MacroDef *table, uint8_t count) {
+    for (int i = 0; i < count; i++) {
+        if (!validMacro(&table[i])) {
+            Serial.printf("Macro %d (%s) is malformed, macros disabled\n", i, table[i].name);
+            return;
+        }
+    }
+    macroTable = table;
+    macroCount = count;
+}
+
+// Call from OnDataRecv when handleBaseMessage() returns false, after the
+// stop check. The control task starts the macro at its next wake.
+static void takeMacroStart(uint32_t vehicleIndex) {
+    uint8_t macro;
+    if (takeMacro(&vehicleLink, vehicleIndex, &macro)) {
+        requestedMacroUs = micros();
+        requestedMacro = macro;
+    }
+}
+
+static bool macroRunning() {
+    return macroPlayer.macro != NULL;
+}
+
+static void logMacroEnd(const MacroDef *macro, MacroEnd reason) {
+    macroLog.lastName = macro->name;
+    macroLog.lastEnd = reason;
+    macroLog.lastRunMs = (micros() - macroPlayer.startedUs) / 1000;
+    macroLog.lastEvents = macroPlayer.events;
+    macroLog.lastLateAvgUs = macroLateAverageUs(&macroPlayer);
+    macroLog.lastLateMaxUs = macroPlayer.lateMaxUs;
+    macroLog.lastFrames = macroLog.frames;
+    macroLog.ends[reason]++;
+}
+
+// Control task: stops the running macro, every macro channel reads 0 afterwards
+static void endMacro(MacroEnd reason) {
+    if (macroPlayer.macro) {
+        logMacroEnd(macroPlayer.macro, reason);
+        stopMacro(&macroPlayer);
+    }
+}
+
+// Call from the control task on every wake, driven while a controller is
+// connected and no stop holds the vehicle. Starts a macro the base asked
+// for and runs whatever is due; true when the outputs have to be written
+// from macroPlayer. servoAngles are the servos' current angles.
+static bool serviceMacro(bool driven, const int16_t *servoAngles) {
+    if (macroStopRequested) {
+        macroStopRequested = false;
+        endMacro(MACRO_ABORT_STOP); // The receive callback made the outputs safe
+    }
+    bool changed = false;
+    int16_t requested = requestedMacro;
+    if (requested >= 0) {
+        requestedMacro = -1;
+        if (requested >= macroCount || !driven || emergencyStopped) {
+            macroLog.refused++;
+        } else {
+            endMacro(MACRO_REPLACED);
+            startMacro(&macroPlayer, &macroTable[requested], micros(), servoAngles);
+            macroLog.lastStartUs = micros() - requestedMacroUs;
+            macroLog.frames = 0;
+            macroLog.runs++;
+            changed = true;
+        }
+    }
+    const MacroDef *running = macroPlayer.macro;
+    if (running) {
+        changed |= runMacro(&macroPlayer, micros());
+        if (!macroPlayer.macro) {
+            logMacroEnd(running, MACRO_DONE);
+        }
+    }
+    return changed;
+}
+
+// Call for every frame before applying it. While a macro runs, a frame
+// without input only keeps the link alive and is not applied; one with
+// input, or a release, ends the macro and is applied as usual.
+static bool macroOwnsFrame(const struct_message *frame) {
+    if (!macroPlayer.macro) {
+        return false;
+    }
+    if (frame->flags & FRAME_RELEASE) {
+        endMacro(MACRO_ABORT_RELEASE);
+        return false;
+    }
+    if (macroInput(frame)) {
+        endMacro(MACRO_ABORT_INPUT);
+        return false;
+    }
+    macroLog.frames++;
+    return true;
+}
+
+// How long the control task may wait for a frame, shorter while a macro
+// step is due sooner than CONTROL_IDLE_PERIOD_MS
+static TickType_t controlWaitTicks() {
+    uint32_t us = macroDueInUs(&macroPlayer, micros(), CONTROL_IDLE_PERIOD_MS * 1000UL);
+    return pdMS_TO_TICKS((us + 999) / 1000);
+}
+
+static void reportMacros() {
+    MacroLog log = macroLog;
+    if (log.runs + log.refused == printedMacroRuns) {
+        return;
+    }
+    printedMacroRuns = log.runs + log.refused;
+    Serial.printf("Macros: %u run, %u refused, ended", log.runs, log.refused);
+    for (int i = 0; i < MACRO_END_COUNT; i++) {
+        if (log.ends[i]) {
+            Serial.printf(" %s=%u", macroEndNames[i], log.ends[i]);
+        }
+    }
+    if (log.lastName) {
+        Serial.printf(" | last %s (%s) after %u ms: started %u us after the radio event, %u steps late by %u us "
+                      "avg, %u us max, %u frames from the base (%u bytes)",
+                      log.lastName, macroEndNames[log.lastEnd], log.lastRunMs, log.lastStartUs, log.lastEvents,
+                      log.lastLateAvgUs, log.lastLateMaxUs, log.lastFrames,
+                      (unsigned)(log.lastFrames * sizeof(struct_message) + sizeof(MacroMessage)));
+    }
+    Serial.println();
+}
+
+// Tag and counter check for messages from another vehicle, which keeps a
+// counter of its own: one replay window per sender
+static bool authenticMessage(const uint8_t *data, int len, ReplayWindow *replay, uint32_t counter) {
+    if (!authEnabled) {
+        return true;
+    }
+    uint32_t start = ESP.getCycleCount();
+    bool authentic = verifyMessage(&authKey, data, len);
+    noteAuthCost(&verifyCost, ESP.getCycleCount() - start);
+    if (!authentic) {
+        vehicleLink.authFailures++;
+        return false;
+    }
+    if (!acceptCounter(replay, counter)) {
+        vehicleLink.replays++;
+        return false;
+    }
+    return true;
+}
+
+// For messages that do not go through handleBaseMessage(): false when they
+// belong to another base
+static bool acceptSessionMessage(const uint8_t *data, int len) {
+    return acceptSession(&vehicleLink, data, len, millis());
+}
+
+static void reportForeignSessions() {
+    uint32_t total = vehicleLink.foreignOther;
+    for (int i = 0; i < FOREIGN_SESSION_SLOTS; i++) {
+        total += vehicleLink.foreign[i].rejected;
+    }
+    if (total == 0) {
+        return;
+    }
+    Serial.print("Dropped from other bases:");
+    for (int i = 0; i < FOREIGN_SESSION_SLOTS && vehicleLink.foreign[i].rejected; i++) {
+        Serial.printf(" %04x:%u", vehicleLink.foreign[i].session, vehicleLink.foreign[i].rejected);
+    }
+    if (vehicleLink.foreignOther) {
+        Serial.printf(" others:%u", vehicleLink.foreignOther);
+    }
+    Serial.println();
+}
+
+static void reportAuth() {
+    if (vehicleLink.authFailures || vehicleLink.replays) {
+        Serial.printf("Auth rejected: %u bad tags, %u replays\n", vehicleLink.authFailures, vehicleLink.replays);
+    }
+    reportAuthCost("verify", &verifyCost);
+}
+
+// Call from the housekeeping task every tick
+static void serviceVehicleLink(uint32_t vehicleIndex, VehicleType type) {
+    static unsigned long lastReportTime = 0;
+    static unsigned long lastSessionReportTime = 0;
+    static bool bootTimeReported = false;
+    setRadioChannel(updateChannelFollower(&vehicleLink.follower, millis()));
+
+    if (!bootTimeReported && firstFrameTime != 0) {
+        bootTimeReported = true;
+        Serial.printf("Boot to first frame: %lu ms\n", firstFrameTime);
+    }
+    // Remember where the base is, written only when it moves
+    if (!vehicleLink.follower.searching && vehicleLink.follower.channel != savedChannel) {
+        savedChannel = vehicleLink.follower.channel;
+        linkStore.putUChar("channel", savedChannel);
+    }
+    if (vehicleLink.session != savedSession) {
+        savedSession = vehicleLink.session;
+        linkStore.putUShort("session", savedSession);
+        Serial.printf("Paired with base %04x\n", savedSession);
+    }
+    if (millis() - lastSessionReportTime >= SESSION_REPORT_PERIOD_MS) {
+        lastSessionReportTime = millis();
+        reportForeignSessions();
+        reportAuth();
+        reportGovernor();
+        reportStops();
+        reportMacros();
+        reportDeadline("Control", &controlDeadline, &printedOverruns);
+    }
+
+    if (millis() - lastReportTime >= LINK_REPORT_PERIOD_MS) {
+        lastReportTime = millis();
+        LinkReport report;
+        buildLinkReport(&vehicleLink, vehicleIndex, type, &report);
+        fillDeadlineReport(&controlDeadline, &reportedOverruns, &report);
+        // Nothing to say while searching, the base cannot hear us anyway
+        if (!vehicleLink.follower.searching) {
+            sendSigned((uint8_t *)&report, sizeof(report));
+        }
+    }
+}
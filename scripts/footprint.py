@@ -0,0 +1,128 @@
+# ============================================
+# MEMORY FOOTPRINT
+# ============================================
+# PlatformIO post script for the firmware environments. After every link it
+# prints static RAM and flash per module and writes the same table to
+# .pio/build/<env>/footprint.txt, so two builds can be diffed:
+#
+#   DRAM    initialised data and bss, what is left is the heap
+#   IRAM    code placed in internal RAM
+#   Flash   everything in the image: code, constants, data initialisers
+#
+# A module is a file of this repository (include/link.h, src/dump.cpp), a
+# library, the Arduino core or an ESP-IDF component, found from the debug
+# line of every symbol. Prebuilt blobs without debug info, like the WiFi
+# driver, add up under "other".
+#
+# With -DHEAP_GUARD in build_flags it also adds the linker flags that send
+# malloc, calloc and realloc through include/footprint.h.
+#
+# Also runs on its own:
+#   python scripts/footprint.py .pio/build/dump/firmware.elf [nm]
+# ============================================
+
+import os
+import re
+import subprocess
+import sys
+
+# Rows besides this repository's own files, largest first
+FOOTPRINT_ROWS = 15
+
+# ESP32 address ranges, anything else is sorted by the symbol type
+IRAM = (0x40070000, 0x400C0000)
+DRAM = (0x3FFAE000, 0x40000000)
+RTC_RAM = (0x50000000, 0x50002000)
+
+SYMBOL = re.compile(r"^([0-9a-fA-F]+) ([0-9a-fA-F]+) (\w) (\S+)(?:\t(.*):\d+)?$")
+
+
+def within(address, region):
+    return region[0] <= address < region[1]
+
+
+def moduleOf(path, projectDir):
+    if not path:
+        return "other"
+    path = path.replace("\\", "/")
+    project = projectDir.replace("\\", "/").rstrip("/") + "/"
+    if path.startswith(project) and "/.pio/" not in path:
+        return path[len(project):]
+    match = re.search(r"/libdeps/[^/]+/([^/]+)/", path)
+    if match:
+        return "lib " + match.group(1)
+    match = re.search(r"/libraries/([^/]+)/", path)
+    if match:
+        return "arduino " + match.group(1)
+    if "/cores/" in path:
+        return "arduino core"
+    match = re.search(r"/components/([^/]+)/", path)
+    if match:
+        return "idf " + match.group(1)
+    return "other"
+
+
+def footprint(elf, nm, projectDir):
+    """Returns {module: [dram, iram, flash]} in bytes"""
+    output = subprocess.check_output([nm, "-S", "-l", elf], universal_newlines=True)
+    modules = {}
+    for line in output.splitlines():
+        match = SYMBOL.match(line)
+        if not match:
+            continue
+        address = int(match.group(1), 16)
+        size = int(match.group(2), 16)
+        kind = match.group(3).lower()
+        row = modules.setdefault(moduleOf(match.group(5), projectDir), [0, 0, 0])
+        if within(address, IRAM):
+            row[1] += size
+            row[2] += size
+        elif within(address, DRAM) or within(address, RTC_RAM) or kind in "bdsg":
+            row[0] += size
+            if kind not in "bs":
+                row[2] += size
+        else:
+            row[2] += size
+    return modules
+
+
+def formatTable(modules, title):
+    own = sorted(name for name in modules if "/" in name and not name.startswith(("lib ", "arduino ", "idf ")))
+    others = sorted((name for name in modules if name not in own), key=lambda name: -sum(modules[name]))
+    shown = own + others[:FOOTPRINT_ROWS]
+    rest = [0, 0, 0]
+    for name in others[FOOTPRINT_ROWS:]:
+        rest = [a + b for a, b in zip(rest, modules[name])]
+    total = [sum(row[i] for row in modules.values()) for i in range(3)]
+    width = max([len(name) for name in shown] + [len("Module")])
+    lines = ["Footprint of %s" % title, "%-*s %8s %8s %8s" % (width, "Module", "DRAM", "IRAM", "Flash")]
+    for name in shown:
+        lines.append("%-*s %8d %8d %8d" % ((width, name) + tuple(modules[name])))
+    if any(rest):
+        lines.append("%-*s %8d %8d %8d" % ((width, "(rest)") + tuple(rest)))
+    lines.append("%-*s %8d %8d %8d" % ((width, "Total") + tuple(total)))
+    return "\n".join(lines)
+
+
+try:
+    Import("env")  # noqa: F821, defined by SCons
+except NameError:
+    env = None
+
+if env is not None:
+    if "-DHEAP_GUARD" in " ".join(env.Flatten(env.get("BUILD_FLAGS", []))):
+        env.Append(LINKFLAGS=["-Wl,--wrap=malloc", "-Wl,--wrap=calloc", "-Wl,--wrap=realloc"])
+
+    def reportFootprint(source, target, env):
+        elf = str(target[0])
+        nm = re.sub(r"gcc$", "nm", env.subst("$CC"))
+        table = formatTable(footprint(elf, nm, env.subst("$PROJECT_DIR")), env.subst("$PIOENV"))
+        print(table)
+        with open(os.path.join(env.subst("$BUILD_DIR"), "footprint.txt"), "w") as out:
+            out.write(table + "\n")
+
+    env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", reportFootprint)
+elif len(sys.argv) >= 2:
+    projectDir = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    nm = sys.argv[2] if len(sys.argv) > 2 else "xtensa-esp32-elf-nm"
+    print(formatTable(footprint(sys.argv[1], nm, projectDir), sys.argv[1]))
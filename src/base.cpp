@@ -2,6 +2,20 @@
 #include <esp_now.h>
 #include <WiFi.h>
 #include <esp_wifi.h>
+#include <esp_idf_version.h>
+#include <Preferences.h>
+#include "tasks.h"
+#include "protocol.h"
+#include "channel.h"
+#include "stickfilter.h"
+#include "edges.h"
+#include "presence.h"
+#include "handoff.h"
+#include "authkey.h"
+#include "redundancy.h"
+#include "linkadapt.h"
+#include "estop.h"
+#include "macro.h"
 
 // ============================================
 // CONTROLLER CONFIGURATION
@@ -18,9 +32,15 @@
 // #define CONTROLLER_PS4   
 //
 // The misc buttons are used to switch between receivers:
-// - Forward button: increment receiver index (next vehicle)
-// - Backward button: decrement receiver index (previous vehicle)  
+// - Forward button: next powered vehicle
+// - Backward button: previous powered vehicle
 // - Reset button: reset receiver index to 0
+//
+// L1, R1, L2 and R2 together stop the whole fleet. Press them again, hold
+// for two seconds and let go to drive again, see include/estop.h.
+//
+// Hold the macro button and press a D-pad direction to start one of the
+// vehicle's motion macros, see include/macro.h.
 // ============================================
 
 // Button mapping structures
@@ -32,6 +52,7 @@ typedef struct ButtonMapping {
     uint16_t miscForwardMask;
     uint16_t miscBackwardMask;
     uint16_t miscResetMask;
+    uint16_t miscMacroMask;
 } ButtonMapping;
 
 // Xbox controller button mappings (original)
@@ -43,7 +64,8 @@ const ButtonMapping controllerMapping = {
     .buttonY = 8,           // Y button
     .miscForwardMask = 4,   // Forward button mask
     .miscBackwardMask = 2,  // Backward button mask
-    .miscResetMask = 8      // Reset button mask
+    .miscResetMask = 8,     // Reset button mask
+    .miscMacroMask = 1      // Xbox button, held for a macro
 };
 const char* CONTROLLER_TYPE = "Xbox";
 #endif
@@ -57,7 +79,8 @@ const ButtonMapping controllerMapping = {
     .buttonY = 8,           // Triangle button - typically mapped to Y
     .miscForwardMask = 4, // Share button
     .miscBackwardMask = 2,// Options button
-    .miscResetMask = 1   // PS button
+    .miscResetMask = 1,  // PS button
+    .miscMacroMask = 8   // Touchpad, held for a macro
 };
 const char* CONTROLLER_TYPE = "PS4";
 #endif
@@ -69,30 +92,210 @@ const char* CONTROLLER_TYPE = "PS4";
 
 // ============================================
 
-ControllerPtr myControllers[BP32_MAX_GAMEPADS];
-// Structure to hold controller state
-struct ControllerState {
-    uint32_t receiverIndex;
-    uint16_t buttons;
-    uint8_t dpad;
-    int32_t axisX, axisY;
-    int32_t axisRX, axisRY;
-    uint32_t brake, throttle;
-    uint16_t miscButtons;
-    bool thumbR, thumbL, r1, l1, r2, l2;
+// ============================================
+// PIPELINE
+// ============================================
+// Bluetooth input and radio transmit run as two pinned tasks joined by one
+// single-slot mailbox per controller. The input task always overwrites the
+// slot so it never waits on the radio; the radio task always sends the
+// newest frame so a Bluetooth burst never queues up stale ones.
+// Override any of these from platformio.ini build_flags.
+#ifndef INPUT_TASK_CORE
+#define INPUT_TASK_CORE 1
+#endif
+#ifndef INPUT_TASK_PRIORITY
+#define INPUT_TASK_PRIORITY 3
+#endif
+#ifndef INPUT_TASK_STACK
+#define INPUT_TASK_STACK 4096
+#endif
+#ifndef RADIO_TASK_CORE
+#define RADIO_TASK_CORE 0
+#endif
+#ifndef RADIO_TASK_PRIORITY
+#define RADIO_TASK_PRIORITY 4
+#endif
+#ifndef RADIO_TASK_STACK
+#define RADIO_TASK_STACK 4096
+#endif
+// How long the radio task waits for the send callback before moving on
+#ifndef SEND_CONFIRM_TIMEOUT_MS
+#define SEND_CONFIRM_TIMEOUT_MS 20
+#endif
+// Every message carries this base's session so vehicles paired with another
+// base in the same venue ignore it. Taken from the MAC address unless set
+// here, e.g. to let a replacement base take over a paired fleet.
+// #define BASE_SESSION_ID 0x1234
+// Second copies of frames, off by default, see include/redundancy.h. Also
+// "redundancy off|changes|all" on the serial monitor.
+// #define FRAME_REDUNDANCY REDUNDANCY_CHANGES
+// PHY rate of each link profile, see include/linkadapt.h. LINK_LONG_RANGE
+// switches the robust profile to Espressif Long Range; every vehicle has to
+// be built with it too, or it cannot hear those frames.
+// #define LINK_LONG_RANGE
+#ifndef LINK_FAST_RATE
+#define LINK_FAST_RATE WIFI_PHY_RATE_24M
+#endif
+#ifndef LINK_NORMAL_RATE
+#define LINK_NORMAL_RATE WIFI_PHY_RATE_1M_L
+#endif
+#ifndef LINK_ROBUST_RATE
+#ifdef LINK_LONG_RANGE
+#define LINK_ROBUST_RATE WIFI_PHY_RATE_LORA_250K
+#else
+#define LINK_ROBUST_RATE WIFI_PHY_RATE_1M_L
+#endif
+#endif
+// One radio task iteration, from the wake to the next wait, see include/deadline.h.
+// A single send confirm timeout overruns it.
+#ifndef RADIO_DEADLINE_BUDGET_US
+#define RADIO_DEADLINE_BUDGET_US 10000
+#endif
+// How often pipeline counters are printed
+#ifndef PIPELINE_STATS_PERIOD_MS
+#define PIPELINE_STATS_PERIOD_MS 5000
+#endif
+
+// Pipeline counters, one struct per task that writes them. A counter only
+// ever has one writer and the loop task only reads, so plain increments
+// never lose a count.
+struct InputStats {
+    uint32_t inputUpdates;      // BP32.update() calls that returned new data
+    uint32_t framesQueued;      // Frames written to a mailbox by the input task
+    uint32_t mailboxOverwrites; // Frames replaced before the radio task took them
+    uint32_t redundantFrames;   // Queued frames identical to the previous one of that controller
+};
+struct RadioStats {
+    uint32_t framesSent;        // esp_now_send calls that were accepted
+    uint32_t sendErrors;        // esp_now_send calls that were rejected
+    uint32_t confirmTimeouts;   // Send callbacks that did not arrive in time
+    uint32_t channelMoves;      // Completed fleet channel moves
+    uint32_t repeatsSent;       // Second copies of frames
+    uint32_t stopCopies;        // Emergency stop messages sent
+    uint32_t stoppedFrames;     // Frames dropped while the fleet was stopped
 };
-int miscButtonTime = 0;
+// Both ESP-NOW callbacks run in the WiFi task
+struct CallbackStats {
+    uint32_t sendFailures;      // Send callbacks reporting failure
+    uint32_t foreignReports;    // Link reports from vehicles paired with another base
+    uint32_t authFailures;      // Reports and acks with a bad tag
+    uint32_t profileChanges;    // Vehicles moved to another link profile
+};
+volatile InputStats inputStats;
+volatile RadioStats radioStats;
+volatile CallbackStats callbackStats;
+DeadlineMonitor radioDeadline = {RADIO_DEADLINE_BUDGET_US}; // Owned by the radio task
+
+// Forward declarations
+void inputTask(void *parameter);
+void radioTask(void *parameter);
+
+ControllerPtr myControllers[BP32_MAX_GAMEPADS];
+// Controller state is sent as is, see include/protocol.h
+typedef struct_message ControllerState;
+// Press counting per controller, see include/edges.h. Owned by the input task.
+PressCounter pressCounters[BP32_MAX_GAMEPADS];
+uint16_t miscLevels[BP32_MAX_GAMEPADS]; // Misc buttons held in the previous sample
+uint8_t nextPressEpoch; // Seeded at boot so vehicles never mistake a restarted base for the old session
 
+// Stick centre calibration, stored in NVS under the controller's BT address
+// so each controller is calibrated once and keeps it across restarts
+#define CALIBRATION_NAMESPACE "calibration"
 struct CalibrationData {
-    int32_t axisX, axisY, axisRX, axisRY;
+    StickCalibration calibration; // All zero until measured
+    CalibrationSampler sampler;
     bool isCalibrated;
+    volatile bool needsSaving;    // Saved by the loop task, flash writes stall for milliseconds
+    volatile bool recalibrate;    // Set by "calibrate" on the serial monitor
+    char key[13];                 // BT address in hex
 };
 CalibrationData controllerCalibrations[BP32_MAX_GAMEPADS];
-uint32_t receiverIndexes[BP32_MAX_GAMEPADS];
+Preferences calibrationStore;
+// axisX, axisY, axisRX, axisRY, brake, throttle
+#define FILTERED_AXES 6
+AxisFilter axisFilters[BP32_MAX_GAMEPADS][FILTERED_AXES];
+ControllerState lastQueuedStates[BP32_MAX_GAMEPADS];
 ControllerState gamepadStates[BP32_MAX_GAMEPADS];
 // Define the MAC address of the receiver
 uint8_t broadcastAddress[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-bool dataSent = true;
+QueueHandle_t txMailboxes[BP32_MAX_GAMEPADS]; // Latest frame of each controller
+SemaphoreHandle_t sendDone; // Given by OnDataSent
+TaskHandle_t inputTaskHandle;
+TaskHandle_t radioTaskHandle;
+ControllerState lastSentState; // Copy for the serial monitor, written by the radio task
+volatile bool lastSentStateValid = false;
+volatile unsigned long firstFrameSentTime = 0; // millis() of the first frame on air, 0 until then
+uint16_t nextSequence = 0; // Shared by every message the base sends
+// Counts sequence wraps so the auth counter never repeats, one more on every
+// boot. Kept in NVS next to the key.
+uint16_t authEpoch = 0;
+volatile bool authEpochNeedsSaving = false;
+Preferences authStore;
+AuthCost signCost;   // Radio task
+AuthCost verifyCost; // Receive callback
+uint16_t baseSession = SESSION_NONE; // Set in setup(), see BASE_SESSION_ID
+
+// Frame repeats, owned by the radio task
+volatile uint8_t redundancyMode = FRAME_REDUNDANCY;
+FrameRepeat frameRepeats[BP32_MAX_GAMEPADS];
+ControllerState previousSentFrames[BP32_MAX_GAMEPADS];
+bool previousSentValid[BP32_MAX_GAMEPADS];
+
+// Link profile per vehicle, see include/linkadapt.h
+LinkAdaptTable linkAdapt;
+const wifi_phy_rate_t profileRates[LINK_PROFILE_COUNT] = {LINK_FAST_RATE, LINK_NORMAL_RATE, LINK_ROBUST_RATE};
+
+// Channel selection and fleet moves, owned by the radio task
+ChannelScores channelScores;
+ChannelMigrator channelMigrator;
+volatile uint8_t reportedLossPercent = 0; // Worst loss in the latest report of a driven vehicle
+volatile bool lossReportReady = false;
+volatile uint8_t requestedChannel = 0;   // Set from the serial monitor
+PresenceTable presenceTable; // Powered vehicles, see include/presence.h
+
+// Release frames for vehicles a controller has left, see include/handoff.h.
+// The input task queues the last frame of the vehicle it leaves, the receive
+// callback queues acknowledgements, the radio task owns the slots.
+QueueHandle_t handoffRequests;
+QueueHandle_t handoffAcks;
+Handoff handoffs[HANDOFF_SLOTS];
+HandoffStats handoffStats;
+
+// Emergency stops, see include/estop.h. Triggers queue a request, the radio
+// task owns the slots, the receive callback queues acknowledgements for the
+// loop task to print.
+struct HeardStopAck {
+  StopAck ack;
+  uint32_t heardUs;
+};
+QueueHandle_t stopRequests;
+QueueHandle_t stopAcks;
+StopBroadcast stopBroadcasts[STOP_SLOTS];
+uint16_t nextStopId; // Seeded at boot like the press epoch
+volatile bool fleetStopped = false; // Every controller's frames held at the base
+StopCombo stopCombos[BP32_MAX_GAMEPADS]; // Owned by the input task
+
+// Motion macros, see include/macro.h. Triggers queue a request, the radio
+// task owns the slots and the quiet controllers.
+QueueHandle_t macroRequests;
+// Macro and stop requests, and vehicle switches that found nothing, for the
+// serial monitor. They come from the input task and the Bluetooth callbacks,
+// the loop task prints them.
+enum RequestKind { REQUEST_MACRO, REQUEST_STOP, REQUEST_NO_VEHICLE };
+struct RequestLog {
+  RequestKind kind;
+  uint32_t vehicleIndex;
+  uint8_t detail; // Macro index, stop reason or controller
+};
+#define REQUEST_LOG_SLOTS 8
+QueueHandle_t requestLogs;
+MacroBroadcast macroBroadcasts[MACRO_SLOTS];
+uint16_t nextMacroRunId; // Seeded at boot like the press epoch
+MacroTrigger macroTriggers[BP32_MAX_GAMEPADS]; // Owned by the input task
+MacroQuiet macroQuiet[BP32_MAX_GAMEPADS];
+ControllerState quietFrames[BP32_MAX_GAMEPADS]; // Latest frame held back, sent as the keepalive
+bool quietFrameValid[BP32_MAX_GAMEPADS];
+MacroStats macroStats;
 
 void dumpGamepadState(ControllerState *gamepadState) {
     Serial.printf("ID:%d | BTN:0x%04x | DPAD:0x%02x | L:%d,%d | R:%d,%d | BT:%d TH:%d | MISC:0x%02x | FWD:%d BWD:%d RST:%d | R1:%d L1:%d R2:%d L2:%d | TL:%d TR:%d\n",
@@ -117,60 +320,429 @@ void dumpGamepadState(ControllerState *gamepadState) {
         gamepadState->thumbR
     );
 }
+// Folds the station MAC into a session id, never SESSION_NONE
+uint16_t pickBaseSession() {
+#ifdef BASE_SESSION_ID
+  return BASE_SESSION_ID;
+#else
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+  uint16_t session = (mac[4] << 8 | mac[5]) ^ (mac[3] << 4);
+  return session != SESSION_NONE ? session : 1;
+#endif
+}
+
+// Next sequence number. A wrap moves the auth epoch on, saved by the loop task.
+uint16_t takeSequence() {
+  uint16_t sequence = nextSequence++;
+  if (nextSequence == 0) {
+    authEpoch++;
+    authEpochNeedsSaving = true;
+  }
+  return sequence;
+}
+
+void saveAuthEpoch() {
+  if (authEpochNeedsSaving) {
+    authEpochNeedsSaving = false;
+    authStore.putUShort("epoch", authEpoch);
+  }
+}
+
+// The rate applies to every ESP-NOW send, so it is only changed when a
+// message needs another profile than the one before
+void setLinkProfile(uint8_t profile) {
+  static int currentRate = -1;
+  if (profileRates[profile] != currentRate &&
+      esp_wifi_config_espnow_rate(WIFI_IF_STA, profileRates[profile]) == ESP_OK) {
+    currentRate = profileRates[profile];
+  }
+}
+
+// Radio stage: only one message is in flight, so radio backpressure stays in this task
+bool sendMessage(void *message, size_t size, uint8_t profile) {
+  setLinkProfile(profile);
+  if (authEnabled) {
+    uint32_t start = ESP.getCycleCount();
+    signMessage(&authKey, (uint8_t *)message, size);
+    noteAuthCost(&signCost, ESP.getCycleCount() - start);
+  }
+  // A confirm that came in after its timeout must not count for this message
+  xSemaphoreTake(sendDone, 0);
+  esp_err_t result = esp_now_send(broadcastAddress, (const uint8_t *)message, size);
+  if (result != ESP_OK) {
+    radioStats.sendErrors++;
+    return false;
+  }
+  radioStats.framesSent++;
+  if (xSemaphoreTake(sendDone, pdMS_TO_TICKS(SEND_CONFIRM_TIMEOUT_MS)) != pdTRUE) {
+    radioStats.confirmTimeouts++;
+  }
+  return true;
+}
+
 void sendGamepad(ControllerState *gamepadState) {
-  esp_err_t result = esp_now_send(broadcastAddress, (uint8_t *)gamepadState, sizeof(*gamepadState));
-  dumpGamepadState(gamepadState);
+  gamepadState->sequence = takeSequence();
+  gamepadState->sessionId = baseSession;
+  gamepadState->authEpoch = authEpoch;
+  LinkAdapt *adapt = claimLinkAdapt(&linkAdapt, gamepadState->receiverIndex);
+  if (sendMessage(gamepadState, sizeof(*gamepadState), adapt ? adapt->profile : LINK_PROFILE_NORMAL)) {
+    noteLinkFrameSent(adapt, millis());
+    memcpy(&lastSentState, gamepadState, sizeof(lastSentState));
+    lastSentStateValid = true;
+    if (firstFrameSentTime == 0) {
+      firstFrameSentTime = millis();
+    }
+  }
+}
+
+// Sends due release frames, before any frame for the vehicles being taken over
+void serviceHandoffs() {
+  struct_message frame;
+  while (xQueueReceive(handoffRequests, &frame, 0) == pdTRUE) {
+    startHandoff(handoffs, &handoffStats, &frame, millis());
+    cancelRepeats(frameRepeats, BP32_MAX_GAMEPADS, frame.receiverIndex);
+  }
+  uint32_t vehicleIndex;
+  while (xQueueReceive(handoffAcks, &vehicleIndex, 0) == pdTRUE) {
+    ackHandoff(handoffs, &handoffStats, vehicleIndex, millis());
+  }
+  Handoff *handoff;
+  while ((handoff = dueHandoff(handoffs, &handoffStats, millis())) != NULL) {
+    handoff->release.sequence = takeSequence();
+    handoff->release.sessionId = baseSession;
+    handoff->release.authEpoch = authEpoch;
+    sendMessage(&handoff->release, sizeof(handoff->release),
+                linkProfileOf(&linkAdapt, handoff->release.receiverIndex));
+    noteHandoffSent(handoff, &handoffStats, millis());
+  }
+}
+
+// Sends the second copy of frames whose repeat is due
+void serviceRepeats() {
+  for (int i = 0; i < BP32_MAX_GAMEPADS; i++) {
+    FrameRepeat *repeat = &frameRepeats[i];
+    if (repeatDue(repeat, millis())) {
+      repeat->pending = false;
+      if (sendMessage(&repeat->frame, sizeof(repeat->frame), linkProfileOf(&linkAdapt, repeat->frame.receiverIndex))) {
+        radioStats.repeatsSent++;
+      }
+    }
+  }
+}
+
+// Sends due emergency stop copies. Called ahead of every other send.
+void serviceStops() {
+  StopRequest request;
+  while (xQueueReceive(stopRequests, &request, 0) == pdTRUE) {
+    startStop(stopBroadcasts, &request, nextStopId++);
+    cancelMacroBroadcasts(macroBroadcasts, request.vehicleIndex);
+    for (int i = 0; i < BP32_MAX_GAMEPADS; i++) {
+      if (request.vehicleIndex == RECEIVER_NONE || macroQuiet[i].vehicleIndex == request.vehicleIndex) {
+        macroQuiet[i].active = false;
+      }
+    }
+    // A second copy of an older command must not follow the stop
+    for (int i = 0; i < BP32_MAX_GAMEPADS; i++) {
+      if (request.vehicleIndex == RECEIVER_NONE || frameRepeats[i].frame.receiverIndex == request.vehicleIndex) {
+        frameRepeats[i].pending = false;
+      }
+    }
+  }
+  StopBroadcast *slot;
+  while ((slot = dueStop(stopBroadcasts, millis())) != NULL) {
+    StopMessage message;
+    buildStopMessage(slot, &message);
+    message.sequence = takeSequence();
+    message.sessionId = baseSession;
+    message.authEpoch = authEpoch;
+    // Every vehicle has to hear it, the one furthest away too
+    if (sendMessage(&message, sizeof(message), announceProfile(&linkAdapt, millis()))) {
+      radioStats.stopCopies++;
+    }
+    noteStopSent(slot, millis(), micros());
+  }
+}
+
+// Sends due macro starts, then a keepalive for every controller whose frames
+// are held back while its vehicle runs a macro
+void serviceMacros() {
+  MacroRequest request;
+  while (xQueueReceive(macroRequests, &request, 0) == pdTRUE) {
+    startMacroBroadcast(macroBroadcasts, &request, nextMacroRunId++);
+    macroStats.started++;
+    if (request.controller >= 0) {
+      startMacroQuiet(&macroQuiet[request.controller], request.vehicleIndex, millis());
+      quietFrameValid[request.controller] = false;
+    }
+  }
+  MacroBroadcast *slot;
+  while ((slot = dueMacroBroadcast(macroBroadcasts, millis())) != NULL) {
+    MacroMessage message;
+    buildMacroMessage(slot, &message);
+    message.sequence = takeSequence();
+    message.sessionId = baseSession;
+    message.authEpoch = authEpoch;
+    if (sendMessage(&message, sizeof(message), linkProfileOf(&linkAdapt, message.vehicleIndex))) {
+      macroStats.copies++;
+    }
+    noteMacroBroadcastSent(slot, millis());
+  }
+  for (int i = 0; i < BP32_MAX_GAMEPADS; i++) {
+    MacroQuiet *quiet = &macroQuiet[i];
+    if (quiet->active && (!myControllers[i] || gamepadStates[i].receiverIndex != quiet->vehicleIndex)) {
+      quiet->active = false;
+    }
+    if (!macroKeepaliveDue(quiet, millis())) {
+      continue;
+    }
+    if (quietFrameValid[i] && !fleetStopped) {
+      ControllerState keepalive = quietFrames[i];
+      keepalive.flags = 0;
+      sendGamepad(&keepalive);
+      macroStats.keepalives++;
+    }
+    quiet->lastSent = millis();
+  }
+}
+
+// Any task: starts macro n on a vehicle, controller -1 when no controller's
+// frames should go quiet
+void requestMacro(int controller, uint32_t vehicleIndex, uint8_t macro) {
+  MacroRequest request;
+  request.vehicleIndex = vehicleIndex;
+  request.macro = macro;
+  request.controller = controller;
+  xQueueSend(macroRequests, &request, 0);
+  xTaskNotifyGive(radioTaskHandle);
+  RequestLog log = {REQUEST_MACRO, vehicleIndex, macro};
+  xQueueSend(requestLogs, &log, 0);
+}
+
+// Any task: stops one vehicle, or the fleet with RECEIVER_NONE
+void requestStop(uint32_t vehicleIndex, uint8_t reason) {
+  StopRequest request;
+  request.vehicleIndex = vehicleIndex;
+  request.reason = reason;
+  request.triggeredUs = micros();
+  if (vehicleIndex == RECEIVER_NONE) {
+    fleetStopped = true;
+  }
+  xQueueSend(stopRequests, &request, 0);
+  xTaskNotifyGive(radioTaskHandle);
+  RequestLog log = {REQUEST_STOP, vehicleIndex, reason};
+  xQueueSend(requestLogs, &log, 0);
+}
+
+void resumeFleet() {
+  if (fleetStopped) {
+    fleetStopped = false;
+    Serial.println("Fleet resumed");
+  }
+}
+
+// Scores every channel by the networks around us and moves the radio to the cleanest one
+void selectChannel() {
+  clearChannelScores(&channelScores);
+  int16_t found = WiFi.scanNetworks(false, false, false, CHANNEL_SCAN_MS_PER_CHANNEL);
+  for (int i = 0; i < found; i++) {
+    addNetworkToScores(&channelScores, WiFi.channel(i), WiFi.RSSI(i));
+  }
+  WiFi.scanDelete();
+  uint8_t channel = pickCleanestChannel(&channelScores);
+  Serial.printf("Channel scan: %d networks, congestion", found > 0 ? found : 0);
+  for (int c = WIFI_CHANNEL_MIN; c <= WIFI_CHANNEL_MAX; c++) {
+    Serial.printf(" %d:%d", c, channelScores.congestion[c]);
+  }
+  Serial.printf("\nUsing channel %d\n", channel);
+  initChannelMigrator(&channelMigrator, channel);
+  esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+}
+
+// Beacons the channel and carries out fleet moves, called by the radio task
+void serviceChannel() {
+  static unsigned long lastAnnounceTime = 0;
+  unsigned long now = millis();
+  if (lossReportReady) {
+    lossReportReady = false;
+    if (reportChannelLoss(&channelMigrator, reportedLossPercent, now)) {
+      channelScores.congestion[channelMigrator.channel] += CHANNEL_LOSS_PENALTY;
+      scheduleChannelMove(&channelMigrator, pickCleanestChannel(&channelScores, channelMigrator.channel), now);
+    }
+  }
+  if (requestedChannel) {
+    scheduleChannelMove(&channelMigrator, requestedChannel, now);
+    requestedChannel = 0;
+  }
+
+  unsigned long period = channelMovePending(&channelMigrator) ? CHANNEL_MOVE_ANNOUNCE_PERIOD_MS : CHANNEL_ANNOUNCE_PERIOD_MS;
+  if (now - lastAnnounceTime >= period) {
+    lastAnnounceTime = now;
+    ChannelAnnounce announce;
+    memset(&announce, 0, sizeof(announce));
+    announce.receiverIndex = RECEIVER_CHANNEL_ANNOUNCE;
+    announce.sequence = takeSequence();
+    announce.sessionId = baseSession;
+    announce.authEpoch = authEpoch;
+    announce.channel = channelMigrator.channel;
+    announce.nextChannel = channelMigrator.nextChannel;
+    announce.switchInMs = channelMoveIn(&channelMigrator, now);
+    // Every vehicle has to hear it, the one furthest away too
+    sendMessage(&announce, sizeof(announce), announceProfile(&linkAdapt, now));
+  }
+
+  uint8_t channel = channelMigrator.channel;
+  if (updateChannelMigrator(&channelMigrator, millis()) != channel) {
+    esp_wifi_set_channel(channelMigrator.channel, WIFI_SECOND_CHAN_NONE);
+    radioStats.channelMoves++;
+  }
+}
+
+// True when a connected controller is currently driving this vehicle
+bool isDrivenVehicle(uint32_t vehicleIndex) {
+  for (int i = 0; i < BP32_MAX_GAMEPADS; i++) {
+    if (myControllers[i] && gamepadStates[i].receiverIndex == vehicleIndex) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Input stage: hands a frame to the radio task without ever waiting on it
+void queueGamepad(unsigned controllerIndex, ControllerState *gamepadState) {
+  if (memcmp(gamepadState, &lastQueuedStates[controllerIndex], sizeof(*gamepadState)) == 0) {
+    inputStats.redundantFrames++;
+  }
+  memcpy(&lastQueuedStates[controllerIndex], gamepadState, sizeof(*gamepadState));
+  if (uxQueueMessagesWaiting(txMailboxes[controllerIndex]) > 0) {
+    inputStats.mailboxOverwrites++;
+  }
+  xQueueOverwrite(txMailboxes[controllerIndex], gamepadState);
+  inputStats.framesQueued++;
+  xTaskNotifyGive(radioTaskHandle);
+}
+// Looks up the stored calibration of a controller, or starts measuring one
+void loadCalibration(int controllerIndex, const uint8_t *btAddress) {
+  CalibrationData *calibrationData = &controllerCalibrations[controllerIndex];
+  snprintf(calibrationData->key, sizeof(calibrationData->key), "%02x%02x%02x%02x%02x%02x", btAddress[0],
+           btAddress[1], btAddress[2], btAddress[3], btAddress[4], btAddress[5]);
+  for (int a = 0; a < FILTERED_AXES; a++) {
+    resetAxisFilter(&axisFilters[controllerIndex][a]);
+  }
+  calibrationData->recalibrate = false;
+  calibrationData->needsSaving = false;
+  if (calibrationStore.getBytes(calibrationData->key, &calibrationData->calibration,
+                                sizeof(calibrationData->calibration)) == sizeof(calibrationData->calibration)) {
+    calibrationData->isCalibrated = true;
+    const int32_t *offset = calibrationData->calibration.offset;
+    Serial.printf("Calibration for %s: L:%d,%d R:%d,%d\n", calibrationData->key, offset[0], offset[1], offset[2],
+                  offset[3]);
+  } else {
+    memset(&calibrationData->calibration, 0, sizeof(calibrationData->calibration));
+    calibrationData->isCalibrated = false;
+    startCalibration(&calibrationData->sampler);
+    Serial.printf("No calibration for %s, leave the sticks centred\n", calibrationData->key);
+  }
+}
+
+// Writes newly measured calibrations to NVS, called from the loop task
+void saveCalibrations() {
+  for (int i = 0; i < BP32_MAX_GAMEPADS; i++) {
+    CalibrationData *calibrationData = &controllerCalibrations[i];
+    if (!calibrationData->needsSaving) {
+      continue;
+    }
+    calibrationData->needsSaving = false;
+    StickCalibration calibration = calibrationData->calibration;
+    calibrationStore.putBytes(calibrationData->key, &calibration, sizeof(calibration));
+    Serial.printf("Calibration saved for %s: L:%d,%d R:%d,%d\n", calibrationData->key, calibration.offset[0],
+                  calibration.offset[1], calibration.offset[2], calibration.offset[3]);
+  }
 }
+
 // Controller event callback
 void processGamepad(GamepadPtr gp, unsigned controllerIndex) {
     CalibrationData *calibrationData = &controllerCalibrations[controllerIndex];
-    uint32_t *receiverIndex = &receiverIndexes[controllerIndex];
-    // if (!calibrationData->isCalibrated) {
-    //     calibrationData->axisX = gp->axisX();
-    //     calibrationData->axisY = gp->axisY();
-    //     calibrationData->axisRX = gp->axisRX();
-    //     calibrationData->axisRY = gp->axisRY();
-    //     calibrationData->isCalibrated = true;
-    // }
-    // Calibration seems to cause more problems than it solves so disabling for now, if you have a controller with drift you can try commenting the following code and uncommenting the previous code.
-    if (!calibrationData->isCalibrated) {
-        calibrationData->axisX = 0;
-        calibrationData->axisY = 0;
-        calibrationData->axisRX = 0;
-        calibrationData->axisRY = 0;
-        calibrationData->isCalibrated = true;
-    }
     if (gp) {
+        int32_t raw[CALIBRATED_AXES] = {gp->axisX(), gp->axisY(), gp->axisRX(), gp->axisRY()};
+        if (calibrationData->recalibrate) {
+            calibrationData->recalibrate = false;
+            calibrationData->isCalibrated = false;
+            startCalibration(&calibrationData->sampler);
+        }
+        // Keep using the previous offsets until a new set is measured
+        if (!calibrationData->isCalibrated &&
+            addCalibrationSample(&calibrationData->sampler, raw, &calibrationData->calibration)) {
+            calibrationData->isCalibrated = true;
+            calibrationData->needsSaving = true;
+        }
+        const int32_t *offset = calibrationData->calibration.offset;
+        AxisFilter *filters = axisFilters[controllerIndex];
+
         ControllerState *gamepadState = &gamepadStates[controllerIndex];
         gamepadState->buttons = gp->buttons();
         gamepadState->dpad = gp->dpad();
-        gamepadState->axisX = gp->axisX() - calibrationData->axisX;
-        gamepadState->axisY = gp->axisY() - calibrationData->axisY;
-        gamepadState->axisRX = gp->axisRX() - calibrationData->axisRX;
-        gamepadState->axisRY = gp->axisRY() - calibrationData->axisRY;
-        gamepadState->brake = gp->brake();
-        gamepadState->throttle = gp->throttle();
+        gamepadState->axisX = filterAxis(&filters[0], raw[0] - offset[0], STICK_DEADBAND, STICK_RANGE);
+        gamepadState->axisY = filterAxis(&filters[1], raw[1] - offset[1], STICK_DEADBAND, STICK_RANGE);
+        gamepadState->axisRX = filterAxis(&filters[2], raw[2] - offset[2], STICK_DEADBAND, STICK_RANGE);
+        gamepadState->axisRY = filterAxis(&filters[3], raw[3] - offset[3], STICK_DEADBAND, STICK_RANGE);
+        gamepadState->brake = filterAxis(&filters[4], gp->brake(), TRIGGER_DEADBAND, 2 * STICK_RANGE);
+        gamepadState->throttle = filterAxis(&filters[5], gp->throttle(), TRIGGER_DEADBAND, 2 * STICK_RANGE);
         gamepadState->thumbR = gp->thumbR();
         gamepadState->thumbL = gp->thumbL();
         gamepadState->r1 = gp->r1();
         gamepadState->l1 = gp->l1();
         gamepadState->r2 = gp->r2();
         gamepadState->l2 = gp->l2();
-
-
+        // With the macro button held the D-pad picks a macro and is not sent
         gamepadState->miscButtons = gp->miscButtons();
-        if (gamepadState->miscButtons && (millis() - miscButtonTime) > 200) {
-          if (gamepadState->miscButtons & controllerMapping.miscForwardMask) {
-            gamepadState->receiverIndex++;
-          } else if (gamepadState->miscButtons & controllerMapping.miscBackwardMask) {
-            gamepadState->receiverIndex--;
-          } else if (gamepadState->miscButtons & controllerMapping.miscResetMask) {
+        bool macroHeld = gamepadState->miscButtons & controllerMapping.miscMacroMask;
+        int macro = takeMacroTrigger(&macroTriggers[controllerIndex], macroHeld, gamepadState);
+        if (macro >= 0) {
+          requestMacro(controllerIndex, gamepadState->receiverIndex, macro);
+        }
+        uint16_t levels = edgeLevels(gamepadState->buttons, gamepadState->dpad, gamepadState->thumbL,
+                                     gamepadState->thumbR, gamepadState->r1, gamepadState->l1, gamepadState->r2,
+                                     gamepadState->l2);
+        bool comboHeld = stopComboHeld(gamepadState->l1, gamepadState->r1, gamepadState->l2, gamepadState->r2);
+        StopComboAction stopAction = updateStopCombo(&stopCombos[controllerIndex], comboHeld, fleetStopped, millis());
+        if (stopAction == STOP_COMBO_STOP) {
+          requestStop(RECEIVER_NONE, STOP_BUTTON);
+        } else if (stopAction == STOP_COMBO_RESUME) {
+          resumeFleet();
+        }
+
+        // One vehicle switch per press, however long the button is held
+        uint16_t miscPressed =
+            gamepadState->miscButtons & ~miscLevels[controllerIndex] & ~controllerMapping.miscMacroMask;
+        miscLevels[controllerIndex] = gamepadState->miscButtons;
+        if (miscPressed) {
+          uint32_t previousIndex = gamepadState->receiverIndex;
+          ControllerState lastFrame = *gamepadState; // Press state as the vehicle being left last saw it
+          // Only vehicles that are powered, the frame below already goes to the new one
+          if (miscPressed & controllerMapping.miscForwardMask) {
+            gamepadState->receiverIndex = stepPresentVehicle(&presenceTable, previousIndex, 1, millis());
+          } else if (miscPressed & controllerMapping.miscBackwardMask) {
+            gamepadState->receiverIndex = stepPresentVehicle(&presenceTable, previousIndex, -1, millis());
+          } else if (miscPressed & controllerMapping.miscResetMask) {
             gamepadState->receiverIndex = 0;
           }
-
-          miscButtonTime = millis();
+          if (gamepadState->receiverIndex != previousIndex) {
+            startPressEpoch(&pressCounters[controllerIndex], nextPressEpoch++, levels);
+            // Release the vehicle we left unless another controller still drives it
+            if (previousIndex != RECEIVER_NONE && !isDrivenVehicle(previousIndex)) {
+              xQueueSend(handoffRequests, &lastFrame, 0);
+            }
+          } else if (!(miscPressed & controllerMapping.miscResetMask)) {
+            RequestLog log = {REQUEST_NO_VEHICLE, previousIndex, (uint8_t)controllerIndex};
+            xQueueSend(requestLogs, &log, 0);
+          }
         }
-        sendGamepad(gamepadState);
+        PressCounter *pressCounter = &pressCounters[controllerIndex];
+        countPresses(pressCounter, levels);
+        gamepadState->pressEpoch = pressCounter->epoch;
+        memcpy(gamepadState->pressCounts, pressCounter->counts, sizeof(gamepadState->pressCounts));
+        queueGamepad(controllerIndex, gamepadState);
 
     }
 }
@@ -185,6 +757,12 @@ void onConnectedController(ControllerPtr ctl) {
       ControllerProperties properties = ctl->getProperties();
       Serial.printf("Controller model: %s, VID=0x%04x, PID=0x%04x\n", ctl->getModelName().c_str(), properties.vendor_id,
                     properties.product_id);
+      loadCalibration(i, properties.btaddr);
+      // Everything counts as held, so buttons down while connecting are not presses
+      startPressEpoch(&pressCounters[i], nextPressEpoch++, 0xFFFF);
+      miscLevels[i] = 0xFFFF;
+      memset(&stopCombos[i], 0, sizeof(stopCombos[i]));
+      macroTriggers[i].dpad = 0xFF; // Like the presses, a direction held while connecting starts nothing
       myControllers[i] = ctl;
       foundEmptySlot = true;
       break;
@@ -201,6 +779,13 @@ void onDisconnectedController(ControllerPtr ctl) {
     if (myControllers[i] == ctl) {
       Serial.printf("CALLBACK: Controller disconnected from index=%d\n", i);
       myControllers[i] = nullptr;
+      // Nobody is driving its vehicle any more, it stops now rather than at
+      // its link timeout
+      uint32_t vehicleIndex = gamepadStates[i].receiverIndex;
+      if (vehicleIndex != RECEIVER_NONE && !isDrivenVehicle(vehicleIndex)) {
+        requestStop(vehicleIndex, STOP_DISCONNECT);
+        xQueueSend(handoffRequests, &gamepadStates[i], 0);
+      }
       foundController = true;
       break;
     }
@@ -210,12 +795,86 @@ void onDisconnectedController(ControllerPtr ctl) {
     Serial.println("CALLBACK: Controller disconnected, but not found in myControllers");
   }
 }
+// Tag check for vehicle messages, only once they are known to be for us
+bool authenticReport(const uint8_t *data, int len) {
+    if (!authEnabled) {
+        return true;
+    }
+    uint32_t start = ESP.getCycleCount();
+    bool authentic = verifyMessage(&authKey, data, len);
+    noteAuthCost(&verifyCost, ESP.getCycleCount() - start);
+    if (!authentic) {
+        callbackStats.authFailures++;
+    }
+    return authentic;
+}
+
+#if ESP_IDF_VERSION_MAJOR >= 5
+void OnDataRecv(const esp_now_recv_info_t *info, const uint8_t *incomingData, int len) {
+#else
+void OnDataRecv(const uint8_t *mac, const uint8_t *incomingData, int len) {
+#endif
+    uint32_t receiverIndex;
+    if (len < (int)sizeof(receiverIndex)) {
+        return;
+    }
+    memcpy(&receiverIndex, incomingData, sizeof(receiverIndex));
+    if (receiverIndex == RECEIVER_LINK_REPORT && len >= (int)sizeof(LinkReport)) {
+        LinkReport report;
+        memcpy(&report, incomingData, sizeof(report));
+        // Unpaired vehicles are listed too, driving one pairs it with us
+        if (report.sessionId != baseSession && report.sessionId != SESSION_NONE) {
+            callbackStats.foreignReports++;
+            return;
+        }
+        if (!authenticReport(incomingData, sizeof(report))) {
+            return;
+        }
+#if ESP_IDF_VERSION_MAJOR >= 5
+        int8_t rssi = info->rx_ctrl->rssi;
+#else
+        int8_t rssi = PRESENCE_RSSI_UNKNOWN;
+#endif
+        notePresence(&presenceTable, &report, rssi, millis());
+        if (report.sessionId != baseSession) {
+            return;
+        }
+        LinkAdapt *adapt = findLinkAdapt(&linkAdapt, report.vehicleIndex);
+        if (adapt && adaptLink(adapt, report.ownFrames, rssi, millis())) {
+            callbackStats.profileChanges++;
+        }
+        // Only vehicles being driven decide whether the fleet has to move
+        if (isDrivenVehicle(report.vehicleIndex)) {
+            reportedLossPercent = sequenceLossPercent(report.framesReceived, report.framesMissed);
+            lossReportReady = true;
+        }
+    } else if (receiverIndex == RECEIVER_RELEASE_ACK && len >= (int)sizeof(ReleaseAck)) {
+        ReleaseAck ack;
+        memcpy(&ack, incomingData, sizeof(ack));
+        if (ack.sessionId == baseSession && authenticReport(incomingData, sizeof(ack))) {
+            xQueueSend(handoffAcks, &ack.vehicleIndex, 0);
+            xTaskNotifyGive(radioTaskHandle);
+        }
+    } else if (receiverIndex == RECEIVER_STOP_ACK && len >= (int)sizeof(StopAck)) {
+        HeardStopAck heard;
+        heard.heardUs = micros();
+        memcpy(&heard.ack, incomingData, sizeof(heard.ack));
+        if (heard.ack.sessionId == baseSession && authenticReport(incomingData, sizeof(heard.ack))) {
+            xQueueSend(stopAcks, &heard, 0);
+        }
+    }
+}
+
 void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status) {
-    // Serial.print("Send Status: ");
-    // Serial.println(status == ESP_NOW_SEND_SUCCESS ? "Success" : "Fail");
+    if (status != ESP_NOW_SEND_SUCCESS) {
+        callbackStats.sendFailures++;
+    }
+    xSemaphoreGive(sendDone);
 }
 void setup() {
     Serial.begin(115200);
+    // The input and radio tasks subscribe as they start, see include/tasks.h
+    startTaskWatchdog();
     
     // Print controller configuration
     Serial.println("=======================================");
@@ -224,12 +883,40 @@ void setup() {
     Serial.printf("Forward Mask: 0x%04x\n", controllerMapping.miscForwardMask);
     Serial.printf("Backward Mask: 0x%04x\n", controllerMapping.miscBackwardMask);
     Serial.printf("Reset Mask: 0x%04x\n", controllerMapping.miscResetMask);
+    Serial.printf("Macro Mask: 0x%04x\n", controllerMapping.miscMacroMask);
     Serial.println("=======================================");
 
-    // Initialize Bluepad32
+    for (int i = 0; i < BP32_MAX_GAMEPADS; i++) {
+        txMailboxes[i] = xQueueCreate(1, sizeof(ControllerState));
+    }
+    sendDone = xSemaphoreCreateBinary();
+    handoffRequests = xQueueCreate(HANDOFF_SLOTS, sizeof(ControllerState));
+    handoffAcks = xQueueCreate(HANDOFF_SLOTS, sizeof(uint32_t));
+    stopRequests = xQueueCreate(STOP_SLOTS, sizeof(StopRequest));
+    stopAcks = xQueueCreate(PRESENCE_SLOTS, sizeof(HeardStopAck));
+    nextStopId = esp_random();
+    macroRequests = xQueueCreate(MACRO_SLOTS, sizeof(MacroRequest));
+    requestLogs = xQueueCreate(REQUEST_LOG_SLOTS, sizeof(RequestLog));
+    nextMacroRunId = esp_random();
+    nextPressEpoch = esp_random();
+    initPresenceTable(&presenceTable);
+    initLinkAdaptTable(&linkAdapt);
+    calibrationStore.begin(CALIBRATION_NAMESPACE, false);
+
+    // Initialize Bluepad32 first, controllers reconnect while the channel scan runs
     BP32.setup(&onConnectedController, &onDisconnectedController);
     // Set device as Wi-Fi station
     WiFi.mode(WIFI_STA);
+#ifdef LINK_LONG_RANGE
+    esp_wifi_set_protocol(WIFI_IF_STA, WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N | WIFI_PROTOCOL_LR);
+#endif
+    baseSession = pickBaseSession();
+    loadAuthKey();
+    // Every boot starts a fresh epoch, vehicles refuse counters they have seen
+    authStore.begin("auth", false);
+    authEpoch = authStore.getUShort("epoch", 0) + 1;
+    authStore.putUShort("epoch", authEpoch);
+    selectChannel();
 
     if (esp_now_init() != ESP_OK) {
         Serial.println("Error initializing ESP-NOW");
@@ -237,11 +924,12 @@ void setup() {
     }
 
     esp_now_register_send_cb(OnDataSent);
+    esp_now_register_recv_cb(OnDataRecv);
 
     esp_now_peer_info_t peerInfo;
     memset(&peerInfo, 0, sizeof(peerInfo));
     memcpy(peerInfo.peer_addr, broadcastAddress, 6);
-    peerInfo.channel = 0;
+    peerInfo.channel = 0; // Follow whatever channel the radio is on
     peerInfo.encrypt = false;
 
     if (esp_now_add_peer(&peerInfo) != ESP_OK) {
@@ -249,6 +937,12 @@ void setup() {
         return;
     }
 
+    radioTaskHandle = startPinnedTask(radioTask, "radio", RADIO_TASK_STACK, RADIO_TASK_PRIORITY, RADIO_TASK_CORE);
+    inputTaskHandle = startPinnedTask(inputTask, "input", INPUT_TASK_STACK, INPUT_TASK_PRIORITY, INPUT_TASK_CORE);
+    watchTask("loop", xTaskGetCurrentTaskHandle(), getArduinoLoopTaskStackSize());
+    // The radio path runs without the heap from here on, see include/footprint.h
+    guardHeap(radioTaskHandle);
+    Serial.printf("Radio up on channel %d at %lu ms, session %04x\n", channelMigrator.channel, millis(), baseSession);
 }
 
 void processControllers() {
@@ -265,16 +959,300 @@ void processControllers() {
 
     i++;
   }
-  dataSent = true;
 }
 
-void loop() {
-  // Fetch controller updates
-  bool dataUpdated = BP32.update();
-  if (dataUpdated & dataSent) {
-    dataSent = false;
-    processControllers();
-  } else { vTaskDelay(1); }
-    // delay(100);  // Send updates every 100ms
+// Bluetooth input task: samples the controllers and fills the mailboxes
+void inputTask(void *parameter) {
+  subscribeWatchdog();
+  for (;;) {
+    // Fetch controller updates
+    if (BP32.update()) {
+      inputStats.inputUpdates++;
+      processControllers();
+    }
+    feedWatchdog();
+    vTaskDelay(1);
+  }
 }
 
+// Radio transmit task: sends the newest frame of every controller that has one
+// and keeps the channel beacon going even when no controller is connected
+void radioTask(void *parameter) {
+  ControllerState frame;
+  bool heldFrames = false;
+  subscribeWatchdog();
+  for (;;) {
+    unsigned long wait = handoffPending(handoffs)                  ? HANDOFF_RETRY_MS
+                         : channelMovePending(&channelMigrator) ? CHANNEL_MOVE_ANNOUNCE_PERIOD_MS
+                                                                : CHANNEL_ANNOUNCE_PERIOD_MS;
+    wait = nextRepeatIn(frameRepeats, BP32_MAX_GAMEPADS, millis(), wait);
+    if (heldFrames) {
+      wait = 1; // A robust vehicle's frame waits in its mailbox for its slot
+    }
+    if (stopPending(stopBroadcasts) && wait > STOP_COPY_INTERVAL_MS) {
+      wait = STOP_COPY_INTERVAL_MS;
+    }
+    wait = nextMacroSendIn(macroBroadcasts, macroQuiet, BP32_MAX_GAMEPADS, millis(), wait);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait));
+    enterDeadlineStage(&radioDeadline, DEADLINE_STOPS, micros());
+    serviceStops();
+    enterDeadlineStage(&radioDeadline, DEADLINE_MACRO, micros());
+    serviceMacros();
+    enterDeadlineStage(&radioDeadline, DEADLINE_HANDOFFS, micros());
+    serviceHandoffs();
+    enterDeadlineStage(&radioDeadline, DEADLINE_FRAMES, micros());
+    heldFrames = false;
+    for (int i = 0; i < BP32_MAX_GAMEPADS; i++) {
+      // A stop triggered while the frames go out still goes first
+      serviceStops();
+      if (fleetStopped) {
+        if (xQueueReceive(txMailboxes[i], &frame, 0) == pdTRUE) {
+          radioStats.stoppedFrames++;
+        }
+        continue;
+      }
+      if (xQueuePeek(txMailboxes[i], &frame, 0) != pdTRUE) {
+        continue;
+      }
+      // The vehicle runs a macro, a keepalive stands in for frames without input
+      if (macroQuietHolds(&macroQuiet[i], &frame)) {
+        xQueueReceive(txMailboxes[i], &quietFrames[i], 0);
+        quietFrameValid[i] = true;
+        macroStats.heldFrames++;
+        continue;
+      }
+      LinkAdapt *adapt = findLinkAdapt(&linkAdapt, frame.receiverIndex);
+      if (!linkFrameDue(adapt, millis())) {
+        heldFrames = true;
+        continue;
+      }
+      if (xQueueReceive(txMailboxes[i], &frame, 0) == pdTRUE) {
+        cancelHandoff(handoffs, frame.receiverIndex);
+        sendGamepad(&frame);
+        bool repeatAll = adapt && linkProfiles[adapt->profile].repeat;
+        scheduleRepeat(&frameRepeats[i], repeatAll ? REDUNDANCY_ALL : redundancyMode, &frame,
+                       previousSentValid[i] ? &previousSentFrames[i] : NULL, millis());
+        memcpy(&previousSentFrames[i], &frame, sizeof(frame));
+        previousSentValid[i] = true;
+        macroQuiet[i].lastSent = millis();
+      }
+    }
+    enterDeadlineStage(&radioDeadline, DEADLINE_REPEATS, micros());
+    serviceRepeats();
+    enterDeadlineStage(&radioDeadline, DEADLINE_CHANNEL, micros());
+    serviceChannel();
+    endDeadlineIteration(&radioDeadline, micros(), millis());
+    feedWatchdog();
+  }
+}
+
+void reportPipelineStats() {
+  static InputStats previousInput;
+  static RadioStats previous;
+  static unsigned long previousTime = 0;
+  InputStats input;
+  RadioStats current;
+  CallbackStats callbacks;
+  memcpy(&input, (const void *)&inputStats, sizeof(input));
+  memcpy(&current, (const void *)&radioStats, sizeof(current));
+  memcpy(&callbacks, (const void *)&callbackStats, sizeof(callbacks));
+  float seconds = (millis() - previousTime) / 1000.0f;
+  uint32_t queued = input.framesQueued - previousInput.framesQueued;
+  uint32_t redundant = input.redundantFrames - previousInput.redundantFrames;
+  Serial.printf("Pipeline: input %.1f/s | queued %.1f/s | redundant %u%% | sent %.1f/s | overwrites %u | send errors %u | send failures %u | confirm timeouts %u | channel %d (moves %u, loss %d%%) | foreign reports %u | bad tags %u | repeats %u (%s) | profile changes %u | stop copies %u, frames dropped %u%s\n",
+      (input.inputUpdates - previousInput.inputUpdates) / seconds,
+      queued / seconds,
+      queued ? (unsigned)(redundant * 100 / queued) : 0,
+      (current.framesSent - previous.framesSent) / seconds,
+      input.mailboxOverwrites,
+      current.sendErrors,
+      callbacks.sendFailures,
+      current.confirmTimeouts,
+      channelMigrator.channel,
+      current.channelMoves,
+      reportedLossPercent,
+      callbacks.foreignReports,
+      callbacks.authFailures,
+      current.repeatsSent - previous.repeatsSent,
+      redundancyModeNames[redundancyMode],
+      callbacks.profileChanges,
+      current.stopCopies,
+      current.stoppedFrames,
+      fleetStopped ? ", fleet stopped" : "");
+  previousInput = input;
+  previous = current;
+  previousTime = millis();
+  HandoffStats handoff = handoffStats;
+  if (handoff.started) {
+    Serial.printf("Handoffs: %u started | %u acked | %u failed | %u release frames | slowest ack %u ms\n",
+                  handoff.started, handoff.acked, handoff.failed, handoff.attempts, handoff.maxAckMs);
+  }
+  MacroStats macros = macroStats;
+  if (macros.started) {
+    Serial.printf("Macros: %u started | %u start copies | %u frames held back, %u keepalives sent instead "
+                  "(%u bytes not sent)\n",
+                  macros.started, macros.copies, macros.heldFrames, macros.keepalives,
+                  (unsigned)((macros.heldFrames - macros.keepalives) * sizeof(ControllerState)));
+  }
+  reportAuthCost("sign", &signCost);
+  reportAuthCost("verify", &verifyCost);
+}
+
+// Loop task: prints the requests queued since the last call
+void reportRequests() {
+  RequestLog log;
+  while (xQueueReceive(requestLogs, &log, 0) == pdTRUE) {
+    if (log.kind == REQUEST_NO_VEHICLE) {
+      Serial.printf("Controller %u: no other vehicle powered\n", log.detail);
+    } else if (log.kind == REQUEST_MACRO) {
+      Serial.printf("Macro %u started on vehicle %u\n", log.detail, log.vehicleIndex);
+    } else if (log.vehicleIndex == RECEIVER_NONE) {
+      Serial.printf("Emergency stop (%s): fleet stopped\n", stopReasonNames[log.detail]);
+    } else {
+      Serial.printf("Emergency stop (%s): vehicle %u stopped\n", stopReasonNames[log.detail], log.vehicleIndex);
+    }
+  }
+}
+
+// One line for every vehicle that confirmed a stop: time to the first copy
+// on air, time from hearing it to safe outputs on the vehicle, and the whole
+// round trip as the base saw it
+void reportStopAcks() {
+  HeardStopAck heard;
+  while (xQueueReceive(stopAcks, &heard, 0) == pdTRUE) {
+    const StopBroadcast *slot = findStop(stopBroadcasts, heard.ack.stopId);
+    if (!slot) {
+      continue;
+    }
+    Serial.printf("Stop %u (%s): first copy on air %u us after the trigger, vehicle %u safe %u us after hearing it, "
+                  "acked %u us after the trigger\n",
+                  slot->stopId, stopReasonNames[slot->request.reason], slot->firstCopyUs, heard.ack.vehicleIndex,
+                  heard.ack.safeUs, heard.heardUs - slot->request.triggeredUs);
+  }
+}
+
+// One line listing every vehicle heard recently, with its type and link quality
+void reportPresence() {
+  unsigned long now = millis();
+  Serial.print("Vehicles:");
+  int live = 0;
+  for (int i = 0; i < PRESENCE_SLOTS; i++) {
+    PresenceEntry entry = presenceTable.entries[i];
+    if (!isPresent(&entry, now)) {
+      continue;
+    }
+    live++;
+    Serial.printf(" | %u %s, loss %u%%", entry.index, vehicleTypeNames[entry.type], entry.lossPercent);
+    if (entry.rawLossPercent != entry.lossPercent) {
+      Serial.printf(" (%u%% before repeats)", entry.rawLossPercent);
+    }
+    const LinkAdapt *adapt = findLinkAdapt(&linkAdapt, entry.index);
+    if (adapt) {
+      Serial.printf(", %s link, own frames lost %u%%", linkProfiles[adapt->profile].name, adapt->lastLossPercent);
+    }
+    if (entry.rssi != PRESENCE_RSSI_UNKNOWN) {
+      Serial.printf(", %d dBm", entry.rssi);
+    }
+    if (!entry.paired) {
+      Serial.print(", unpaired");
+    }
+    if (entry.overruns) {
+      Serial.printf(", %u overruns (last in %s, worst %u ms)", entry.overruns, deadlineStageNames[entry.overrunStage],
+                    entry.worstOverrunMs);
+    }
+  }
+  Serial.println(live ? "" : " none");
+}
+
+// Reads "channel <n>" from the serial monitor to move the fleet by hand,
+// "calibrate" to measure the stick centres of every connected controller again,
+// "redundancy <mode>" to trade airtime for fewer lost frames, "stop" and
+// "resume" for an emergency stop of the whole fleet and "macro <vehicle> <n>"
+// to start a vehicle's motion macro without a controller
+void processSerialCommands() {
+  static char line[32];
+  static int length = 0;
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (c != '\n' && c != '\r') {
+      if (length < (int)sizeof(line) - 1) {
+        line[length++] = c;
+      }
+      continue;
+    }
+    line[length] = '\0';
+    length = 0;
+    int channel;
+    unsigned vehicle, macro;
+    if (strcmp(line, "stop") == 0) {
+      requestStop(RECEIVER_NONE, STOP_SERIAL);
+    } else if (strcmp(line, "resume") == 0) {
+      resumeFleet();
+    } else if (strcmp(line, "calibrate") == 0) {
+      Serial.println("Recalibrating, leave the sticks centred");
+      for (int i = 0; i < BP32_MAX_GAMEPADS; i++) {
+        if (myControllers[i]) {
+          controllerCalibrations[i].recalibrate = true;
+        }
+      }
+    } else if (sscanf(line, "channel %d", &channel) == 1) {
+      if (channel >= WIFI_CHANNEL_MIN && channel <= WIFI_CHANNEL_MAX) {
+        Serial.printf("Moving fleet to channel %d\n", channel);
+        requestedChannel = channel;
+      } else {
+        Serial.printf("Channel must be %d-%d\n", WIFI_CHANNEL_MIN, WIFI_CHANNEL_MAX);
+      }
+    } else if (sscanf(line, "macro %u %u", &vehicle, &macro) == 2) {
+      if (vehicle != 0 && macro < MACRO_KEYS) {
+        requestMacro(-1, vehicle, macro);
+      } else {
+        Serial.printf("Macro needs a vehicle and a macro 0-%d\n", MACRO_KEYS - 1);
+      }
+    } else if (strncmp(line, "redundancy ", 11) == 0) {
+      int mode = 0;
+      while (mode < REDUNDANCY_MODE_COUNT && strcmp(line + 11, redundancyModeNames[mode]) != 0) {
+        mode++;
+      }
+      if (mode < REDUNDANCY_MODE_COUNT) {
+        redundancyMode = mode;
+        Serial.printf("Redundancy %s\n", redundancyModeNames[mode]);
+      } else {
+        Serial.println("Redundancy must be off, changes or all");
+      }
+    }
+  }
+}
+
+// The Arduino loop task only reports, it is never on the input or radio path
+void loop() {
+  processSerialCommands();
+  saveCalibrations();
+  saveAuthEpoch();
+  reportRequests();
+  reportStopAcks();
+  static uint32_t loggedReceiverIndex = 0;
+  static unsigned long lastStatsTime = 0;
+  static bool firstFrameLogged = false;
+  static uint32_t printedRadioOverruns = 0;
+  if (!firstFrameLogged && firstFrameSentTime != 0) {
+    firstFrameLogged = true;
+    Serial.printf("Boot to first frame sent: %lu ms\n", firstFrameSentTime);
+  }
+  if (lastSentStateValid && lastSentState.receiverIndex != loggedReceiverIndex) {
+    loggedReceiverIndex = lastSentState.receiverIndex;
+    const PresenceEntry *entry = findPresence(&presenceTable, loggedReceiverIndex);
+    Serial.printf("Driving %u (%s)\n", loggedReceiverIndex, entry ? vehicleTypeNames[entry->type] : "none");
+    dumpGamepadState(&lastSentState);
+  }
+  if (millis() - lastStatsTime >= PIPELINE_STATS_PERIOD_MS) {
+    lastStatsTime = millis();
+    reportPipelineStats();
+    reportPresence();
+    if (lastSentStateValid) {
+      dumpGamepadState(&lastSentState);
+    }
+    reportTaskStacks();
+    reportDeadline("Radio", &radioDeadline, &printedRadioOverruns);
+  }
+  vTaskDelay(pdMS_TO_TICKS(10));
+}
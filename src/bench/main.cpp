@@ -0,0 +1,596 @@
+// ============================================
+// CONTROL KERNEL MICROBENCHMARKS
+// ============================================
+// Times the per-frame logic shared by the firmwares, one kernel at a time,
+// on the build machine:
+//
+//   pio run -e bench
+//   .pio/build/bench/program src/bench/baseline.txt
+//   .pio/build/bench/program src/bench/baseline.txt update
+//   .pio/build/bench/program src/bench/baseline.txt tolerance=40
+//
+// Every kernel runs over a fixed corpus built from a fixed seed, several
+// rounds, and the fastest round counts. A calibration loop of plain integer
+// work runs the same way, and each kernel is compared by its time relative
+// to that loop, which takes most of the host's speed out of the figures and
+// lets the committed baseline gate any machine. The program prints ns/op,
+// the relative cost and heap allocations per op, and exits with 1 when a
+// kernel's relative cost is above its baseline by more than the tolerance
+// (25% by default) or it allocates more. "update" writes the current
+// figures as the new baseline.
+//
+// The vehicle frame kernels make the calls each processGamepad() makes into
+// include/vehicleframe.h and the other plain logic headers, without the
+// pin, servo and expander writes that only exist on hardware.
+// ============================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "protocol.h"
+#include "link.h"
+#include "edges.h"
+#include "mixer.h"
+#include "softpwm.h"
+#include "lights.h"
+#include "stickfilter.h"
+#include "trailerstate.h"
+#include "auth.h"
+#include "governor.h"
+#include "vehicleframe.h"
+
+#define BENCH_ROUNDS 25
+#define BENCH_CORPUS 256
+#define BENCH_MIN_ROUND_NS 5000000 // Each round runs at least this long
+#define BENCH_DEFAULT_TOLERANCE_PERCENT 25
+
+// Heap allocations, counted so a kernel that starts allocating fails the run
+static unsigned long long allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+// Keeps results alive so the compiler cannot drop the work
+static volatile uint32_t sink;
+
+static uint32_t rngState = 12345;
+static uint32_t nextRandom() {
+    rngState = rngState * 1664525u + 1013904223u;
+    return rngState >> 8;
+}
+static int32_t randomAxis() { return (int32_t)(nextRandom() % 1025) - 512; }
+
+// --------------------------------------------
+// Corpora
+// --------------------------------------------
+
+struct Corpus {
+    std::vector<struct_message> frames;          // What the base sends while driving
+    std::vector<std::vector<uint8_t> > messages; // Everything a vehicle hears
+    std::vector<int32_t> rawAxes;                // Controller readings around the centre
+    std::vector<std::string> trailerLines;       // Codes and snapshots on the trailer wire
+    AuthKey key;
+    std::vector<struct_message> signedFrames;    // frames with their tags
+};
+
+static void buildCorpus(Corpus *c) {
+    uint8_t keyBytes[AUTH_KEY_BYTES];
+    for (int i = 0; i < AUTH_KEY_BYTES; i++) {
+        keyBytes[i] = (uint8_t)nextRandom();
+    }
+    initAuthKey(&c->key, keyBytes);
+    uint8_t counts[PRESS_COUNT_BYTES] = {0};
+    for (int i = 0; i < BENCH_CORPUS; i++) {
+        struct_message f;
+        memset(&f, 0, sizeof(f));
+        f.receiverIndex = 1 + nextRandom() % 4;
+        f.sequence = (uint16_t)i;
+        f.sessionId = 0x1234;
+        f.buttons = nextRandom() % 16 == 0 ? 1 << (nextRandom() % 4) : 0;
+        f.dpad = nextRandom() % 8 == 0 ? 1 << (nextRandom() % 4) : 0;
+        f.axisX = randomAxis();
+        f.axisY = randomAxis();
+        f.axisRX = randomAxis();
+        f.axisRY = randomAxis();
+        f.r1 = nextRandom() % 4 == 0;
+        f.l1 = nextRandom() % 4 == 0;
+        f.r2 = nextRandom() % 4 == 0;
+        f.l2 = nextRandom() % 4 == 0;
+        int pressed = nextRandom() % EDGE_INPUT_COUNT;
+        if (nextRandom() % 8 == 0) {
+            setPressCount(counts, pressed, pressCount(counts, pressed) + 1);
+        }
+        memcpy(f.pressCounts, counts, sizeof(counts));
+        c->frames.push_back(f);
+        signMessage(&c->key, (uint8_t *)&f, sizeof(f));
+        c->signedFrames.push_back(f);
+
+        // One in eight messages is an announce, one in sixteen from another base
+        std::vector<uint8_t> bytes((const uint8_t *)&f, (const uint8_t *)&f + sizeof(f));
+        if (i % 8 == 7) {
+            ChannelAnnounce a;
+            memset(&a, 0, sizeof(a));
+            a.receiverIndex = RECEIVER_CHANNEL_ANNOUNCE;
+            a.sequence = (uint16_t)i;
+            a.sessionId = 0x1234;
+            a.channel = a.nextChannel = 6;
+            bytes.assign((const uint8_t *)&a, (const uint8_t *)&a + sizeof(a));
+        } else if (i % 16 == 3) {
+            uint16_t foreign = 0x4321;
+            memcpy(&bytes[SESSION_ID_OFFSET], &foreign, sizeof(foreign));
+        }
+        c->messages.push_back(bytes);
+
+        c->rawAxes.push_back((int32_t)(nextRandom() % 61) - 30 + (i % 32 == 0 ? randomAxis() : 0));
+
+        char line[24];
+        if (i % 4 == 0) {
+            TrailerState s;
+            unpackTrailerState((uint16_t)(nextRandom() & 0x1FF), &s);
+            formatTrailerSnapshot(&s, nextRandom() % 2000, line, sizeof(line));
+        } else {
+            snprintf(line, sizeof(line), "%u", nextRandom() % 14);
+        }
+        c->trailerLines.push_back(line);
+    }
+}
+
+// --------------------------------------------
+// Kernels, each returns the number of operations it did
+// --------------------------------------------
+
+// Reference work the kernels are divided by: field loads, multiplies, a
+// clamp and a data dependent branch per frame, the mix the kernels are made of
+static uint32_t benchCalibration(const Corpus &c) {
+    uint32_t hash = 2166136261u;
+    int32_t total = 0;
+    for (size_t i = 0; i < c.frames.size(); i++) {
+        const struct_message &f = c.frames[i];
+        hash = (hash ^ (uint32_t)f.axisX) * 16777619u;
+        hash = (hash ^ (uint32_t)f.axisY) * 16777619u;
+        int32_t mixed = f.axisRX * 3 / 4 + f.axisRY / 2;
+        total += mixed > 255 ? 255 : mixed < -255 ? -255 : mixed;
+        if (f.buttons & 1) {
+            total -= (int32_t)(hash >> 24);
+        }
+    }
+    sink = hash + (uint32_t)total;
+    return (uint32_t)c.frames.size();
+}
+
+// The drive limit as it is with a good link
+static RangeGovernor fullGovernor() {
+    RangeGovernor g;
+    initGovernor(&g, 0);
+    g.limit = GOVERNOR_FULL;
+    return g;
+}
+
+// Vehicle receive path: session check, sequence counting, copy and address check
+static uint32_t benchFrameDecode(const Corpus &c) {
+    VehicleLink link;
+    initVehicleLink(&link, 6, 0x1234, 0);
+    uint32_t mine = 0;
+    for (size_t i = 0; i < c.messages.size(); i++) {
+        const std::vector<uint8_t> &m = c.messages[i];
+        if (!receiveBaseMessage(&link, m.data(), (int)m.size(), (unsigned long)i)) {
+            continue;
+        }
+        struct_message frame;
+        memcpy(&frame, m.data(), sizeof(frame));
+        mine += frame.receiverIndex == 2;
+    }
+    sink = mine;
+    return (uint32_t)c.messages.size();
+}
+
+static uint32_t benchPressTracking(const Corpus &c) {
+    PressTracker tracker;
+    memset(&tracker, 0, sizeof(tracker));
+    uint8_t presses[EDGE_INPUT_COUNT];
+    uint32_t total = 0;
+    for (size_t i = 0; i < c.frames.size(); i++) {
+        takePresses(&tracker, c.frames[i].pressEpoch, c.frames[i].pressCounts, presses);
+        total += presses[i % EDGE_INPUT_COUNT];
+    }
+    sink = total;
+    return (uint32_t)c.frames.size();
+}
+
+// Base input stage: four sticks and two triggers per sample
+static uint32_t benchStickFilter(const Corpus &c) {
+    AxisFilter filters[6];
+    for (int a = 0; a < 6; a++) {
+        resetAxisFilter(&filters[a]);
+    }
+    int32_t total = 0;
+    for (size_t i = 0; i < c.rawAxes.size(); i++) {
+        for (int a = 0; a < 4; a++) {
+            total += filterAxis(&filters[a], c.rawAxes[(i + a) % c.rawAxes.size()], STICK_DEADBAND, STICK_RANGE);
+        }
+        for (int a = 4; a < 6; a++) {
+            total += filterAxis(&filters[a], c.rawAxes[i] + 512, TRIGGER_DEADBAND, 2 * STICK_RANGE);
+        }
+    }
+    sink = (uint32_t)total;
+    return (uint32_t)c.rawAxes.size();
+}
+
+static uint32_t benchMixer(const Corpus &c) {
+    int32_t total = 0;
+    for (size_t i = 0; i < c.frames.size(); i++) {
+        const struct_message &f = c.frames[i];
+        DriveCommand d = mixDrive((DriveMode)(i % 4), f.axisY, f.axisRX, 120);
+        total += d.left - d.right;
+    }
+    sink = (uint32_t)total;
+    return (uint32_t)c.frames.size();
+}
+
+// dump.cpp: presses, Ackermann drive, steering angle and trim
+static uint32_t benchDumpFrame(const Corpus &c) {
+    PressTracker tracker;
+    memset(&tracker, 0, sizeof(tracker));
+    uint8_t presses[EDGE_INPUT_COUNT];
+    RangeGovernor governor = fullGovernor();
+    TrimStepper trimStepper;
+    memset(&trimStepper, 0, sizeof(trimStepper));
+    int32_t total = 0;
+    int trim = 0;
+    for (size_t i = 0; i < c.frames.size(); i++) {
+        const struct_message &f = c.frames[i];
+        takePresses(&tracker, f.pressEpoch, f.pressCounts, presses);
+        DriveCommand d = mixDrive(DRIVE_ACKERMANN, f.axisY, f.axisRX, DUMP_STEER_ASSIST);
+        int left = motorCommand(governed(&governor, d.left), MOTOR_DEADBAND);
+        int right = motorCommand(governed(&governor, d.right), MOTOR_DEADBAND);
+        trim = stepTrim(&trimStepper, trim, (int)f.r1 - (int)f.l1, 2, (unsigned long)i * 10);
+        total += left + right + steeringAngle(f.axisRX, DUMP_STEERING_DIVISOR) - trim + presses[EDGE_THUMB_R];
+    }
+    sink = (uint32_t)total;
+    return (uint32_t)c.frames.size();
+}
+
+// fork.cpp: as the dump truck plus pivot modes, the mast and the mast tilt
+static uint32_t benchForkFrame(const Corpus &c) {
+    PressTracker tracker;
+    memset(&tracker, 0, sizeof(tracker));
+    uint8_t presses[EDGE_INPUT_COUNT];
+    RangeGovernor governor = fullGovernor();
+    int tiltFrames = 0;
+    int tilt = 90;
+    int32_t total = 0;
+    for (size_t i = 0; i < c.frames.size(); i++) {
+        const struct_message &f = c.frames[i];
+        takePresses(&tracker, f.pressEpoch, f.pressCounts, presses);
+        int steering = steeringAngle(f.axisRX, FORK_STEERING_DIVISOR);
+        DriveMode mode = f.r2 ? DRIVE_PIVOT_RIGHT : f.l2 ? DRIVE_PIVOT_LEFT : DRIVE_ACKERMANN;
+        DriveCommand d = mixDrive(mode, f.axisY, f.axisRX, FORK_STEER_ASSIST);
+        int left = motorCommand(governed(&governor, d.left), FORK_MOTOR_DEADBAND);
+        int right = motorCommand(governed(&governor, d.right), FORK_MOTOR_DEADBAND);
+        int mast = motorCommand(mastCommand(f.axisRY), FORK_MOTOR_DEADBAND);
+        tilt = stepHeldServo(&tiltFrames, tilt, f.dpad == 1 ? 1 : f.dpad == 2 ? -1 : 0, 1, 4);
+        total += steering + left + right + mast + tilt + presses[EDGE_THUMB_R];
+    }
+    sink = (uint32_t)total;
+    return (uint32_t)c.frames.size();
+}
+
+// excavator.cpp: four proportional hydraulics and two tracks into the soft PWM
+static uint32_t benchExcavatorFrame(const Corpus &c) {
+    PressTracker tracker;
+    memset(&tracker, 0, sizeof(tracker));
+    uint8_t presses[EDGE_INPUT_COUNT];
+    RangeGovernor governor = fullGovernor();
+    SoftPwm pwm;
+    initSoftPwm(&pwm);
+    for (size_t i = 0; i < c.frames.size(); i++) {
+        const struct_message &f = c.frames[i];
+        takePresses(&tracker, f.pressEpoch, f.pressCounts, presses);
+        setSoftPwmMotor(&pwm, 0, 1, stickToDuty(f.axisY, HYDRAULIC_DEADZONE, HYDRAULIC_STICK_RANGE));
+        setSoftPwmMotor(&pwm, 2, 3, stickToDuty(f.axisX, PIVOT_DEADZONE, HYDRAULIC_STICK_RANGE));
+        setSoftPwmMotor(&pwm, 4, 5, stickToDuty(f.axisRY, HYDRAULIC_DEADZONE, HYDRAULIC_STICK_RANGE));
+        setSoftPwmMotor(&pwm, 6, 7, stickToDuty(f.axisRX, HYDRAULIC_DEADZONE, HYDRAULIC_STICK_RANGE));
+        setSoftPwmMotor(&pwm, 8, 9, governed(&governor, buttonDuty(f.r1, f.r2)));
+        setSoftPwmMotor(&pwm, 10, 11, governed(&governor, buttonDuty(f.l1, f.l2)));
+        setSoftPwmMotor(&pwm, 12, 13, buttonDuty(f.dpad == 1, f.dpad == 2));
+        setSoftPwmMotor(&pwm, 14, 15, buttonDuty(f.dpad == 4, f.dpad == 8));
+    }
+    sink = pwm.duty[0] + pwm.duty[5] + presses[0];
+    return (uint32_t)c.frames.size();
+}
+
+// Held-button servo stepping: the fork's mast tilt every fourth frame and
+// the five degree steps of moveServo() on the dump truck and semi
+static uint32_t benchServoStep(const Corpus &c) {
+    int tiltFrames = 0;
+    int tilt = 90;
+    int servo = 90;
+    uint32_t total = 0;
+    for (size_t i = 0; i < c.frames.size(); i++) {
+        const struct_message &f = c.frames[i];
+        int movement = f.dpad == 1 ? 1 : f.dpad == 2 ? -1 : 0;
+        tilt = stepHeldServo(&tiltFrames, tilt, movement, 1, 4);
+        servo = stepServo(servo, f.buttons & 1 ? 1 : f.buttons & 8 ? -1 : 0, 5);
+        total += tilt + servo;
+    }
+    sink = total;
+    return (uint32_t)c.frames.size();
+}
+
+// One soft PWM slot: all 16 channel levels for the expander write
+static uint32_t benchSoftPwmTick(const Corpus &c) {
+    SoftPwm pwm;
+    initSoftPwm(&pwm);
+    for (int ch = 0; ch < SOFTPWM_CHANNELS; ch++) {
+        pwm.duty[ch] = (uint8_t)(c.frames[ch].axisY & 0x0F);
+    }
+    uint32_t total = 0;
+    for (size_t i = 0; i < c.frames.size(); i++) {
+        total += nextSoftPwmLevels(&pwm);
+    }
+    sink = total;
+    return (uint32_t)c.frames.size();
+}
+
+// semi.cpp: presses, throttle, steering, light engine and the trailer state relayed onwards
+static uint32_t benchSemiFrame(const Corpus &c) {
+    PressTracker tracker;
+    memset(&tracker, 0, sizeof(tracker));
+    uint8_t presses[EDGE_INPUT_COUNT];
+    RangeGovernor governor = fullGovernor();
+    LightEngine lights;
+    initLightEngine(&lights);
+    TrailerState desired;
+    initTrailerState(&desired);
+    uint32_t total = 0;
+    for (size_t i = 0; i < c.frames.size(); i++) {
+        const struct_message &f = c.frames[i];
+        unsigned long now = (unsigned long)i * 10;
+        takePresses(&tracker, f.pressEpoch, f.pressCounts, presses);
+        int throttle = semiThrottle(f.axisY, &governor, f.buttons & 1);
+        total += motorCommand(throttle, MOTOR_DEADBAND) + motorCommand(throttle / 3, MOTOR_DEADBAND);
+        total += steeringAngle(f.axisRX, SEMI_STEERING_DIVISOR);
+        for (uint8_t p = 0; p < presses[EDGE_THUMB_R]; p++) {
+            setLightPattern(&lights, (LightPattern)((lights.pattern + 1) % (LIGHTS_HAZARD + 1)), now);
+        }
+        setTurnDirection(&lights, f.axisRX > 256 ? 1 : f.axisRX < -256 ? -1 : 0, now);
+        desired.lights = updateLights(&lights, now);
+        setTrailerAuxFromTriggers(&desired, f.r1, f.r2, f.l1, f.l2);
+        total += packTrailerState(&desired);
+    }
+    sink = total;
+    return (uint32_t)c.frames.size();
+}
+
+static uint32_t benchTrailerParse(const Corpus &c) {
+    TrailerState s;
+    initTrailerState(&s);
+    long age;
+    uint32_t total = 0;
+    for (size_t i = 0; i < c.trailerLines.size(); i++) {
+        total += parseTrailerLine(c.trailerLines[i].c_str(), &s, &age);
+    }
+    sink = total + packTrailerState(&s);
+    return (uint32_t)c.trailerLines.size();
+}
+
+// Base send path: one tag per frame
+static uint32_t benchAuthSign(const Corpus &c) {
+    uint32_t total = 0;
+    for (size_t i = 0; i < c.frames.size(); i++) {
+        struct_message frame = c.frames[i];
+        signMessage(&c.key, (uint8_t *)&frame, sizeof(frame));
+        total += frame.authTag;
+    }
+    sink = total;
+    return (uint32_t)c.frames.size();
+}
+
+// Vehicle side once the index matches: tag and replay counter
+static uint32_t benchAuthVerify(const Corpus &c) {
+    VehicleLink link;
+    initVehicleLink(&link, 6, 0x1234, 0);
+    link.authKey = &c.key;
+    link.messageSession = 0x1234;
+    uint32_t accepted = 0;
+    for (size_t i = 0; i < c.signedFrames.size(); i++) {
+        const struct_message &frame = c.signedFrames[i];
+        accepted += authenticBaseMessage(&link, (const uint8_t *)&frame, sizeof(frame), frame.authEpoch,
+                                         frame.sequence);
+    }
+    sink = accepted;
+    return (uint32_t)c.signedFrames.size();
+}
+
+// --------------------------------------------
+// Runner
+// --------------------------------------------
+
+struct Kernel {
+    const char *name;
+    uint32_t (*run)(const Corpus &c);
+};
+
+static const Kernel calibrationKernel = {"calibration", benchCalibration};
+
+static const Kernel kernels[] = {
+    {"frame_decode", benchFrameDecode},
+    {"press_tracking", benchPressTracking},
+    {"stick_filter", benchStickFilter},
+    {"mixer", benchMixer},
+    {"dump_frame", benchDumpFrame},
+    {"fork_frame", benchForkFrame},
+    {"excavator_frame", benchExcavatorFrame},
+    {"servo_step", benchServoStep},
+    {"softpwm_tick", benchSoftPwmTick},
+    {"semi_frame", benchSemiFrame},
+    {"trailer_parse", benchTrailerParse},
+    {"auth_sign", benchAuthSign},
+    {"auth_verify", benchAuthVerify},
+};
+
+struct Result {
+    double nsPerOp;
+    double relative; // nsPerOp over the calibration loop's
+    double allocsPerOp;
+};
+
+// One round of a kernel: runs it for at least BENCH_MIN_ROUND_NS
+static void measureRound(const Kernel &kernel, const Corpus &c, Result *best) {
+    typedef std::chrono::steady_clock Clock;
+    uint64_t ops = 0;
+    unsigned long long allocsBefore = allocations;
+    Clock::time_point start = Clock::now();
+    uint64_t elapsedNs = 0;
+    do {
+        ops += kernel.run(c);
+        elapsedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    } while (elapsedNs < BENCH_MIN_ROUND_NS);
+    double ns = (double)elapsedNs / ops;
+    if (ns < best->nsPerOp) {
+        best->nsPerOp = ns;
+    }
+    best->allocsPerOp = (double)(allocations - allocsBefore) / ops;
+}
+
+// Rounds go through every kernel in turn, so a busy spell on the host slows
+// one round of each rather than every round of one kernel
+static std::vector<Result> measureAll(const Kernel *list, size_t count, const Corpus &c) {
+    Result initial = {1e30, 0, 0};
+    std::vector<Result> results(count, initial);
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t k = 0; k < count; k++) {
+            measureRound(list[k], c, &results[k]);
+        }
+    }
+    return results;
+}
+
+typedef std::map<std::string, Result> Baseline;
+
+// Lines of "<kernel> <relative> <ns/op> <allocs/op>", # starts a comment.
+// Only the relative cost is compared, ns/op is there for reading.
+static bool readBaseline(const char *path, Baseline *baseline) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string name;
+        Result r = {0, 0, 0};
+        if (fields >> name >> r.relative >> r.nsPerOp >> r.allocsPerOp) {
+            (*baseline)[name] = r;
+        }
+    }
+    return true;
+}
+
+static bool writeBaseline(const char *path, const Result &calibration, const std::vector<Result> &results) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "# Control kernel baseline, see src/bench/main.cpp. Kernels are compared by their\n"
+                  "# cost relative to the calibration loop (%.2f ns/op when this was written).\n"
+                  "# kernel relative ns/op allocs/op\n",
+            calibration.nsPerOp);
+    for (size_t k = 0; k < results.size(); k++) {
+        fprintf(file, "%s %.3f %.2f %.2f\n", kernels[k].name, results[k].relative, results[k].nsPerOp,
+                results[k].allocsPerOp);
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <baseline file> [update] [tolerance=<percent>]\n", argv[0]);
+        return 2;
+    }
+    const char *baselinePath = argv[1];
+    bool update = false;
+    double tolerance = BENCH_DEFAULT_TOLERANCE_PERCENT;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "update") == 0) {
+            update = true;
+        } else if (strncmp(argv[i], "tolerance=", 10) == 0) {
+            tolerance = atof(argv[i] + 10);
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    Corpus corpus;
+    buildCorpus(&corpus);
+    Baseline baseline;
+    bool haveBaseline = readBaseline(baselinePath, &baseline);
+    if (!haveBaseline && !update) {
+        fprintf(stderr, "No baseline at %s, run with update to create one\n", baselinePath);
+    }
+
+    // The calibration loop goes first, then the kernels in table order
+    std::vector<Kernel> list(1, calibrationKernel);
+    list.insert(list.end(), kernels, kernels + sizeof(kernels) / sizeof(kernels[0]));
+    std::vector<Result> measured = measureAll(&list[0], list.size(), corpus);
+    Result calibration = measured[0];
+    printf("Calibration loop: %.2f ns/op\n\n", calibration.nsPerOp);
+    printf("%-16s %10s %9s %9s %10s %8s\n", "Kernel", "ns/op", "relative", "baseline", "change", "allocs");
+    std::vector<Result> results;
+    int regressions = 0;
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        Result r = measured[k + 1];
+        r.relative = r.nsPerOp / calibration.nsPerOp;
+        results.push_back(r);
+        Baseline::const_iterator it = baseline.find(kernels[k].name);
+        if (it == baseline.end()) {
+            printf("%-16s %10.2f %9.3f %9s %10s %8.2f\n", kernels[k].name, r.nsPerOp, r.relative, "-", "-",
+                   r.allocsPerOp);
+            continue;
+        }
+        double change = 100.0 * (r.relative - it->second.relative) / it->second.relative;
+        bool slower = change > tolerance;
+        bool allocates = r.allocsPerOp > it->second.allocsPerOp;
+        printf("%-16s %10.2f %9.3f %9.3f %+9.1f%% %8.2f%s\n", kernels[k].name, r.nsPerOp, r.relative,
+               it->second.relative, change, r.allocsPerOp, slower ? "  SLOWER" : allocates ? "  ALLOCATES" : "");
+        regressions += slower || allocates;
+    }
+
+    if (update) {
+        if (!writeBaseline(baselinePath, calibration, results)) {
+            fprintf(stderr, "Cannot write %s\n", baselinePath);
+            return 2;
+        }
+        printf("\nBaseline written to %s\n", baselinePath);
+        return 0;
+    }
+    if (regressions) {
+        printf("\n%d kernel(s) regressed past the baseline (tolerance %.0f%%)\n", regressions, tolerance);
+        return 1;
+    }
+    printf("\nNo regressions (tolerance %.0f%%)\n", tolerance);
+    return 0;
+}
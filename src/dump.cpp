@@ -2,24 +2,21 @@
 #include <ESP32Servo.h>  // by Kevin Harrington
 #include <esp_now.h>
 #include <WiFi.h>
+#include "tasks.h"
+#include "vehiclelink.h"
+#include "persist.h"
+#include "power.h"
+#include "mixer.h"
+#include "vehicleframe.h"
 uint32_t thisReceiverIndex = 3;
-// Structure to receive message
-typedef struct struct_message {
-    uint32_t receiverIndex;
-    uint16_t buttons;
-    uint8_t dpad;
-    int32_t axisX, axisY;
-    int32_t axisRX, axisRY;
-    uint32_t brake, throttle;
-    uint16_t miscButtons;
-    bool thumbR, thumbL, r1, l1, r2, l2;
-} struct_message;
-bool dataUpdated;
 bool initialConnectionMade = false; // Flag to track if initial connection has been established
-bool connectionActive = false; // Tracks if connection is currently active
-unsigned long lastPacketTime = 0; // Timestamp of last received packet
+volatile bool connectionActive = false; // Tracks if connection is currently active
+volatile unsigned long lastPacketTime = 0; // Timestamp of last received packet
 const unsigned long CONNECTION_TIMEOUT = 3000; // 3 seconds timeout for connection
-struct_message receivedData;
+struct_message receivedData; // Frame currently being processed by the control task
+QueueHandle_t frameMailbox; // Holds only the latest frame for the control task
+TaskHandle_t controlTaskHandle;
+TaskHandle_t housekeepingTaskHandle;
 // ControllerPtr myControllers[BP32_MAX_GAMEPADS];
 
 #define steeringServoPin 23
@@ -44,30 +41,53 @@ struct_message receivedData;
 
 // Forward function declarations
 void flashConnectionIndicator();
+void emergencyStop();
 
 Servo steeringServo;
 Servo auxServo;
-int lightSwitchTime = 0;
 int adjustedSteeringValue = 86;
 int steeringTrim = 0;
+TrimStepper trimStepper; // Owned by the control task
+// Follows the base's press counters, see include/edges.h. Owned by the control task.
+PressTracker pressTracker;
+uint8_t presses[EDGE_INPUT_COUNT]; // Presses of each input since the previous frame
 int auxServoValue = 90;
+
+// Kept across power cycles, see include/persist.h
+struct PersistedState {
+  int16_t steeringTrim;
+};
 bool lightsOn = false;
 
 // Callback function for received data
 void OnDataRecv(const uint8_t * mac, const uint8_t *incomingData, int len) {
+    uint32_t heardUs = micros();
+    // Network messages are handled here, only control frames continue
+    if (!handleBaseMessage(incomingData, len)) {
+      // An emergency stop does not wait for the control task
+      if (takeEmergencyStop(thisReceiverIndex)) {
+        xQueueReset(frameMailbox);
+        emergencyStop();
+        confirmStop(thisReceiverIndex, heardUs);
+      }
+      takeMacroStart(thisReceiverIndex);
+      return;
+    }
     struct_message tempReceivedData;
     memcpy(&tempReceivedData, incomingData, sizeof(receivedData));
-    if (tempReceivedData.receiverIndex == thisReceiverIndex){
-      memcpy(&receivedData, &tempReceivedData, sizeof(receivedData));
-      dataUpdated = true;
+    if (tempReceivedData.receiverIndex == thisReceiverIndex) {
+      // Newer frames replace one the control task has not picked up yet
+      xQueueOverwrite(frameMailbox, &tempReceivedData);
       
       // Update connection timestamp
       lastPacketTime = millis();
+      noteFrameAccepted(&tempReceivedData);
       
       // Check if connection needs to be re-established
       if (!connectionActive) {
         connectionActive = true;
-        flashConnectionIndicator();
+        // The indicator blocks, so the housekeeping task plays it
+        xTaskNotifyGive(housekeepingTaskHandle);
       }
     }
     // Serial.print("Buttons: ");
@@ -83,34 +103,17 @@ void OnDataRecv(const uint8_t * mac, const uint8_t *incomingData, int len) {
 }
 
 void moveMotor(int motorPin0, int motorPin1, int velocity) {
-  if (velocity > 15) {
-    analogWrite(motorPin0, velocity);
-    analogWrite(motorPin1, LOW);
-  } else if (velocity < -15) {
-    analogWrite(motorPin0, LOW);
-    analogWrite(motorPin1, (-1 * velocity));
-  } else {
-    analogWrite(motorPin0, 0);
-    analogWrite(motorPin1, 0);
-  }
+  velocity = motorCommand(velocity, MOTOR_DEADBAND);
+  analogWrite(motorPin0, velocity > 0 ? velocity : 0);
+  analogWrite(motorPin1, velocity < 0 ? -velocity : 0);
 }
 
 void moveServo(int movement, Servo &servo, int &servoValue) {
-  switch (movement) {
-    case 1:
-      if (servoValue >= 10 && servoValue < 170) {
-        servoValue = servoValue + 5;
-        servo.write(servoValue);
-        delay(10);
-      }
-      break;
-    case -1:
-      if (servoValue <= 170 && servoValue > 10) {
-        servoValue = servoValue - 5;
-        servo.write(servoValue);
-        delay(10);
-      }
-      break;
+  int stepped = stepServo(servoValue, movement, 5);
+  if (stepped != servoValue) {
+    servoValue = stepped;
+    servo.write(servoValue);
+    delay(10);
   }
 }
 
@@ -125,34 +128,23 @@ void flashConnectionIndicator() {
     digitalWrite(auxAttach1, LOW);
     delay(200);
   }
+  // Restore the lights to whatever the driver had selected
+  digitalWrite(auxAttach0, lightsOn ? HIGH : LOW);
 }
 
-void processThrottle(int axisYValue) {
-  int adjustedThrottleValue = axisYValue / 2;
-  moveMotor(leftMotor0, leftMotor1, adjustedThrottleValue);
-  moveMotor(rightMotor0, rightMotor1, adjustedThrottleValue);
-}
-void processTrimRight(int trimValue)
-{
-  if(trimValue == 1 && trimValue < 20)
-  {
-  steeringTrim = steeringTrim + 2;
-  delay(50);
-  }
+void processDrive(int axisYValue, int axisRXValue) {
+  DriveCommand drive = mixDrive(DRIVE_ACKERMANN, axisYValue, axisRXValue, DUMP_STEER_ASSIST);
+  moveMotor(leftMotor0, leftMotor1, governThrottle(drive.left));
+  moveMotor(rightMotor0, rightMotor1, governThrottle(drive.right));
 }
-
-void processTrimLeft(int trimValue)
-{
-  if(trimValue == 1 && trimValue > -20)
-  {
-  steeringTrim = steeringTrim - 2;
-  delay(50);
-  }
+// R1 trims right and L1 left while held, see stepTrim()
+void processTrim(bool trimRight, bool trimLeft) {
+  steeringTrim = stepTrim(&trimStepper, steeringTrim, (int)trimRight - (int)trimLeft, 2, millis());
 }
 
 
 void processSteering(int axisRXValue) {
-  adjustedSteeringValue = (90 - (axisRXValue / 11))-steeringTrim;
+  adjustedSteeringValue = steeringAngle(axisRXValue, DUMP_STEERING_DIVISOR) - steeringTrim;
   steeringServo.write(adjustedSteeringValue);
 }
 
@@ -169,8 +161,9 @@ void processDumpBed(int dpadValue) {
     digitalWrite(auxAttach3, LOW);
   }
 }
-void processAux(bool buttonValue) {
-  if (buttonValue && (millis() - lightSwitchTime) > 200) {
+// Toggles once per press; an even count since the last frame cancels out
+void processAux(uint8_t pressCount) {
+  if (pressCount & 1) {
     if (lightsOn) {
       digitalWrite(auxAttach0, LOW);
       digitalWrite(auxAttach1, LOW);
@@ -180,31 +173,156 @@ void processAux(bool buttonValue) {
       digitalWrite(auxAttach1, LOW);
       lightsOn = true;
     }
-
-    lightSwitchTime = millis();
   }
 }
 
 void processGamepad() {
+  takePresses(&pressTracker, receivedData.pressEpoch, receivedData.pressCounts, presses);
   //Throttle
-  processThrottle(receivedData.axisY);
+  processDrive(receivedData.axisY, receivedData.axisRX);
   //Steering
   processSteering(receivedData.axisRX);
   //DumpBed
   processDumpBed(receivedData.dpad);
   //Aux
-  processAux(receivedData.thumbR);
+  processAux(presses[EDGE_THUMB_R]);
 
-  processTrimRight(receivedData.r1);
-  processTrimLeft(receivedData.l1);
+  processTrim(receivedData.r1, receivedData.l1);
 
 }
+// Motion macros, see include/macro.h
+enum DumpMacroChannel { BED_CHANNEL, DUMP_DRIVE_CHANNEL };
+
+// Raise the bed all the way, let the load slide, creep forward to clear it
+// and lower the bed again
+const uint8_t tipBed[] = {
+  MACRO_DRIVE(BED_CHANNEL, 100, 3000), MACRO_SETTLE, MACRO_WAIT(1500),
+  MACRO_DRIVE(DUMP_DRIVE_CHANNEL, 35, 700), MACRO_SETTLE,
+  MACRO_DRIVE(BED_CHANNEL, -100, 3000), MACRO_SETTLE, MACRO_END};
+// D-pad up with the macro button held on the base
+const MacroDef dumpMacros[] = {MACRO_DEF("tip bed", tipBed)};
+
+// The bed is on or off like on the d-pad; the drive goes straight ahead
+void applyMacro() {
+  int bed = macroPlayer.drive[BED_CHANNEL];
+  processDumpBed(bed > 0 ? 1 : bed < 0 ? 2 : 0);
+  int drive = governThrottle(macroPlayer.drive[DUMP_DRIVE_CHANNEL] * 255 / 100);
+  moveMotor(leftMotor0, leftMotor1, drive);
+  moveMotor(rightMotor0, rightMotor1, drive);
+}
+
 void processControllers() {
   processGamepad();
 }
 
+// Drive and dump bed off. Runs in the receive callback, so only pin writes.
+void emergencyStop() {
+  moveMotor(leftMotor0, leftMotor1, 0);
+  moveMotor(rightMotor0, rightMotor1, 0);
+  digitalWrite(auxAttach2, LOW);
+  digitalWrite(auxAttach3, LOW);
+}
+
+// High priority task pinned to CONTROL_TASK_CORE. Blocks until a frame arrives.
+void controlTask(void *parameter) {
+  subscribeWatchdog();
+  for (;;) {
+    bool framed = xQueueReceive(frameMailbox, &receivedData, controlWaitTicks()) == pdTRUE;
+    controlStage(DEADLINE_GOVERNOR);
+    bool limitMoved = serviceRangeGovernor();
+    if (framed && macroOwnsFrame(&receivedData)) {
+      // A frame without input while a macro runs only keeps the link alive
+      wakeForFrame();
+    } else if (framed) {
+      controlStage(DEADLINE_APPLY);
+      wakeForFrame();
+      processControllers();
+      // A stop that came in while the frame was applied wins
+      if (emergencyStopped) {
+        emergencyStop();
+      }
+      controlStage(DEADLINE_CONFIRM);
+      confirmRelease(&receivedData, thisReceiverIndex);
+    } else if (limitMoved && connectionActive && !emergencyStopped && !macroRunning()) {
+      // The link limit moved between frames, the drive follows it
+      controlStage(DEADLINE_APPLY);
+      processDrive(receivedData.axisY, receivedData.axisRX);
+    }
+    controlStage(DEADLINE_MACRO);
+    // The drive follows a moved link limit during a macro too
+    if (serviceMacro(connectionActive, NULL) || (limitMoved && macroRunning())) {
+      applyMacro();
+      if (emergencyStopped) {
+        emergencyStop();
+      }
+    }
+    // Check if connection has timed out
+    controlStage(DEADLINE_TIMEOUT);
+    if (connectionActive && (millis() - lastPacketTime > CONNECTION_TIMEOUT)) {
+      // Connection lost, reset the flag so lights will flash on reconnection
+      connectionActive = false;
+      endMacro(MACRO_ABORT_TIMEOUT);
+      // Stop motors for safety when connection is lost
+      moveMotor(leftMotor0, leftMotor1, 0);
+      moveMotor(rightMotor0, rightMotor1, 0);
+    }
+    controlStage(DEADLINE_POWER);
+    servicePower();
+    endControlIteration();
+  }
+}
+
+void savePersistedState() {
+  PersistedState state;
+  memset(&state, 0, sizeof(state));
+  state.steeringTrim = steeringTrim;
+  persistStateWhenSettled(&state, sizeof(state));
+}
+
+void restorePersistedState() {
+  PersistedState state;
+  memset(&state, 0, sizeof(state));
+  state.steeringTrim = steeringTrim;
+  if (loadPersistedState(&state, sizeof(state))) {
+    steeringTrim = clampTrim(state.steeringTrim);
+  }
+}
+
+// Low priority task for everything that may block: indicator and reports
+void housekeepingTask(void *parameter) {
+  for (;;) {
+    // Notified by OnDataRecv when a connection is (re)established
+    if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HOUSEKEEPING_PERIOD_MS)) > 0) {
+      flashConnectionIndicator();
+    }
+    if (controlStalled()) {
+      emergencyStop();
+    }
+    serviceVehicleLink(thisReceiverIndex, VEHICLE_DUMP_TRUCK);
+    savePersistedState();
+    reportPowerStats();
+    reportTaskStacksPeriodically();
+  }
+}
+
 // Arduino setup function. Runs in CPU 1
 void setup() {
+  Serial.begin(115200);
+  // Control loops subscribe as they start, see include/tasks.h
+  startTaskWatchdog();
+
+  // Radio first: it takes the longest to come up
+  WiFi.setSleep(false);
+  WiFi.mode(WIFI_STA);
+
+  if (esp_now_init() != ESP_OK) {
+      Serial.println("Error initializing ESP-NOW");
+      return;
+  }
+  startVehicleLink();
+  useMacros(dumpMacros, sizeof(dumpMacros) / sizeof(dumpMacros[0]));
+  restorePersistedState();
+
   pinMode(auxAttach2, OUTPUT);
   pinMode(auxAttach3, OUTPUT);
   pinMode(auxAttach0, OUTPUT);
@@ -222,37 +340,25 @@ void setup() {
   connectionActive = false;
   lastPacketTime = 0;
 
+  adjustedSteeringValue = adjustedSteeringValue - steeringTrim;
   steeringServo.attach(steeringServoPin);
   steeringServo.write(adjustedSteeringValue);
 
-  Serial.begin(115200);
-  WiFi.setSleep(false);
-  WiFi.mode(WIFI_STA);
+  frameMailbox = xQueueCreate(1, sizeof(struct_message));
+  housekeepingTaskHandle = startPinnedTask(housekeepingTask, "housekeeping", HOUSEKEEPING_TASK_STACK,
+                                           HOUSEKEEPING_TASK_PRIORITY, HOUSEKEEPING_TASK_CORE);
+  controlTaskHandle = startPinnedTask(controlTask, "control", CONTROL_TASK_STACK,
+                                      CONTROL_TASK_PRIORITY, CONTROL_TASK_CORE);
 
-  if (esp_now_init() != ESP_OK) {
-      Serial.println("Error initializing ESP-NOW");
-      return;
-  }
+  // Frames are only taken once everything they drive is set up
   esp_now_register_recv_cb(OnDataRecv);
-
+  // The control path runs without the heap from here on, see include/footprint.h
+  guardHeap(controlTaskHandle);
+  Serial.printf("Control ready at %lu ms\n", millis());
 }
 
 
+// Arduino loop task is not needed, all work happens in controlTask and housekeepingTask
 void loop() {
-  if (dataUpdated) {
-    // dumpGamepadState();
-    processControllers();
-    dataUpdated = false;
-  }
-  else { 
-    // Check if connection has timed out
-    if (connectionActive && (millis() - lastPacketTime > CONNECTION_TIMEOUT)) {
-      // Connection lost, reset the flag so lights will flash on reconnection
-      connectionActive = false;
-      // Stop motors for safety when connection is lost
-      moveMotor(leftMotor0, leftMotor1, 0);
-      moveMotor(rightMotor0, rightMotor1, 0);
-    }
-    vTaskDelay(1); 
-  }
+  vTaskDelete(NULL);
 }
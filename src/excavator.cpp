@@ -2,23 +2,21 @@
 #include "Adafruit_MCP23X17.h"
 #include <esp_now.h>
 #include <WiFi.h>
+#include "tasks.h"
+#include "vehiclelink.h"
+#include "persist.h"
+#include "power.h"
+#include "softpwm.h"
+#include "vehicleframe.h"
 uint32_t thisReceiverIndex = 1;
-// Structure to receive message
-typedef struct struct_message {
-    uint32_t receiverIndex;
-    uint16_t buttons;
-    uint8_t dpad;
-    int32_t axisX, axisY;
-    int32_t axisRX, axisRY;
-    uint32_t brake, throttle;
-    uint16_t miscButtons;
-    bool thumbR, thumbL, r1, l1, r2, l2;
-} struct_message;
-bool dataUpdated;
-bool connectionActive = false; // Tracks if connection is currently active
-unsigned long lastPacketTime = 0; // Timestamp of last received packet
+volatile bool connectionActive = false; // Tracks if connection is currently active
+volatile unsigned long lastPacketTime = 0; // Timestamp of last received packet
 const unsigned long CONNECTION_TIMEOUT = 3000; // 3 seconds timeout for connection
-struct_message receivedData;
+struct_message receivedData; // Frame currently being processed by the control task
+QueueHandle_t frameMailbox; // Holds only the latest frame for the control task
+QueueHandle_t logMailbox; // Latest processed frame, printed by the housekeeping task
+TaskHandle_t controlTaskHandle;
+TaskHandle_t housekeepingTaskHandle;
 // defines
 #define clawServoPin 5
 #define auxServoPin 18
@@ -47,147 +45,135 @@ struct_message receivedData;
 #define rightMotor0 4
 #define rightMotor1 5
 
+#define PWM_TIMER 0
+#define PWM_STATS_PERIOD_MS 10000
+
 // Forward declarations
 void flashConnectionIndicator();
+void emergencyStop();
 
 Adafruit_MCP23X17 mcp;
+// Every expander output is driven through the PWM engine, see include/softpwm.h
+SoftPwm expanderPwm;
+hw_timer_t *pwmTimer = nullptr;
+TaskHandle_t pwmTaskHandle;
+// Running totals kept by the PWM task, the housekeeping task reports differences
+struct PwmStats {
+  uint32_t ticks;
+  uint32_t missedTicks; // Timer ticks that came while the previous write was still going
+  uint32_t writes;
+  uint32_t writeUs;
+  uint32_t maxWriteUs;
+};
+PwmStats pwmStats;
 Servo clawServo;
 Servo auxServo;
 
 int dly = 250;
 int clawServoValue = 90;
 int auxServoValue = 90;
+
+// Kept across power cycles, see include/persist.h
+struct PersistedState {
+  int16_t clawServoValue;
+  int16_t auxServoValue;
+};
 int servoDelay = 0;
-int lightSwitchTime = 0;
 
 bool cabLightsOn = false;
 bool auxLightsOn = false;
+// Follows the base's press counters, see include/edges.h. Owned by the control task.
+PressTracker pressTracker;
+uint8_t presses[EDGE_INPUT_COUNT]; // Presses of each input since the previous frame
 bool moveClawServoUp = false;
 bool moveClawServoDown = false;
 bool moveAuxServoUp = false;
 bool moveAuxServoDown = false;
 
-void dumpGamepadState() {
+void dumpGamepadState(const struct_message *data) {
     Serial.printf(
         "idx=%d, dpad: 0x%02x, buttons: 0x%04x, axis L: %4d, %4d, axis R: %4d, %4d, brake: %4d, throttle: %4d "
         "misc: 0x%02x, misc Forward: %d, misc Backward: %d, misc Reset: %d, R1: %d, L1: %d, R2: %d, L2: %d, idx=%d\n",
-        receivedData.receiverIndex,        // Receiver Index
-        receivedData.dpad,         // D-pad
-        receivedData.buttons,      // bitmask of pressed buttons
-        receivedData.axisX,        // (-511 - 512) left X Axis
-        receivedData.axisY,        // (-511 - 512) left Y axis
-        receivedData.axisRX,       // (-511 - 512) right X axis
-        receivedData.axisRY,       // (-511 - 512) right Y axis
-        receivedData.brake,        // (0 - 1023): brake button
-        receivedData.throttle,     // (0 - 1023): throttle (AKA gas) button
-        receivedData.miscButtons,  // bitmask of pressed "misc" buttons
-        receivedData.miscButtons & 4,
-        receivedData.miscButtons & 2,
-        receivedData.miscButtons & 8,
-        receivedData.r1,
-        receivedData.l1,
-        receivedData.r2,
-        receivedData.l2,
-        receivedData.receiverIndex
+        data->receiverIndex,        // Receiver Index
+        data->dpad,         // D-pad
+        data->buttons,      // bitmask of pressed buttons
+        data->axisX,        // (-511 - 512) left X Axis
+        data->axisY,        // (-511 - 512) left Y axis
+        data->axisRX,       // (-511 - 512) right X axis
+        data->axisRY,       // (-511 - 512) right Y axis
+        data->brake,        // (0 - 1023): brake button
+        data->throttle,     // (0 - 1023): throttle (AKA gas) button
+        data->miscButtons,  // bitmask of pressed "misc" buttons
+        data->miscButtons & 4,
+        data->miscButtons & 2,
+        data->miscButtons & 8,
+        data->r1,
+        data->l1,
+        data->r2,
+        data->l2,
+        data->receiverIndex
     );
 }
 // Callback function for received data
 void OnDataRecv(const uint8_t * mac, const uint8_t *incomingData, int len) {
+    uint32_t heardUs = micros();
+    // Network messages are handled here, only control frames continue
+    if (!handleBaseMessage(incomingData, len)) {
+      // An emergency stop does not wait for the control task
+      if (takeEmergencyStop(thisReceiverIndex)) {
+        xQueueReset(frameMailbox);
+        emergencyStop();
+        confirmStop(thisReceiverIndex, heardUs);
+      }
+      takeMacroStart(thisReceiverIndex);
+      return;
+    }
     struct_message tempReceivedData;
-    memcpy(&tempReceivedData, incomingData, sizeof(receivedData));    if (tempReceivedData.receiverIndex == thisReceiverIndex){
-      memcpy(&receivedData, &tempReceivedData, sizeof(receivedData));
-      dataUpdated = true;
+    memcpy(&tempReceivedData, incomingData, sizeof(receivedData));
+    if (tempReceivedData.receiverIndex == thisReceiverIndex) {
+      // Newer frames replace one the control task has not picked up yet
+      xQueueOverwrite(frameMailbox, &tempReceivedData);
       
       // Update connection timestamp
       lastPacketTime = millis();
+      noteFrameAccepted(&tempReceivedData);
       
       // Check if connection needs to be re-established
       if (!connectionActive) {
         connectionActive = true;
-        flashConnectionIndicator();
+        // The indicator blocks, so the housekeeping task plays it
+        xTaskNotifyGive(housekeepingTaskHandle);
       }
     }
 }
 
 
 void processBoom(int axisYValue) {
-  int adjustedValue = axisYValue / 2;
-  if (adjustedValue > 100) {
-    mcp.digitalWrite(mainBoom0, HIGH);
-    mcp.digitalWrite(mainBoom1, LOW);
-  } else if (adjustedValue < -100) {
-    mcp.digitalWrite(mainBoom0, LOW);
-    mcp.digitalWrite(mainBoom1, HIGH);
-  } else {
-    mcp.digitalWrite(mainBoom0, LOW);
-    mcp.digitalWrite(mainBoom1, LOW);
-  }
+  setSoftPwmMotor(&expanderPwm, mainBoom0, mainBoom1,
+                  stickToDuty(axisYValue, HYDRAULIC_DEADZONE, HYDRAULIC_STICK_RANGE));
 }
-void processPivot(int axisYValue) {
-  int adjustedValue = axisYValue / 2;
-  // Create a deadzone in the center - only activate when stick is moved to edges
-  int deadzone = 75; // Deadzone threshold
-  
-  if (adjustedValue > (100 + deadzone)) {
-    mcp.digitalWrite(pivot0, HIGH);
-    mcp.digitalWrite(pivot1, LOW);
-  } else if (adjustedValue < (-100 - deadzone)) {
-    mcp.digitalWrite(pivot0, LOW);
-    mcp.digitalWrite(pivot1, HIGH);
-  } else {
-    mcp.digitalWrite(pivot0, LOW);
-    mcp.digitalWrite(pivot1, LOW);
-  }
+void processPivot(int axisXValue) {
+  setSoftPwmMotor(&expanderPwm, pivot0, pivot1, stickToDuty(axisXValue, PIVOT_DEADZONE, HYDRAULIC_STICK_RANGE));
 }
-void processDipper(int axisYValue) {
-  int adjustedValue = axisYValue / 2;
-  if (adjustedValue > 100) {
-    mcp.digitalWrite(dipper0, HIGH);
-    mcp.digitalWrite(dipper1, LOW);
-  } else if (adjustedValue < -100) {
-    mcp.digitalWrite(dipper0, LOW);
-    mcp.digitalWrite(dipper1, HIGH);
-  } else {
-    mcp.digitalWrite(dipper0, LOW);
-    mcp.digitalWrite(dipper1, LOW);
-  }
+void processDipper(int axisRYValue) {
+  setSoftPwmMotor(&expanderPwm, dipper0, dipper1,
+                  stickToDuty(axisRYValue, HYDRAULIC_DEADZONE, HYDRAULIC_STICK_RANGE));
 }
-void processBucket(int axisYValue) {
-  int adjustedValue = axisYValue / 2;
-  if (adjustedValue > 100) {
-    mcp.digitalWrite(tiltAttach0, HIGH);
-    mcp.digitalWrite(tiltAttach1, LOW);
-  } else if (adjustedValue < -100) {
-    mcp.digitalWrite(tiltAttach0, LOW);
-    mcp.digitalWrite(tiltAttach1, HIGH);
-  } else {
-    mcp.digitalWrite(tiltAttach0, LOW);
-    mcp.digitalWrite(tiltAttach1, LOW);
-  }
+void processBucket(int axisRXValue) {
+  setSoftPwmMotor(&expanderPwm, tiltAttach0, tiltAttach1,
+                  stickToDuty(axisRXValue, HYDRAULIC_DEADZONE, HYDRAULIC_STICK_RANGE));
+}
+// The tracks are the only drive the link limit applies to
+void processTracks() {
+  setSoftPwmMotor(&expanderPwm, rightMotor0, rightMotor1, governThrottle(buttonDuty(receivedData.r1, receivedData.r2)));
+  setSoftPwmMotor(&expanderPwm, leftMotor0, leftMotor1, governThrottle(buttonDuty(receivedData.l1, receivedData.l2)));
 }
 void processAux(int dpadValue) {
-  if (dpadValue == 1) {
-    mcp.digitalWrite(thumb0, HIGH);
-    mcp.digitalWrite(thumb1, LOW);
-  } else if (dpadValue == 2) {
-    mcp.digitalWrite(thumb0, LOW);
-    mcp.digitalWrite(thumb1, HIGH);
-  } else {
-    mcp.digitalWrite(thumb0, LOW);
-    mcp.digitalWrite(thumb1, LOW);
-  }
-  if (dpadValue == 4) {
-    mcp.digitalWrite(auxAttach0, HIGH);
-    mcp.digitalWrite(auxAttach1, LOW);
-  } else if (dpadValue == 8) {
-    mcp.digitalWrite(auxAttach0, LOW);
-    mcp.digitalWrite(auxAttach1, HIGH);
-  } else {
-    mcp.digitalWrite(auxAttach0, LOW);
-    mcp.digitalWrite(auxAttach1, LOW);
-  }
+  setSoftPwmMotor(&expanderPwm, thumb0, thumb1, buttonDuty(dpadValue == 1, dpadValue == 2));
+  setSoftPwmMotor(&expanderPwm, auxAttach0, auxAttach1, buttonDuty(dpadValue == 4, dpadValue == 8));
 }
 void processGamepad() {
+  takePresses(&pressTracker, receivedData.pressEpoch, receivedData.pressCounts, presses);
   //Boom
   processBoom(receivedData.axisY);
   //Pivot
@@ -198,50 +184,16 @@ void processGamepad() {
   processBucket(receivedData.axisRX);
   //Aux
   processAux(receivedData.dpad);
-  //Lights
-  if ((millis() - lightSwitchTime) > 200) {
-    if (receivedData.thumbR == 1) {
-      if (!cabLightsOn) {
-        digitalWrite(cabLights, HIGH);
-        cabLightsOn = true;
-      } else {
-        digitalWrite(cabLights, LOW);
-        cabLightsOn = false;
-      }
-      delay(80);
-    }
-    if (receivedData.thumbL == 1) {
-      if (!auxLightsOn) {
-        digitalWrite(auxLights, HIGH);
-        auxLightsOn = true;
-      } else {
-        digitalWrite(auxLights, LOW);
-        auxLightsOn = false;
-      }
-      delay(80);
-    }
-    lightSwitchTime = millis();
-  }
-  if (receivedData.r1 == 1) {
-    mcp.digitalWrite(rightMotor0, HIGH);
-    mcp.digitalWrite(rightMotor1, LOW);
-  } else if (receivedData.r2 == 1) {
-    mcp.digitalWrite(rightMotor0, LOW);
-    mcp.digitalWrite(rightMotor1, HIGH);
-  } else if (receivedData.r1 == 0 || receivedData.r2 == 0) {
-    mcp.digitalWrite(rightMotor0, LOW);
-    mcp.digitalWrite(rightMotor1, LOW);
+  //Lights, toggled once per press
+  if (presses[EDGE_THUMB_R] & 1) {
+    cabLightsOn = !cabLightsOn;
+    digitalWrite(cabLights, cabLightsOn ? HIGH : LOW);
   }
-  if (receivedData.l1 == 1) {
-    mcp.digitalWrite(leftMotor0, HIGH);
-    mcp.digitalWrite(leftMotor1, LOW);
-  } else if (receivedData.l2 == 1) {
-    mcp.digitalWrite(leftMotor0, LOW);
-    mcp.digitalWrite(leftMotor1, HIGH);
-  } else if (receivedData.l1 == 0 || receivedData.r2 == 0) {
-    mcp.digitalWrite(leftMotor0, LOW);
-    mcp.digitalWrite(leftMotor1, LOW);
+  if (presses[EDGE_THUMB_L] & 1) {
+    auxLightsOn = !auxLightsOn;
+    digitalWrite(auxLights, auxLightsOn ? HIGH : LOW);
   }
+  processTracks();
 
   if (receivedData.buttons & 1) {
     moveClawServoDown = true;
@@ -306,21 +258,285 @@ void processGamepad() {
 void processControllers() {
   processGamepad();
 }
-void setup() {
 
+// Motion macros, see include/macro.h. A channel's percentage has the sign
+// of the stick that moves the same output; flip one if your hydraulics are
+// plumbed the other way.
+enum ExcavatorMacroChannel {
+  BOOM_CHANNEL, DIPPER_CHANNEL, BUCKET_CHANNEL, PIVOT_CHANNEL,
+  LEFT_TRACK_CHANNEL, RIGHT_TRACK_CHANNEL, THUMB_CHANNEL, AUX_CHANNEL
+};
+enum ExcavatorMacroServo { CLAW_SERVO, AUX_SERVO };
+
+const uint8_t macroPins[MACRO_CHANNELS][2] = {
+  {mainBoom0, mainBoom1}, {dipper0, dipper1}, {tiltAttach0, tiltAttach1}, {pivot0, pivot1},
+  {leftMotor0, leftMotor1}, {rightMotor0, rightMotor1}, {thumb0, thumb1}, {auxAttach0, auxAttach1}};
+
+// One bucket: boom down with the dipper out, curl in while the dipper pulls
+// back, lift and swing, dump, swing back
+const uint8_t digAndDump[] = {
+  MACRO_DRIVE(BOOM_CHANNEL, 50, 900), MACRO_DRIVE(DIPPER_CHANNEL, -60, 900), MACRO_SETTLE,
+  MACRO_DRIVE(BUCKET_CHANNEL, 70, 700), MACRO_DRIVE(DIPPER_CHANNEL, 60, 1100), MACRO_SETTLE,
+  MACRO_DRIVE(BOOM_CHANNEL, -70, 1200), MACRO_WAIT(400), MACRO_DRIVE(PIVOT_CHANNEL, 80, 1500), MACRO_SETTLE,
+  MACRO_DRIVE(BUCKET_CHANNEL, -80, 800), MACRO_SETTLE,
+  MACRO_DRIVE(PIVOT_CHANNEL, -80, 1500), MACRO_WAIT(300), MACRO_DRIVE(BOOM_CHANNEL, 40, 900), MACRO_SETTLE,
+  MACRO_END};
+const uint8_t clawGrab[] = {MACRO_SERVO(CLAW_SERVO, 40, 60), MACRO_SETTLE, MACRO_END};
+const uint8_t clawRelease[] = {MACRO_SERVO(CLAW_SERVO, 150, 90), MACRO_SETTLE, MACRO_END};
+// D-pad up, down and right with the macro button held on the base
+const MacroDef excavatorMacros[] = {
+  MACRO_DEF("dig and dump", digAndDump), MACRO_DEF("claw grab", clawGrab), MACRO_DEF("claw release", clawRelease)};
+
+// Writes every macro channel and the servos the macro moved
+void applyMacro() {
+  for (int c = 0; c < MACRO_CHANNELS; c++) {
+    int duty = macroPlayer.drive[c] * SOFTPWM_STEPS / 100;
+    // The tracks are governed as when driven by hand
+    if (c == LEFT_TRACK_CHANNEL || c == RIGHT_TRACK_CHANNEL) {
+      duty = governThrottle(duty);
+    }
+    setSoftPwmMotor(&expanderPwm, macroPins[c][0], macroPins[c][1], duty);
+  }
+  if (macroPlayer.servosUsed & (1 << CLAW_SERVO)) {
+    clawServoValue = constrain(macroPlayer.servoAngle[CLAW_SERVO], 10, 170);
+    clawServo.write(clawServoValue);
+  }
+  if (macroPlayer.servosUsed & (1 << AUX_SERVO)) {
+    auxServoValue = constrain(macroPlayer.servoAngle[AUX_SERVO], 10, 174);
+    auxServo.write(auxServoValue);
+  }
+}
+
+// Every expander channel drives a motor or a valve, all of them off. Runs in
+// the receive callback: the duties are bytes, the PWM task puts them on the
+// pins at its next tick.
+void emergencyStop() {
+  for (int i = 0; i < SOFTPWM_CHANNELS; i++) {
+    expanderPwm.duty[i] = 0;
+  }
+}
+
+// High priority task pinned to CONTROL_TASK_CORE. Blocks until a frame arrives.
+void controlTask(void *parameter) {
+  subscribeWatchdog();
+  for (;;) {
+    bool framed = xQueueReceive(frameMailbox, &receivedData, controlWaitTicks()) == pdTRUE;
+    controlStage(DEADLINE_GOVERNOR);
+    bool limitMoved = serviceRangeGovernor();
+    if (framed && macroOwnsFrame(&receivedData)) {
+      // A frame without input while a macro runs only keeps the link alive
+      wakeForFrame();
+    } else if (framed) {
+      controlStage(DEADLINE_APPLY);
+      wakeForFrame();
+      processControllers();
+      // A stop that came in while the frame was applied wins
+      if (emergencyStopped) {
+        emergencyStop();
+      }
+      controlStage(DEADLINE_CONFIRM);
+      confirmRelease(&receivedData, thisReceiverIndex);
+      xQueueOverwrite(logMailbox, &receivedData);
+    } else if (limitMoved && connectionActive && !emergencyStopped && !macroRunning()) {
+      // The link limit moved between frames, the tracks follow it
+      controlStage(DEADLINE_APPLY);
+      processTracks();
+    }
+    controlStage(DEADLINE_MACRO);
+    const int16_t servoAngles[MACRO_SERVOS] = {(int16_t)clawServoValue, (int16_t)auxServoValue};
+    // The tracks follow a moved link limit during a macro too
+    if (serviceMacro(connectionActive, servoAngles) || (limitMoved && macroRunning())) {
+      applyMacro();
+      if (emergencyStopped) {
+        emergencyStop();
+      }
+    }
+    // Check if connection has timed out
+    controlStage(DEADLINE_TIMEOUT);
+    if (connectionActive && (millis() - lastPacketTime > CONNECTION_TIMEOUT)) {
+      // Connection lost, reset the flag so lights will flash on reconnection
+      connectionActive = false;
+      endMacro(MACRO_ABORT_TIMEOUT);
+      // Every hydraulic and both tracks off, whatever a frame or a macro left running
+      emergencyStop();
+    }
+    controlStage(DEADLINE_POWER);
+    servicePower();
+    endControlIteration();
+  }
+}
+
+void savePersistedState() {
+  PersistedState state;
+  memset(&state, 0, sizeof(state));
+  state.clawServoValue = clawServoValue;
+  state.auxServoValue = auxServoValue;
+  persistStateWhenSettled(&state, sizeof(state));
+}
+
+void restorePersistedState() {
+  PersistedState state;
+  memset(&state, 0, sizeof(state));
+  state.clawServoValue = clawServoValue;
+  state.auxServoValue = auxServoValue;
+  if (loadPersistedState(&state, sizeof(state))) {
+    clawServoValue = constrain(state.clawServoValue, 10, 170);
+    auxServoValue = constrain(state.auxServoValue, 10, 174);
+  }
+}
+
+// Sets all 16 expander outputs in one transfer
+void writeExpanderPorts(uint16_t levels) {
+  Wire.beginTransmission(MCP23XXX_ADDR);
+  Wire.write(0x12); // GPIOA, GPIOB follows
+  Wire.write(levels & 0xFF);
+  Wire.write(levels >> 8);
+  Wire.endTransmission();
+}
+
+// All 16 expander pins are motor outputs. Latch them low, then make them
+// outputs in one IODIRA/IODIRB write instead of 16 read-modify-write calls.
+void initExpanderOutputs() {
+  writeExpanderPorts(0);
+  Wire.beginTransmission(MCP23XXX_ADDR);
+  Wire.write(0x00); // IODIRA, IODIRB follows
+  Wire.write(0x00);
+  Wire.write(0x00);
+  Wire.endTransmission();
+}
+
+void IRAM_ATTR onPwmTick() {
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(pwmTaskHandle, &woken);
+  if (woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+// Woken by the timer once per PWM slot, writes the ports when an output changes.
+// An I2C write that hangs stops the feeds, the task watchdog then resets the
+// vehicle and setup() starts the expander with every output off.
+void pwmTask(void *parameter) {
+  uint16_t writtenLevels = 0;
+  subscribeWatchdog();
+  for (;;) {
+    uint32_t pending = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    pwmStats.ticks++;
+    pwmStats.missedTicks += pending - 1;
+    // Ten times a second is plenty, feeding takes a lock
+    if (pwmStats.ticks % (SOFTPWM_TICK_HZ / 10) == 0) {
+      feedWatchdog();
+    }
+    uint16_t levels = nextSoftPwmLevels(&expanderPwm);
+    if (levels == writtenLevels) {
+      continue;
+    }
+    unsigned long start = micros();
+    writeExpanderPorts(levels);
+    uint32_t us = micros() - start;
+    writtenLevels = levels;
+    pwmStats.writes++;
+    pwmStats.writeUs += us;
+    if (us > pwmStats.maxWriteUs) {
+      pwmStats.maxWriteUs = us;
+    }
+  }
+}
+
+// Times a few port writes and warns when the configured PWM would not fit the bus budget
+void checkPwmBusBudget() {
+  const int samples = 32;
+  unsigned long start = micros();
+  for (int i = 0; i < samples; i++) {
+    writeExpanderPorts(0);
+  }
+  uint32_t writeUs = (micros() - start) / samples;
+  uint32_t busPercent = (uint32_t)SOFTPWM_TICK_HZ * writeUs / 10000;
+  Serial.printf("Expander write %u us, PWM %d Hz x %d steps uses up to %u%% of the bus\n", writeUs,
+                SOFTPWM_FREQUENCY_HZ, SOFTPWM_STEPS, busPercent);
+  if (busPercent > SOFTPWM_BUS_BUDGET_PERCENT) {
+    Serial.println("PWM over the bus budget, lower SOFTPWM_FREQUENCY_HZ or SOFTPWM_STEPS");
+  }
+}
+
+void startSoftPwm() {
+  initSoftPwm(&expanderPwm);
+  pwmTaskHandle = startPinnedTask(pwmTask, "pwm", SOFTPWM_TASK_STACK, SOFTPWM_TASK_PRIORITY, SOFTPWM_TASK_CORE);
+  pwmTimer = timerBegin(PWM_TIMER, 80, true); // 1 MHz
+  timerAttachInterrupt(pwmTimer, &onPwmTick, true);
+  timerAlarmWrite(pwmTimer, 1000000 / SOFTPWM_TICK_HZ, true);
+  timerAlarmEnable(pwmTimer);
+}
+
+// Prints what the PWM engine did since the previous report
+void reportPwmStats() {
+  static unsigned long lastReportTime = 0;
+  static PwmStats last;
+  if (millis() - lastReportTime < PWM_STATS_PERIOD_MS) {
+    return;
+  }
+  unsigned long elapsedMs = millis() - lastReportTime;
+  lastReportTime = millis();
+  PwmStats now = pwmStats;
+  uint32_t writes = now.writes - last.writes;
+  uint32_t writeUs = now.writeUs - last.writeUs;
+  Serial.printf("PWM: %lu ticks/s, %lu writes/s, write %u us avg %u us max, bus %lu%%, missed %u\n",
+                (unsigned long)(now.ticks - last.ticks) * 1000 / elapsedMs, (unsigned long)writes * 1000 / elapsedMs,
+                writes ? writeUs / writes : 0, now.maxWriteUs, (unsigned long)writeUs / (elapsedMs * 10),
+                now.missedTicks - last.missedTicks);
+  last = now;
+  pwmStats.maxWriteUs = 0;
+}
+
+// Low priority task for everything that may block: indicator, logging and reports
+void housekeepingTask(void *parameter) {
+  struct_message loggedData;
+  for (;;) {
+    // Notified by OnDataRecv when a connection is (re)established
+    if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HOUSEKEEPING_PERIOD_MS)) > 0) {
+      flashConnectionIndicator();
+    }
+    if (controlStalled()) {
+      emergencyStop();
+    }
+    // Frames processed while we were printing are skipped rather than queued
+    if (xQueueReceive(logMailbox, &loggedData, 0) == pdTRUE) {
+      dumpGamepadState(&loggedData);
+    }
+    serviceVehicleLink(thisReceiverIndex, VEHICLE_EXCAVATOR);
+    savePersistedState();
+    reportPowerStats();
+    reportPwmStats();
+    reportTaskStacksPeriodically();
+  }
+}
+
+void setup() {
   Serial.begin(115200);
+  // Control loops subscribe as they start, see include/tasks.h
+  startTaskWatchdog();
+
+  // Radio first: it takes the longest to come up
+  WiFi.setSleep(false);
+  WiFi.mode(WIFI_STA);
+
+  if (esp_now_init() != ESP_OK) {
+      Serial.println("Error initializing ESP-NOW");
+      return;
+  }
+  startVehicleLink();
+  useMacros(excavatorMacros, sizeof(excavatorMacros) / sizeof(excavatorMacros[0]));
+  restorePersistedState();
 
   // Initialize connection variables
   connectionActive = false;
   lastPacketTime = 0;
 
-  mcp.begin_I2C();
-  //   put your setup code here, to run once:
-
-
-  for (int i = 0; i <= 15; i++) {
-    mcp.pinMode(i, OUTPUT);
-  }
+  mcp.begin_I2C(MCP23XXX_ADDR);
+  Wire.setClock(SOFTPWM_I2C_HZ);
+  initExpanderOutputs();
+  checkPwmBusBudget();
+  startSoftPwm();
 
   pinMode(clawServoPin, OUTPUT);
   pinMode(auxServoPin, OUTPUT);
@@ -332,49 +548,27 @@ void setup() {
   auxServo.attach(auxServoPin);
   clawServo.write(clawServoValue);
   auxServo.write(auxServoValue);
-  Serial.begin(115200);
 
-  WiFi.setSleep(false);
-  WiFi.mode(WIFI_STA);
+  frameMailbox = xQueueCreate(1, sizeof(struct_message));
+  logMailbox = xQueueCreate(1, sizeof(struct_message));
+  housekeepingTaskHandle = startPinnedTask(housekeepingTask, "housekeeping", HOUSEKEEPING_TASK_STACK,
+                                           HOUSEKEEPING_TASK_PRIORITY, HOUSEKEEPING_TASK_CORE);
+  controlTaskHandle = startPinnedTask(controlTask, "control", CONTROL_TASK_STACK,
+                                      CONTROL_TASK_PRIORITY, CONTROL_TASK_CORE);
 
-  if (esp_now_init() != ESP_OK) {
-      Serial.println("Error initializing ESP-NOW");
-      return;
-  }
+  // Frames are only taken once everything they drive is set up
   esp_now_register_recv_cb(OnDataRecv);
+  // The control path runs without the heap from here on, see include/footprint.h
+  guardHeap(controlTaskHandle);
+  guardHeap(pwmTaskHandle);
+  Serial.printf("Control ready at %lu ms\n", millis());
 }
 
 
 
+// Arduino loop task is not needed, all work happens in controlTask and housekeepingTask
 void loop() {
-
-  if (dataUpdated) {
-
-    if (receivedData.receiverIndex == thisReceiverIndex) {
-      dumpGamepadState();
-      processControllers();
-      dataUpdated = false;
-    }
-  }
-  else { 
-    // Check if connection has timed out
-    if (connectionActive && (millis() - lastPacketTime > CONNECTION_TIMEOUT)) {
-      // Connection lost, reset the flag so lights will flash on reconnection
-      connectionActive = false;
-      // Stop all motors for safety when connection is lost
-      mcp.digitalWrite(mainBoom0, LOW);
-      mcp.digitalWrite(mainBoom1, LOW);
-      mcp.digitalWrite(dipper0, LOW);
-      mcp.digitalWrite(dipper1, LOW);
-      mcp.digitalWrite(pivot0, LOW);
-      mcp.digitalWrite(pivot1, LOW);
-      mcp.digitalWrite(leftMotor0, LOW);
-      mcp.digitalWrite(leftMotor1, LOW);
-      mcp.digitalWrite(rightMotor0, LOW);
-      mcp.digitalWrite(rightMotor1, LOW);
-    }
-    vTaskDelay(1); 
-  }
+  vTaskDelete(NULL);
 }
 
 // Function to flash lights as a connection indicator
@@ -386,4 +580,6 @@ void flashConnectionIndicator() {
     digitalWrite(cabLights, LOW);
     delay(200);
   }
+  // Restore the cab lights to whatever the driver had selected
+  digitalWrite(cabLights, cabLightsOn ? HIGH : LOW);
 }
\ No newline at end of file
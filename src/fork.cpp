@@ -2,38 +2,35 @@
 #include <ESP32Servo.h>  // by Kevin Harrington
 #include <esp_now.h>
 #include <WiFi.h>
+#include "tasks.h"
+#include "vehiclelink.h"
+#include "persist.h"
+#include "power.h"
+#include "mixer.h"
+#include "vehicleframe.h"
 
 uint32_t thisReceiverIndex = 2;
 
-// Structure to receive message
-typedef struct struct_message {
-    uint32_t receiverIndex;
-    uint16_t buttons;
-    uint8_t dpad;
-    int32_t axisX, axisY;
-    int32_t axisRX, axisRY;
-    uint32_t brake, throttle;
-    uint16_t miscButtons;
-    bool thumbR, thumbL, r1, l1, r2, l2;
-} struct_message;
-
-bool dataUpdated;
-bool connectionActive = false; // Tracks if connection is currently active
-unsigned long lastPacketTime = 0; // Timestamp of last received packet
+volatile bool connectionActive = false; // Tracks if connection is currently active
+volatile unsigned long lastPacketTime = 0; // Timestamp of last received packet
 const unsigned long CONNECTION_TIMEOUT = 3000; // 3 seconds timeout for connection
-struct_message receivedData;
+struct_message receivedData; // Frame currently being processed by the control task
+QueueHandle_t frameMailbox; // Holds only the latest frame for the control task
+TaskHandle_t controlTaskHandle;
+TaskHandle_t housekeepingTaskHandle;
 
 // Forward declarations
-void processThrottle(int axisYValue);
+void processDrive(int axisYValue, int axisRXValue, bool pivotLeft, bool pivotRight);
 void processMast(int axisRYValue);
-void processTrimRight(int trimValue);
-void processTrimLeft(int trimValue);
+void processTrim(bool trimRight, bool trimLeft);
 void processSteering(int axisRXValue);
 void processMastTilt(int dpadValue);
 void processAux(bool buttonValue);
 void moveMotor(int motorPin0, int motorPin1, int velocity);
 void processControllers();
+void reportMixerTiming();
 void flashConnectionIndicator();
+void emergencyStop();
 
 #define steeringServoPin 23
 #define mastTiltServoPin 22
@@ -58,41 +55,61 @@ Servo steeringServo;
 Servo mastTiltServo;
 
 int servoDelay = 0;
-int lightSwitchTime = 0;
-float adjustedSteeringValue = 86;
-float steeringAdjustment = 1;
+int adjustedSteeringValue = 86;
 int steeringTrim = 0;
+TrimStepper trimStepper; // Owned by the control task
+// Follows the base's press counters, see include/edges.h. Owned by the control task.
+PressTracker pressTracker;
+uint8_t presses[EDGE_INPUT_COUNT]; // Presses of each input since the previous frame
 int mastTiltValue = 90;
 
+// Kept across power cycles, see include/persist.h
+struct PersistedState {
+  int16_t steeringTrim;
+  int16_t mastTiltValue;
+};
+
 bool lightsOn = false;
 bool moveMastTiltServoDown = false;
 bool moveMastTiltServoUp = false;
-bool hardLeft;
-bool hardRight;
+volatile bool connectionIndicatorActive = false; // Steering servo belongs to the indicator while set
 
 // Callback function for received data
 void OnDataRecv(const uint8_t * mac, const uint8_t *incomingData, int len) {
+    uint32_t heardUs = micros();
+    // Network messages are handled here, only control frames continue
+    if (!handleBaseMessage(incomingData, len)) {
+      // An emergency stop does not wait for the control task
+      if (takeEmergencyStop(thisReceiverIndex)) {
+        xQueueReset(frameMailbox);
+        emergencyStop();
+        confirmStop(thisReceiverIndex, heardUs);
+      }
+      takeMacroStart(thisReceiverIndex);
+      return;
+    }
     struct_message tempReceivedData;
     memcpy(&tempReceivedData, incomingData, sizeof(receivedData));
-    if (tempReceivedData.receiverIndex == thisReceiverIndex){
-      memcpy(&receivedData, &tempReceivedData, sizeof(receivedData));
-      dataUpdated = true;
+    if (tempReceivedData.receiverIndex == thisReceiverIndex) {
+      // Newer frames replace one the control task has not picked up yet
+      xQueueOverwrite(frameMailbox, &tempReceivedData);
       
       // Update connection timestamp
       lastPacketTime = millis();
+      noteFrameAccepted(&tempReceivedData);
       
       // Check if connection needs to be re-established
       if (!connectionActive) {
         connectionActive = true;
-        flashConnectionIndicator();
+        // The indicator blocks, so the housekeeping task plays it
+        xTaskNotifyGive(housekeepingTaskHandle);
       }
     }
 }
 
 // Function to move steering servo left and right as a connection indicator
 void flashConnectionIndicator() {
-  // Store original position
-  float originalPosition = adjustedSteeringValue;
+  connectionIndicatorActive = true;
   
   // Flash the steering servo left and right twice
   for (int i = 0; i < 2; i++) {
@@ -104,120 +121,64 @@ void flashConnectionIndicator() {
     delay(150);
   }
   
-  // Return to original position
-  steeringServo.write(originalPosition);
+  // Return to the position the driver is currently steering to
+  steeringServo.write(adjustedSteeringValue - steeringTrim);
+  connectionIndicatorActive = false;
 }
 
 void processGamepad() {
-  //Throttle
-  processThrottle(receivedData.axisY);
+  takePresses(&pressTracker, receivedData.pressEpoch, receivedData.pressCounts, presses);
   //Steering
   processSteering(receivedData.axisRX);
+  //Throttle, mixed with this frame's steering and pivot buttons
+  processDrive(receivedData.axisY, receivedData.axisRX, receivedData.l2, receivedData.r2);
   //Rasing and lowering of mast
   processMast(receivedData.axisRY);
   //MastTilt
   processMastTilt(receivedData.dpad);
   //Aux
-  processAux(receivedData.thumbR);
-
-  processTrimRight(receivedData.r1);
-  processTrimLeft(receivedData.l1);
+  processAux(presses[EDGE_THUMB_R]);
 
-  if (receivedData.l2) {
-    hardLeft = true;
-  } else {
-    hardLeft = false;
-  }
-  if (receivedData.r2) {
-    hardRight = true;
-  } else {
-    hardRight = false;
-  }
+  processTrim(receivedData.r1, receivedData.l1);
 }
 
-void processThrottle(int axisYValue) {
-  float adjustedThrottleValue = axisYValue / 2;
-  if (adjustedThrottleValue > 15 || adjustedThrottleValue < -15) {
-    if (hardRight) {
-      moveMotor(rightMotor0, rightMotor1, -1 * (adjustedThrottleValue * steeringAdjustment));
-    } else if (hardLeft) {
-      moveMotor(leftMotor0, leftMotor1, -1 * (adjustedThrottleValue * steeringAdjustment));
-    } else if (adjustedSteeringValue > 100) {
-      moveMotor(leftMotor0, leftMotor1, adjustedThrottleValue * steeringAdjustment);
-      moveMotor(rightMotor0, rightMotor1, adjustedThrottleValue);
-    } else if (adjustedSteeringValue < 80) {
-      moveMotor(leftMotor0, leftMotor1, adjustedThrottleValue);
-      moveMotor(rightMotor0, rightMotor1, adjustedThrottleValue * steeringAdjustment);
-    } else {
-      moveMotor(leftMotor0, leftMotor1, adjustedThrottleValue);
-      moveMotor(rightMotor0, rightMotor1, adjustedThrottleValue);
-    }
-  } else {
-    moveMotor(leftMotor0, leftMotor1, 0);
-    moveMotor(rightMotor0, rightMotor1, 0);
-  }
+// Pivot turns on L2/R2, otherwise the steering servo turns and the inner side helps
+void processDrive(int axisYValue, int axisRXValue, bool pivotLeft, bool pivotRight) {
+  DriveMode mode = pivotRight ? DRIVE_PIVOT_RIGHT : pivotLeft ? DRIVE_PIVOT_LEFT : DRIVE_ACKERMANN;
+  DriveCommand drive = mixDrive(mode, axisYValue, axisRXValue, FORK_STEER_ASSIST);
+  moveMotor(leftMotor0, leftMotor1, governThrottle(drive.left));
+  moveMotor(rightMotor0, rightMotor1, governThrottle(drive.right));
 }
 
 void processMast(int axisRYValue) {
-  int adjustedMastValue = axisRYValue / 2;
-  if (adjustedMastValue > 100 || adjustedMastValue < -100) {
-    moveMotor(mastMotor0, mastMotor1, adjustedMastValue);
-  } else {
-    moveMotor(mastMotor0, mastMotor1, 0);
-  }
+  moveMotor(mastMotor0, mastMotor1, mastCommand(axisRYValue));
 }
 
-void processTrimRight(int trimValue) {
-  if (trimValue == 1 && trimValue < 20) {
-    steeringTrim = steeringTrim + 2;
-    delay(50);
-  }
-}
-
-void processTrimLeft(int trimValue) {
-  if (trimValue == 1 && trimValue > -20) {
-    steeringTrim = steeringTrim - 2;
-    delay(50);
-  }
+// R1 trims right and L1 left while held, see stepTrim()
+void processTrim(bool trimRight, bool trimLeft) {
+  steeringTrim = stepTrim(&trimStepper, steeringTrim, (int)trimRight - (int)trimLeft, 2, millis());
 }
 
 void processSteering(int axisRXValue) {
-  adjustedSteeringValue = (90 - (axisRXValue / 9));
-  steeringServo.write(adjustedSteeringValue - steeringTrim);
-
-  if (adjustedSteeringValue > 100) {
-    steeringAdjustment = ((200 - adjustedSteeringValue) / 100);
-  } else if (adjustedSteeringValue < 80) {
-    steeringAdjustment = ((200 - (90 + (90 - adjustedSteeringValue))) / 100);
+  adjustedSteeringValue = steeringAngle(axisRXValue, FORK_STEERING_DIVISOR);
+  if (!connectionIndicatorActive) {
+    steeringServo.write(adjustedSteeringValue - steeringTrim);
   }
 }
 
 void processMastTilt(int dpadValue) {
-  if (dpadValue == 1) {
-    if (servoDelay == 4) {
-      if (mastTiltValue >= 10 && mastTiltValue < 170) {
-        //if using a ps3 controller that was flashed as an xbox360 controller change the value "1 " below to a "3" or "4" to make up for the slower movement.
-        mastTiltValue = mastTiltValue + 1;
-        mastTiltServo.write(mastTiltValue);
-      }
-      servoDelay = 0;
-    }
-    servoDelay++;
-  } else if (dpadValue == 2) {
-    if (servoDelay == 4) {
-      if (mastTiltValue <= 170 && mastTiltValue > 10) {
-        //if using a ps3 controller that was flashed as an xbox360 controller change the value "1" below to a "3" or "4" to make up for the slower movement.
-        mastTiltValue = mastTiltValue - 1;
-        mastTiltServo.write(mastTiltValue);
-      }
-      servoDelay = 0;
-    }
-    servoDelay++;
+  int movement = dpadValue == 1 ? 1 : dpadValue == 2 ? -1 : 0;
+  //if using a ps3 controller that was flashed as an xbox360 controller change the step "1" below to a "3" or "4" to make up for the slower movement.
+  int stepped = stepHeldServo(&servoDelay, mastTiltValue, movement, 1, 4);
+  if (stepped != mastTiltValue) {
+    mastTiltValue = stepped;
+    mastTiltServo.write(mastTiltValue);
   }
 }
 
-void processAux(bool buttonValue) {
-  if (buttonValue && (millis() - lightSwitchTime) > 200) {
+// Toggles once per press; an even count since the last frame cancels out
+void processAux(uint8_t pressCount) {
+  if (pressCount & 1) {
     if (lightsOn) {
       digitalWrite(auxAttach0, LOW);
       digitalWrite(auxAttach1, LOW);
@@ -227,21 +188,91 @@ void processAux(bool buttonValue) {
       digitalWrite(auxAttach1, LOW);
       lightsOn = true;
     }
+  }
+}
+
+// The float drive path mixDrive() replaced, kept to time one against the other
+DriveCommand mixDriveFloat(DriveMode mode, int axisYValue, int axisRXValue) {
+  float throttle = axisYValue / 2;
+  float steering = 90 - (axisRXValue / 9);
+  float adjustment = 1;
+  if (steering > 100) {
+    adjustment = (200 - steering) / 100;
+  } else if (steering < 80) {
+    adjustment = (200 - (90 + (90 - steering))) / 100;
+  }
+  float left = throttle;
+  float right = throttle;
+  if (throttle <= 15 && throttle >= -15) {
+    left = right = 0;
+  } else if (mode == DRIVE_PIVOT_RIGHT) {
+    right = -throttle * adjustment;
+  } else if (mode == DRIVE_PIVOT_LEFT) {
+    left = -throttle * adjustment;
+  } else if (steering > 100) {
+    left = throttle * adjustment;
+  } else if (steering < 80) {
+    right = throttle * adjustment;
+  }
+  DriveCommand command;
+  command.left = (int16_t)left;
+  command.right = (int16_t)right;
+  return command;
+}
 
-    lightSwitchTime = millis();
+// Times mixDrive() and the float path over the same sweep of sticks, once at
+// boot before the control task has anything to do
+void reportMixerTiming() {
+  const int frames = 256;
+  volatile int32_t sink = 0;
+  uint32_t start = ESP.getCycleCount();
+  for (int i = 0; i < frames; i++) {
+    DriveCommand drive = mixDrive((DriveMode)(i % 4 == 3 ? DRIVE_PIVOT_LEFT : DRIVE_ACKERMANN),
+                                  (i * 37) % 1025 - 512, (i * 91) % 1025 - 512, FORK_STEER_ASSIST);
+    sink = sink + drive.left - drive.right;
+  }
+  uint32_t fixedCycles = (ESP.getCycleCount() - start) / frames;
+  start = ESP.getCycleCount();
+  for (int i = 0; i < frames; i++) {
+    DriveCommand drive = mixDriveFloat((DriveMode)(i % 4 == 3 ? DRIVE_PIVOT_LEFT : DRIVE_ACKERMANN),
+                                       (i * 37) % 1025 - 512, (i * 91) % 1025 - 512);
+    sink = sink + drive.left - drive.right;
   }
+  uint32_t floatCycles = (ESP.getCycleCount() - start) / frames;
+  uint32_t mhz = ESP.getCpuFreqMHz();
+  Serial.printf("Mixer: %u cycles (%u ns) per frame, float path %u cycles (%u ns)\n", fixedCycles,
+                fixedCycles * 1000 / mhz, floatCycles, floatCycles * 1000 / mhz);
 }
 
 void moveMotor(int motorPin0, int motorPin1, int velocity) {
-  if (velocity > 1) {
-    analogWrite(motorPin0, velocity);
-    analogWrite(motorPin1, LOW);
-  } else if (velocity < -1) {
-    analogWrite(motorPin0, LOW);
-    analogWrite(motorPin1, (-1 * velocity));
-  } else {
-    analogWrite(motorPin0, 0);
-    analogWrite(motorPin1, 0);
+  velocity = motorCommand(velocity, FORK_MOTOR_DEADBAND);
+  analogWrite(motorPin0, velocity > 0 ? velocity : 0);
+  analogWrite(motorPin1, velocity < 0 ? -velocity : 0);
+}
+
+// Motion macros, see include/macro.h
+enum ForkMacroChannel { MAST_CHANNEL, FORK_DRIVE_CHANNEL };
+enum ForkMacroServo { MAST_TILT_SERVO };
+
+// Raise the load clear of the ground and tilt it back before driving
+const uint8_t liftAndTilt[] = {
+  MACRO_DRIVE(MAST_CHANNEL, 80, 1200), MACRO_SERVO(MAST_TILT_SERVO, 120, 60), MACRO_SETTLE, MACRO_END};
+// Level the forks, lower the load and back out from under it
+const uint8_t setDown[] = {
+  MACRO_SERVO(MAST_TILT_SERVO, 90, 60), MACRO_SETTLE, MACRO_DRIVE(MAST_CHANNEL, -60, 1200), MACRO_SETTLE,
+  MACRO_DRIVE(FORK_DRIVE_CHANNEL, -40, 800), MACRO_SETTLE, MACRO_END};
+// D-pad up and down with the macro button held on the base
+const MacroDef forkMacros[] = {MACRO_DEF("lift and tilt", liftAndTilt), MACRO_DEF("set down", setDown)};
+
+// Writes the mast, both drive sides straight ahead and the tilt if the macro moved it
+void applyMacro() {
+  moveMotor(mastMotor0, mastMotor1, macroPlayer.drive[MAST_CHANNEL] * 255 / 100);
+  int drive = governThrottle(macroPlayer.drive[FORK_DRIVE_CHANNEL] * 255 / 100);
+  moveMotor(leftMotor0, leftMotor1, drive);
+  moveMotor(rightMotor0, rightMotor1, drive);
+  if (macroPlayer.servosUsed & (1 << MAST_TILT_SERVO)) {
+    mastTiltValue = constrain(macroPlayer.servoAngle[MAST_TILT_SERVO], 10, 170);
+    mastTiltServo.write(mastTiltValue);
   }
 }
 
@@ -249,8 +280,118 @@ void processControllers() {
   processGamepad();
 }
 
+// Drive and mast off. Runs in the receive callback, so only pin writes.
+void emergencyStop() {
+  moveMotor(leftMotor0, leftMotor1, 0);
+  moveMotor(rightMotor0, rightMotor1, 0);
+  moveMotor(mastMotor0, mastMotor1, 0);
+}
+
+// High priority task pinned to CONTROL_TASK_CORE. Blocks until a frame arrives.
+void controlTask(void *parameter) {
+  subscribeWatchdog();
+  for (;;) {
+    bool framed = xQueueReceive(frameMailbox, &receivedData, controlWaitTicks()) == pdTRUE;
+    controlStage(DEADLINE_GOVERNOR);
+    bool limitMoved = serviceRangeGovernor();
+    if (framed && macroOwnsFrame(&receivedData)) {
+      // A frame without input while a macro runs only keeps the link alive
+      wakeForFrame();
+    } else if (framed) {
+      controlStage(DEADLINE_APPLY);
+      wakeForFrame();
+      processControllers();
+      // A stop that came in while the frame was applied wins
+      if (emergencyStopped) {
+        emergencyStop();
+      }
+      controlStage(DEADLINE_CONFIRM);
+      confirmRelease(&receivedData, thisReceiverIndex);
+    } else if (limitMoved && connectionActive && !emergencyStopped && !macroRunning()) {
+      // The link limit moved between frames, the drive follows it
+      controlStage(DEADLINE_APPLY);
+      processDrive(receivedData.axisY, receivedData.axisRX, receivedData.l2, receivedData.r2);
+    }
+    controlStage(DEADLINE_MACRO);
+    const int16_t servoAngles[MACRO_SERVOS] = {(int16_t)mastTiltValue, 0};
+    // The drive follows a moved link limit during a macro too
+    if (serviceMacro(connectionActive, servoAngles) || (limitMoved && macroRunning())) {
+      applyMacro();
+      if (emergencyStopped) {
+        emergencyStop();
+      }
+    }
+    // Check if connection has timed out
+    controlStage(DEADLINE_TIMEOUT);
+    if (connectionActive && (millis() - lastPacketTime > CONNECTION_TIMEOUT)) {
+      // Connection lost, reset the flag so steering will flash on reconnection
+      connectionActive = false;
+      endMacro(MACRO_ABORT_TIMEOUT);
+      // Stop motors for safety when connection is lost
+      moveMotor(leftMotor0, leftMotor1, 0);
+      moveMotor(rightMotor0, rightMotor1, 0);
+      moveMotor(mastMotor0, mastMotor1, 0);
+    }
+    controlStage(DEADLINE_POWER);
+    servicePower();
+    endControlIteration();
+  }
+}
+
+void savePersistedState() {
+  PersistedState state;
+  memset(&state, 0, sizeof(state));
+  state.steeringTrim = steeringTrim;
+  state.mastTiltValue = mastTiltValue;
+  persistStateWhenSettled(&state, sizeof(state));
+}
+
+void restorePersistedState() {
+  PersistedState state;
+  memset(&state, 0, sizeof(state));
+  state.steeringTrim = steeringTrim;
+  state.mastTiltValue = mastTiltValue;
+  if (loadPersistedState(&state, sizeof(state))) {
+    steeringTrim = clampTrim(state.steeringTrim);
+    mastTiltValue = constrain(state.mastTiltValue, 10, 170);
+  }
+}
+
+// Low priority task for everything that may block: indicator and reports
+void housekeepingTask(void *parameter) {
+  for (;;) {
+    // Notified by OnDataRecv when a connection is (re)established
+    if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HOUSEKEEPING_PERIOD_MS)) > 0) {
+      flashConnectionIndicator();
+    }
+    if (controlStalled()) {
+      emergencyStop();
+    }
+    serviceVehicleLink(thisReceiverIndex, VEHICLE_FORKLIFT);
+    savePersistedState();
+    reportPowerStats();
+    reportTaskStacksPeriodically();
+  }
+}
+
 // Arduino setup function. Runs in CPU 1
 void setup() {
+  Serial.begin(115200);
+  // Control loops subscribe as they start, see include/tasks.h
+  startTaskWatchdog();
+
+  // Radio first: it takes the longest to come up
+  WiFi.setSleep(false);
+  WiFi.mode(WIFI_STA);
+
+  if (esp_now_init() != ESP_OK) {
+      Serial.println("Error initializing ESP-NOW");
+      return;
+  }
+  startVehicleLink();
+  useMacros(forkMacros, sizeof(forkMacros) / sizeof(forkMacros[0]));
+  restorePersistedState();
+
   pinMode(mastMotor0, OUTPUT);
   pinMode(mastMotor1, OUTPUT);
   pinMode(auxAttach0, OUTPUT);
@@ -267,50 +408,25 @@ void setup() {
   lastPacketTime = 0;
 
   steeringServo.attach(steeringServoPin);
-  steeringServo.write(adjustedSteeringValue);
+  steeringServo.write(adjustedSteeringValue - steeringTrim);
   mastTiltServo.attach(mastTiltServoPin);
   mastTiltServo.write(mastTiltValue);
 
-  Serial.begin(115200);
-
-  WiFi.setSleep(false);
-  WiFi.mode(WIFI_STA);
+  frameMailbox = xQueueCreate(1, sizeof(struct_message));
+  housekeepingTaskHandle = startPinnedTask(housekeepingTask, "housekeeping", HOUSEKEEPING_TASK_STACK,
+                                           HOUSEKEEPING_TASK_PRIORITY, HOUSEKEEPING_TASK_CORE);
+  controlTaskHandle = startPinnedTask(controlTask, "control", CONTROL_TASK_STACK,
+                                      CONTROL_TASK_PRIORITY, CONTROL_TASK_CORE);
 
-  if (esp_now_init() != ESP_OK) {
-      Serial.println("Error initializing ESP-NOW");
-      return;
-  }
+  // Frames are only taken once everything they drive is set up
   esp_now_register_recv_cb(OnDataRecv);
+  // The control path runs without the heap from here on, see include/footprint.h
+  guardHeap(controlTaskHandle);
+  Serial.printf("Control ready at %lu ms\n", millis());
+  reportMixerTiming();
 }
 
-// Arduino loop function. Runs in CPU 1.
+// Arduino loop task is not needed, all work happens in controlTask and housekeepingTask
 void loop() {
-  // This call fetches all the controllers' data.
-  // Call this function in your main loop.
-  if (dataUpdated) {
-    processControllers();
-    dataUpdated = false;
-  }
-  else { 
-    // Check if connection has timed out
-    if (connectionActive && (millis() - lastPacketTime > CONNECTION_TIMEOUT)) {
-      // Connection lost, reset the flag so steering will flash on reconnection
-      connectionActive = false;
-      // Stop motors for safety when connection is lost
-      moveMotor(leftMotor0, leftMotor1, 0);
-      moveMotor(rightMotor0, rightMotor1, 0);
-      moveMotor(mastMotor0, mastMotor1, 0);
-    }
-    vTaskDelay(1); 
-  }
-
-  // Check for connection timeout
-  if (connectionActive && (millis() - lastPacketTime > CONNECTION_TIMEOUT)) {
-    // Connection has timed out
-    connectionActive = false;
-    // Stop all motors
-    moveMotor(leftMotor0, leftMotor1, 0);
-    moveMotor(rightMotor0, rightMotor1, 0);
-    moveMotor(mastMotor0, mastMotor1, 0);
-  }
+  vTaskDelete(NULL);
 }
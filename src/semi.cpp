@@ -2,49 +2,38 @@
 #include <ESP32Servo.h>  // by Kevin Harrington
 #include <esp_now.h>
 #include <WiFi.h>
+#include "tasks.h"
+#include "vehiclelink.h"
+#include "persist.h"
+#include "power.h"
+#include "lights.h"
+#include "trailerstate.h"
+#include "vehicleframe.h"
 
 
 uint32_t thisReceiverIndex = 4;
-// Structure to receive message
-typedef struct struct_message {
-    uint32_t receiverIndex;
-    uint16_t buttons;
-    uint8_t dpad;
-    int32_t axisX, axisY;
-    int32_t axisRX, axisRY;
-    uint32_t brake, throttle;
-    uint16_t miscButtons;
-    bool thumbR, thumbL, r1, l1, r2, l2;
-} struct_message;
-bool dataUpdated;
-bool connectionActive = false; // Tracks if connection is currently active
-unsigned long lastPacketTime = 0; // Timestamp of last received packet
+volatile bool connectionActive = false; // Tracks if connection is currently active
+volatile unsigned long lastPacketTime = 0; // Timestamp of last received packet
 const unsigned long CONNECTION_TIMEOUT = 3000; // 3 seconds timeout for connection
-struct_message receivedData;
-uint16_t buttonMaskY = 8;      // Triangle on PS4
-uint16_t buttonMaskA = 1;      // Cross on PS4
-uint16_t buttonMaskB = 2;      // Circle on PS4
-uint16_t buttonMaskX = 4;      // Square on PS4
+struct_message receivedData; // Frame currently being processed by the control task
+QueueHandle_t frameMailbox; // Holds only the latest frame for the control task
+TaskHandle_t controlTaskHandle;
+TaskHandle_t housekeepingTaskHandle;
+
+// Serial0 carries both the trailer link and log lines. Only the housekeeping
+// task writes to it, everything else queues a log line so nothing interleaves.
+#define LOG_QUEUE_LENGTH 32
+QueueHandle_t logQueue;
+// Where the semi wants the trailer, see include/trailerstate.h. The control
+// task sets legs, ramp and aux motors, the housekeeping task sets the lights
+// and sends whatever changed.
+TrailerState trailerDesired;
+// Counter above the relay's sequence, see relayTrailerState()
+uint16_t relayEpoch = 0;
+volatile bool relayEpochNeedsSaving = false;
+#define TRAILER_STATS_PERIOD_MS 10000
 // ControllerPtr myControllers[BP32_MAX_GAMEPADS];
 
-/*What the different Serial commands for the trailer esp32 daughter board do
-1-Trailer Legs Up
-2-Trailer Legs Down
-3-Ramp Up
-4-Ramp Down
-5-auxMotor1 Forward
-6-auxMotor1 Reverse
-7-auxMotor1 STOP
-8-auxMotor2 Forward
-9-auxMotor2 Reverse
-10-auxMotor2 STOP
-11- LT1 LOW
-12- LT1 HIGH
-13- LT2 LOW
-14- LT2 HIGH
-15- LT3 LOW
-16- LT3 HIGH
-*/
 #define LT1 15
 #define LT2 27
 #define LT3 14
@@ -74,53 +63,67 @@ Servo hitchServo;
 
 // Forward declarations
 void flashConnectionIndicator();
+void emergencyStop();
 
-int lightSwitchButtonTime = 0;
-int lightSwitchTime = 0;
-int hitchButtonTime = 0;
-const int hitchDebounceDelay = 500; // Debounce delay in milliseconds
-int adjustedSteeringValue = 90;
-int rawSteeringValue = 90; // Raw steering value from controller before trim
+void logLine(const char *text) {
+  xQueueSend(logQueue, &text, 0);
+}
+
+volatile int adjustedSteeringValue = 90;
+volatile int rawSteeringValue = 90; // Raw steering value from controller before trim
 int hitchServoValueEngaged = 155;
 int hitchServoValueDisengaged = 100;
 int steeringTrim = 0;
-int lightMode = 0;
-bool lightsOn = false;
-bool auxLightsOn = false;
-bool blinkLT = false;
-bool hazardLT = false;
-bool hazardsOn = false;
+TrimStepper trimStepper; // Owned by the control task
+volatile int lightMode = 0; // 0 off, 1 steady, 2 turn signals, 3 hazards
+volatile bool auxLightsOn = false;
+// Owned by the housekeeping task
+LightEngine lightEngine;
+uint8_t appliedLights = 0; // LIGHT_ bits currently on the pins and sent to the trailer
 bool smokeGenOn = false;
-bool trailerAuxMtr1Forward = false;
-bool trailerAuxMtr1Reverse = false;
-bool trailerAuxMtr2Forward = false;
-bool trailerAuxMtr2Reverse = false;
 bool hitchUp = true;
-bool trailerRampUp = true;
-bool trailerLegsUp = true;
 bool reducedSpeedMode = false;
-unsigned long speedModeButtonTime = 0;
-unsigned long rampButtonTime = 0;
-unsigned long legsButtonTime = 0;
-const int speedModeDebounceDelay = 500; // Debounce delay for speed mode toggle
-const int rampDebounceDelay = 500; // Debounce delay for ramp toggle
-const int legsDebounceDelay = 500; // Debounce delay for legs toggle
+// Follows the base's press counters, see include/edges.h. Owned by the control task.
+PressTracker pressTracker;
+uint8_t presses[EDGE_INPUT_COUNT]; // Presses of each input since the previous frame
+
+// Kept across power cycles, see include/persist.h
+struct PersistedState {
+  int16_t steeringTrim;
+  uint8_t hitchUp;
+  uint8_t trailerLegsUp;
+  uint8_t trailerRampUp;
+};
 
 // Callback function for received data
 void OnDataRecv(const uint8_t * mac, const uint8_t *incomingData, int len) {
+    uint32_t heardUs = micros();
+    // Network messages are handled here, only control frames continue
+    if (!handleBaseMessage(incomingData, len)) {
+      // An emergency stop does not wait for the control task
+      if (takeEmergencyStop(thisReceiverIndex)) {
+        xQueueReset(frameMailbox);
+        emergencyStop();
+        confirmStop(thisReceiverIndex, heardUs);
+      }
+      takeMacroStart(thisReceiverIndex);
+      return;
+    }
     struct_message tempReceivedData;
     memcpy(&tempReceivedData, incomingData, sizeof(receivedData));
-    if (tempReceivedData.receiverIndex == thisReceiverIndex){
-      memcpy(&receivedData, &tempReceivedData, sizeof(receivedData));
-      dataUpdated = true;
+    if (tempReceivedData.receiverIndex == thisReceiverIndex) {
+      // Newer frames replace one the control task has not picked up yet
+      xQueueOverwrite(frameMailbox, &tempReceivedData);
       
       // Update connection timestamp
       lastPacketTime = millis();
+      noteFrameAccepted(&tempReceivedData);
       
       // Check if connection needs to be re-established
       if (!connectionActive) {
         connectionActive = true;
-        flashConnectionIndicator();
+        // The indicator blocks, so the housekeeping task plays it
+        xTaskNotifyGive(housekeepingTaskHandle);
       }
     }
 }
@@ -138,98 +141,55 @@ void flashConnectionIndicator() {
     digitalWrite(LT3, LOW);
     delay(200);
   }
+  // Restore the lights to whatever the light engine last set
+  digitalWrite(LT1, (appliedLights & LIGHT_LT1) ? HIGH : LOW);
+  digitalWrite(LT2, (appliedLights & LIGHT_LT2) ? HIGH : LOW);
+  digitalWrite(LT3, (appliedLights & LIGHT_LT3) ? HIGH : LOW);
 }
 
 void moveMotor(int motorPin0, int motorPin1, int velocity) {
-  if (velocity > 15) {
-    analogWrite(motorPin0, velocity);
-    analogWrite(motorPin1, LOW);
-  } else if (velocity < -15) {
-    analogWrite(motorPin0, LOW);
-    analogWrite(motorPin1, (-1 * velocity));
-  } else {
-    analogWrite(motorPin0, 0);
-    analogWrite(motorPin1, 0);
-  }
+  velocity = motorCommand(velocity, MOTOR_DEADBAND);
+  analogWrite(motorPin0, velocity > 0 ? velocity : 0);
+  analogWrite(motorPin1, velocity < 0 ? -velocity : 0);
 }
 
 void moveServo(int movement, Servo &servo, int &servoValue) {
-  switch (movement) {
-    case 1:
-      if (servoValue >= 10 && servoValue < 170) {
-        servoValue = servoValue + 5;
-        servo.write(servoValue);
-        delay(10);
-      }
-      break;
-    case -1:
-      if (servoValue <= 170 && servoValue > 10) {
-        servoValue = servoValue - 5;
-        servo.write(servoValue);
-        delay(10);
-      }
-      break;
+  int stepped = stepServo(servoValue, movement, 5);
+  if (stepped != servoValue) {
+    servoValue = stepped;
+    servo.write(servoValue);
+    delay(10);
   }
 }
 
 
-void processTrailerLegs(int value) {
-  // Use Cross button (buttonMaskA) for toggling the trailer legs position
-  if ((value & buttonMaskA) && (millis() - legsButtonTime > legsDebounceDelay)) {
-    // Toggle the legs position
-    if (trailerLegsUp) {
-      Serial.println(2); // Legs Down
-      Serial.println("Trailer Legs: Down");
-      trailerLegsUp = false;
-    } else {
-      Serial.println(1); // Legs Up
-      Serial.println("Trailer Legs: Up");
-      trailerLegsUp = true;
-    }
-    delay(10);
-    
-    // Update the last button press time
-    legsButtonTime = millis();
+// Toggles below flip once per press; an even count since the last frame cancels out
+
+void processTrailerLegs(uint8_t pressCount) {
+  // Cross button (A) toggles the trailer legs position
+  if (pressCount & 1) {
+    trailerDesired.legsUp = !trailerDesired.legsUp;
+    logLine(trailerDesired.legsUp ? "Trailer Legs: Up" : "Trailer Legs: Down");
   }
 }
-void processTrailerRamp(int value) {
-  // Use Circle button (buttonMaskB) for toggling the ramp position
-  if ((value & buttonMaskB) && (millis() - rampButtonTime > rampDebounceDelay)) {
-    // Toggle the ramp position
-    if (trailerRampUp) {
-      Serial.println(4); // Ramp Down
-      Serial.println("Ramp: Down");
-      trailerRampUp = false;
-    } else {
-      Serial.println(3); // Ramp Up
-      Serial.println("Ramp: Up");
-      trailerRampUp = true;
-    }
-    delay(10);
-    
-    // Update the last button press time
-    rampButtonTime = millis();
+void processTrailerRamp(uint8_t pressCount) {
+  // Circle button (B) toggles the ramp position
+  if (pressCount & 1) {
+    trailerDesired.rampUp = !trailerDesired.rampUp;
+    logLine(trailerDesired.rampUp ? "Ramp: Up" : "Ramp: Down");
   }
 }
 
-void processSpeedMode(int value) {
-  // Triangle button toggles reduced speed mode with debouncing
-  if ((value & buttonMaskY) && (millis() - speedModeButtonTime > speedModeDebounceDelay)) {
-    reducedSpeedMode = !reducedSpeedMode; // Toggle the speed mode
-    Serial.print("Speed Mode: ");
-    Serial.println(reducedSpeedMode ? "Reduced (50%)" : "Normal (100%)");
-    speedModeButtonTime = millis();
+void processSpeedMode(uint8_t pressCount) {
+  // Triangle button (Y) toggles reduced speed mode
+  if (pressCount & 1) {
+    reducedSpeedMode = !reducedSpeedMode;
+    logLine(reducedSpeedMode ? "Speed Mode: Reduced (50%)" : "Speed Mode: Normal (100%)");
   }
 }
 
 void processThrottle(int axisYValue) {
-  int adjustedThrottleValue = axisYValue / 2;
-  
-  // Apply 50% speed reduction if reduced speed mode is enabled
-  if (reducedSpeedMode) {
-    adjustedThrottleValue = adjustedThrottleValue / 2; // Further reduce to 50%
-  }
-  
+  int adjustedThrottleValue = semiThrottle(axisYValue, &rangeGovernor, reducedSpeedMode);
   int smokeThrottle = adjustedThrottleValue / 3;
   
   moveMotor(rearMotor0, rearMotor1, adjustedThrottleValue);
@@ -238,18 +198,13 @@ void processThrottle(int axisYValue) {
   moveMotor(auxAttach2, auxAttach3, smokeThrottle);
 }
 
-void processTrimAndHitch(int dpadValue) {
-  if (dpadValue == 4 && steeringTrim < 20) {
-    steeringTrim = steeringTrim + 1;
-    delay(50);
-  } else if (dpadValue == 8 && steeringTrim > -20) {
-    steeringTrim = steeringTrim - 1;
-    delay(50);
-  }
+void processTrimAndHitch(int dpadValue, uint8_t hitchPressCount) {
+  // D-pad right and left trim while held, see stepTrim()
+  int trimMovement = dpadValue == 4 ? 1 : dpadValue == 8 ? -1 : 0;
+  steeringTrim = stepTrim(&trimStepper, steeringTrim, trimMovement, 1, millis());
   
-  // Hitch toggle with debounce - only process if sufficient time has passed since last button press
-  if (dpadValue == 2 && (millis() - hitchButtonTime > hitchDebounceDelay)) {
-    // Toggle the hitch state
+  // D-pad down toggles the hitch
+  if (hitchPressCount & 1) {
     if (hitchUp) {
       hitchServo.write(hitchServoValueDisengaged);
       hitchUp = false;
@@ -257,64 +212,29 @@ void processTrimAndHitch(int dpadValue) {
       hitchServo.write(hitchServoValueEngaged);
       hitchUp = true;
     }
-    delay(10);
-    
-    // Update the last button press time
-    hitchButtonTime = millis();
   }
 }
 void processSteering(int axisRXValue) {
-  rawSteeringValue = 90 - (axisRXValue / 9); // Store raw steering value without trim
+  rawSteeringValue = steeringAngle(axisRXValue, SEMI_STEERING_DIVISOR); // Store raw steering value without trim
   adjustedSteeringValue = rawSteeringValue - steeringTrim; // Apply trim for actual steering
   frontSteeringServo.write(180 - adjustedSteeringValue);
+}
 
-  Serial.print("Steering Value:");
-  Serial.println(adjustedSteeringValue);
-}
-
-void processLights(bool buttonValue) {
-  if (buttonValue && (millis() - lightSwitchButtonTime) > 300) {
-    lightMode++;
-    if (lightMode == 1) {
-      digitalWrite(LT1, HIGH);
-      digitalWrite(LT2, HIGH);
-      Serial.println(12);
-      delay(10);
-      Serial.println(14);
-    } else if (lightMode == 2) {
-      digitalWrite(LT1, LOW);
-      digitalWrite(LT2, LOW);
-      delay(100);
-      digitalWrite(LT1, HIGH);
-      digitalWrite(LT2, HIGH);
-      blinkLT = true;
-    } else if (lightMode == 3) {
-      blinkLT = false;
-      hazardLT = true;
-    } else if (lightMode == 4) {
-      hazardLT = false;
-      digitalWrite(LT1, LOW);
-      digitalWrite(LT2, LOW);
-      Serial.println(11);
-      delay(10);
-      Serial.println(13);
+// Steps through the light modes once per press, the housekeeping task turns them into light patterns
+void processLights(uint8_t pressCount) {
+  for (uint8_t i = 0; i < pressCount; i++) {
+    if (lightMode < 3) {
+      lightMode = lightMode + 1;
+    } else {
+      // Leaving hazards switches everything off and toggles the aux lights
       lightMode = 0;
-      if (!auxLightsOn) {
-        digitalWrite(LT3, HIGH);
-        Serial.println(16);
-        auxLightsOn = true;
-      } else {
-        digitalWrite(LT3, LOW);
-        Serial.println(15);
-        auxLightsOn = false;
-      }
+      auxLightsOn = !auxLightsOn;
     }
-    lightSwitchButtonTime = millis();
   }
 }
 
-void processSmokeGen(bool buttonValue) {
-  if (buttonValue) {
+void processSmokeGen(uint8_t pressCount) {
+  if (pressCount & 1) {
     if (!smokeGenOn) {
       digitalWrite(auxAttach0, LOW);
       digitalWrite(auxAttach1, HIGH);
@@ -327,134 +247,348 @@ void processSmokeGen(bool buttonValue) {
   }
 }
 
-void processTrailerAuxMtr1Forward(bool value) {
-  if (value) {
-      Serial.println(5);
-      delay(10);
-      trailerAuxMtr1Forward = true;
-  } else if (trailerAuxMtr1Forward) {
-    Serial.println(7);
-    delay(10);
-    trailerAuxMtr1Forward = false;
-  }
+// Trailer aux motors run while their trigger is held
+void processTrailerAuxMotors(bool forward1, bool reverse1, bool forward2, bool reverse2) {
+  setTrailerAuxFromTriggers(&trailerDesired, forward1, reverse1, forward2, reverse2);
 }
-void processTrailerAuxMtr1Reverse(bool value) {
-  if (value) {
-      Serial.println(6);
-      delay(10);
-      trailerAuxMtr1Reverse = true;
-  } else if (trailerAuxMtr1Reverse) {
-    Serial.println(7);
-    delay(10);
-    trailerAuxMtr1Reverse = false;
+
+// Sends the trailer state over ESP-NOW for trailers running without the serial
+// cable. Called by the control task right after each frame so a change goes
+// out with no extra hop, and repeated every TRAILER_SNAPSHOT_PERIOD_MS.
+void relayTrailerState() {
+  static uint16_t relayedState = 0xFFFF;
+  static unsigned long lastRelayTime = 0;
+  static uint16_t relaySequence = 0;
+  uint16_t state = packTrailerState(&trailerDesired);
+  if (state == relayedState && millis() - lastRelayTime < TRAILER_SNAPSHOT_PERIOD_MS) {
+    return;
   }
-}
-void processTrailerAuxMtr2Forward(bool value) {
-  if (value) {
-      Serial.println(8);
-      delay(10);
-      trailerAuxMtr2Forward = true;
-  } else if (trailerAuxMtr2Forward) {
-    Serial.println(10);
-    delay(10);
-    trailerAuxMtr2Forward = false;
+  TrailerStateMessage message;
+  memset(&message, 0, sizeof(message));
+  message.receiverIndex = RECEIVER_TRAILER_STATE;
+  message.sequence = relaySequence++;
+  message.authEpoch = relayEpoch;
+  if (relaySequence == 0) {
+    // A wrap moves the epoch on, saved by the housekeeping task
+    relayEpoch++;
+    relayEpochNeedsSaving = true;
   }
-}
-void processTrailerAuxMtr2Reverse(bool value) {
-  if (value) {
-      Serial.println(9);
-      delay(10);
-      trailerAuxMtr2Reverse = true;
-  } else if (trailerAuxMtr2Reverse) {
-    Serial.println(10);
-    delay(10);
-    trailerAuxMtr2Reverse = false;
+  message.sessionId = vehicleLink.session;
+  message.tractorIndex = thisReceiverIndex;
+  message.state = state;
+  if (sendSigned((uint8_t *)&message, sizeof(message)) == ESP_OK) {
+    relayedState = state;
+    lastRelayTime = millis();
   }
 }
 
 void processGamepad() {
+  takePresses(&pressTracker, receivedData.pressEpoch, receivedData.pressCounts, presses);
   //Throttle
   processThrottle(receivedData.axisY);
   //Steering
   processSteering(receivedData.axisRX);
   //Steering trim and hitch
-  processTrimAndHitch(receivedData.dpad);
+  processTrimAndHitch(receivedData.dpad, presses[EDGE_DPAD_DOWN]);
   //Lights
-  processLights(receivedData.thumbR);
-  processSmokeGen(receivedData.thumbL);
+  processLights(presses[EDGE_THUMB_R]);
+  processSmokeGen(presses[EDGE_THUMB_L]);
   
   // Process speed mode toggle (Triangle button)
-  processSpeedMode(receivedData.buttons);
-
-  processTrailerLegs(receivedData.buttons);
-  processTrailerRamp(receivedData.buttons);
-
-  processTrailerAuxMtr1Forward(receivedData.r1);
-  processTrailerAuxMtr1Reverse(receivedData.r2);
-  processTrailerAuxMtr2Forward(receivedData.l1);
-  processTrailerAuxMtr2Reverse(receivedData.l2);
-
-  if (blinkLT && (millis() - lightSwitchTime) > 300) {
-    if (!lightsOn) {
-      if (rawSteeringValue <= 85) {
-        digitalWrite(LT1, HIGH);
-        Serial.println(12);
-      } else if (rawSteeringValue >= 95) {
-        digitalWrite(LT2, HIGH);
-        Serial.println(14);
+  processSpeedMode(presses[EDGE_Y]);
+
+  processTrailerLegs(presses[EDGE_A]);
+  processTrailerRamp(presses[EDGE_B]);
+
+  processTrailerAuxMotors(receivedData.r1, receivedData.r2, receivedData.l1, receivedData.l2);
+}
+
+// Drives the pins for the lights that changed, the trailer follows through trailerDesired
+void applyLights(uint8_t lights) {
+  uint8_t changed = lights ^ appliedLights;
+  if (changed & LIGHT_LT1) {
+    digitalWrite(LT1, (lights & LIGHT_LT1) ? HIGH : LOW);
+  }
+  if (changed & LIGHT_LT2) {
+    digitalWrite(LT2, (lights & LIGHT_LT2) ? HIGH : LOW);
+  }
+  if (changed & LIGHT_LT3) {
+    digitalWrite(LT3, (lights & LIGHT_LT3) ? HIGH : LOW);
+  }
+  appliedLights = lights;
+  trailerDesired.lights = lights;
+}
+
+// Sends the trailer whatever changed since the last call, plus a full snapshot
+// every TRAILER_SNAPSHOT_PERIOD_MS. Called every housekeeping tick.
+void syncTrailer() {
+  static TrailerState sent;
+  static bool sentValid = false;
+  static unsigned long lastChangeTime = 0;
+  static unsigned long lastSnapshotTime = 0;
+  static unsigned long lastStatsTime = 0;
+  static uint32_t linkBytes = 0, codesSent = 0, snapshotsSent = 0;
+
+  TrailerState desired = trailerDesired;
+  unsigned long now = millis();
+  if (!sentValid) {
+    // Start from the trailer's default state; anything restored differently
+    // goes out as codes, and the snapshot repairs a trailer that disagrees
+    initTrailerState(&sent);
+    sentValid = true;
+  }
+  uint8_t codes[TRAILER_MAX_CODES];
+  int count = trailerCodesForChange(&sent, &desired, codes);
+  for (int i = 0; i < count; i++) {
+    linkBytes += Serial.println(codes[i]);
+  }
+  if (count > 0) {
+    codesSent += count;
+    lastChangeTime = now;
+    sent = desired;
+  }
+  if (now - lastSnapshotTime >= TRAILER_SNAPSHOT_PERIOD_MS) {
+    lastSnapshotTime = now;
+    char snapshot[16];
+    formatTrailerSnapshot(&sent, now - lastChangeTime, snapshot, sizeof(snapshot));
+    linkBytes += Serial.println(snapshot);
+    snapshotsSent++;
+  }
+  if (now - lastStatsTime >= TRAILER_STATS_PERIOD_MS) {
+    Serial.printf("Trailer link: %.1f B/s, %u codes, %u snapshots\n", linkBytes * 1000.0f / (now - lastStatsTime),
+                  codesSent, snapshotsSent);
+    lastStatsTime = now;
+    linkBytes = codesSent = snapshotsSent = 0;
+  }
+}
+
+// Light sequencing, called every housekeeping tick
+void processLightEngine() {
+  static const LightPattern patterns[] = { LIGHTS_OFF, LIGHTS_STEADY, LIGHTS_TURN, LIGHTS_HAZARD };
+  unsigned long now = millis();
+  setLightPattern(&lightEngine, patterns[lightMode], now);
+  // Blink the side the semi is steering to
+  int steering = rawSteeringValue;
+  setTurnDirection(&lightEngine, steering <= 85 ? -1 : steering >= 95 ? 1 : 0, now);
+  lightEngine.aux = auxLightsOn;
+  applyLights(updateLights(&lightEngine, now));
+}
+
+void processControllers() {
+  processGamepad();
+}
+
+void stopAllOutputs() {
+  trailerDesired.aux1 = 0;
+  trailerDesired.aux2 = 0;
+  digitalWrite(rearMotor0, LOW);
+  digitalWrite(rearMotor1, LOW);
+  digitalWrite(rearMotor2, LOW);
+  digitalWrite(rearMotor3, LOW);
+  digitalWrite(frontMotor0, LOW);
+  digitalWrite(frontMotor1, LOW);
+  digitalWrite(auxAttach0, LOW);
+  digitalWrite(auxAttach1, LOW);
+  digitalWrite(auxAttach2, LOW);
+  digitalWrite(auxAttach3, LOW);
+  digitalWrite(auxAttach4, LOW);
+  digitalWrite(auxAttach5, LOW);
+  digitalWrite(LT1, LOW);
+  digitalWrite(LT2, LOW);
+  digitalWrite(LT3, LOW);
+}
+
+// Motion macros, see include/macro.h. The legs and the ramp go up on a
+// positive channel and down on a negative one, the trailer moves them.
+enum SemiMacroChannel { SEMI_DRIVE_CHANNEL, LEGS_CHANNEL, RAMP_CHANNEL };
+enum SemiMacroServo { HITCH_SERVO };
+
+// Legs down, unhitch, pull out from under the trailer, ramp down
+const uint8_t dropTrailer[] = {
+  MACRO_SET(LEGS_CHANNEL, -100), MACRO_WAIT(2500), MACRO_SET(LEGS_CHANNEL, 0),
+  MACRO_SERVO(HITCH_SERVO, 100, 120), MACRO_SETTLE,
+  MACRO_DRIVE(SEMI_DRIVE_CHANNEL, 30, 1500), MACRO_SETTLE,
+  MACRO_SET(RAMP_CHANNEL, -100), MACRO_WAIT(2000), MACRO_SET(RAMP_CHANNEL, 0), MACRO_END};
+// Ramp up, back under the trailer, hitch, legs up
+const uint8_t hitchTrailer[] = {
+  MACRO_SET(RAMP_CHANNEL, 100), MACRO_WAIT(2000), MACRO_SET(RAMP_CHANNEL, 0),
+  MACRO_DRIVE(SEMI_DRIVE_CHANNEL, -25, 1500), MACRO_SETTLE,
+  MACRO_SERVO(HITCH_SERVO, 155, 120), MACRO_SETTLE,
+  MACRO_SET(LEGS_CHANNEL, 100), MACRO_WAIT(2500), MACRO_SET(LEGS_CHANNEL, 0), MACRO_END};
+// D-pad up and down with the macro button held on the base
+const MacroDef semiMacros[] = {MACRO_DEF("drop trailer", dropTrailer), MACRO_DEF("hitch trailer", hitchTrailer)};
+
+void applyMacro() {
+  processThrottle(macroPlayer.drive[SEMI_DRIVE_CHANNEL] * 512 / 100);
+  int legs = macroPlayer.drive[LEGS_CHANNEL];
+  if (legs != 0 && trailerDesired.legsUp != (legs > 0)) {
+    trailerDesired.legsUp = legs > 0;
+    logLine(trailerDesired.legsUp ? "Trailer Legs: Up" : "Trailer Legs: Down");
+  }
+  int ramp = macroPlayer.drive[RAMP_CHANNEL];
+  if (ramp != 0 && trailerDesired.rampUp != (ramp > 0)) {
+    trailerDesired.rampUp = ramp > 0;
+    logLine(trailerDesired.rampUp ? "Ramp: Up" : "Ramp: Down");
+  }
+  if (macroPlayer.servosUsed & (1 << HITCH_SERVO)) {
+    int angle = macroPlayer.servoAngle[HITCH_SERVO];
+    hitchServo.write(angle);
+    // Saved as whichever end the hitch is nearer to
+    hitchUp = abs(angle - hitchServoValueEngaged) < abs(angle - hitchServoValueDisengaged);
+  }
+}
+
+// Everything that moves off, lights stay as they are. Runs in the receive
+// callback, so only pin writes. The trailer takes the stop itself, its aux
+// motors are cleared here so the next relay does not start them again.
+void emergencyStop() {
+  moveMotor(rearMotor0, rearMotor1, 0);
+  moveMotor(rearMotor2, rearMotor3, 0);
+  moveMotor(frontMotor0, frontMotor1, 0);
+  moveMotor(auxAttach2, auxAttach3, 0);
+  trailerDesired.aux1 = 0;
+  trailerDesired.aux2 = 0;
+}
+
+// High priority task pinned to CONTROL_TASK_CORE. Blocks until a frame arrives.
+void controlTask(void *parameter) {
+  subscribeWatchdog();
+  for (;;) {
+    bool framed = xQueueReceive(frameMailbox, &receivedData, controlWaitTicks()) == pdTRUE;
+    controlStage(DEADLINE_GOVERNOR);
+    bool limitMoved = serviceRangeGovernor();
+    if (framed && macroOwnsFrame(&receivedData)) {
+      // A frame without input while a macro runs only keeps the link alive
+      wakeForFrame();
+    } else if (framed) {
+      controlStage(DEADLINE_APPLY);
+      wakeForFrame();
+      processControllers();
+      // A stop that came in while the frame was applied wins
+      if (emergencyStopped) {
+        emergencyStop();
       }
-      lightsOn = true;
-    } else {
-      if (rawSteeringValue <= 85) {
-        digitalWrite(LT2, HIGH);
-        digitalWrite(LT1, LOW);
-        Serial.println(11);
-        delay(10);
-        Serial.println(14);
-      } else if (rawSteeringValue >= 95) {
-        digitalWrite(LT1, HIGH);
-        digitalWrite(LT2, LOW);
-        Serial.println(13);
-        delay(10);
-        Serial.println(12);
+      controlStage(DEADLINE_CONFIRM);
+      confirmRelease(&receivedData, thisReceiverIndex);
+    } else if (limitMoved && connectionActive && !emergencyStopped && !macroRunning()) {
+      // The link limit moved between frames, the drive follows it
+      controlStage(DEADLINE_APPLY);
+      processThrottle(receivedData.axisY);
+    }
+    controlStage(DEADLINE_MACRO);
+    const int16_t servoAngles[MACRO_SERVOS] = {
+      (int16_t)(hitchUp ? hitchServoValueEngaged : hitchServoValueDisengaged), 0};
+    // The drive follows a moved link limit during a macro too
+    if (serviceMacro(connectionActive, servoAngles) || (limitMoved && macroRunning())) {
+      applyMacro();
+      if (emergencyStopped) {
+        emergencyStop();
       }
-      lightsOn = false;
     }
-    lightSwitchTime = millis();
+    // Check for connection timeout
+    controlStage(DEADLINE_TIMEOUT);
+    if (connectionActive && (millis() - lastPacketTime > CONNECTION_TIMEOUT)) {
+      connectionActive = false;
+      endMacro(MACRO_ABORT_TIMEOUT);
+      // Handle connection timeout (e.g., stop motors, reset values, etc.)
+      stopAllOutputs();
+    }
+    controlStage(DEADLINE_RELAY);
+    relayTrailerState();
+    controlStage(DEADLINE_POWER);
+    servicePower();
+    endControlIteration();
   }
-  if (blinkLT && rawSteeringValue > 85 && rawSteeringValue < 95) {
-    digitalWrite(LT1, HIGH);
-    digitalWrite(LT2, HIGH);
-    Serial.println(12);
-    delay(10);
-    Serial.println(14);
+}
+
+// Every boot starts a fresh epoch for the relay, the trailer refuses counters it has seen
+void startRelayEpoch() {
+  relayEpoch = linkStore.getUShort("relayEpoch", 0) + 1;
+  linkStore.putUShort("relayEpoch", relayEpoch);
+}
+
+void saveRelayEpoch() {
+  if (relayEpochNeedsSaving) {
+    relayEpochNeedsSaving = false;
+    linkStore.putUShort("relayEpoch", relayEpoch);
   }
-  if (hazardLT && (millis() - lightSwitchTime) > 300) {
-    if (!hazardsOn) {
-      digitalWrite(LT1, HIGH);
-      digitalWrite(LT2, HIGH);
-      Serial.println(12);
-      delay(10);
-      Serial.println(14);
-      hazardsOn = true;
-    } else {
-      digitalWrite(LT1, LOW);
-      digitalWrite(LT2, LOW);
-      Serial.println(11);
-      delay(10);
-      Serial.println(13);
-      hazardsOn = false;
-    }
-    lightSwitchTime = millis();
+}
+
+void fillPersistedState(PersistedState *state) {
+  memset(state, 0, sizeof(*state));
+  state->steeringTrim = steeringTrim;
+  state->hitchUp = hitchUp;
+  state->trailerLegsUp = trailerDesired.legsUp;
+  state->trailerRampUp = trailerDesired.rampUp;
+}
+
+void savePersistedState() {
+  PersistedState state;
+  fillPersistedState(&state);
+  persistStateWhenSettled(&state, sizeof(state));
+}
+
+// Needs trailerDesired initialised first
+void restorePersistedState() {
+  PersistedState state;
+  fillPersistedState(&state);
+  if (loadPersistedState(&state, sizeof(state))) {
+    steeringTrim = clampTrim(state.steeringTrim);
+    hitchUp = state.hitchUp;
+    trailerDesired.legsUp = state.trailerLegsUp;
+    trailerDesired.rampUp = state.trailerRampUp;
   }
 }
 
-void processControllers() {
-  processGamepad();
+// Low priority task that owns Serial0: trailer link, light sequencing and logging
+void housekeepingTask(void *parameter) {
+  const char *line;
+  int loggedSteeringValue = adjustedSteeringValue;
+  for (;;) {
+    // Notified by OnDataRecv when a connection is (re)established
+    if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HOUSEKEEPING_PERIOD_MS)) > 0) {
+      flashConnectionIndicator();
+    }
+    if (controlStalled()) {
+      emergencyStop();
+    }
+    processLightEngine();
+    syncTrailer();
+    while (xQueueReceive(logQueue, &line, 0) == pdTRUE) {
+      Serial.println(line);
+    }
+    if (adjustedSteeringValue != loggedSteeringValue) {
+      loggedSteeringValue = adjustedSteeringValue;
+      Serial.print("Steering Value:");
+      Serial.println(loggedSteeringValue);
+    }
+    serviceVehicleLink(thisReceiverIndex, VEHICLE_SEMI);
+    savePersistedState();
+    saveRelayEpoch();
+    reportPowerStats();
+    reportTaskStacksPeriodically();
+  }
 }
 
 void setup() {
   Serial.begin(115200);
+  // Control loops subscribe as they start, see include/tasks.h
+  startTaskWatchdog();
+
+  // Radio first: it takes the longest to come up
+  WiFi.setSleep(false);
+  WiFi.mode(WIFI_STA);
+
+  if (esp_now_init() != ESP_OK) {
+      Serial.println("Error initializing ESP-NOW");
+      return;
+  }
+  startVehicleLink();
+  startRelayEpoch();
+  useMacros(semiMacros, sizeof(semiMacros) / sizeof(semiMacros[0]));
+  hitchUp = false; // Disengaged unless a saved state says otherwise
+  initTrailerState(&trailerDesired); // Matches what the trailer does at power up
+  restorePersistedState();
 
   // Initialize connection variables
   connectionActive = false;
@@ -476,68 +610,30 @@ void setup() {
   pinMode(LT2, OUTPUT);
   pinMode(LT3, OUTPUT);
 
-  digitalWrite(rearMotor0, LOW);
-  digitalWrite(rearMotor1, LOW);
-  digitalWrite(rearMotor2, LOW);
-  digitalWrite(rearMotor3, LOW);
-  digitalWrite(frontMotor0, LOW);
-  digitalWrite(frontMotor1, LOW);
-  digitalWrite(auxAttach0, LOW);
-  digitalWrite(auxAttach1, LOW);
-  digitalWrite(auxAttach2, LOW);
-  digitalWrite(auxAttach3, LOW);
-  digitalWrite(auxAttach4, LOW);
-  digitalWrite(auxAttach5, LOW);
-  digitalWrite(LT1, LOW);
-  digitalWrite(LT2, LOW);
-  digitalWrite(LT3, LOW);
+  stopAllOutputs();
+  initLightEngine(&lightEngine);
 
+  adjustedSteeringValue = rawSteeringValue - steeringTrim;
   frontSteeringServo.attach(frontSteeringServoPin);
-  frontSteeringServo.write(adjustedSteeringValue);
+  frontSteeringServo.write(180 - adjustedSteeringValue);
   hitchServo.attach(hitchServoPin);
-  hitchServo.write(hitchServoValueDisengaged); // Set to disengaged position on boot
-  hitchUp = false; // Initialize hitchUp to match the actual servo position
-  trailerRampUp = true; // Initialize ramp to up position by default
-  trailerLegsUp = true; // Initialize legs to up position by default
+  hitchServo.write(hitchUp ? hitchServoValueEngaged : hitchServoValueDisengaged);
 
-    WiFi.setSleep(false);
-  WiFi.mode(WIFI_STA);
+  frameMailbox = xQueueCreate(1, sizeof(struct_message));
+  logQueue = xQueueCreate(LOG_QUEUE_LENGTH, sizeof(const char *));
+  housekeepingTaskHandle = startPinnedTask(housekeepingTask, "housekeeping", HOUSEKEEPING_TASK_STACK,
+                                           HOUSEKEEPING_TASK_PRIORITY, HOUSEKEEPING_TASK_CORE);
+  controlTaskHandle = startPinnedTask(controlTask, "control", CONTROL_TASK_STACK,
+                                      CONTROL_TASK_PRIORITY, CONTROL_TASK_CORE);
 
-  if (esp_now_init() != ESP_OK) {
-      Serial.println("Error initializing ESP-NOW");
-      return;
-  }
+  // Frames are only taken once everything they drive is set up
   esp_now_register_recv_cb(OnDataRecv);
+  // The control path runs without the heap from here on, see include/footprint.h
+  guardHeap(controlTaskHandle);
+  Serial.printf("Control ready at %lu ms\n", millis());
 }
 
-
-
-// Arduino loop function. Runs in CPU 1.
+// Arduino loop task is not needed, all work happens in controlTask and housekeepingTask
 void loop() {
-  if (dataUpdated) {
-    processControllers();
-    dataUpdated = false;
-  }
-  else { vTaskDelay(1); }
-
-  // Check for connection timeout
-  if (connectionActive && (millis() - lastPacketTime > CONNECTION_TIMEOUT)) {
-    connectionActive = false;
-    // Handle connection timeout (e.g., stop motors, reset values, etc.)
-    digitalWrite(rearMotor0, LOW);
-    digitalWrite(rearMotor1, LOW);
-    digitalWrite(rearMotor2, LOW);
-    digitalWrite(rearMotor3, LOW);
-    digitalWrite(frontMotor0, LOW);
-    digitalWrite(frontMotor1, LOW);
-    digitalWrite(auxAttach0, LOW);
-    digitalWrite(auxAttach1, LOW);
-    digitalWrite(auxAttach2, LOW);
-    digitalWrite(auxAttach3, LOW);
-    digitalWrite(auxAttach4, LOW);
-    digitalWrite(auxAttach5, LOW);
-    digitalWrite(LT1, LOW);
-    digitalWrite(LT2, LOW);
-    digitalWrite(LT3, LOW);
-  }
-}
\ No newline at end of file
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,385 @@
+// ============================================
+// ESP-NOW FLEET SIMULATOR
+// ============================================
+// Runs a base and a fleet of vehicles in one process on a simulated radio.
+// With bases=N there are N bases on the same channel, each with its own
+// session and its own fleet using the same vehicle indexes.
+//
+//   pio run -e sim
+//   .pio/build/sim/program src/sim/scenarios/fleet5.txt
+//   .pio/build/sim/program src/sim/scenarios/fleet20.txt input_hz=50 frame_bytes=96
+//
+// A scenario is a text file of key=value lines; anything given on the
+// command line overrides the file. See the scenarios folder for the keys.
+//
+//   .pio/build/sim/program src/sim/scenarios/macro.txt macro=0
+//
+// plays the same motion macro from the sticks instead of starting it on the
+// vehicle, for the timing and airtime next to each other.
+// ============================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "sim.h"
+#include "nodes.h"
+
+typedef std::map<std::string, std::string> Scenario;
+
+static bool parseLine(Scenario &scenario, std::string line) {
+    size_t comment = line.find('#');
+    if (comment != std::string::npos) {
+        line.erase(comment);
+    }
+    line.erase(0, line.find_first_not_of(" \t\r"));
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if (line.empty()) {
+        return true;
+    }
+    size_t equals = line.find('=');
+    if (equals == std::string::npos) {
+        return false;
+    }
+    std::string key = line.substr(0, equals);
+    std::string value = line.substr(equals + 1);
+    key.erase(key.find_last_not_of(" \t") + 1);
+    value.erase(0, value.find_first_not_of(" \t"));
+    scenario[key] = value;
+    return true;
+}
+
+static double number(const Scenario &scenario, const char *key, double fallback) {
+    Scenario::const_iterator it = scenario.find(key);
+    return it == scenario.end() ? fallback : atof(it->second.c_str());
+}
+
+static uint32_t percentile(std::vector<uint32_t> &values, double fraction) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t rank = (size_t)(fraction * (values.size() - 1) + 0.5);
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+}
+
+// simMacro played on an ideal clock: every output change at the time it is due
+static std::vector<OutputChange> referenceMacro() {
+    std::vector<OutputChange> changes;
+    MacroPlayer player;
+    startMacro(&player, &simMacro, 0, NULL);
+    uint32_t nowUs = 0;
+    for (;;) {
+        if (runMacro(&player, nowUs)) {
+            OutputChange change;
+            change.timeUs = nowUs;
+            memcpy(change.drive, player.drive, SIM_MACRO_CHANNELS);
+            changes.push_back(change);
+        }
+        if (!player.macro) {
+            return changes;
+        }
+        nowUs += macroDueInUs(&player, nowUs, 1000000);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <scenario file> [key=value ...]\n", argv[0]);
+        return 2;
+    }
+
+    Scenario scenario;
+    std::ifstream file(argv[1]);
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", argv[1]);
+        return 2;
+    }
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        if (!parseLine(scenario, line)) {
+            fprintf(stderr, "%s:%d: expected key=value\n", argv[1], lineNumber);
+            return 2;
+        }
+    }
+    for (int i = 2; i < argc; i++) {
+        if (!parseLine(scenario, argv[i])) {
+            fprintf(stderr, "Bad override: %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    double durationS = number(scenario, "duration_s", 30);
+    int vehicles = (int)number(scenario, "vehicles", 5);
+    int baseCount = std::max(1, (int)number(scenario, "bases", 1));
+    bool prePaired = number(scenario, "pre_paired", 1) != 0;
+
+    MediumConfig mediumConfig;
+    mediumConfig.lossPercent = number(scenario, "loss_percent", 0);
+    mediumConfig.latencyUs = (uint32_t)number(scenario, "latency_us", 100);
+    mediumConfig.jitterUs = (uint32_t)number(scenario, "jitter_us", 0);
+    mediumConfig.reorder = number(scenario, "reorder", 0) != 0;
+    mediumConfig.usPerByte = number(scenario, "us_per_byte", 8.0);
+    mediumConfig.overheadBytes = (uint32_t)number(scenario, "overhead_bytes", 43);
+    mediumConfig.preambleUs = (uint32_t)number(scenario, "preamble_us", 192);
+    mediumConfig.contention = number(scenario, "contention", 1) != 0;
+    mediumConfig.burstChannel = (uint8_t)number(scenario, "burst_channel", 0);
+    mediumConfig.burstLossPercent = number(scenario, "burst_loss_percent", 0);
+    mediumConfig.burstStartUs = (uint64_t)(number(scenario, "burst_start_s", 0) * 1e6);
+    mediumConfig.burstEndUs = (uint64_t)(number(scenario, "burst_end_s", 0) * 1e6);
+
+    BaseConfig baseConfig;
+    baseConfig.controllers = std::min(vehicles, (int)number(scenario, "controllers", 1));
+    baseConfig.inputRateHz = number(scenario, "input_hz", 100);
+    baseConfig.frameBytes = (size_t)number(scenario, "frame_bytes", sizeof(struct_message));
+    baseConfig.startChannel = (uint8_t)number(scenario, "start_channel", 1);
+    baseConfig.switchAtUs = (uint64_t)(number(scenario, "switch_at_s", 0) * 1e6);
+    baseConfig.handoff = number(scenario, "handoff", 1) != 0;
+    baseConfig.redundancy = std::min((int)number(scenario, "redundancy", REDUNDANCY_OFF), (int)REDUNDANCY_ALL);
+    baseConfig.stopAtUs = (uint64_t)(number(scenario, "stop_at_s", 0) * 1e6);
+    baseConfig.macroAtUs = (uint64_t)(number(scenario, "macro_at_s", 0) * 1e6);
+    baseConfig.macroMode = number(scenario, "macro", 1) != 0;
+    baseConfig.macroDpad = number(scenario, "macro_dpad", 0) != 0;
+
+    VehicleConfig vehicleConfig;
+    vehicleConfig.processUs = (uint32_t)number(scenario, "process_us", 200);
+    vehicleConfig.connectionTimeoutMs = (uint32_t)number(scenario, "connection_timeout_ms", 3000);
+    vehicleConfig.stopUs = (uint32_t)number(scenario, "stop_us", 30);
+    GovernorConfig &governor = vehicleConfig.governor;
+    governor.fullLossPercent = (uint8_t)number(scenario, "governor_full_loss_percent", governor.fullLossPercent);
+    governor.stopLossPercent = (uint8_t)number(scenario, "governor_stop_loss_percent", governor.stopLossPercent);
+    governor.fullGapMs = (uint16_t)number(scenario, "governor_full_gap_ms", governor.fullGapMs);
+    governor.stopGapMs = (uint16_t)number(scenario, "governor_stop_gap_ms", governor.stopGapMs);
+    governor.fullRssi = (int8_t)number(scenario, "governor_full_rssi", governor.fullRssi);
+    governor.stopRssi = (int8_t)number(scenario, "governor_stop_rssi", governor.stopRssi);
+    governor.rampDownMs = (uint16_t)number(scenario, "governor_ramp_down_ms", governor.rampDownMs);
+    governor.rampUpMs = (uint16_t)number(scenario, "governor_ramp_up_ms", governor.rampUpMs);
+    // Only this vehicle of each fleet drives out of range
+    int fadeVehicle = (int)number(scenario, "fade_vehicle", 1);
+    VehicleConfig fadeConfig = vehicleConfig;
+    fadeConfig.fadeStartUs = (uint64_t)(number(scenario, "fade_start_s", 0) * 1e6);
+    fadeConfig.fadeEndUs = (uint64_t)(number(scenario, "fade_end_s", 0) * 1e6);
+    fadeConfig.fadeStartRssi = (int8_t)number(scenario, "fade_start_rssi", fadeConfig.fadeStartRssi);
+    fadeConfig.fadeEndRssi = (int8_t)number(scenario, "fade_end_rssi", fadeConfig.fadeEndRssi);
+
+    Simulator sim((uint32_t)number(scenario, "seed", 1));
+    Medium medium(sim, mediumConfig);
+    std::vector<std::unique_ptr<BaseNode> > bases;
+    std::vector<std::unique_ptr<VehicleNode> > fleet;
+    for (int b = 0; b < baseCount; b++) {
+        baseConfig.session = (uint16_t)(b + 1);
+        bases.push_back(std::unique_ptr<BaseNode>(new BaseNode(sim, medium, baseConfig)));
+        medium.attach(bases.back().get());
+        // Without pre_paired every vehicle pairs with whichever base drives its index first
+        vehicleConfig.pairedSession = prePaired ? baseConfig.session : SESSION_NONE;
+        fadeConfig.pairedSession = vehicleConfig.pairedSession;
+        for (int v = 0; v < vehicles; v++) {
+            const VehicleConfig &config = v + 1 == fadeVehicle ? fadeConfig : vehicleConfig;
+            fleet.push_back(std::unique_ptr<VehicleNode>(new VehicleNode(sim, medium, v + 1, config)));
+            medium.attach(fleet.back().get());
+        }
+    }
+
+    bases[0]->start();
+    for (size_t b = 1; b < bases.size(); b++) {
+        // Bases are switched on independently, their beacons are not in step
+        BaseNode *base = bases[b].get();
+        sim.at(sim.below(CHANNEL_ANNOUNCE_PERIOD_MS * 1000), [base]() { base->start(); });
+    }
+    for (size_t v = 0; v < fleet.size(); v++) {
+        fleet[v]->start();
+    }
+    uint64_t endUs = (uint64_t)(durationS * 1e6);
+    sim.run(endUs);
+
+    printf("Scenario %s: %d base(s), %d vehicles each, %d driven, %.0f Hz, %u byte frames, %.0f s\n", argv[1],
+           baseCount, vehicles, baseConfig.controllers, baseConfig.inputRateHz, (unsigned)std::max(baseConfig.frameBytes, sizeof(struct_message)),
+           durationS);
+    const MediumStats &m = medium.stats;
+    printf("Medium: airtime %.1f%% | transmissions %llu | collisions %llu | deferrals %llu | receptions %llu | lost %llu\n",
+           endUs ? 100.0 * m.busyUs / endUs : 0.0, (unsigned long long)m.transmissions,
+           (unsigned long long)m.collisions, (unsigned long long)m.deferrals, (unsigned long long)m.deliveries,
+           (unsigned long long)m.losses);
+    for (size_t b = 0; b < bases.size(); b++) {
+        const BaseNode &base = *bases[b];
+        printf("Base %04x: channel %d | moves %llu | announces %llu | link reports %llu (foreign %llu) | confirm "
+               "timeouts %llu\n",
+               base.session(), base.channel(), (unsigned long long)base.channelMoves,
+               (unsigned long long)base.announcesSent, (unsigned long long)base.linkReports,
+               (unsigned long long)base.foreignReports, (unsigned long long)base.confirmTimeouts);
+    }
+
+    printf("\nVehicle  session  queued    sent  applied  delivery  base ovw  veh ovw  p50 ms  p99 ms  max ms  failsafes  "
+           "first frame  foreign\n");
+    uint64_t totalFailsafes = 0;
+    std::vector<uint32_t> allLatencies;
+    uint64_t totalQueued = 0, totalApplied = 0;
+    for (size_t v = 0; v < fleet.size(); v++) {
+        VehicleNode &vehicle = *fleet[v];
+        totalFailsafes += vehicle.failsafes;
+        if (v % vehicles >= (size_t)baseConfig.controllers) {
+            continue; // Idle vehicles only listen
+        }
+        const BaseVehicleStats &b = bases[v / vehicles]->stats[v % vehicles];
+        uint64_t foreign = vehicle.link.foreignOther;
+        for (int i = 0; i < FOREIGN_SESSION_SLOTS; i++) {
+            foreign += vehicle.link.foreign[i].rejected;
+        }
+        totalQueued += b.framesQueued;
+        totalApplied += vehicle.framesApplied;
+        allLatencies.insert(allLatencies.end(), vehicle.latenciesUs.begin(), vehicle.latenciesUs.end());
+        std::vector<uint32_t> &latencies = vehicle.latenciesUs;
+        printf("%7u     %04x %7llu %7llu  %7llu   %6.1f%%  %8llu  %7llu  %6.2f  %6.2f  %6.2f  %9llu  %8.1f ms  %7llu\n",
+               vehicle.index, vehicle.link.session, (unsigned long long)b.framesQueued, (unsigned long long)b.framesSent,
+               (unsigned long long)vehicle.framesApplied,
+               b.framesQueued ? 100.0 * vehicle.framesApplied / b.framesQueued : 0.0,
+               (unsigned long long)b.overwrites, (unsigned long long)vehicle.overwrites,
+               percentile(latencies, 0.5) / 1000.0, percentile(latencies, 0.99) / 1000.0,
+               latencies.empty() ? 0.0 : *std::max_element(latencies.begin(), latencies.end()) / 1000.0,
+               (unsigned long long)vehicle.failsafes, vehicle.firstFrameUs / 1000.0, (unsigned long long)foreign);
+    }
+
+    for (size_t v = 0; v < fleet.size(); v++) {
+        for (size_t i = 0; i < fleet[v]->failsafeTimesMs.size(); i++) {
+            printf("Failsafe: vehicle %u at %.3f s\n", fleet[v]->index, fleet[v]->failsafeTimesMs[i] / 1000.0);
+        }
+    }
+
+    // Vehicle 1 of the first fleet is the one controller 0 leaves
+    if (baseConfig.switchAtUs && vehicles > baseConfig.controllers) {
+        const VehicleNode &left = *fleet[0];
+        const HandoffStats &h = bases[0]->handoffStats;
+        double neutralMs = -1;
+        const char *how = "never";
+        if (left.neutralUs >= baseConfig.switchAtUs) {
+            neutralMs = (left.neutralUs - baseConfig.switchAtUs) / 1000.0;
+            how = "release frame";
+        } else {
+            for (size_t i = 0; i < left.failsafeTimesMs.size(); i++) {
+                if (left.failsafeTimesMs[i] * 1000ULL >= baseConfig.switchAtUs) {
+                    neutralMs = (left.failsafeTimesMs[i] * 1000ULL - baseConfig.switchAtUs) / 1000.0;
+                    how = "connection timeout";
+                    break;
+                }
+            }
+        }
+        printf("\nHandoff at %.3f s: vehicle 1 at neutral after %.2f ms (%s) | %u release frames | acked %u, "
+               "failed %u, ack after %u ms\n",
+               baseConfig.switchAtUs / 1e6, neutralMs, how, h.attempts, h.acked, h.failed, h.maxAckMs);
+    }
+
+    // The governor should bring a fading vehicle to a stop before its failsafe
+    for (size_t v = 0; v < fleet.size(); v++) {
+        const VehicleNode &vehicle = *fleet[v];
+        if (!vehicle.fading()) {
+            continue;
+        }
+        double failsafeS = vehicle.failsafeTimesMs.empty() ? -1 : vehicle.failsafeTimesMs[0] / 1000.0;
+        printf("\nGovernor: vehicle %u slowing from %.3f s, halted at %.3f s, failsafe at %.3f s with the limit at "
+               "%d%% | limited %.1f s, down to %d%%\n",
+               vehicle.index, vehicle.slowedUs / 1e6, vehicle.haltedUs ? vehicle.haltedUs / 1e6 : -1.0, failsafeS,
+               vehicle.limitAtFailsafe * 100 / GOVERNOR_FULL, vehicle.governor.limitedMs / 1000.0,
+               vehicle.governor.lowestLimit * 100 / GOVERNOR_FULL);
+    }
+
+    // Trigger to safe outputs on every vehicle, next to what a frame takes
+    if (baseConfig.stopAtUs) {
+        std::vector<uint32_t> stopUs;
+        for (size_t v = 0; v < fleet.size(); v++) {
+            if (fleet[v]->stoppedUs >= baseConfig.stopAtUs) {
+                stopUs.push_back((uint32_t)(fleet[v]->stoppedUs - baseConfig.stopAtUs));
+            }
+        }
+        uint64_t copies = 0, acks = 0, held = 0;
+        for (size_t b = 0; b < bases.size(); b++) {
+            copies += bases[b]->stopCopiesSent;
+            acks += bases[b]->stopAcks;
+            held += bases[b]->stoppedFrames;
+        }
+        printf("\nStop at %.3f s: first copy after %.2f ms, %llu copies | %u of %u vehicles safe, p50 %.2f ms, max "
+               "%.2f ms | %llu acks | %llu frames held\n",
+               baseConfig.stopAtUs / 1e6, bases[0]->firstStopCopyUs / 1000.0, (unsigned long long)copies,
+               (unsigned)stopUs.size(), (unsigned)fleet.size(), percentile(stopUs, 0.5) / 1000.0,
+               stopUs.empty() ? 0.0 : *std::max_element(stopUs.begin(), stopUs.end()) / 1000.0,
+               (unsigned long long)acks, (unsigned long long)held);
+    }
+
+    // Vehicle 1's outputs against the macro on an ideal clock, each change
+    // matched in order; a change the vehicle never showed counts as missed
+    if (baseConfig.macroAtUs) {
+        const VehicleNode &vehicle = *fleet[0];
+        const BaseNode &base = *bases[0];
+        std::vector<OutputChange> reference = referenceMacro();
+        size_t next = 0;
+        while (next < vehicle.outputs.size() && vehicle.outputs[next].timeUs < baseConfig.macroAtUs) {
+            next++;
+        }
+        int64_t firstUs = -1;
+        std::vector<int32_t> errorsUs;
+        for (size_t r = 0; r < reference.size(); r++) {
+            size_t v = next;
+            while (v < vehicle.outputs.size() &&
+                   memcmp(vehicle.outputs[v].drive, reference[r].drive, SIM_MACRO_CHANNELS) != 0) {
+                v++;
+            }
+            if (v == vehicle.outputs.size()) {
+                continue;
+            }
+            next = v + 1;
+            if (firstUs < 0) {
+                firstUs = (int64_t)vehicle.outputs[v].timeUs - (int64_t)reference[r].timeUs;
+            }
+            errorsUs.push_back((int32_t)((int64_t)vehicle.outputs[v].timeUs - (int64_t)reference[r].timeUs - firstUs));
+        }
+        double sum = 0;
+        int32_t least = 0, most = 0;
+        for (size_t i = 0; i < errorsUs.size(); i++) {
+            sum += errorsUs[i] < 0 ? -errorsUs[i] : errorsUs[i];
+            least = std::min(least, errorsUs[i]);
+            most = std::max(most, errorsUs[i]);
+        }
+        const MacroStats &m = base.macroStats;
+        printf("\nMacro at %.3f s (%s): %u of %u output changes, error avg %.2f ms, min %.2f ms, max %.2f ms | "
+               "first change %.2f ms after the trigger",
+               base.macroTriggerUs / 1e6,
+               !baseConfig.macroMode ? "streamed from the sticks"
+               : baseConfig.macroDpad ? "D-pad press, one start message" : "one start message",
+               (unsigned)errorsUs.size(), (unsigned)reference.size(), errorsUs.empty() ? 0.0 : sum / errorsUs.size() / 1000.0,
+               least / 1000.0, most / 1000.0, firstUs < 0 ? -1.0 : (firstUs - (int64_t)base.macroTriggerUs) / 1000.0);
+        if (baseConfig.macroMode) {
+            printf(" (start message to first step %.2f ms)", vehicle.macroStartUs / 1000.0);
+        }
+        printf("\nMacro traffic to vehicle 1 from then on: %llu messages, %llu bytes | %llu start copies, %llu frames "
+               "held, %llu keepalives | runs %llu, aborted %llu, refused %llu\n",
+               (unsigned long long)base.macroMessages, (unsigned long long)base.macroBytes,
+               (unsigned long long)m.copies, (unsigned long long)m.heldFrames, (unsigned long long)m.keepalives,
+               (unsigned long long)vehicle.macroRuns, (unsigned long long)vehicle.macroAborts,
+               (unsigned long long)vehicle.macroRefused);
+    }
+
+    uint64_t received = 0, missed = 0, recovered = 0, repeats = 0;
+    for (size_t v = 0; v < fleet.size(); v++) {
+        received += fleet[v]->reportedReceived;
+        missed += fleet[v]->reportedMissed;
+        recovered += fleet[v]->reportedRecovered;
+    }
+    for (size_t b = 0; b < bases.size(); b++) {
+        repeats += bases[b]->repeatsSent;
+    }
+    uint64_t expected = received + missed;
+    printf("\nRedundancy %s: %llu repeats | base messages lost %.2f%% on air, %.2f%% after repeats\n",
+           redundancyModeNames[baseConfig.redundancy], (unsigned long long)repeats,
+           expected ? 100.0 * (missed + recovered) / expected : 0.0, expected ? 100.0 * missed / expected : 0.0);
+
+    printf("\nTotal: delivery %.1f%% | latency p50 %.2f ms p99 %.2f ms | failsafes %llu\n",
+           totalQueued ? 100.0 * totalApplied / totalQueued : 0.0, percentile(allLatencies, 0.5) / 1000.0,
+           percentile(allLatencies, 0.99) / 1000.0, (unsigned long long)totalFailsafes);
+    return 0;
+}
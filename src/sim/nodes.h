@@ -0,0 +1,748 @@
+#pragma once
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "sim.h"
+#include "protocol.h"
+#include "channel.h"
+#include "link.h"
+#include "handoff.h"
+#include "redundancy.h"
+#include "governor.h"
+#include "estop.h"
+#include "macro.h"
+
+// ============================================
+// SIMULATED BASE AND VEHICLES
+// ============================================
+// Each node follows the task layout of its firmware: the base has an input
+// stage filling one mailbox per controller and a radio stage with a single
+// frame in flight, a vehicle has a control stage behind a one-frame mailbox
+// and a housekeeping tick. The network logic is the real shared code from
+// protocol.h, channel.h, link.h, handoff.h, redundancy.h, governor.h,
+// estop.h and macro.h.
+// ============================================
+
+// The macro vehicle 1 is asked for. A vehicle's output on channel c is
+// what the driver would set with axis c at 5 per percent: axisX, axisY,
+// axisRX, axisRY.
+#define SIM_MACRO_CHANNELS 4
+#define SIM_MACRO_AXIS_SCALE 5
+// With macroDpad the driver holds the macro button from macroAtUs and
+// presses D-pad up this much later, for one input sample or more
+#define SIM_MACRO_BUTTON 1
+#define SIM_MACRO_PRESS_MS 100
+#define SIM_MACRO_HOLD_MS 300
+static const uint8_t simMacroCode[] = {
+    MACRO_DRIVE(0, 80, 640), MACRO_DRIVE(1, -50, 905), MACRO_SETTLE, MACRO_WAIT(333),
+    MACRO_DRIVE(2, 60, 415), MACRO_WAIT(157), MACRO_DRIVE(3, -100, 246), MACRO_SETTLE,
+    MACRO_SET(0, 30), MACRO_WAIT(522), MACRO_END};
+static const MacroDef simMacro = MACRO_DEF("sim", simMacroCode);
+
+struct BaseConfig {
+    int controllers = 1;       // Each one drives vehicle index controller + 1
+    double inputRateHz = 100;  // Controller updates per second, per controller
+    size_t frameBytes = sizeof(struct_message); // Padded up to try larger frames
+    uint8_t startChannel = 1;
+    uint32_t sendConfirmTimeoutUs = 20000;
+    uint16_t session = 1;
+    uint64_t switchAtUs = 0; // Controller 0 moves on to the first undriven vehicle then, 0 never
+    bool handoff = true;     // Release the vehicle left behind, as the firmware does
+    int redundancy = REDUNDANCY_OFF;
+    uint64_t stopAtUs = 0;   // Emergency stop of the whole fleet then, 0 never
+    // Controller 0 runs simMacro on vehicle 1 then: with macroMode as one
+    // macro start, without it by streaming the sticks. 0 never.
+    uint64_t macroAtUs = 0;
+    bool macroMode = true;
+    bool macroDpad = false; // Started from the controller like base.cpp, not from the serial monitor
+};
+
+struct VehicleConfig {
+    uint32_t processUs = 200;           // Control task time per frame
+    uint32_t connectionTimeoutMs = 3000; // CONNECTION_TIMEOUT in the firmwares
+    uint32_t housekeepingMs = 10;
+    uint32_t reportPeriodMs = 1000;
+    uint16_t pairedSession = SESSION_NONE; // Left over from a previous run, none pairs with the first base
+    uint32_t controlIdleMs = 20;         // CONTROL_IDLE_PERIOD_MS, the governor runs at least this often
+    uint32_t stopUs = 30;                // Receive callback writing every output safe
+    GovernorConfig governor = defaultGovernorConfig();
+    // Synthetic link trace: the vehicle drives out of range, loss grows from
+    // 0 to 100% and the signal from fadeStartRssi to fadeEndRssi. 0 never;
+    // an rssi of 0 leaves the signal unknown, as on a firmware built
+    // without GOVERNOR_RSSI.
+    uint64_t fadeStartUs = 0;
+    uint64_t fadeEndUs = 0;
+    int8_t fadeStartRssi = -60;
+    int8_t fadeEndRssi = -95;
+};
+
+// A vehicle's outputs after a change, for the macro comparison
+struct OutputChange {
+    uint64_t timeUs;
+    int8_t drive[SIM_MACRO_CHANNELS];
+};
+
+// Counters the base keeps per driven vehicle
+struct BaseVehicleStats {
+    uint64_t framesQueued = 0;
+    uint64_t framesSent = 0;
+    uint64_t overwrites = 0; // Frames replaced in the mailbox before the radio got to them
+};
+
+class BaseNode : public Node {
+public:
+    BaseNode(Simulator &sim, Medium &medium, const BaseConfig &config)
+        : sim(sim), medium(medium), config(config) {
+        slots.resize(config.controllers);
+        stats.resize(config.controllers);
+        repeats.resize(config.controllers);
+        initChannelMigrator(&migrator, config.startChannel);
+        clearChannelScores(&scores);
+    }
+
+    void start() {
+        uint64_t period = (uint64_t)(1000000.0 / config.inputRateHz);
+        for (int c = 0; c < config.controllers; c++) {
+            // Controllers are not in step with each other
+            sim.after(sim.below((uint32_t)period), [this, c]() { inputTick(c); });
+        }
+        sim.after(0, [this]() { channelTick(); });
+        if (config.stopAtUs) {
+            sim.at(config.stopAtUs, [this]() { requestStop(); });
+        }
+        if (config.macroAtUs && !(config.macroMode && config.macroDpad)) {
+            sim.at(config.macroAtUs, [this]() { requestMacro(1, 0); });
+        }
+    }
+
+    virtual void receive(const uint8_t *data, int len, uint64_t) {
+        uint32_t receiverIndex;
+        if (len < (int)sizeof(ReleaseAck)) {
+            return;
+        }
+        memcpy(&receiverIndex, data, sizeof(receiverIndex));
+        if (receiverIndex == RECEIVER_STOP_ACK && len >= (int)sizeof(StopAck)) {
+            StopAck ack;
+            memcpy(&ack, data, sizeof(ack));
+            if (ack.sessionId == config.session) {
+                stopAcks++;
+                lastStopAckUs = sim.now();
+            }
+            return;
+        }
+        if (receiverIndex == RECEIVER_RELEASE_ACK) {
+            ReleaseAck ack;
+            memcpy(&ack, data, sizeof(ack));
+            if (ack.sessionId == config.session) {
+                ackHandoff(handoffs, &handoffStats, ack.vehicleIndex, sim.millis());
+            }
+            return;
+        }
+        if (receiverIndex != RECEIVER_LINK_REPORT || len < (int)sizeof(LinkReport)) {
+            return;
+        }
+        LinkReport report;
+        memcpy(&report, data, sizeof(report));
+        if (report.sessionId != config.session) {
+            foreignReports++;
+            return;
+        }
+        linkReports++;
+        // Same rule as the firmware: only a vehicle someone is driving counts
+        if (report.vehicleIndex >= 1 && report.vehicleIndex <= (uint32_t)config.controllers) {
+            pendingLoss = sequenceLossPercent(report.framesReceived, report.framesMissed);
+            lossReportReady = true;
+        }
+    }
+
+    virtual uint8_t channel() const { return migrator.channel; }
+    uint16_t session() const { return config.session; }
+
+    std::vector<BaseVehicleStats> stats;
+    HandoffStats handoffStats = HandoffStats();
+    uint64_t announcesSent = 0;
+    uint64_t linkReports = 0;
+    uint64_t foreignReports = 0; // Link reports from vehicles paired with another base
+    uint64_t channelMoves = 0;
+    uint64_t confirmTimeouts = 0;
+    uint64_t repeatsSent = 0;
+    uint64_t stopCopiesSent = 0;
+    uint64_t stoppedFrames = 0;  // Frames dropped while the fleet was stopped
+    uint32_t firstStopCopyUs = 0; // Trigger to the radio taking the first copy
+    uint64_t stopAcks = 0;
+    uint64_t lastStopAckUs = 0;
+    uint64_t macroMessages = 0;  // Sent for vehicle 1 from macroAtUs on
+    uint64_t macroBytes = 0;
+    uint64_t macroTriggerUs = 0; // When the macro was asked for, 0 never
+    MacroStats macroStats = MacroStats();
+
+private:
+    struct Slot {
+        bool full = false;
+        struct_message frame;
+        uint64_t createdUs = 0;
+        struct_message previous; // Last frame sent, for REDUNDANCY_CHANGES
+        bool previousValid = false;
+    };
+
+    // Input stage: sample the stick, overwrite the mailbox, wake the radio
+    void inputTick(int c) {
+        Slot &slot = slots[c];
+        if (slot.full) {
+            stats[c].overwrites++;
+        }
+        uint32_t target = c + 1;
+        if (c == 0 && config.switchAtUs && sim.now() >= config.switchAtUs) {
+            target = config.controllers + 1;
+            if (slot.frame.receiverIndex == 1 && config.handoff) {
+                startHandoff(handoffs, &handoffStats, &slot.frame, sim.millis());
+                cancelRepeats(repeats.data(), config.controllers, slot.frame.receiverIndex);
+            }
+        }
+        memset(&slot.frame, 0, sizeof(slot.frame));
+        slot.frame.receiverIndex = target;
+        if (c == 0 && config.macroAtUs && sim.now() >= config.macroAtUs) {
+            // The driver lets go of the sticks, or plays the macro on them
+            if (!config.macroMode && driverMacro.macro) {
+                runMacro(&driverMacro, (uint32_t)sim.now());
+                int32_t *axes[SIM_MACRO_CHANNELS] = {&slot.frame.axisX, &slot.frame.axisY, &slot.frame.axisRX,
+                                                     &slot.frame.axisRY};
+                for (int a = 0; a < SIM_MACRO_CHANNELS; a++) {
+                    *axes[a] = driverMacro.drive[a] * SIM_MACRO_AXIS_SCALE;
+                }
+            } else if (config.macroMode && config.macroDpad) {
+                // Same steps as processGamepad() in base.cpp
+                uint64_t sinceMs = (sim.now() - config.macroAtUs) / 1000;
+                bool held = sinceMs < SIM_MACRO_HOLD_MS;
+                slot.frame.miscButtons = held ? SIM_MACRO_BUTTON : 0;
+                slot.frame.dpad = sinceMs >= SIM_MACRO_PRESS_MS && held ? 1 : 0;
+                int macro = takeMacroTrigger(&macroTrigger, held, &slot.frame);
+                if (macro >= 0) {
+                    requestMacro(slot.frame.receiverIndex, (uint8_t)macro);
+                }
+            }
+        } else {
+            slot.frame.axisY = (int32_t)(sim.millis() % 1024) - 512;
+        }
+        slot.createdUs = sim.now();
+        slot.full = true;
+        stats[c].framesQueued++;
+        radioKick();
+        sim.after((uint64_t)(1000000.0 / config.inputRateHz), [this, c]() { inputTick(c); });
+    }
+
+    // Same as requestStop() and serviceStops() in base.cpp
+    void requestStop() {
+        StopRequest request;
+        request.vehicleIndex = RECEIVER_NONE;
+        request.reason = STOP_SERIAL;
+        request.triggeredUs = (uint32_t)sim.now();
+        startStop(stopSlots, &request, nextStopId++);
+        fleetStopped = true;
+        for (size_t c = 0; c < repeats.size(); c++) {
+            repeats[c].pending = false;
+        }
+        radioKick();
+    }
+
+    // Same as requestMacro() and serviceMacros() in base.cpp
+    void requestMacro(uint32_t vehicleIndex, uint8_t macro) {
+        macroTriggerUs = sim.now();
+        if (!config.macroMode) {
+            startMacro(&driverMacro, &simMacro, (uint32_t)sim.now(), NULL);
+            return;
+        }
+        MacroRequest request;
+        request.vehicleIndex = vehicleIndex;
+        request.macro = macro;
+        request.controller = 0;
+        startMacroBroadcast(macroSlots, &request, nextMacroRunId++);
+        startMacroQuiet(&quiet, request.vehicleIndex, sim.millis());
+        macroStats.started++;
+        radioKick();
+    }
+
+    // What the base puts on air for vehicle 1 once the macro is asked for
+    void countMacroTraffic(uint32_t vehicleIndex, size_t bytes) {
+        if (config.macroAtUs && sim.now() >= config.macroAtUs && vehicleIndex == 1) {
+            macroMessages++;
+            macroBytes += bytes;
+        }
+    }
+
+    // Radio stage: one frame in flight, stops first, then announces, then round robin
+    void radioKick() {
+        if (!radioBusy) {
+            radioNext();
+        }
+    }
+
+    void radioNext() {
+        std::vector<uint8_t> payload;
+        uint64_t createdUs = sim.now();
+        if (StopBroadcast *slot = dueStop(stopSlots, sim.millis())) {
+            StopMessage message;
+            buildStopMessage(slot, &message);
+            message.sequence = nextSequence++;
+            message.sessionId = config.session;
+            payload.assign((const uint8_t *)&message, (const uint8_t *)&message + sizeof(message));
+            noteStopSent(slot, sim.millis(), (uint32_t)sim.now());
+            if (!firstStopCopyUs) {
+                firstStopCopyUs = slot->firstCopyUs;
+            }
+            stopCopiesSent++;
+            if (slot->active) {
+                sim.after(STOP_COPY_INTERVAL_MS * 1000, [this]() { radioKick(); });
+            }
+        } else if (MacroBroadcast *slot = dueMacroBroadcast(macroSlots, sim.millis())) {
+            MacroMessage message;
+            buildMacroMessage(slot, &message);
+            message.sequence = nextSequence++;
+            message.sessionId = config.session;
+            payload.assign((const uint8_t *)&message, (const uint8_t *)&message + sizeof(message));
+            noteMacroBroadcastSent(slot, sim.millis());
+            macroStats.copies++;
+            countMacroTraffic(message.vehicleIndex, payload.size());
+            if (slot->active) {
+                sim.after(MACRO_COPY_INTERVAL_MS * 1000, [this]() { radioKick(); });
+            }
+        } else if (quietFrameValid && !fleetStopped && macroKeepaliveDue(&quiet, sim.millis())) {
+            struct_message keepalive = quietFrame;
+            keepalive.flags = 0;
+            keepalive.sequence = nextSequence++;
+            keepalive.sessionId = config.session;
+            payload.assign((const uint8_t *)&keepalive, (const uint8_t *)&keepalive + sizeof(keepalive));
+            payload.resize(std::max(payload.size(), config.frameBytes), 0);
+            quiet.lastSent = sim.millis();
+            macroStats.keepalives++;
+            countMacroTraffic(keepalive.receiverIndex, payload.size());
+        } else if (announcePending) {
+            announcePending = false;
+            ChannelAnnounce announce;
+            memset(&announce, 0, sizeof(announce));
+            announce.receiverIndex = RECEIVER_CHANNEL_ANNOUNCE;
+            announce.sequence = nextSequence++;
+            announce.sessionId = config.session;
+            announce.channel = migrator.channel;
+            announce.nextChannel = migrator.nextChannel;
+            announce.switchInMs = channelMoveIn(&migrator, sim.millis());
+            payload.assign((const uint8_t *)&announce, (const uint8_t *)&announce + sizeof(announce));
+            announcesSent++;
+        } else if (Handoff *handoff = dueHandoff(handoffs, &handoffStats, sim.millis())) {
+            handoff->release.sequence = nextSequence++;
+            handoff->release.sessionId = config.session;
+            noteHandoffSent(handoff, &handoffStats, sim.millis());
+            payload.assign((const uint8_t *)&handoff->release, (const uint8_t *)&handoff->release + sizeof(handoff->release));
+        } else if (FrameRepeat *repeat = dueRepeat()) {
+            repeat->pending = false;
+            payload.assign((const uint8_t *)&repeat->frame, (const uint8_t *)&repeat->frame + sizeof(repeat->frame));
+            payload.resize(std::max(payload.size(), config.frameBytes), 0);
+            repeatsSent++;
+            countMacroTraffic(repeat->frame.receiverIndex, payload.size());
+        } else {
+            // Controller 0's frames without input stay at the base while vehicle 1 runs the macro
+            if (slots[0].full && macroQuietHolds(&quiet, &slots[0].frame)) {
+                slots[0].full = false;
+                quietFrame = slots[0].frame;
+                quietFrameValid = true;
+                macroStats.heldFrames++;
+            }
+            int c = -1;
+            for (int i = 0; i < config.controllers; i++) {
+                int candidate = (nextSlot + i) % config.controllers;
+                if (slots[candidate].full) {
+                    c = candidate;
+                    break;
+                }
+            }
+            if (c < 0) {
+                radioBusy = false;
+                return;
+            }
+            // Held at the base until the fleet is resumed, which the simulator never does
+            if (fleetStopped) {
+                for (size_t i = 0; i < slots.size(); i++) {
+                    if (slots[i].full) {
+                        slots[i].full = false;
+                        stoppedFrames++;
+                    }
+                }
+                radioBusy = false;
+                return;
+            }
+            nextSlot = (c + 1) % config.controllers;
+            Slot &slot = slots[c];
+            slot.full = false;
+            cancelHandoff(handoffs, slot.frame.receiverIndex);
+            slot.frame.sequence = nextSequence++;
+            slot.frame.sessionId = config.session;
+            payload.assign((const uint8_t *)&slot.frame, (const uint8_t *)&slot.frame + sizeof(slot.frame));
+            payload.resize(std::max(payload.size(), config.frameBytes), 0);
+            createdUs = slot.createdUs;
+            stats[c].framesSent++;
+            scheduleRepeat(&repeats[c], config.redundancy, &slot.frame, slot.previousValid ? &slot.previous : NULL,
+                           sim.millis());
+            slot.previous = slot.frame;
+            slot.previousValid = true;
+            if (c == 0) {
+                quiet.lastSent = sim.millis();
+            }
+            countMacroTraffic(slot.frame.receiverIndex, payload.size());
+            if (repeats[c].pending) {
+                sim.after(FRAME_REPEAT_DELAY_MS * 1000, [this]() { radioKick(); });
+            }
+        }
+        radioBusy = true;
+        // The radio task waits for the send callback, or gives up after the timeout
+        uint64_t attempt = ++sendAttempt;
+        medium.transmit(this, payload, createdUs, [this, attempt]() { sendDone(attempt); });
+        sim.after(config.sendConfirmTimeoutUs, [this, attempt]() {
+            if (attempt == sendAttempt && radioBusy && !confirmed) {
+                confirmTimeouts++;
+                sendDone(attempt);
+            }
+        });
+        confirmed = false;
+    }
+
+    FrameRepeat *dueRepeat() {
+        for (size_t c = 0; c < repeats.size(); c++) {
+            if (repeatDue(&repeats[c], sim.millis())) {
+                return &repeats[c];
+            }
+        }
+        return NULL;
+    }
+
+    void sendDone(uint64_t attempt) {
+        if (attempt != sendAttempt || confirmed) {
+            return;
+        }
+        confirmed = true;
+        radioNext();
+    }
+
+    // Same steps as serviceChannel() in base.cpp, once per millisecond
+    void channelTick() {
+        unsigned long now = sim.millis();
+        if (lossReportReady) {
+            lossReportReady = false;
+            if (reportChannelLoss(&migrator, pendingLoss, now)) {
+                scores.congestion[migrator.channel] += CHANNEL_LOSS_PENALTY;
+                scheduleChannelMove(&migrator, pickCleanestChannel(&scores, migrator.channel), now);
+            }
+        }
+        unsigned long period = channelMovePending(&migrator) ? CHANNEL_MOVE_ANNOUNCE_PERIOD_MS : CHANNEL_ANNOUNCE_PERIOD_MS;
+        if (now - lastAnnounceTime >= period) {
+            lastAnnounceTime = now;
+            announcePending = true;
+            radioKick();
+        }
+        if (handoffPending(handoffs) || macroKeepaliveDue(&quiet, now)) {
+            radioKick();
+        }
+        uint8_t channel = migrator.channel;
+        if (updateChannelMigrator(&migrator, now) != channel) {
+            channelMoves++;
+        }
+        sim.after(1000, [this]() { channelTick(); });
+    }
+
+    Simulator &sim;
+    Medium &medium;
+    BaseConfig config;
+    std::vector<Slot> slots;
+    std::vector<FrameRepeat> repeats;
+    ChannelMigrator migrator;
+    ChannelScores scores;
+    uint16_t nextSequence = 0;
+    Handoff handoffs[HANDOFF_SLOTS] = {};
+    int nextSlot = 0;
+    bool radioBusy = false;
+    bool confirmed = true;
+    uint64_t sendAttempt = 0;
+    bool announcePending = false;
+    unsigned long lastAnnounceTime = 0;
+    uint8_t pendingLoss = 0;
+    bool lossReportReady = false;
+    StopBroadcast stopSlots[STOP_SLOTS] = {};
+    uint16_t nextStopId = 1;
+    bool fleetStopped = false;
+    MacroPlayer driverMacro = MacroPlayer(); // The driver's hands when macroMode is off
+    MacroBroadcast macroSlots[MACRO_SLOTS] = {};
+    uint16_t nextMacroRunId = 1;
+    MacroQuiet quiet = MacroQuiet(); // Controller 0's
+    MacroTrigger macroTrigger = MacroTrigger();
+    struct_message quietFrame;
+    bool quietFrameValid = false;
+};
+
+class VehicleNode : public Node {
+public:
+    VehicleNode(Simulator &sim, Medium &medium, uint32_t index, const VehicleConfig &config)
+        : index(index), sim(sim), medium(medium), config(config) {}
+
+    void start() {
+        initVehicleLink(&link, WIFI_CHANNEL_MIN, config.pairedSession, sim.millis());
+        initGovernor(&governor, sim.millis());
+        // Vehicles power up at different moments
+        sim.at(sim.below(config.housekeepingMs * 1000), [this]() { housekeepingTick(); });
+        sim.at(sim.below(config.controlIdleMs * 1000), [this]() { controlTick(); });
+    }
+
+    bool fading() const { return config.fadeEndUs > config.fadeStartUs; }
+
+    // How far along the fade the vehicle is, 0 before and 1 after
+    double fade(uint64_t nowUs) const {
+        if (!fading() || nowUs <= config.fadeStartUs) {
+            return 0;
+        }
+        if (nowUs >= config.fadeEndUs) {
+            return 1;
+        }
+        return (double)(nowUs - config.fadeStartUs) / (config.fadeEndUs - config.fadeStartUs);
+    }
+
+    virtual double extraLossPercent(uint64_t nowUs) const { return 100.0 * fade(nowUs); }
+
+    int8_t rssi(uint64_t nowUs) const {
+        if (!fading() || config.fadeStartRssi == GOVERNOR_RSSI_UNKNOWN) {
+            return GOVERNOR_RSSI_UNKNOWN;
+        }
+        return (int8_t)(config.fadeStartRssi + (config.fadeEndRssi - config.fadeStartRssi) * fade(nowUs));
+    }
+
+    virtual void receive(const uint8_t *data, int len, uint64_t createdUs) {
+        if (!receiveBaseMessage(&link, data, len, sim.millis())) {
+            // Same as the firmware's OnDataRecv: outputs safe in the callback
+            if (takeStop(&link, index)) {
+                pendingFrame = false;
+                uint64_t heardUs = sim.now();
+                sim.after(config.stopUs, [this, heardUs]() {
+                    if (!stoppedUs) {
+                        stoppedUs = sim.now();
+                    }
+                    StopAck ack;
+                    buildStopAck(&link, index, (uint32_t)(sim.now() - heardUs), &ack);
+                    std::vector<uint8_t> payload((const uint8_t *)&ack, (const uint8_t *)&ack + sizeof(ack));
+                    medium.transmit(this, payload, sim.now());
+                });
+            }
+            // Picked up at the control task's next wake, as in the firmware
+            uint8_t macro;
+            if (takeMacro(&link, index, &macro)) {
+                requestedMacro = macro;
+                requestedMacroUs = sim.now();
+            }
+            return;
+        }
+        uint32_t receiverIndex;
+        memcpy(&receiverIndex, data, sizeof(receiverIndex));
+        if (receiverIndex != index) {
+            return;
+        }
+        confirmSession(&link);
+        framesHeard++;
+        struct_message frame;
+        memcpy(&frame, data, sizeof(frame));
+        countOwnFrame(&link, &frame);
+        // One-frame mailbox in front of the control task, newest frame wins
+        if (controlBusy) {
+            if (pendingFrame) {
+                overwrites++;
+            }
+            pendingFrame = true;
+            pendingCreatedUs = createdUs;
+            pending = frame;
+            return;
+        }
+        process(createdUs, frame);
+    }
+
+    virtual uint8_t channel() const { return link.follower.channel; }
+
+    uint32_t index;
+    uint64_t framesHeard = 0;
+    uint64_t framesApplied = 0;
+    uint64_t overwrites = 0;
+    uint64_t failsafes = 0;
+    std::vector<unsigned long> failsafeTimesMs;
+    std::vector<uint32_t> latenciesUs; // Command sampled at the base to actuator written
+    uint64_t firstFrameUs = 0;
+    uint64_t neutralUs = 0; // Last time a release frame took the vehicle to neutral
+    uint64_t reportedReceived = 0; // Sums of its link reports, what the base hears
+    uint64_t reportedMissed = 0;
+    uint64_t reportedRecovered = 0;
+    uint64_t slowedUs = 0;   // Governor first left full speed, 0 never
+    uint64_t haltedUs = 0;   // Governor reached zero after that, 0 never
+    int32_t limitAtFailsafe = GOVERNOR_FULL;
+    uint64_t stoppedUs = 0;  // Outputs written safe by the first stop, 0 never
+    std::vector<OutputChange> outputs; // Every change of the macro channels
+    uint64_t macroStartUs = 0;         // Start message heard to first step, 0 never
+    uint64_t macroRuns = 0;
+    uint64_t macroAborts = 0;          // Ended by a frame or the timeout
+    uint64_t macroRefused = 0;         // Not simMacro, or nobody driving
+    VehicleLink link;
+    RangeGovernor governor;
+
+private:
+    void process(uint64_t createdUs, const struct_message &frame) {
+        controlBusy = true;
+        sim.after(config.processUs, [this, createdUs, frame]() {
+            framesApplied++;
+            // Same as confirmRelease() in the firmware
+            if (frame.flags & FRAME_RELEASE) {
+                if (!released) {
+                    released = true;
+                    neutralUs = sim.now();
+                }
+                ReleaseAck ack;
+                buildReleaseAck(&link, &frame, index, &ack);
+                std::vector<uint8_t> payload((const uint8_t *)&ack, (const uint8_t *)&ack + sizeof(ack));
+                medium.transmit(this, payload, sim.now());
+            } else {
+                released = false;
+            }
+            // Same as macroOwnsFrame(): a frame without input leaves a running macro alone
+            if (!player.macro || (frame.flags & FRAME_RELEASE) || macroInput(&frame)) {
+                if (player.macro) {
+                    stopMacro(&player);
+                    macroAborts++;
+                }
+                const int32_t axes[SIM_MACRO_CHANNELS] = {frame.axisX, frame.axisY, frame.axisRX, frame.axisRY};
+                int8_t drive[SIM_MACRO_CHANNELS];
+                for (int a = 0; a < SIM_MACRO_CHANNELS; a++) {
+                    drive[a] = (int8_t)std::max(-100, std::min(100, (int)(axes[a] / SIM_MACRO_AXIS_SCALE)));
+                }
+                writeOutputs(drive);
+            }
+            latenciesUs.push_back((uint32_t)(sim.now() - createdUs));
+            if (!firstFrameUs) {
+                firstFrameUs = sim.now();
+            }
+            lastPacketMs = sim.millis();
+            connectionActive = true;
+            controlBusy = false;
+            serviceMacro();
+            if (pendingFrame) {
+                pendingFrame = false;
+                process(pendingCreatedUs, pending);
+            }
+        });
+    }
+
+    void writeOutputs(const int8_t *drive) {
+        if (!outputs.empty() && memcmp(outputs.back().drive, drive, SIM_MACRO_CHANNELS) == 0) {
+            return;
+        }
+        OutputChange change;
+        change.timeUs = sim.now();
+        memcpy(change.drive, drive, SIM_MACRO_CHANNELS);
+        outputs.push_back(change);
+    }
+
+    // Same as serviceMacro() in vehiclelink.h, on every control task wake
+    void serviceMacro() {
+        bool changed = false;
+        if (requestedMacro >= 0) {
+            int requested = requestedMacro;
+            requestedMacro = -1;
+            if (requested != 0 || !connectionActive) {
+                macroRefused++;
+            } else {
+                if (player.macro) {
+                    macroAborts++;
+                }
+                startMacro(&player, &simMacro, (uint32_t)sim.now(), NULL);
+                if (!macroStartUs) {
+                    macroStartUs = sim.now() - requestedMacroUs;
+                }
+                macroRuns++;
+                changed = true;
+            }
+        }
+        if (player.macro) {
+            changed |= runMacro(&player, (uint32_t)sim.now());
+        }
+        if (changed) {
+            writeOutputs(player.drive);
+        }
+        if (player.macro) {
+            // The firmware waits whole ticks; the wait ends on a tick boundary
+            uint32_t ticks = (macroDueInUs(&player, (uint32_t)sim.now(), config.controlIdleMs * 1000) + 999) / 1000;
+            uint64_t wakeUs = (sim.now() / 1000 + std::max<uint32_t>(ticks, 1)) * 1000;
+            uint64_t wake = ++macroWake;
+            sim.at(wakeUs, [this, wake]() {
+                if (wake == macroWake && !controlBusy) {
+                    serviceMacro();
+                }
+            });
+        }
+    }
+
+    void housekeepingTick() {
+        unsigned long now = sim.millis();
+        updateChannelFollower(&link.follower, now);
+
+        if (connectionActive && now - lastPacketMs > config.connectionTimeoutMs) {
+            connectionActive = false;
+            if (player.macro) {
+                stopMacro(&player);
+                writeOutputs(player.drive);
+                macroAborts++;
+            }
+            limitAtFailsafe = governor.limit;
+            failsafes++;
+            failsafeTimesMs.push_back(now);
+        }
+
+        if (now - lastReportTime >= config.reportPeriodMs) {
+            lastReportTime = now;
+            LinkReport report;
+            buildLinkReport(&link, index, VEHICLE_UNKNOWN, &report);
+            reportedReceived += report.framesReceived;
+            reportedMissed += report.framesMissed;
+            reportedRecovered += report.framesRecovered;
+            if (!link.follower.searching) {
+                std::vector<uint8_t> payload((const uint8_t *)&report, (const uint8_t *)&report + sizeof(report));
+                medium.transmit(this, payload, sim.now());
+            }
+        }
+        sim.after(config.housekeepingMs * 1000, [this]() { housekeepingTick(); });
+    }
+
+    // Same as serviceRangeGovernor() in the firmware, once per control task idle period
+    void controlTick() {
+        updateGovernor(&governor, &config.governor, link.baseStats.received, link.baseStats.missed,
+                       link.follower.lastBaseFrame, rssi(sim.now()), sim.millis());
+        if (governor.limit == GOVERNOR_FULL) {
+            reachedFull = true;
+        } else if (reachedFull && !slowedUs) {
+            slowedUs = sim.now();
+        }
+        if (slowedUs && !haltedUs && governor.limit == 0) {
+            haltedUs = sim.now();
+        }
+        if (!controlBusy) {
+            serviceMacro();
+        }
+        sim.after(config.controlIdleMs * 1000, [this]() { controlTick(); });
+    }
+
+    Simulator &sim;
+    Medium &medium;
+    VehicleConfig config;
+    bool reachedFull = false;
+    bool controlBusy = false;
+    bool pendingFrame = false;
+    struct_message pending;
+    bool released = false;
+    uint64_t pendingCreatedUs = 0;
+    bool connectionActive = false;
+    unsigned long lastPacketMs = 0;
+    unsigned long lastReportTime = 0;
+    MacroPlayer player = MacroPlayer();
+    int requestedMacro = -1;
+    uint64_t requestedMacroUs = 0;
+    uint64_t macroWake = 0; // Only the newest wake counts
+};
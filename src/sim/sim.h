@@ -0,0 +1,210 @@
+#pragma once
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <vector>
+
+// ============================================
+// DISCRETE EVENT SIMULATOR AND ESP-NOW MEDIUM
+// ============================================
+// Time is virtual and counted in microseconds. Nodes schedule callbacks and
+// hand frames to the Medium, which decides when and whether each other node
+// hears them.
+// ============================================
+
+class Simulator {
+public:
+    explicit Simulator(uint32_t seed) : rng(seed) {}
+
+    uint64_t now() const { return nowUs; }
+    // Millisecond clock with the same meaning as Arduino millis()
+    unsigned long millis() const { return (unsigned long)(nowUs / 1000); }
+
+    void at(uint64_t timeUs, std::function<void()> fn) {
+        Event event = { timeUs, nextOrder++, fn };
+        events.push(event);
+    }
+    void after(uint64_t delayUs, std::function<void()> fn) { at(nowUs + delayUs, fn); }
+
+    void run(uint64_t endUs) {
+        while (!events.empty() && events.top().time <= endUs) {
+            Event event = events.top();
+            events.pop();
+            nowUs = event.time;
+            event.fn();
+        }
+        nowUs = endUs;
+    }
+
+    double uniform() { return std::uniform_real_distribution<double>(0.0, 1.0)(rng); }
+    uint32_t below(uint32_t n) { return n ? std::uniform_int_distribution<uint32_t>(0, n - 1)(rng) : 0; }
+
+private:
+    struct Event {
+        uint64_t time;
+        uint64_t order; // Keeps events at the same time in scheduling order
+        std::function<void()> fn;
+        bool operator>(const Event &other) const {
+            return time != other.time ? time > other.time : order > other.order;
+        }
+    };
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event> > events;
+    std::mt19937 rng;
+    uint64_t nowUs = 0;
+    uint64_t nextOrder = 0;
+};
+
+class Node {
+public:
+    virtual ~Node() {}
+    // createdUs is simulator bookkeeping (when the command was sampled), not part of the frame
+    virtual void receive(const uint8_t *data, int len, uint64_t createdUs) = 0;
+    virtual uint8_t channel() const = 0;
+    // Loss on top of the medium's for every frame this node sends or hears
+    virtual double extraLossPercent(uint64_t) const { return 0; }
+    int id = 0;
+};
+
+struct MediumConfig {
+    double lossPercent = 0;      // Independent loss per receiver and frame
+    uint32_t latencyUs = 100;    // Driver and callback time on top of airtime
+    uint32_t jitterUs = 0;       // Uniform extra delay per receiver and frame
+    bool reorder = false;        // Let jitter deliver frames out of order
+    double usPerByte = 8.0;      // 1 Mbit/s, the ESP-NOW default rate
+    uint32_t overheadBytes = 43; // MAC header, vendor action frame and FCS
+    uint32_t preambleUs = 192;   // Long preamble at 1 Mbit/s
+    bool contention = true;      // Carrier sense, backoff and collisions
+    uint32_t slotUs = 20;
+    uint32_t maxBackoffSlots = 15;
+    // Interference on one channel for a stretch of time
+    uint8_t burstChannel = 0;
+    double burstLossPercent = 0;
+    uint64_t burstStartUs = 0;
+    uint64_t burstEndUs = 0;
+};
+
+struct MediumStats {
+    uint64_t transmissions = 0;
+    uint64_t collisions = 0;  // Transmissions destroyed by another one
+    uint64_t deferrals = 0;   // Times a sender found the channel busy
+    uint64_t deliveries = 0;
+    uint64_t losses = 0;      // Per receiver, including collisions
+    uint64_t busyUs = 0;      // Total airtime
+};
+
+class Medium {
+public:
+    Medium(Simulator &sim, const MediumConfig &config) : sim(sim), config(config) {
+        for (int c = 0; c < CHANNELS; c++) {
+            busyUntil[c] = 0;
+            lastStart[c] = 0;
+        }
+    }
+
+    void attach(Node *node) {
+        node->id = (int)nodes.size();
+        nodes.push_back(node);
+    }
+
+    uint64_t airtimeUs(size_t len) const {
+        return config.preambleUs + (uint64_t)((len + config.overheadBytes) * config.usPerByte);
+    }
+
+    // Broadcasts a frame from a node. onDone runs when it has left the air,
+    // which is when the ESP-NOW send callback would fire.
+    void transmit(Node *from, const std::vector<uint8_t> &payload, uint64_t createdUs,
+                  std::function<void()> onDone = std::function<void()>()) {
+        attempt(from, payload, createdUs, onDone);
+    }
+
+    MediumStats stats;
+
+private:
+    static const int CHANNELS = 15;
+
+    struct Transmission {
+        bool collided = false;
+    };
+
+    void attempt(Node *from, std::vector<uint8_t> payload, uint64_t createdUs, std::function<void()> onDone) {
+        uint8_t ch = from->channel();
+        uint64_t now = sim.now();
+        uint64_t airtime = airtimeUs(payload.size());
+        std::shared_ptr<Transmission> tx(new Transmission());
+
+        if (config.contention) {
+            // Someone started less than a slot ago: we cannot hear them yet
+            if (lastTx[ch] && now < lastStart[ch] + config.slotUs) {
+                tx->collided = true;
+                if (!lastTx[ch]->collided) {
+                    lastTx[ch]->collided = true;
+                    stats.collisions++;
+                }
+                stats.collisions++;
+            } else if (now < busyUntil[ch]) {
+                stats.deferrals++;
+                uint64_t retryAt = busyUntil[ch] + config.slotUs * sim.below(config.maxBackoffSlots + 1);
+                sim.at(retryAt, [this, from, payload, createdUs, onDone]() {
+                    attempt(from, payload, createdUs, onDone);
+                });
+                return;
+            }
+        }
+
+        stats.transmissions++;
+        stats.busyUs += airtime;
+        lastStart[ch] = now;
+        lastTx[ch] = tx;
+        if (now + airtime > busyUntil[ch]) {
+            busyUntil[ch] = now + airtime;
+        }
+        uint64_t end = now + airtime;
+        sim.at(end, [this, from, payload, createdUs, onDone, tx, ch]() {
+            deliver(from, payload, createdUs, tx, ch);
+            if (onDone) {
+                onDone();
+            }
+        });
+    }
+
+    void deliver(Node *from, const std::vector<uint8_t> &payload, uint64_t createdUs,
+                 std::shared_ptr<Transmission> tx, uint8_t ch) {
+        uint64_t end = sim.now();
+        for (size_t i = 0; i < nodes.size(); i++) {
+            Node *to = nodes[i];
+            if (to == from || to->channel() != ch) {
+                continue;
+            }
+            double loss = config.lossPercent;
+            if (ch == config.burstChannel && end >= config.burstStartUs && end < config.burstEndUs) {
+                loss += config.burstLossPercent;
+            }
+            loss += from->extraLossPercent(end) + to->extraLossPercent(end);
+            if (tx->collided || sim.uniform() * 100.0 < loss) {
+                stats.losses++;
+                continue;
+            }
+            uint64_t deliverAt = end + config.latencyUs + (config.jitterUs ? sim.below(config.jitterUs + 1) : 0);
+            uint64_t &last = lastDelivery[std::make_pair(from->id, to->id)];
+            if (!config.reorder && deliverAt < last) {
+                deliverAt = last;
+            }
+            last = deliverAt;
+            stats.deliveries++;
+            sim.at(deliverAt, [to, payload, createdUs]() {
+                to->receive(payload.data(), (int)payload.size(), createdUs);
+            });
+        }
+    }
+
+    Simulator &sim;
+    MediumConfig config;
+    std::vector<Node *> nodes;
+    uint64_t busyUntil[CHANNELS];
+    uint64_t lastStart[CHANNELS];
+    std::shared_ptr<Transmission> lastTx[CHANNELS];
+    std::map<std::pair<int, int>, uint64_t> lastDelivery;
+};
@@ -1,27 +1,34 @@
 
 #include <Arduino.h>
 #include <ESP32Servo.h>
+#include <esp_now.h>
+#include <WiFi.h>
+#include "trailerstate.h"
+#include "vehiclelink.h"
+#include "persist.h"
+#include "tasks.h"
 
 #define RX0 3
 #define TX0 1
-/*What the different Serial commands for the trailer esp32 daughter board do
-1-Trailer Legs Up
-2-Trailer Legs Down
-3-Ramp Up
-4-Ramp Down
-5-auxMotor1 Forward
-6-auxMotor1 Reverse
-7-auxMotor1 STOP
-8-auxMotor2 Forward
-9-auxMotor2 Reverse
-10-auxMotor2 STOP
-11- LT1 LOW
-12- LT1 HIGH
-13- LT2 LOW
-14- LT2 HIGH
-15- LT3 LOW
-16- LT3 HIGH
-*/
+// The trailer hears its semi three ways:
+// - direct: base frames sent to the semi, for the aux motors only (fastest)
+// - relay: the full trailer state the semi broadcasts over ESP-NOW
+// - serial: codes and snapshots on the wire from the semi, see include/trailerstate.h
+// Direct and relay win while they are heard, the wire is the fallback.
+
+// Receiver index of the semi this trailer belongs to
+#ifndef TRAILER_TRACTOR_INDEX
+#define TRAILER_TRACTOR_INDEX 4
+#endif
+// Index the trailer reports its link statistics under, never driven itself
+#ifndef TRAILER_INDEX
+#define TRAILER_INDEX 100
+#endif
+// Base frames older than this no longer drive the aux motors
+#define TRAILER_DIRECT_FRESH_MS 200
+#define PATH_STATS_PERIOD_MS 10000
+// Longest line from the semi, codes and snapshots are far shorter
+#define SEMI_LINE_MAX 32
 #define trailerLegServoPin 23
 #define trailerRampServoPin 22
 
@@ -45,20 +52,226 @@ Servo trailerRampServo;
 
 int trailerLegValue = LEGS_DOWN_POSITION;
 int trailerRampValue = RAMP_UP_POSITION;
-bool lightsOn = false;
-bool auxLightsOn = false;
+TrailerState appliedState; // What the outputs are set to right now
+TrailerState serialState;  // What the wire has told us so far
+unsigned long lastLineTime = 0;
+
+// The semi's line being read, see readSemiLine()
+char semiLine[SEMI_LINE_MAX];
+int semiLineLength = 0;
+
+// Written by OnDataRecv, read by loop()
+volatile uint16_t relayedState = 0;
+volatile unsigned long relayTime = 0; // 0 until the semi has been heard over the air
+volatile bool relayUpdated = false;
+ReplayWindow relayReplay; // Counter of our semi, only touched by OnDataRecv
+volatile int8_t directAux1 = 0;
+volatile int8_t directAux2 = 0;
+volatile unsigned long directTime = 0;
+volatile bool directUpdated = false;
+
+// How much later than the base frame an aux change arrives on the other paths
+struct PathLatency {
+  uint32_t samples;
+  uint32_t totalMs;
+  uint32_t maxMs;
+};
+PathLatency relayLatency;
+PathLatency serialLatency;
+uint16_t directAuxBits = 0;     // Aux part of the packed state, as last seen directly
+unsigned long auxChangeTime = 0;
+bool relayPending = false;      // Waiting for the relay to catch up with directAuxBits
+bool serialPending = false;
+
+// Kept across power cycles, see include/persist.h
+struct PersistedState {
+  uint8_t legsUp;
+  uint8_t rampUp;
+};
+
+void OnDataRecv(const uint8_t *mac, const uint8_t *incomingData, int len) {
+  uint32_t heardUs = micros();
+  uint32_t receiverIndex;
+  if (len < (int)sizeof(receiverIndex)) {
+    return;
+  }
+  memcpy(&receiverIndex, incomingData, sizeof(receiverIndex));
+  if (receiverIndex == RECEIVER_TRAILER_STATE) {
+    // A semi of another base may be pulling a trailer with the same index
+    if (!acceptSessionMessage(incomingData, len)) {
+      return;
+    }
+    TrailerStateMessage message;
+    if (len >= (int)sizeof(message)) {
+      memcpy(&message, incomingData, sizeof(message));
+      if (message.tractorIndex == TRAILER_TRACTOR_INDEX &&
+          authenticMessage(incomingData, sizeof(message), &relayReplay,
+                           authCounter(message.authEpoch, message.sequence))) {
+        relayedState = message.state;
+        relayTime = millis();
+        relayUpdated = true;
+        noteFrameAccepted();
+      }
+    }
+    return;
+  }
+  if (!handleBaseMessage(incomingData, len)) {
+    // A stop for the fleet or for our semi: aux motors off here, and held off
+    // like a direct frame so a stale relay does not start them again
+    if (takeEmergencyStop(TRAILER_INDEX, TRAILER_TRACTOR_INDEX)) {
+      digitalWrite(auxMotor1, LOW);
+      digitalWrite(auxMotor2, LOW);
+      digitalWrite(auxMotor3, LOW);
+      digitalWrite(auxMotor4, LOW);
+      directAux1 = 0;
+      directAux2 = 0;
+      directTime = millis();
+      directUpdated = true;
+      confirmStop(TRAILER_INDEX, heardUs);
+    }
+    return;
+  }
+  struct_message frame;
+  memcpy(&frame, incomingData, sizeof(frame));
+  if (frame.receiverIndex == TRAILER_TRACTOR_INDEX) {
+    TrailerState aux;
+    setTrailerAuxFromTriggers(&aux, frame.r1, frame.r2, frame.l1, frame.l2);
+    directAux1 = aux.aux1;
+    directAux2 = aux.aux2;
+    directTime = millis();
+    directUpdated = true;
+    noteFrameAccepted();
+  }
+}
+
+// Collects a line from the semi without waiting for it and without the
+// heap. True once a whole line is in semiLine, trimmed.
+bool readSemiLine() {
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (c != '\n') {
+      if (semiLineLength < SEMI_LINE_MAX - 1) {
+        semiLine[semiLineLength++] = c;
+      }
+      continue;
+    }
+    while (semiLineLength > 0 && isspace((unsigned char)semiLine[semiLineLength - 1])) {
+      semiLineLength--;
+    }
+    semiLine[semiLineLength] = '\0';
+    int start = 0;
+    while (isspace((unsigned char)semiLine[start])) {
+      start++;
+    }
+    memmove(semiLine, semiLine + start, semiLineLength - start + 1);
+    semiLineLength = 0;
+    return true;
+  }
+  return false;
+}
+
+void countPathLatency(PathLatency *latency, bool *pending, const TrailerState *state, unsigned long now) {
+  if (*pending && (packTrailerState(state) & TRAILER_PACKED_AUX_MASK) == directAuxBits) {
+    uint32_t ms = now - auxChangeTime;
+    latency->samples++;
+    latency->totalMs += ms;
+    if (ms > latency->maxMs) {
+      latency->maxMs = ms;
+    }
+    *pending = false;
+  }
+}
+
+void reportPathLatency() {
+  static unsigned long lastReportTime = 0;
+  if (millis() - lastReportTime < PATH_STATS_PERIOD_MS) {
+    return;
+  }
+  lastReportTime = millis();
+  Serial.printf("Trailer paths: direct %s | relay %s +%ums avg +%ums max (%u) | serial %s +%ums avg +%ums max (%u)\n",
+                directTime && millis() - directTime < TRAILER_DIRECT_FRESH_MS ? "up" : "down",
+                relayTime && millis() - relayTime < TRAILER_LINK_TIMEOUT_MS ? "up" : "down",
+                relayLatency.samples ? relayLatency.totalMs / relayLatency.samples : 0, relayLatency.maxMs,
+                relayLatency.samples,
+                lastLineTime && millis() - lastLineTime < TRAILER_LINK_TIMEOUT_MS ? "up" : "down",
+                serialLatency.samples ? serialLatency.totalMs / serialLatency.samples : 0, serialLatency.maxMs,
+                serialLatency.samples);
+}
+
+void setAuxMotor(int pin0, int pin1, int8_t direction) {
+  digitalWrite(pin0, direction < 0 ? HIGH : LOW);
+  digitalWrite(pin1, direction > 0 ? HIGH : LOW);
+}
+
+// Moves every output whose field differs, so applying the same state twice does nothing
+void applyState(const TrailerState *target) {
+  if (target->legsUp != appliedState.legsUp) {
+    trailerLegValue = target->legsUp ? LEGS_UP_POSITION : LEGS_DOWN_POSITION;
+    trailerLegServo.write(trailerLegValue);
+    Serial.println(target->legsUp ? "Legs moved to UP position" : "Legs moved to DOWN position");
+  }
+  if (target->rampUp != appliedState.rampUp) {
+    trailerRampValue = target->rampUp ? RAMP_UP_POSITION : RAMP_DOWN_POSITION;
+    trailerRampServo.write(trailerRampValue);
+    Serial.println(target->rampUp ? "Ramp moved to UP position" : "Ramp moved to DOWN position");
+  }
+  if (target->aux1 != appliedState.aux1) {
+    setAuxMotor(auxMotor1, auxMotor2, target->aux1);
+  }
+  if (target->aux2 != appliedState.aux2) {
+    setAuxMotor(auxMotor3, auxMotor4, target->aux2);
+  }
+  uint8_t changed = target->lights ^ appliedState.lights;
+  if (changed & LIGHT_LT1) {
+    digitalWrite(LT1, (target->lights & LIGHT_LT1) ? HIGH : LOW);
+  }
+  if (changed & LIGHT_LT2) {
+    digitalWrite(LT2, (target->lights & LIGHT_LT2) ? HIGH : LOW);
+  }
+  if (changed & LIGHT_LT3) {
+    digitalWrite(LT3, (target->lights & LIGHT_LT3) ? HIGH : LOW);
+  }
+  appliedState = *target;
+}
 
-String receivedDataStr = "";
+void savePersistedState() {
+  PersistedState state;
+  memset(&state, 0, sizeof(state));
+  state.legsUp = appliedState.legsUp;
+  state.rampUp = appliedState.rampUp;
+  persistStateWhenSettled(&state, sizeof(state));
+}
 
 void setup() {
   Serial.begin(115200);
+  // Control loops subscribe as they start, see include/tasks.h
+  startTaskWatchdog();
+
+  // Radio first: it takes the longest to come up
+  WiFi.mode(WIFI_STA);
+  bool radioReady = esp_now_init() == ESP_OK;
+  if (radioReady) {
+    startVehicleLink();
+  } else {
+    Serial.println("Error initializing ESP-NOW, serial link only");
+  }
 
+  // Servos go straight to where they were left, no sweep through other positions
+  initTrailerState(&appliedState); // Legs down, ramp up, everything off
+  PersistedState state;
+  memset(&state, 0, sizeof(state));
+  state.legsUp = appliedState.legsUp;
+  state.rampUp = appliedState.rampUp;
+  if (loadPersistedState(&state, sizeof(state))) {
+    appliedState.legsUp = state.legsUp;
+    appliedState.rampUp = state.rampUp;
+  }
+  serialState = appliedState;
+  trailerLegValue = appliedState.legsUp ? LEGS_UP_POSITION : LEGS_DOWN_POSITION;
+  trailerRampValue = appliedState.rampUp ? RAMP_UP_POSITION : RAMP_DOWN_POSITION;
   trailerRampServo.attach(trailerRampServoPin);
   trailerRampServo.write(trailerRampValue);
-  delay(500);
   trailerLegServo.attach(trailerLegServoPin);
-  trailerLegServo.write(140); // Intermediate position to avoid strain
-  delay(50);
   trailerLegServo.write(trailerLegValue);
 
   pinMode(auxMotor1, OUTPUT);
@@ -79,76 +292,93 @@ void setup() {
    while (Serial.available() > 0) {
         Serial.read();  // Discard the unread data
     }
+  if (radioReady) {
+    // Frames are only taken once everything they drive is set up
+    esp_now_register_recv_cb(OnDataRecv);
+  }
+  // The loop task is the trailer's only task, it drives the outputs too
+  watchTask("loop", xTaskGetCurrentTaskHandle(), getArduinoLoopTaskStackSize());
+  subscribeWatchdog();
+  Serial.printf("Control ready at %lu ms\n", millis());
 }
 
 void loop() {
-  if (Serial.available() > 0) {
-    /*//This grabs whatever we "serial.println" on from the semi and stores it inside recievedDataStr.
+  unsigned long now = millis();
+  bool relayFresh = relayTime && now - relayTime < TRAILER_LINK_TIMEOUT_MS;
+  TrailerState target = appliedState;
+
+  controlStage(DEADLINE_RELAY);
+  // Direct path: only tells us about the aux motors, but first
+  if (directUpdated) {
+    directUpdated = false;
+    TrailerState aux = appliedState;
+    aux.aux1 = directAux1;
+    aux.aux2 = directAux2;
+    uint16_t bits = packTrailerState(&aux) & TRAILER_PACKED_AUX_MASK;
+    if (bits != directAuxBits) {
+      directAuxBits = bits;
+      auxChangeTime = directTime;
+      relayPending = true;
+      serialPending = true;
+    }
+  }
+
+  // Relay path: the full state, replaces the wire while it is heard
+  if (relayUpdated) {
+    relayUpdated = false;
+    TrailerState relayed;
+    unpackTrailerState(relayedState, &relayed);
+    countPathLatency(&relayLatency, &relayPending, &relayed, now);
+  }
+  if (relayFresh) {
+    unpackTrailerState(relayedState, &target);
+  }
+
+  controlStage(DEADLINE_SERIAL);
+  if (readSemiLine()) {
+    /*//This grabs whatever we "serial.println" on from the semi and stores it inside semiLine.
     Its crucial that if you add a function for the truck to send to the trailer you use "println" and not just "print" as it reads the value up until a new line which is specfied by the "ln" in "println"
     For example in the first if statement we check to see if mtr = 1. "1" is the value we sent from the truck. If thsi statement is true it will proceed with adding 2 to the trailerlegvalue which raises the traileg servo*/
-    receivedDataStr = Serial.readStringUntil('\n');
-    int mtr = receivedDataStr.toInt();  //Converts what we grabed from serial to an integer which we can easily use later in if statements
-    Serial.print("Received: ");
-    Serial.println(mtr);
-    if (mtr == 1) {
-      // Legs Up - Go directly to up position
-      trailerLegValue = LEGS_UP_POSITION;
-      trailerLegServo.write(trailerLegValue);
-      Serial.println("Legs moved to UP position");
-    } else if (mtr == 2) {
-      // Legs Down - Go directly to down position
-      trailerLegValue = LEGS_DOWN_POSITION;
-      trailerLegServo.write(trailerLegValue);
-      Serial.println("Legs moved to DOWN position");
-    }
-    if (mtr == 3) {
-      // Ramp Up - Go directly to up position
-      trailerRampValue = RAMP_UP_POSITION;
-      trailerRampServo.write(trailerRampValue);
-      Serial.println("Ramp moved to UP position");
-    } else if (mtr == 4) {
-      // Ramp Down - Go directly to down position
-      trailerRampValue = RAMP_DOWN_POSITION;
-      trailerRampServo.write(trailerRampValue);
-      Serial.println("Ramp moved to DOWN position");
-    }
-    if (mtr == 5) {
-      digitalWrite(auxMotor1, LOW);
-      digitalWrite(auxMotor2, HIGH);
-    } else if (mtr == 6) {
-      digitalWrite(auxMotor1, HIGH);
-      digitalWrite(auxMotor2, LOW);
-    } else if (mtr == 7) {
-      digitalWrite(auxMotor1, LOW);
-      digitalWrite(auxMotor2, LOW);
-    }
-    if (mtr == 8) {
-      digitalWrite(auxMotor3, LOW);
-      digitalWrite(auxMotor4, HIGH);
-    } else if (mtr == 9) {
-      digitalWrite(auxMotor3, HIGH);
-      digitalWrite(auxMotor4, LOW);
-    } else if (mtr == 10) {
-      digitalWrite(auxMotor3, LOW);
-      digitalWrite(auxMotor4, LOW);
-    }
-    if (mtr == 11) {
-      digitalWrite(LT1, LOW);
-    }
-    else if (mtr == 12) {
-      digitalWrite(LT1, HIGH);
-    }
-    if (mtr == 13) {
-      digitalWrite(LT2, LOW);
-    }
-    else if (mtr == 14) {
-      digitalWrite(LT2, HIGH);
-    }
-    if (mtr == 15) {
-      digitalWrite(LT3, LOW);
-    }
-    else if (mtr == 16) {
-      digitalWrite(LT3, HIGH);
+    TrailerState received = serialState;
+    long ageMs;
+    if (parseTrailerLine(semiLine, &received, &ageMs)) {
+      lastLineTime = now;
+      countPathLatency(&serialLatency, &serialPending, &received, now);
+      if (!relayFresh) {
+        if (ageMs < 0) {
+          Serial.print("Received: ");
+          Serial.println(semiLine);
+        } else if (!trailerStatesEqual(&received, &serialState)) {
+          // A code went missing; ageMs is how long ago the semi changed the state
+          Serial.printf("Snapshot repaired state, last change %ld ms ago\n", ageMs);
+        }
+      }
+      serialState = received;
     }
   }
-}
\ No newline at end of file
+  if (!relayFresh) {
+    target = serialState;
+  }
+
+  if (directTime && now - directTime < TRAILER_DIRECT_FRESH_MS) {
+    target.aux1 = directAux1;
+    target.aux2 = directAux2;
+  }
+
+  // Semi gone quiet on every path: never leave an aux motor running
+  bool serialFresh = lastLineTime && now - lastLineTime < TRAILER_LINK_TIMEOUT_MS;
+  bool directFresh = directTime && now - directTime < TRAILER_LINK_TIMEOUT_MS;
+  if (!relayFresh && !serialFresh && !directFresh) {
+    target.aux1 = 0;
+    target.aux2 = 0;
+  }
+  controlStage(DEADLINE_APPLY);
+  applyState(&target);
+  // Nothing else runs to notice a stall here, the watchdog resets the trailer
+  endControlIteration();
+
+  serviceVehicleLink(TRAILER_INDEX, VEHICLE_TRAILER);
+  savePersistedState();
+  reportPathLatency();
+  reportTaskStacksPeriodically();
+}
@@ -0,0 +1,132 @@
+// ============================================
+// SOFT PWM CHECKS
+// ============================================
+// Native checks for include/softpwm.h: every channel is on for exactly its
+// duty over one period, the two sides of a motor are never on together, and
+// stickToDuty()/buttonDuty() keep their deadzone, endpoints and sign. Also
+// prints what one tick costs on the build machine.
+//
+//   pio test -e test          # SOFTPWM_STEPS as the excavator ships
+//   pio test -e test-fine     # a finer resolution
+// ============================================
+
+#include <unity.h>
+#include <stdio.h>
+#include <chrono>
+#include "softpwm.h"
+
+#define TEST_DEADZONE 60
+#define TEST_RANGE 512
+#define TEST_COST_TICKS 1000000
+
+void setUp() {}
+void tearDown() {}
+
+// On slots of each channel over one full period
+static void countOnSlots(SoftPwm *pwm, int onSlots[SOFTPWM_CHANNELS]) {
+    for (int ch = 0; ch < SOFTPWM_CHANNELS; ch++) {
+        onSlots[ch] = 0;
+    }
+    for (int slot = 0; slot < SOFTPWM_STEPS; slot++) {
+        uint16_t levels = nextSoftPwmLevels(pwm);
+        for (int ch = 0; ch < SOFTPWM_CHANNELS; ch++) {
+            onSlots[ch] += (levels >> ch) & 1;
+        }
+    }
+}
+
+static void testOnSlotsMatchDuty() {
+    SoftPwm pwm;
+    initSoftPwm(&pwm);
+    int onSlots[SOFTPWM_CHANNELS];
+    // Every duty from off to always on, spread over the channels
+    for (int duty = 0; duty <= SOFTPWM_STEPS; duty++) {
+        for (int ch = 0; ch < SOFTPWM_CHANNELS; ch++) {
+            pwm.duty[ch] = (uint8_t)((duty + ch) % (SOFTPWM_STEPS + 1));
+        }
+        countOnSlots(&pwm, onSlots);
+        for (int ch = 0; ch < SOFTPWM_CHANNELS; ch++) {
+            TEST_ASSERT_EQUAL_INT(pwm.duty[ch], onSlots[ch]);
+        }
+        // A period ends where it started
+        TEST_ASSERT_EQUAL_INT(0, pwm.slot);
+    }
+}
+
+static void testMotorSidesNeverOnTogether() {
+    SoftPwm pwm;
+    initSoftPwm(&pwm);
+    int onSlots[SOFTPWM_CHANNELS];
+    for (int duty = -SOFTPWM_STEPS - 2; duty <= SOFTPWM_STEPS + 2; duty++) {
+        setSoftPwmMotor(&pwm, 0, 1, duty);
+        for (int slot = 0; slot < SOFTPWM_STEPS; slot++) {
+            uint16_t levels = nextSoftPwmLevels(&pwm);
+            TEST_ASSERT_FALSE((levels & 1) && (levels & 2));
+        }
+        countOnSlots(&pwm, onSlots);
+        int expected = duty > SOFTPWM_STEPS ? SOFTPWM_STEPS : duty < -SOFTPWM_STEPS ? -SOFTPWM_STEPS : duty;
+        TEST_ASSERT_EQUAL_INT(expected > 0 ? expected : 0, onSlots[0]);
+        TEST_ASSERT_EQUAL_INT(expected < 0 ? -expected : 0, onSlots[1]);
+    }
+}
+
+static void testStickToDuty() {
+    // Nothing inside the deadzone, either way
+    TEST_ASSERT_EQUAL_INT(0, stickToDuty(0, TEST_DEADZONE, TEST_RANGE));
+    TEST_ASSERT_EQUAL_INT(0, stickToDuty(TEST_DEADZONE, TEST_DEADZONE, TEST_RANGE));
+    TEST_ASSERT_EQUAL_INT(0, stickToDuty(-TEST_DEADZONE, TEST_DEADZONE, TEST_RANGE));
+    // The first step just past it, full duty at full throw and beyond
+    TEST_ASSERT_EQUAL_INT(1, stickToDuty(TEST_DEADZONE + 1, TEST_DEADZONE, TEST_RANGE));
+    TEST_ASSERT_EQUAL_INT(-1, stickToDuty(-TEST_DEADZONE - 1, TEST_DEADZONE, TEST_RANGE));
+    TEST_ASSERT_EQUAL_INT(SOFTPWM_STEPS, stickToDuty(TEST_RANGE, TEST_DEADZONE, TEST_RANGE));
+    TEST_ASSERT_EQUAL_INT(-SOFTPWM_STEPS, stickToDuty(-TEST_RANGE, TEST_DEADZONE, TEST_RANGE));
+    TEST_ASSERT_EQUAL_INT(SOFTPWM_STEPS, stickToDuty(TEST_RANGE + 100, TEST_DEADZONE, TEST_RANGE));
+    // Symmetric, and never falls back as the stick moves out
+    int previous = 0;
+    for (int value = 0; value <= TEST_RANGE; value++) {
+        int duty = stickToDuty(value, TEST_DEADZONE, TEST_RANGE);
+        TEST_ASSERT_EQUAL_INT(-duty, stickToDuty(-value, TEST_DEADZONE, TEST_RANGE));
+        TEST_ASSERT_TRUE(duty >= previous);
+        TEST_ASSERT_TRUE(duty <= SOFTPWM_STEPS);
+        previous = duty;
+    }
+}
+
+static void testButtonDuty() {
+    TEST_ASSERT_EQUAL_INT(0, buttonDuty(false, false));
+    TEST_ASSERT_EQUAL_INT(SOFTPWM_STEPS, buttonDuty(true, false));
+    TEST_ASSERT_EQUAL_INT(-SOFTPWM_STEPS, buttonDuty(false, true));
+    // Forward wins when both are held
+    TEST_ASSERT_EQUAL_INT(SOFTPWM_STEPS, buttonDuty(true, true));
+}
+
+// Not a pass or fail: the tick's cost on this machine, next to the checks
+static void testTickCost() {
+    typedef std::chrono::steady_clock Clock;
+    SoftPwm pwm;
+    initSoftPwm(&pwm);
+    for (int ch = 0; ch < SOFTPWM_CHANNELS; ch++) {
+        pwm.duty[ch] = (uint8_t)(ch % (SOFTPWM_STEPS + 1));
+    }
+    volatile uint16_t sink = 0;
+    Clock::time_point start = Clock::now();
+    for (long i = 0; i < TEST_COST_TICKS; i++) {
+        sink = sink ^ nextSoftPwmLevels(&pwm);
+    }
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count() /
+                (double)TEST_COST_TICKS;
+    char message[96];
+    snprintf(message, sizeof(message), "Soft PWM tick: %.1f ns, %d ticks/s = %.4f%% of one host core", ns,
+             SOFTPWM_TICK_HZ, ns * SOFTPWM_TICK_HZ / 1e7);
+    TEST_MESSAGE(message);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(testOnSlotsMatchDuty);
+    RUN_TEST(testMotorSidesNeverOnTogether);
+    RUN_TEST(testStickToDuty);
+    RUN_TEST(testButtonDuty);
+    RUN_TEST(testTickCost);
+    return UNITY_END();
+}